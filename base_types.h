@@ -22,11 +22,13 @@ typedef struct PeerManager PeerManager;
 typedef struct QemuLauncher QemuLauncher;
 typedef struct ColodState ColodState;
 typedef struct Formater Formater;
+typedef struct FormaterTemplate FormaterTemplate;
 typedef struct QmpCommands QmpCommands;
 typedef struct ColodMainCoroutine ColodMainCoroutine;
 typedef struct ColodClientListener ColodClientListener;
 typedef struct ColodQmpState ColodQmpState;
 typedef struct ColodWatchdog ColodWatchdog;
 typedef struct Cpg Cpg;
+typedef struct CpgMux CpgMux;
 
 #endif // BASE_TYPES_H
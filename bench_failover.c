@@ -0,0 +1,439 @@
+/*
+ * COLO background daemon failover latency benchmark
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+#include "base_types.h"
+#include "smoketest.h"
+#include "coroutine_stack.h"
+#include "smoke_util.h"
+#include "coutil.h"
+#include "json_util.h"
+#include "cpg.h"
+#include "netlink.h"
+
+#define BENCH_INTERFACE "bench0"
+
+typedef enum BenchFault {
+    FAULT_PEER_LEFT,
+    FAULT_MESSAGE_FAILED,
+    FAULT_COLO_EXIT,
+    FAULT_LINK_DOWN
+} BenchFault;
+
+typedef struct BenchCase {
+    const gchar *name;
+    BenchFault fault;
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+    {"peer_left", FAULT_PEER_LEFT},
+    {"message_failed", FAULT_MESSAGE_FAILED},
+    {"colo_exit", FAULT_COLO_EXIT},
+    {"link_down", FAULT_LINK_DOWN},
+};
+
+typedef struct QmpStub {
+    Coroutine coroutine;
+    SmokeTestcase *testcase;
+    GIOChannel *channel;
+    gboolean quit;
+} QmpStub;
+
+struct SmokeTestcase {
+    Coroutine coroutine;
+    SmokeColodContext *sctx;
+    const BenchCase *config;
+    QmpStub *qmp, *qmp_yank;
+    gint64 inject_time, first_time, done_time;
+    gboolean quit;
+};
+
+static CoroutineType qmp_stub_type =
+    COROUTINE_POOL("qmp stub", QmpStub, COROUTINE_STACK_SIZE);
+static CoroutineType testcase_type =
+    COROUTINE_POOL("testcase", SmokeTestcase, COROUTINE_STACK_SIZE);
+
+void colod_syslog(int pri, const char *fmt, ...) {
+    va_list args;
+
+    if (pri > LOG_WARNING && !smoke_do_trace()) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+static void qmp_stub_write(QmpStub *this, const gchar *line) {
+    GIOStatus ret;
+
+    ret = g_io_channel_write_chars(this->channel, line, strlen(line),
+                                   NULL, NULL);
+    assert(ret == G_IO_STATUS_NORMAL);
+    ret = g_io_channel_flush(this->channel, NULL);
+    assert(ret == G_IO_STATUS_NORMAL);
+}
+
+static gchar *qmp_stub_reply(JsonNode *request, const gchar *command) {
+    const gchar *ret;
+
+    if (!strcmp(command, "query-status")) {
+        ret = "{\"status\": \"running\", \"running\": true}";
+    } else if (!strcmp(command, "query-colo-status")) {
+        ret = "{\"mode\": \"secondary\", \"last-mode\": \"none\","
+              " \"reason\": \"none\"}";
+    } else if (!strcmp(command, "query-yank")) {
+        ret = "[{\"type\": \"migration\"},"
+              " {\"type\": \"chardev\", \"id\": \"mirror0\"},"
+              " {\"type\": \"chardev\", \"id\": \"comp_sec_in0\"}]";
+    } else {
+        ret = "{}";
+    }
+
+    if (has_member(request, "id")) {
+        return g_strdup_printf("{\"return\": %s, \"id\": \"%s\"}\n", ret,
+                               get_member_str(request, "id"));
+    }
+
+    return g_strdup_printf("{\"return\": %s}\n", ret);
+}
+
+static void qmp_stub_record(QmpStub *this, const gchar *command) {
+    SmokeTestcase *testcase = this->testcase;
+    gint64 now = g_get_monotonic_time();
+
+    if (!testcase->inject_time) {
+        return;
+    }
+
+    if (!testcase->first_time) {
+        testcase->first_time = now;
+    }
+
+    if (this == testcase->qmp && !strcmp(command, "cont")
+            && !testcase->done_time) {
+        testcase->done_time = now;
+    }
+}
+
+static gboolean _qmp_stub_co(Coroutine *coroutine, QmpStub *this) {
+    struct {
+        gchar *reply;
+    } *co;
+    gchar *line;
+    gsize len;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    qmp_stub_write(this, "{\"QMP\": {\"version\": {}, \"capabilities\": [\"oob\"]}}\n");
+
+    while (TRUE) {
+        co_recurse(ret = colod_channel_read_line_co(coroutine, this->channel,
+                                                    NULL, &line, &len, NULL));
+        if (ret < 0) {
+            break;
+        }
+
+        JsonNode *request = json_from_string(line, NULL);
+        g_free(line);
+        assert(request);
+
+        const gchar *command;
+        if (has_member(request, "execute")) {
+            command = get_member_str(request, "execute");
+        } else {
+            command = get_member_str(request, "exec-oob");
+        }
+
+        qmp_stub_record(this, command);
+        CO reply = qmp_stub_reply(request, command);
+        json_node_unref(request);
+
+        co_recurse(ret = colod_channel_write_timeout_co(coroutine, this->channel,
+                                                        NULL, CO reply, strlen(CO reply),
+                                                        1000, NULL));
+        g_free(CO reply);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    this->quit = TRUE;
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean qmp_stub_co(gpointer data) {
+    QmpStub *this = data;
+    Coroutine *coroutine = data;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _qmp_stub_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    return ret;
+}
+
+static QmpStub *qmp_stub_new(SmokeTestcase *testcase, GIOChannel *channel) {
+    QmpStub *this;
+    Coroutine *coroutine;
+
+    this = coroutine_new(&qmp_stub_type);
+    coroutine = &this->coroutine;
+    coroutine->cb = qmp_stub_co;
+    this->testcase = testcase;
+    this->channel = channel;
+
+    g_idle_add(qmp_stub_co, this);
+    return this;
+}
+
+static void inject_fault(SmokeTestcase *this) {
+    SmokeColodContext *sctx = this->sctx;
+    const gchar *colo_exit = "{\"event\": \"COLO_EXIT\", \"data\":"
+                             " {\"mode\": \"secondary\", \"reason\": \"error\"}}\n";
+
+    this->inject_time = g_get_monotonic_time();
+
+    switch (this->config->fault) {
+        case FAULT_PEER_LEFT:
+            colod_cpg_stub_notify(sctx->cctx.cpg, MESSAGE_NONE, FALSE, TRUE);
+        break;
+
+        case FAULT_MESSAGE_FAILED:
+            colod_cpg_stub_notify(sctx->cctx.cpg, MESSAGE_FAILED, FALSE, FALSE);
+        break;
+
+        case FAULT_COLO_EXIT:
+            qmp_stub_write(this->qmp, colo_exit);
+        break;
+
+        case FAULT_LINK_DOWN:
+            // The replication link breaks together with the monitored link
+            netlink_stub_notify(BENCH_INTERFACE, FALSE);
+            qmp_stub_write(this->qmp, colo_exit);
+        break;
+    }
+}
+
+static gboolean _testcase_co(Coroutine *coroutine, SmokeTestcase *this) {
+    struct {
+        int tries;
+    } *co;
+    SmokeColodContext *sctx = this->sctx;
+    gchar *line;
+    gsize len;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    co_recurse(ch_execute_co(coroutine, sctx->client_ch,
+                             "{'exec-colod': 'demote'}\n", 1000));
+
+    qmp_stub_write(this->qmp, "{\"event\": \"MIGRATION\", \"data\": {\"status\": \"active\"}}\n");
+    qmp_stub_write(this->qmp, "{\"event\": \"RESUME\"}\n");
+
+    for (CO tries = 0; CO tries < 1000; CO tries++) {
+        co_recurse(ch_write_co(coroutine, sctx->client_ch,
+                               "{'exec-colod': 'query-status'}\n", 1000));
+        co_recurse(ch_readln_co(coroutine, sctx->client_ch, &line, &len, 1000));
+        gboolean running = !!strstr(line, "\"replication\": true");
+        g_free(line);
+        if (running) {
+            break;
+        }
+
+        g_timeout_add(1, coroutine->cb, this);
+        co_yield_int(G_SOURCE_REMOVE);
+    }
+    assert(CO tries < 1000);
+
+    inject_fault(this);
+
+    while (!this->done_time) {
+        progress_source_add(coroutine->cb, this);
+        co_yield_int(G_SOURCE_REMOVE);
+    }
+
+    co_recurse(ch_execute_co(coroutine, sctx->client_ch,
+                             "{'exec-colod': 'quit'}\n", 1000));
+
+    this->quit = TRUE;
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean testcase_co(gpointer data) {
+    SmokeTestcase *this = data;
+    Coroutine *coroutine = data;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _testcase_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    return ret;
+}
+
+static SmokeTestcase *testcase_new(SmokeColodContext *sctx,
+                                   const BenchCase *config) {
+    SmokeTestcase *this;
+    Coroutine *coroutine;
+
+    this = coroutine_new(&testcase_type);
+    coroutine = &this->coroutine;
+    coroutine->cb = testcase_co;
+    this->sctx = sctx;
+    this->config = config;
+    this->qmp = qmp_stub_new(this, sctx->qmp_ch);
+    this->qmp_yank = qmp_stub_new(this, sctx->qmp_yank_ch);
+
+    sctx->cctx.monitor_interface = BENCH_INTERFACE;
+    sctx->cctx.command_timeout = 60*1000;
+    colod_cpg_stub_set_loopback(sctx->cctx.cpg, TRUE);
+
+    g_idle_add(testcase_co, this);
+    return this;
+}
+
+static void testcase_free(SmokeTestcase *this) {
+    while (!this->quit || !this->qmp->quit || !this->qmp_yank->quit) {
+        g_main_context_iteration(g_main_context_default(), TRUE);
+    }
+
+    coroutine_free(this->qmp);
+    coroutine_free(this->qmp_yank);
+    coroutine_free(this);
+}
+
+static void bench_run(const BenchCase *config, gint64 *first, gint64 *done) {
+    GError *errp = NULL;
+    SmokeColodContext *sctx;
+    SmokeTestcase *testcase;
+
+    sctx = smoke_context_new(&errp);
+    if (!sctx) {
+        fprintf(stderr, "%s\n", errp->message);
+        exit(EXIT_FAILURE);
+    }
+
+    testcase = testcase_new(sctx, config);
+
+    daemon_mainloop(&sctx->cctx);
+
+    *first = testcase->first_time - testcase->inject_time;
+    *done = testcase->done_time - testcase->inject_time;
+
+    testcase_free(testcase);
+    smoke_context_free(sctx);
+}
+
+static int compare_gint64(const void *a, const void *b) {
+    gint64 _a = *(const gint64 *) a;
+    gint64 _b = *(const gint64 *) b;
+
+    return (_a > _b) - (_a < _b);
+}
+
+static gint64 percentile(const gint64 *sorted, int count, int percent) {
+    int index = (count * percent + 99) / 100 - 1;
+
+    return sorted[CLAMP(index, 0, count - 1)];
+}
+
+static void report(const gchar *name, const gchar *what, gint64 *samples,
+                   int count) {
+    qsort(samples, count, sizeof(gint64), compare_gint64);
+
+    printf("%-16s %-12s runs %6d  p50 %8" G_GINT64_FORMAT "us"
+           "  p99 %8" G_GINT64_FORMAT "us  max %8" G_GINT64_FORMAT "us\n",
+           name, what, count, percentile(samples, count, 50),
+           percentile(samples, count, 99), samples[count - 1]);
+}
+
+static void bench_case(const BenchCase *config, int runs) {
+    gint64 *first = g_new0(gint64, runs);
+    gint64 *done = g_new0(gint64, runs);
+
+    for (int i = 0; i < runs; i++) {
+        bench_run(config, &first[i], &done[i]);
+    }
+
+    report(config->name, "first-qmp", first, runs);
+    report(config->name, "failover", done, runs);
+    fflush(stdout);
+
+    g_free(first);
+    g_free(done);
+}
+
+int main(int argc, char **argv) {
+    GError *errp = NULL;
+    GOptionContext *context;
+    int runs = 1000;
+    gchar *only = NULL;
+    gboolean found = FALSE;
+    GOptionEntry entries[] = {
+        {"runs", 'n', 0, G_OPTION_ARG_INT, &runs, "Number of runs per case (default 1000)", NULL},
+        {"case", 'c', 0, G_OPTION_ARG_STRING, &only, "Only run this case: peer_left, message_failed, colo_exit or link_down", NULL},
+        {0}
+    };
+
+    context = g_option_context_new("- benchmark failover latency");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &errp)) {
+        fprintf(stderr, "%s\n", errp->message);
+        g_error_free(errp);
+        g_option_context_free(context);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (runs <= 0) {
+        fprintf(stderr, "--runs must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    smoke_init();
+
+    for (guint i = 0; i < G_N_ELEMENTS(bench_cases); i++) {
+        if (only && strcmp(only, bench_cases[i].name)) {
+            continue;
+        }
+
+        found = TRUE;
+        bench_case(&bench_cases[i], runs);
+    }
+
+    if (!found) {
+        fprintf(stderr, "Unknown case: %s\n", only);
+        return EXIT_FAILURE;
+    }
+
+    g_free(only);
+    return EXIT_SUCCESS;
+}
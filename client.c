@@ -22,25 +22,34 @@
 #include "json_util.h"
 #include "qmp.h"
 #include "coroutine_stack.h"
-#include "peer_manager.h"
+#include "metrics.h"
+#include "poller.h"
 
 
-typedef struct ColodClient {
+struct ColodClient {
     Coroutine coroutine;
     QLIST_ENTRY(ColodClient) next;
     QmpCommands *commands;
     ColodClientListener *parent;
     GIOChannel *channel;
+    CoroutineWatch *watch;
+    ColodWriter *writer;
     gboolean stopped_qemu;
     gboolean quit;
     gboolean busy;
-} ColodClient;
+};
+
+// query-status nests deepest: dispatch, handler, health check callback,
+// qemu status query and a qmp execute that drains a stale reply, times out
+// and yanks, 18 frames
+static CoroutineType client_coroutine_type =
+    COROUTINE_POOL("client", ColodClient, 22);
 
 QLIST_HEAD(ColodClientHead, ColodClient);
 struct ColodClientListener {
     int socket;
     QmpCommands *commands;
-    PeerManager *peer;
+    GHashTable *registry;
     guint listen_source_id;
     struct ColodClientHead head;
     JsonNode *store;
@@ -48,52 +57,19 @@ struct ColodClientListener {
     const ClientCallbacks *cb;
     gpointer cb_data;
     CoroutineLock lock;
-};
 
-struct MyTimeout {
-    GTimer *timer;
-    guint timeout_ms;
+    // Instances hosted in this process share the socket of the root listener
+    ColodClientListener *root;
+    gchar *name;
+    // name -> ColodClientListener, only set in the root listener
+    GHashTable *instances;
 };
 
-guint my_timeout_remaining_ms(MyTimeout *this) {
-    guint elapsed = g_timer_elapsed(this->timer, NULL)/1000;
-
-    if (elapsed >= this->timeout_ms) {
-        return 0;
-    }
-
-    return this->timeout_ms - elapsed;
-}
-
-guint my_timeout_remaining_minus_ms(MyTimeout *this, guint minus) {
-    guint remaining = my_timeout_remaining_ms(this);
-
-    if (minus >= remaining) {
-        return 0;
-    }
-
-    return remaining - minus;
-}
-
-MyTimeout *my_timeout_new(guint timeout_ms) {
-    MyTimeout *this = g_rc_box_new0(MyTimeout);
-    this->timer = g_timer_new();
-    this->timeout_ms = MAX(0, timeout_ms);
-    return this;
-}
-
-static void my_timeout_free(gpointer data) {
-    MyTimeout *this = data;
-    g_timer_destroy(this->timer);
-}
-
-MyTimeout *my_timeout_ref(MyTimeout *this) {
-    return g_rc_box_acquire(this);
-}
-
-void my_timeout_unref(MyTimeout *this) {
-    g_rc_box_release_full(this, my_timeout_free);
-}
+typedef struct ClientCommand {
+    ClientCommandFunc func;
+    ClientCommandFlags flags;
+    gpointer data;
+} ClientCommand;
 
 void client_register(ColodClientListener *this, const ClientCallbacks *cb, gpointer data) {
     assert(!this->cb && !this->cb_data);
@@ -114,15 +90,26 @@ void client_unregister(ColodClientListener *this, const ClientCallbacks *cb, gpo
         co_yield_int(G_SOURCE_REMOVE); \
     }
 
+// The callbacks may be unregistered while we wait for the lock
+#define lock_callback(func, errp, ret) \
+    colod_lock_co(this->lock); \
+    if (!this->cb || !this->cb->func) { \
+        colod_unlock_co(this->lock); \
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_QUIT, \
+                    "colod main coroutine quit while waiting"); \
+        return (ret); \
+    }
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
 #define query_status_co(...) co_wrap(_query_status(__VA_ARGS__))
-static int _query_status(Coroutine *coroutine, ColodClientListener *this, ColodState *ret) {
+static int _query_status(Coroutine *coroutine, ColodClientListener *this,
+                         ColodState *ret, GError **errp) {
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->query_status || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->query_status);
+    lock_callback(query_status, errp, -1);
 
     this->cb->query_status(this->cb_data, ret);
 
@@ -143,8 +130,8 @@ static int _check_health_co(Coroutine *coroutine, ColodClientListener *this, GEr
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_check_health_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_check_health_co);
+    lock_callback(_check_health_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -156,20 +143,9 @@ static int _check_health_co(Coroutine *coroutine, ColodClientListener *this, GEr
     return ret;
 }
 
-#define set_peer(...) co_wrap(_set_peer(__VA_ARGS__))
-static void _set_peer(Coroutine *coroutine, ColodClientListener *this, const char *peer) {
-    (void) coroutine;
-    peer_manager_set_peer(this->peer, peer);
-}
-
-#define clear_peer(...) co_wrap(_clear_peer(__VA_ARGS__))
-static void _clear_peer(Coroutine *coroutine, ColodClientListener *this) {
-    (void) coroutine;
-    peer_manager_clear_peer(this->peer);
-}
-
 #define promote(...) co_wrap(_promote(__VA_ARGS__))
-static int _promote(Coroutine *coroutine, ColodClientListener *this) {
+static int _promote(Coroutine *coroutine, ColodClientListener *this,
+                    GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -179,8 +155,8 @@ static int _promote(Coroutine *coroutine, ColodClientListener *this) {
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_promote_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_promote_co);
+    lock_callback(_promote_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -194,7 +170,8 @@ static int _promote(Coroutine *coroutine, ColodClientListener *this) {
 }
 
 #define start_migration(...) co_wrap(_start_migration(__VA_ARGS__))
-static int _start_migration(Coroutine *coroutine, ColodClientListener *this) {
+static int _start_migration(Coroutine *coroutine, ColodClientListener *this,
+                            GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -204,8 +181,8 @@ static int _start_migration(Coroutine *coroutine, ColodClientListener *this) {
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_start_migration_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_start_migration_co);
+    lock_callback(_start_migration_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -219,7 +196,8 @@ static int _start_migration(Coroutine *coroutine, ColodClientListener *this) {
 }
 
 #define reboot(...) co_wrap(_reboot(__VA_ARGS__))
-static int _reboot(Coroutine *coroutine, ColodClientListener *this) {
+static int _reboot(Coroutine *coroutine, ColodClientListener *this,
+                   GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -229,8 +207,8 @@ static int _reboot(Coroutine *coroutine, ColodClientListener *this) {
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_reboot_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_reboot_co);
+    lock_callback(_reboot_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -244,7 +222,8 @@ static int _reboot(Coroutine *coroutine, ColodClientListener *this) {
 }
 
 #define shutdown(...) co_wrap(_shutdown(__VA_ARGS__))
-static int _shutdown(Coroutine *coroutine, ColodClientListener *this, MyTimeout *timeout) {
+static int _shutdown(Coroutine *coroutine, ColodClientListener *this,
+                     MyTimeout *timeout, GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -255,8 +234,8 @@ static int _shutdown(Coroutine *coroutine, ColodClientListener *this, MyTimeout
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_shutdown_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_shutdown_co);
+    lock_callback(_shutdown_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -270,7 +249,8 @@ static int _shutdown(Coroutine *coroutine, ColodClientListener *this, MyTimeout
 }
 
 #define demote(...) co_wrap(_demote(__VA_ARGS__))
-static int _demote(Coroutine *coroutine, ColodClientListener *this, MyTimeout *timeout) {
+static int _demote(Coroutine *coroutine, ColodClientListener *this,
+                   MyTimeout *timeout, GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -281,8 +261,8 @@ static int _demote(Coroutine *coroutine, ColodClientListener *this, MyTimeout *t
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_demote_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_demote_co);
+    lock_callback(_demote_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -296,7 +276,8 @@ static int _demote(Coroutine *coroutine, ColodClientListener *this, MyTimeout *t
 }
 
 #define quit(...) co_wrap(_quit(__VA_ARGS__))
-static int _quit(Coroutine *coroutine, ColodClientListener *this, MyTimeout *timeout) {
+static int _quit(Coroutine *coroutine, ColodClientListener *this,
+                 MyTimeout *timeout, GError **errp) {
     struct {
         const ClientCallbacks *cb;
         gpointer data;
@@ -307,8 +288,8 @@ static int _quit(Coroutine *coroutine, ColodClientListener *this, MyTimeout *tim
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_quit_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_quit_co);
+    lock_callback(_quit_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -333,8 +314,8 @@ static int _yank_co(Coroutine *coroutine, ColodClientListener *this, GError **er
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    wait_while(!this->cb || !this->cb->_yank_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_yank_co);
+    lock_callback(_yank_co, errp, -1);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -359,8 +340,8 @@ static ColodQmpResult *_execute_nocheck_co(Coroutine *coroutine, ColodClientList
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
-    wait_while(!this->cb || !this->cb->_execute_nocheck_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_execute_nocheck_co);
+    lock_callback(_execute_nocheck_co, errp, NULL);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -385,8 +366,8 @@ static ColodQmpResult *_execute_co(Coroutine *coroutine, ColodClientListener *th
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
-    wait_while(!this->cb || !this->cb->_execute_co || this->lock.holder);
-    colod_lock_co(this->lock);
+    wait_while(!this->cb || !this->cb->_execute_co);
+    lock_callback(_execute_co, errp, NULL);
 
     CO cb = this->cb;
     CO data = this->cb_data;
@@ -399,7 +380,7 @@ static ColodQmpResult *_execute_co(Coroutine *coroutine, ColodClientListener *th
 }
 #pragma GCC diagnostic pop
 
-static ColodQmpResult *create_reply(const gchar *member) {
+ColodQmpResult *client_create_reply(const gchar *member) {
     ColodQmpResult *result;
 
     gchar *reply = g_strdup_printf("{\"return\": %s}\n", member);
@@ -409,7 +390,7 @@ static ColodQmpResult *create_reply(const gchar *member) {
     return result;
 }
 
-static ColodQmpResult *create_error_reply(const gchar *message) {
+ColodQmpResult *client_create_error_reply(const gchar *message) {
     ColodQmpResult *result;
 
     gchar *reply = g_strdup_printf("{\"error\": \"%s\"}\n", message);
@@ -419,10 +400,11 @@ static ColodQmpResult *create_error_reply(const gchar *message) {
     return result;
 }
 
-#define handle_query_status_co(...) \
-    co_wrap(_handle_query_status_co(__VA_ARGS__))
 static ColodQmpResult *_handle_query_status_co(Coroutine *coroutine,
-                                               ColodClientListener *this) {
+                                               ColodClient *client,
+                                               G_GNUC_UNUSED ColodQmpResult *request,
+                                               G_GNUC_UNUSED gpointer data) {
+    ColodClientListener *this = client->parent;
     int ret;
     ColodQmpResult *result;
     ColodState state;
@@ -441,9 +423,15 @@ static ColodQmpResult *_handle_query_status_co(Coroutine *coroutine,
         }
     }
 
-    co_recurse(query_status_co(coroutine, this, &state));
+    co_recurse(ret = query_status_co(coroutine, this, &state, &local_errp));
     co_end;
 
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
+
     gchar *member;
     member = g_strdup_printf("{\"running\": %s,"
                              " \"primary\": %s, \"replication\": %s,"
@@ -454,13 +442,16 @@ static ColodQmpResult *_handle_query_status_co(Coroutine *coroutine,
                              bool_to_json(failed || state.failed),
                              bool_to_json(state.peer_failover), bool_to_json(state.peer_failed));
 
-    result = create_reply(member);
+    result = client_create_reply(member);
     assert(result);
     g_free(member);
     return result;
 }
 
-static ColodQmpResult *handle_query_store(ColodClient *client) {
+static ColodQmpResult *handle_query_store(G_GNUC_UNUSED Coroutine *coroutine,
+                                          ColodClient *client,
+                                          G_GNUC_UNUSED ColodQmpResult *request,
+                                          G_GNUC_UNUSED gpointer data) {
     ColodQmpResult *result;
     gchar *store_str;
     JsonNode *store = client->parent->store;
@@ -471,107 +462,296 @@ static ColodQmpResult *handle_query_store(ColodClient *client) {
         store_str = g_strdup("{}");
     }
 
-    result = create_reply(store_str);
+    result = client_create_reply(store_str);
     g_free(store_str);
     return result;
 }
 
-static ColodQmpResult *handle_set_store(ColodQmpResult *request,
-                                        ColodClient *client) {
+static ColodQmpResult *handle_query_metrics(G_GNUC_UNUSED Coroutine *coroutine,
+                                            G_GNUC_UNUSED ColodClient *client,
+                                            G_GNUC_UNUSED ColodQmpResult *request,
+                                            G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    gchar *metrics = metrics_to_json();
+
+    result = client_create_reply(metrics);
+    g_free(metrics);
+    return result;
+}
+
+static ColodQmpResult *handle_query_coroutines(G_GNUC_UNUSED Coroutine *coroutine,
+                                               G_GNUC_UNUSED ColodClient *client,
+                                               G_GNUC_UNUSED ColodQmpResult *request,
+                                               G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    gchar *stats = coroutine_stats_to_json();
+
+    result = client_create_reply(stats);
+    g_free(stats);
+    return result;
+}
+
+static ColodQmpResult *handle_query_profile(G_GNUC_UNUSED Coroutine *coroutine,
+                                            G_GNUC_UNUSED ColodClient *client,
+                                            G_GNUC_UNUSED ColodQmpResult *request,
+                                            G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    gchar *profile = coroutine_profile_to_json();
+
+    result = client_create_reply(profile);
+    g_free(profile);
+    return result;
+}
+
+static ColodQmpResult *handle_set_store(G_GNUC_UNUSED Coroutine *coroutine,
+                                        ColodClient *client,
+                                        ColodQmpResult *request,
+                                        G_GNUC_UNUSED gpointer data) {
     JsonNode *store;
 
-    if (!has_member(request->json_root, "store")) {
-        return create_error_reply("Member 'store' missing");
+    if (!has_member(qmp_result_get_json(request), "store")) {
+        return client_create_error_reply("Member 'store' missing");
     }
 
-    store = get_member_node(request->json_root, "store");
+    store = get_member_node(qmp_result_get_json(request), "store");
 
     if (client->parent->store) {
         json_node_unref(client->parent->store);
     }
     client->parent->store = json_node_ref(store);
 
-    return create_reply("{}");
+    return client_create_reply("{}");
+}
+
+static ColodClientListener *client_root(ColodClient *client) {
+    return client->parent->root ? client->parent->root : client->parent;
+}
+
+static ColodQmpResult *handle_query_instances(G_GNUC_UNUSED Coroutine *coroutine,
+                                              ColodClient *client,
+                                              G_GNUC_UNUSED ColodQmpResult *request,
+                                              G_GNUC_UNUSED gpointer data) {
+    ColodClientListener *root = client_root(client);
+    JsonArray *array = json_array_new();
+    JsonNode *node = json_node_alloc();
+    ColodQmpResult *result;
+
+    if (root->instances) {
+        GList *names = g_hash_table_get_keys(root->instances);
+        names = g_list_sort(names, (GCompareFunc) g_strcmp0);
+        for (GList *entry = names; entry; entry = entry->next) {
+            json_array_add_string_element(array, entry->data);
+        }
+        g_list_free(names);
+    }
+    json_node_init_array(node, array);
+    json_array_unref(array);
+
+    gchar *member = json_to_string(node, FALSE);
+    json_node_unref(node);
+    result = client_create_reply(member);
+    g_free(member);
+    return result;
+}
+
+static ColodQmpResult *handle_select_instance(G_GNUC_UNUSED Coroutine *coroutine,
+                                              ColodClient *client,
+                                              ColodQmpResult *request,
+                                              G_GNUC_UNUSED gpointer data) {
+    ColodClientListener *root = client_root(client);
+    ColodClientListener *instance;
+    const gchar *name;
+
+    name = get_member_str(qmp_result_get_json(request), "instance");
+    if (!name) {
+        return client_create_error_reply("Member 'instance' missing");
+    }
+
+    if (!root->instances) {
+        return client_create_error_reply("Not hosting multiple instances");
+    }
+
+    instance = g_hash_table_lookup(root->instances, name);
+    if (!instance) {
+        return client_create_error_reply("Unknown instance");
+    }
+
+    // The connection would be unable to resume qemu of the old instance
+    if (client->stopped_qemu) {
+        return client_create_error_reply("Qemu is stopped by this client");
+    }
+
+    QLIST_REMOVE(client, next);
+    QLIST_INSERT_HEAD(&instance->head, client, next);
+    client->parent = instance;
+    client->commands = instance->commands;
+
+    return client_create_reply("{}");
 }
 
 static MyTimeout *request_timeout(ColodQmpResult *request) {
-    if (!has_member(request->json_root, "timeout")) {
+    if (!has_member(qmp_result_get_json(request), "timeout")) {
         return NULL;
     }
 
-    JsonObject *object = json_node_get_object(request->json_root);
+    JsonObject *object = json_node_get_object(qmp_result_get_json(request));
     guint timeout = json_object_get_int_member(object, "timeout");
 
     return my_timeout_new(timeout);
 }
 
-#define handle_start_migration(...) co_wrap(_handle_start_migration(__VA_ARGS__))
-static ColodQmpResult * _handle_start_migration(Coroutine *coroutine, ColodClientListener *this) {
+static ColodQmpResult *_handle_promote(Coroutine *coroutine,
+                                       ColodClient *client,
+                                       G_GNUC_UNUSED ColodQmpResult *request,
+                                       G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
+
     co_begin(ColodQmpResult *, NULL);
 
-    co_recurse(start_migration(coroutine, this));
+    co_recurse(ret = promote(coroutine, client->parent, &local_errp));
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 
     co_end;
 }
 
-#define handle_shutdown(...) co_wrap(_handle_shutdown(__VA_ARGS__))
-static ColodQmpResult *_handle_shutdown(Coroutine *coroutine, ColodClientListener *this, ColodQmpResult *request) {
+static ColodQmpResult *_handle_start_migration(Coroutine *coroutine,
+                                               ColodClient *client,
+                                               G_GNUC_UNUSED ColodQmpResult *request,
+                                               G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_begin(ColodQmpResult *, NULL);
+
+    co_recurse(ret = start_migration(coroutine, client->parent, &local_errp));
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
+
+    return client_create_reply("{}");
+
+    co_end;
+}
+
+static ColodQmpResult *_handle_reboot(Coroutine *coroutine,
+                                      ColodClient *client,
+                                      G_GNUC_UNUSED ColodQmpResult *request,
+                                      G_GNUC_UNUSED gpointer data) {
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_begin(ColodQmpResult *, NULL);
+
+    co_recurse(ret = reboot(coroutine, client->parent, &local_errp));
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
+
+    return client_create_reply("{}");
+
+    co_end;
+}
+
+static ColodQmpResult *_handle_shutdown(Coroutine *coroutine, ColodClient *client,
+                                        ColodQmpResult *request,
+                                        G_GNUC_UNUSED gpointer data) {
     struct {
         MyTimeout *timeout;
     } *co;
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
 
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
     CO timeout = request_timeout(request);
-    co_recurse(shutdown(coroutine, this, CO timeout));
+    co_recurse(ret = shutdown(coroutine, client->parent, CO timeout,
+                                  &local_errp));
     if (CO timeout) {
         my_timeout_unref(CO timeout);
     }
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 
     co_end;
 }
 
-#define handle_demote(...) co_wrap(_handle_demote(__VA_ARGS__))
-static ColodQmpResult *_handle_demote(Coroutine *coroutine, ColodClientListener *this, ColodQmpResult *request) {
+static ColodQmpResult *_handle_demote(Coroutine *coroutine, ColodClient *client,
+                                      ColodQmpResult *request,
+                                      G_GNUC_UNUSED gpointer data) {
     struct {
         MyTimeout *timeout;
     } *co;
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
 
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
     CO timeout = request_timeout(request);
-    co_recurse(demote(coroutine, this, CO timeout));
+    co_recurse(ret = demote(coroutine, client->parent, CO timeout,
+                                &local_errp));
     if (CO timeout) {
         my_timeout_unref(CO timeout);
     }
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 
     co_end;
 }
 
-#define handle_quit(...) co_wrap(_handle_quit(__VA_ARGS__))
-static ColodQmpResult *_handle_quit(Coroutine *coroutine, ColodClientListener *this, ColodQmpResult *request) {
+static ColodQmpResult *_handle_quit(Coroutine *coroutine, ColodClient *client,
+                                      ColodQmpResult *request,
+                                      G_GNUC_UNUSED gpointer data) {
     struct {
         MyTimeout *timeout;
     } *co;
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
 
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
     CO timeout = request_timeout(request);
-    co_recurse(quit(coroutine, this, CO timeout));
+    co_recurse(ret = quit(coroutine, client->parent, CO timeout,
+                              &local_errp));
     if (CO timeout) {
         my_timeout_unref(CO timeout);
     }
+    if (ret < 0) {
+        result = client_create_error_reply(local_errp->message);
+        g_error_free(local_errp);
+        return result;
+    }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 
     co_end;
 }
@@ -579,12 +759,12 @@ static ColodQmpResult *_handle_quit(Coroutine *coroutine, ColodClientListener *t
 static JsonNode *get_commands(ColodQmpResult *request, GError **errp) {
     JsonNode *commands;
 
-    if (!has_member(request->json_root, "commands")) {
+    if (!has_member(qmp_result_get_json(request), "commands")) {
         colod_error_set(errp, "Member 'commands' missing");
         return NULL;
     }
 
-    commands = get_member_node(request->json_root, "commands");
+    commands = get_member_node(qmp_result_get_json(request), "commands");
     if (!JSON_NODE_HOLDS_ARRAY(commands)) {
         colod_error_set(errp, "Member 'commands' must be an array");
         return NULL;
@@ -602,88 +782,101 @@ static ColodQmpResult *handle_set(ColodClient *this,
 
     JsonNode *commands = get_commands(request, &local_errp);
     if (!commands) {
-        reply = create_error_reply(local_errp->message);
+        reply = client_create_error_reply(local_errp->message);
         g_error_free(local_errp);
         return reply;
     }
 
     int ret = func(this->commands, commands, &local_errp);
     if (ret < 0) {
-        reply = create_error_reply(local_errp->message);
+        reply = client_create_error_reply(local_errp->message);
         g_error_free(local_errp);
         return reply;
     }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 }
 
-static ColodQmpResult *handle_set_prepare_secondary(ColodClient *this,
-                                                    ColodQmpResult *request) {
-    return handle_set(this, qmp_commands_set_prepare_secondary, request);
+static ColodQmpResult *handle_set_prepare_secondary(G_GNUC_UNUSED Coroutine *coroutine,
+                                                    ColodClient *client,
+                                                    ColodQmpResult *request,
+                                                    G_GNUC_UNUSED gpointer data) {
+    return handle_set(client, qmp_commands_set_prepare_secondary, request);
 }
 
-static ColodQmpResult *handle_set_migration_start(ColodClient *this,
-                                                  ColodQmpResult *request) {
-    return handle_set(this, qmp_commands_set_migration_start, request);
+static ColodQmpResult *handle_set_migration_start(G_GNUC_UNUSED Coroutine *coroutine,
+                                                  ColodClient *client,
+                                                  ColodQmpResult *request,
+                                                  G_GNUC_UNUSED gpointer data) {
+    return handle_set(client, qmp_commands_set_migration_start, request);
 }
 
-static ColodQmpResult *handle_set_migration_switchover(ColodClient *this,
-                                                       ColodQmpResult *request) {
-    return handle_set(this, qmp_commands_set_migration_switchover, request);
+static ColodQmpResult *handle_set_migration_switchover(G_GNUC_UNUSED Coroutine *coroutine,
+                                                       ColodClient *client,
+                                                       ColodQmpResult *request,
+                                                       G_GNUC_UNUSED gpointer data) {
+    return handle_set(client, qmp_commands_set_migration_switchover, request);
 }
 
-static ColodQmpResult *handle_set_primary_failover(ColodClient *this,
-                                                   ColodQmpResult *request) {
-    return handle_set(this, qmp_commands_set_failover_primary, request);
+static ColodQmpResult *handle_set_primary_failover(G_GNUC_UNUSED Coroutine *coroutine,
+                                                   ColodClient *client,
+                                                   ColodQmpResult *request,
+                                                   G_GNUC_UNUSED gpointer data) {
+    return handle_set(client, qmp_commands_set_failover_primary, request);
 }
 
-static ColodQmpResult *handle_set_secondary_failover(ColodClient *this,
-                                                     ColodQmpResult *request) {
-    return handle_set(this, qmp_commands_set_failover_secondary, request);
+static ColodQmpResult *handle_set_secondary_failover(G_GNUC_UNUSED Coroutine *coroutine,
+                                                     ColodClient *client,
+                                                     ColodQmpResult *request,
+                                                     G_GNUC_UNUSED gpointer data) {
+    return handle_set(client, qmp_commands_set_failover_secondary, request);
 }
 
-static ColodQmpResult *handle_set_yank(ColodClient *this, ColodQmpResult *request) {
+static ColodQmpResult *handle_set_yank(G_GNUC_UNUSED Coroutine *coroutine,
+                                       ColodClient *client,
+                                       ColodQmpResult *request,
+                                       G_GNUC_UNUSED gpointer data) {
     JsonNode *instances;
 
-    if (!has_member(request->json_root, "instances")) {
-        return create_error_reply("Member 'instances' missing");
+    if (!has_member(qmp_result_get_json(request), "instances")) {
+        return client_create_error_reply("Member 'instances' missing");
     }
 
-    instances = get_member_node(request->json_root, "instances");
+    instances = get_member_node(qmp_result_get_json(request), "instances");
     if (!JSON_NODE_HOLDS_ARRAY(instances)) {
-        return create_error_reply("Member 'instances' must be an array");
+        return client_create_error_reply("Member 'instances' must be an array");
     }
 
-    qmp_commands_set_yank_instances(this->commands, instances);
+    qmp_commands_set_yank_instances(client->commands, instances);
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 }
 
-#define handle_yank_co(...) \
-    co_wrap(_handle_yank_co(__VA_ARGS__))
 static ColodQmpResult *_handle_yank_co(Coroutine *coroutine,
-                                       ColodClientListener *this) {
+                                       ColodClient *client,
+                                       G_GNUC_UNUSED ColodQmpResult *request,
+                                       G_GNUC_UNUSED gpointer data) {
     ColodQmpResult *result;
     int ret;
     GError *local_errp = NULL;
 
-    ret = _yank_co(coroutine, this, &local_errp);
+    ret = _yank_co(coroutine, client->parent, &local_errp);
     if (coroutine->yield) {
         return NULL;
     }
     if (ret < 0) {
-        result = create_error_reply(local_errp->message);
+        result = client_create_error_reply(local_errp->message);
         g_error_free(local_errp);
         return result;
     }
 
-    return create_reply("{}");
+    return client_create_reply("{}");
 }
 
-#define handle_stop_co(...) \
-    co_wrap(_handle_stop_co(__VA_ARGS__))
 static ColodQmpResult *_handle_stop_co(Coroutine *coroutine,
-                                       ColodClient *client) {
+                                       ColodClient *client,
+                                       G_GNUC_UNUSED ColodQmpResult *request,
+                                       G_GNUC_UNUSED gpointer data) {
     ColodQmpResult *result;
     GError *local_errp = NULL;
 
@@ -693,7 +886,7 @@ static ColodQmpResult *_handle_stop_co(Coroutine *coroutine,
         return NULL;
     }
     if (!result) {
-        result = create_error_reply(local_errp->message);
+        result = client_create_error_reply(local_errp->message);
         g_error_free(local_errp);
         return result;
     }
@@ -702,10 +895,10 @@ static ColodQmpResult *_handle_stop_co(Coroutine *coroutine,
     return result;
 }
 
-#define handle_cont_co(...) \
-    co_wrap(_handle_cont_co(__VA_ARGS__))
 static ColodQmpResult *_handle_cont_co(Coroutine *coroutine,
-                                       ColodClient *client) {
+                                       ColodClient *client,
+                                       G_GNUC_UNUSED ColodQmpResult *request,
+                                       G_GNUC_UNUSED gpointer data) {
     ColodQmpResult *result;
     GError *local_errp = NULL;
 
@@ -715,7 +908,7 @@ static ColodQmpResult *_handle_cont_co(Coroutine *coroutine,
         return NULL;
     }
     if (!result) {
-        result = create_error_reply(local_errp->message);
+        result = client_create_error_reply(local_errp->message);
         g_error_free(local_errp);
         return result;
     }
@@ -724,43 +917,80 @@ static ColodQmpResult *_handle_cont_co(Coroutine *coroutine,
     return result;
 }
 
-#define handle_set_peer(...) co_wrap(_handle_set_peer(__VA_ARGS__))
-static ColodQmpResult * _handle_set_peer(Coroutine *coroutine, ColodClientListener *this, ColodQmpResult *request) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+
+#define client_dispatch_co(...) co_wrap(_client_dispatch_co(__VA_ARGS__))
+static ColodQmpResult *_client_dispatch_co(Coroutine *coroutine,
+                                           ColodClient *client,
+                                           ColodQmpResult *request) {
+    ColodClientListener *this = client->parent;
     struct {
-        const gchar *peer;
+        ClientCommand command;
+        gint64 deadline;
     } *co;
+    ColodQmpResult *result;
+    const gchar *name;
+    MyTimeout *timeout;
 
     co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
-    if (!has_member(request->json_root, "peer")) {
-        return create_error_reply("Member 'peer' missing");
+    if (request->fields.valid) {
+        name = request->fields.exec_colod;
+    } else {
+        name = get_member_str(qmp_result_get_json(request), "exec-colod");
+    }
+    if (!name) {
+        return client_create_error_reply("Could not get exec-colod member");
+    }
+
+    ClientCommand *command = g_hash_table_lookup(this->registry, name);
+    if (!command) {
+        return client_create_error_reply("Unknown command");
+    }
+    if (this->instances && !(command->flags & CLIENT_COMMAND_GLOBAL)) {
+        return client_create_error_reply("No instance selected");
+    }
+    // The entry may be unregistered while we yield
+    CO command = *command;
+    metrics_inc(metrics_counter("client_commands", "command", name), 1);
+
+    // A timeout member bounds everything the command does
+    timeout = request_timeout(request);
+    CO deadline = colod_deadline_enter(coroutine, timeout);
+    if (timeout) {
+        my_timeout_unref(timeout);
+    }
+
+    if (CO command.flags & CLIENT_COMMAND_LOCK) {
+        colod_lock_co(this->lock);
     }
 
-    CO peer = get_member_str(request->json_root, "peer");
-    co_recurse(set_peer(coroutine, this, CO peer));
+    if (CO command.flags & CLIENT_COMMAND_COROUTINE) {
+        co_recurse(result = CO command.func(coroutine, client, request,
+                                            CO command.data));
+    } else {
+        result = CO command.func(coroutine, client, request, CO command.data);
+    }
 
-    return create_reply("{}");
+    if (CO command.flags & CLIENT_COMMAND_LOCK) {
+        colod_unlock_co(this->lock);
+    }
+    colod_deadline_restore(coroutine, CO deadline);
 
     co_end;
-}
 
-#define handle_query_peer(...) co_wrap(_handle_query_peer(__VA_ARGS__))
-static ColodQmpResult * _handle_query_peer(Coroutine *coroutine, ColodClientListener *this) {
-    (void) coroutine;
-    gchar *member;
-    member = g_strdup_printf("{\"peer\": \"%s\"}", peer_manager_get_peer(this->peer));
-
-    ColodQmpResult *result = create_reply(member);
-    assert(result);
-    g_free(member);
     return result;
 }
+#pragma GCC diagnostic pop
 
 static void client_free(ColodClient *client) {
     QLIST_REMOVE(client, next);
+    colod_writer_free(client->writer);
+    colod_watch_free(client->watch);
     g_io_channel_unref(client->channel);
-    g_free(client);
+    coroutine_free(client);
 }
 
 static gboolean _colod_client_co(Coroutine *coroutine);
@@ -786,6 +1016,7 @@ static gboolean _colod_client_co(Coroutine *coroutine) {
         gsize len;
         ColodQmpResult *request, *result;
     } *co;
+    QmpFields fields;
     int ret;
     GError *local_errp = NULL;
 
@@ -796,6 +1027,7 @@ static gboolean _colod_client_co(Coroutine *coroutine) {
         CO line = NULL;
         client->busy = FALSE;
         co_recurse(ret = colod_channel_read_line_co(coroutine, client->channel,
+                                                    client->watch,
                                                     &CO line, &CO len, &local_errp));
         if (client->quit) {
             if (local_errp) {
@@ -809,86 +1041,51 @@ static gboolean _colod_client_co(Coroutine *coroutine) {
         }
 
         client->busy = TRUE;
-
-        CO request = qmp_parse_result(CO line, CO len, &local_errp);
-        if (!CO request) {
-            goto error_client;
+        colod_trace("client: %s", CO line);
+
+        // Only exec-colod commands need the json tree, everything else is
+        // passed through to qemu as is
+        CO request = NULL;
+        ret = qmp_scan_fields(CO line, CO len, &fields);
+        if (ret < 0 || !fields.valid || fields.has_exec_colod) {
+            CO request = qmp_parse_result(CO line, CO len, &local_errp);
+            CO line = NULL;
+            if (!CO request) {
+                goto error_client;
+            }
+            if (!ret) {
+                CO request->fields = fields;
+            }
         }
 
-        colod_trace("client: %s", CO request->line);
-        if (has_member(CO request->json_root, "exec-colod")) {
-            const gchar *command = get_member_str(CO request->json_root,
-                                                  "exec-colod");
-            if (!command) {
-                CO result = create_error_reply("Could not get exec-colod "
-                                               "member");
-            } else if (!strcmp(command, "query-status")) {
-                co_recurse(CO result = handle_query_status_co(coroutine, client->parent));
-            } else if (!strcmp(command, "query-store")) {
-                CO result = handle_query_store(client);
-            } else if (!strcmp(command, "set-store")) {
-                CO result = handle_set_store(CO request, client);
-            } else if (!strcmp(command, "promote")) {
-                co_recurse(promote(coroutine, client->parent));
-                CO result = create_reply("{}");
-            } else if (!strcmp(command, "start-migration")) {
-                co_recurse(CO result = handle_start_migration(coroutine, client->parent));
-            } else if (!strcmp(command, "reboot")) {
-                co_recurse(reboot(coroutine, client->parent));
-                CO result = create_reply("{}");
-            } else if (!strcmp(command, "shutdown")) {
-                co_recurse(CO result = handle_shutdown(coroutine, client->parent, CO request));
-            } else if (!strcmp(command, "demote")) {
-                co_recurse(CO result = handle_demote(coroutine, client->parent, CO request));
-            } else if (!strcmp(command, "quit")) {
-                co_recurse(CO result = handle_quit(coroutine, client->parent, CO request));
-            } else if (!strcmp(command, "set-prepare-secondary")) {
-                CO result = handle_set_prepare_secondary(client, CO request);
-            } else if (!strcmp(command, "set-migration-start")) {
-                CO result = handle_set_migration_start(client, CO request);
-            } else if (!strcmp(command, "set-migration-switchover")) {
-                CO result = handle_set_migration_switchover(client, CO request);
-            } else if (!strcmp(command, "set-primary-failover")) {
-                CO result = handle_set_primary_failover(client, CO request);
-            } else if (!strcmp(command, "set-secondary-failover")) {
-                CO result = handle_set_secondary_failover(client, CO request);
-            } else if (!strcmp(command, "set-yank")) {
-                CO result = handle_set_yank(client, CO request);
-            } else if (!strcmp(command, "yank")) {
-                co_recurse(CO result = handle_yank_co(coroutine, client->parent));
-            } else if (!strcmp(command, "stop")) {
-                co_recurse(CO result = handle_stop_co(coroutine, client));
-            } else if (!strcmp(command, "cont")) {
-                co_recurse(CO result = handle_cont_co(coroutine, client));
-            } else if (!strcmp(command, "set-peer")) {
-                co_recurse(CO result = handle_set_peer(coroutine, client->parent, CO request));
-            } else if (!strcmp(command, "query-peer")) {
-                co_recurse(CO result = handle_query_peer(coroutine, client->parent));
-            } else if (!strcmp(command, "clear-peer")) {
-                co_recurse(clear_peer(coroutine, client->parent));
-                CO result = create_reply("{}");
-            } else {
-                CO result = create_error_reply("Unknown command");
-            }
+        if (CO request && has_member(qmp_result_get_json(CO request),
+                                     "exec-colod")) {
+            co_recurse(CO result = client_dispatch_co(coroutine, client,
+                                                      CO request));
+        } else if (client->parent->instances) {
+            CO result = client_create_error_reply("No instance selected");
         } else {
+            metrics_inc(metrics_counter("client_commands", "command", "qmp"), 1);
             co_recurse(CO result = execute_nocheck_co(coroutine,
                                                       client->parent,
                                                       &local_errp,
-                                                      CO request->line));
+                                                      CO request ?
+                                                          CO request->line :
+                                                          CO line));
             if (!CO result) {
-                CO result = create_error_reply(local_errp->message);
+                CO result = client_create_error_reply(local_errp->message);
                 g_error_free(local_errp);
                 local_errp = NULL;
             }
         }
 
         qmp_result_free(CO request);
+        g_free(CO line);
 
         colod_trace("client: %s", CO result->line);
-        co_recurse(ret = colod_channel_write_timeout_co(coroutine, client->channel,
-                                                        CO result->line,
-                                                        CO result->len, 1000,
-                                                        &local_errp));
+        co_recurse(ret = colod_writer_write_co(coroutine, client->writer,
+                                               CO result->line, CO result->len,
+                                               1000, &local_errp));
         if (ret < 0) {
             qmp_result_free(CO result);
             goto error_client;
@@ -932,15 +1129,17 @@ static int client_new(ColodClientListener *listener, int fd, GError **errp) {
         return -1;
     }
 
-    client = g_new0(ColodClient, 1);
+    client = coroutine_new(&client_coroutine_type);
     coroutine = &client->coroutine;
     coroutine->cb = colod_client_co;
     client->commands = listener->commands;
     client->parent = listener;
     client->channel = channel;
+    client->watch = colod_watch_new(fd, "client watch");
+    client->writer = colod_writer_new(fd, client->watch);
     QLIST_INSERT_HEAD(&listener->head, client, next);
 
-    g_io_add_watch(channel, G_IO_IN | G_IO_HUP, coroutine_giofunc_cb, client);
+    colod_watch_arm(client->watch, coroutine, G_IO_IN, G_PRIORITY_DEFAULT);
     return 0;
 }
 
@@ -980,7 +1179,7 @@ void client_listener_free(ColodClientListener *listener) {
     ColodClient *entry;
 
     if (listener->listen_source_id) {
-        g_source_remove(listener->listen_source_id);
+        colod_fd_remove(listener->listen_source_id);
         close(listener->socket);
     }
 
@@ -995,21 +1194,112 @@ void client_listener_free(ColodClientListener *listener) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
-    peer_manager_unref(listener->peer);
+    if (listener->root) {
+        g_hash_table_remove(listener->root->instances, listener->name);
+        g_free(listener->name);
+    }
+    if (listener->instances) {
+        assert(!g_hash_table_size(listener->instances));
+        g_hash_table_unref(listener->instances);
+    }
+
+    g_hash_table_unref(listener->registry);
     g_free(listener);
 }
 
-ColodClientListener *client_listener_new(int socket, QmpCommands *commands,
-                                         PeerManager *peer) {
+static const struct {
+    const gchar *name;
+    ClientCommandFunc func;
+    ClientCommandFlags flags;
+} client_builtin_commands[] = {
+    {"query-status", _handle_query_status_co, CLIENT_COMMAND_COROUTINE},
+    {"query-store", handle_query_store, 0},
+    {"set-store", handle_set_store, 0},
+    {"query-metrics", handle_query_metrics, CLIENT_COMMAND_GLOBAL},
+    {"query-coroutines", handle_query_coroutines, CLIENT_COMMAND_GLOBAL},
+    {"query-profile", handle_query_profile, CLIENT_COMMAND_GLOBAL},
+    {"query-instances", handle_query_instances, CLIENT_COMMAND_GLOBAL},
+    {"select-instance", handle_select_instance, CLIENT_COMMAND_GLOBAL},
+    {"promote", _handle_promote, CLIENT_COMMAND_COROUTINE},
+    {"start-migration", _handle_start_migration, CLIENT_COMMAND_COROUTINE},
+    {"reboot", _handle_reboot, CLIENT_COMMAND_COROUTINE},
+    {"shutdown", _handle_shutdown, CLIENT_COMMAND_COROUTINE},
+    {"demote", _handle_demote, CLIENT_COMMAND_COROUTINE},
+    {"quit", _handle_quit, CLIENT_COMMAND_COROUTINE},
+    {"set-prepare-secondary", handle_set_prepare_secondary, 0},
+    {"set-migration-start", handle_set_migration_start, 0},
+    {"set-migration-switchover", handle_set_migration_switchover, 0},
+    {"set-primary-failover", handle_set_primary_failover, 0},
+    {"set-secondary-failover", handle_set_secondary_failover, 0},
+    {"set-yank", handle_set_yank, 0},
+    {"yank", _handle_yank_co, CLIENT_COMMAND_COROUTINE},
+    {"stop", _handle_stop_co, CLIENT_COMMAND_COROUTINE},
+    {"cont", _handle_cont_co, CLIENT_COMMAND_COROUTINE},
+};
+
+void client_register_command(ColodClientListener *this, const gchar *name,
+                             ClientCommandFunc func, ClientCommandFlags flags,
+                             gpointer data) {
+    ClientCommand *command;
+
+    assert(!g_hash_table_contains(this->registry, name));
+
+    command = g_new0(ClientCommand, 1);
+    command->func = func;
+    command->flags = flags;
+    command->data = data;
+    g_hash_table_insert(this->registry, g_strdup(name), command);
+}
+
+void client_unregister_command(ColodClientListener *this, const gchar *name) {
+    gboolean removed = g_hash_table_remove(this->registry, name);
+    assert(removed);
+}
+
+static ColodClientListener *client_listener_alloc(int socket,
+                                                  QmpCommands *commands) {
     ColodClientListener *listener;
 
     listener = g_new0(ColodClientListener, 1);
     listener->socket = socket;
     listener->commands = commands;
-    listener->peer = peer_manager_ref(peer);
-    listener->listen_source_id = g_unix_fd_add(socket, G_IO_IN,
-                                               client_listener_new_client,
-                                               listener);
+    listener->registry = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    for (guint i = 0; i < G_N_ELEMENTS(client_builtin_commands); i++) {
+        client_register_command(listener, client_builtin_commands[i].name,
+                                client_builtin_commands[i].func,
+                                client_builtin_commands[i].flags, NULL);
+    }
+
+    return listener;
+}
+
+ColodClientListener *client_listener_new(int socket, QmpCommands *commands) {
+    ColodClientListener *listener;
+
+    listener = client_listener_alloc(socket, commands);
+    listener->listen_source_id = colod_fd_add(socket, G_IO_IN,
+                                              client_listener_new_client,
+                                              listener);
+
+    return listener;
+}
+
+ColodClientListener *client_listener_new_instance(ColodClientListener *root,
+                                                  const gchar *name,
+                                                  QmpCommands *commands) {
+    ColodClientListener *listener;
+
+    assert(!root->root);
+    if (!root->instances) {
+        root->instances = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    assert(!g_hash_table_contains(root->instances, name));
+
+    listener = client_listener_alloc(-1, commands);
+    listener->root = root;
+    listener->name = g_strdup(name);
+    g_hash_table_insert(root->instances, listener->name, listener);
 
     return listener;
 }
@@ -15,14 +15,6 @@
 #include "base_types.h"
 #include "daemon.h"
 
-typedef struct MyTimeout MyTimeout;
-
-guint my_timeout_remaining_ms(MyTimeout *this);
-guint my_timeout_remaining_minus_ms(MyTimeout *this, guint minus);
-MyTimeout *my_timeout_new(guint timeout_ms);
-MyTimeout *my_timeout_ref(MyTimeout *this);
-void my_timeout_unref(MyTimeout *this);
-
 typedef struct ClientCallbacks ClientCallbacks;
 
 struct ClientCallbacks {
@@ -48,7 +40,38 @@ struct ClientCallbacks {
 void client_register(ColodClientListener *this, const ClientCallbacks *cb, gpointer data);
 void client_unregister(ColodClientListener *this, const ClientCallbacks *cb, gpointer data);
 
+typedef struct ColodClient ColodClient;
+
+typedef enum ClientCommandFlags {
+    // The handler may yield and is called via co_recurse()
+    CLIENT_COMMAND_COROUTINE = 1,
+    // The listener lock is held while the handler runs
+    CLIENT_COMMAND_LOCK = 2,
+    // Available before the client selected an instance
+    CLIENT_COMMAND_GLOBAL = 4
+} ClientCommandFlags;
+
+// Handler for a "exec-colod" command, returns the reply to send to the client
+typedef ColodQmpResult *(*ClientCommandFunc)(Coroutine *coroutine,
+                                             ColodClient *client,
+                                             ColodQmpResult *request,
+                                             gpointer data);
+
+void client_register_command(ColodClientListener *this, const gchar *name,
+                             ClientCommandFunc func, ClientCommandFlags flags,
+                             gpointer data);
+void client_unregister_command(ColodClientListener *this, const gchar *name);
+
+ColodQmpResult *client_create_reply(const gchar *member);
+ColodQmpResult *client_create_error_reply(const gchar *message);
+
 void client_listener_free(ColodClientListener *listener);
-ColodClientListener *client_listener_new(int socket, QmpCommands *commands, PeerManager *peer);
+ColodClientListener *client_listener_new(int socket, QmpCommands *commands);
+// An instance hosted alongside others in this process. Its clients connect
+// to the root listener and pick the instance with "select-instance". Free
+// the instances before the root.
+ColodClientListener *client_listener_new_instance(ColodClientListener *root,
+                                                  const gchar *name,
+                                                  QmpCommands *commands);
 
 #endif // CLIENT_H
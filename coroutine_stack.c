@@ -0,0 +1,253 @@
+/*
+ * COLO background daemon coroutine stack management
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib-2.0/glib.h>
+
+#include "coroutine_stack.h"
+
+// Free objects kept for reuse per pooled type
+#define COROUTINE_POOL_MAX 8
+
+static CoroutineType *coroutine_types = NULL;
+
+gboolean coroutine_profiling = FALSE;
+static CoroutineProfileFrame *coroutine_profile_current = NULL;
+
+typedef struct CoroutineProfileSite {
+    const char *site;
+    guint64 resumes;
+    gint64 cpu_ns;
+    gint64 wait_us;
+} CoroutineProfileSite;
+
+static void coroutine_setup(Coroutine *coroutine, CoroutineType *type,
+                            CoroutineFrame *stack) {
+    if (!type->registered) {
+        type->registered = TRUE;
+        type->next = coroutine_types;
+        coroutine_types = type;
+    }
+
+    assert(type->depth);
+    coroutine->type = type;
+    coroutine->stack = stack;
+    type->depth_high = MAX(type->depth_high, 1);
+    type->live++;
+    type->live_high = MAX(type->live_high, type->live);
+}
+
+void coroutine_init(Coroutine *coroutine, CoroutineType *type) {
+    assert(!type->size);
+
+    type->allocated++;
+    coroutine_setup(coroutine, type, g_new0(CoroutineFrame, type->depth));
+}
+
+void coroutine_destroy(Coroutine *coroutine) {
+    assert(!coroutine->type->size);
+
+    coroutine->type->live--;
+    g_free(coroutine->stack);
+    coroutine->stack = NULL;
+    coroutine->frame = NULL;
+}
+
+// Keep the frames aligned like the object itself
+static gsize coroutine_stack_offset(CoroutineType *type) {
+    return (type->size + 7) & ~((gsize) 7);
+}
+
+gpointer coroutine_new(CoroutineType *type) {
+    gsize offset = coroutine_stack_offset(type);
+    gsize size = offset + type->depth * sizeof(CoroutineFrame);
+    char *object;
+
+    assert(type->size >= sizeof(Coroutine));
+
+    if (type->pool) {
+        object = type->pool;
+        type->pool = *(gpointer *) object;
+        type->pooled--;
+        memset(object, 0, size);
+    } else {
+        object = g_malloc0(size);
+        type->allocated++;
+    }
+
+    coroutine_setup((Coroutine *) object, type,
+                    (CoroutineFrame *) (object + offset));
+    return object;
+}
+
+void coroutine_free(gpointer data) {
+    Coroutine *coroutine = data;
+    CoroutineType *type = coroutine->type;
+
+    assert(type->size);
+
+    type->live--;
+    if (type->pooled >= COROUTINE_POOL_MAX) {
+        g_free(data);
+        return;
+    }
+
+    *(gpointer *) data = type->pool;
+    type->pool = data;
+    type->pooled++;
+}
+
+gchar *coroutine_stats_to_json(void) {
+    GString *out = g_string_new(NULL);
+
+    g_string_append_printf(out, "{\"frame-size\": %u, \"types\": [",
+                           (guint) COROUTINE_FRAME_SIZE);
+    for (CoroutineType *type = coroutine_types; type; type = type->next) {
+        g_string_append_printf(out,
+                               "%s{\"name\": \"%s\", \"depth\": %u, "
+                               "\"depth-high\": %u, \"frame-high\": %u, "
+                               "\"live\": %u, \"live-high\": %u, "
+                               "\"allocated\": %" G_GUINT64_FORMAT ", "
+                               "\"pooled\": %u}",
+                               type == coroutine_types ? "" : ", ",
+                               type->name, type->depth, type->depth_high,
+                               (guint) type->frame_high, type->live,
+                               type->live_high, type->allocated,
+                               type->pooled);
+    }
+    g_string_append(out, "]}");
+
+    return g_string_free(out, FALSE);
+}
+
+static gint64 coroutine_profile_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((gint64) ts.tv_sec) * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static CoroutineProfileSite *coroutine_profile_site(CoroutineType *type,
+                                                    const char *site) {
+    CoroutineProfileSite *entry;
+
+    if (!type->profile) {
+        type->profile = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              NULL, g_free);
+    }
+
+    entry = g_hash_table_lookup(type->profile, site);
+    if (!entry) {
+        entry = g_new0(CoroutineProfileSite, 1);
+        entry->site = site;
+        g_hash_table_insert(type->profile, (gpointer) site, entry);
+    }
+
+    return entry;
+}
+
+void _coroutine_profile_enter(Coroutine *coroutine,
+                              CoroutineProfileFrame *profile) {
+    CoroutineProfileSite *entry;
+
+    // Resumed at the innermost co_yield, the first run counts as "start"
+    profile->site = coroutine->site ? coroutine->site : "start";
+    entry = coroutine_profile_site(coroutine->type, profile->site);
+    entry->resumes++;
+    if (coroutine->yield_time) {
+        entry->wait_us += g_get_monotonic_time() - coroutine->yield_time;
+    }
+
+    profile->cpu_nested = 0;
+    profile->parent = coroutine_profile_current;
+    coroutine_profile_current = profile;
+    profile->cpu_start = coroutine_profile_cpu_ns();
+}
+
+void _coroutine_profile_leave(Coroutine *coroutine,
+                              CoroutineProfileFrame *profile) {
+    gint64 elapsed = coroutine_profile_cpu_ns() - profile->cpu_start;
+    CoroutineProfileSite *entry;
+
+    entry = coroutine_profile_site(coroutine->type, profile->site);
+    entry->cpu_ns += elapsed - profile->cpu_nested;
+
+    assert(coroutine_profile_current == profile);
+    coroutine_profile_current = profile->parent;
+    if (profile->parent) {
+        profile->parent->cpu_nested += elapsed;
+    }
+
+    coroutine->yield_time = coroutine->yield ? g_get_monotonic_time() : 0;
+}
+
+static gint coroutine_profile_compare(gconstpointer a, gconstpointer b) {
+    const CoroutineProfileSite *site_a = *(CoroutineProfileSite **) a;
+    const CoroutineProfileSite *site_b = *(CoroutineProfileSite **) b;
+
+    if (site_a->resumes != site_b->resumes) {
+        return site_a->resumes > site_b->resumes ? -1 : 1;
+    }
+    return strcmp(site_a->site, site_b->site);
+}
+
+void coroutine_profile_foreach(CoroutineProfileFunc func, gpointer data) {
+    for (CoroutineType *type = coroutine_types; type; type = type->next) {
+        GHashTableIter iter;
+        gpointer value;
+        GPtrArray *sites;
+
+        if (!type->profile) {
+            continue;
+        }
+
+        sites = g_ptr_array_new();
+        g_hash_table_iter_init(&iter, type->profile);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            g_ptr_array_add(sites, value);
+        }
+        g_ptr_array_sort(sites, coroutine_profile_compare);
+
+        for (guint i = 0; i < sites->len; i++) {
+            CoroutineProfileSite *site = sites->pdata[i];
+            func(type->name, site->site, site->resumes,
+                 site->cpu_ns / 1000, site->wait_us, data);
+        }
+
+        g_ptr_array_free(sites, TRUE);
+    }
+}
+
+static void coroutine_profile_json_cb(const char *type, const char *site,
+                                      guint64 resumes, guint64 cpu_us,
+                                      guint64 wait_us, gpointer data) {
+    GString *out = data;
+
+    g_string_append_printf(out,
+                           "%s{\"type\": \"%s\", \"site\": \"%s\", "
+                           "\"resumes\": %" G_GUINT64_FORMAT ", "
+                           "\"cpu-us\": %" G_GUINT64_FORMAT ", "
+                           "\"wait-us\": %" G_GUINT64_FORMAT "}",
+                           out->str[out->len - 1] == '[' ? "" : ", ",
+                           type, site, resumes, cpu_us, wait_us);
+}
+
+gchar *coroutine_profile_to_json(void) {
+    GString *out = g_string_new(NULL);
+
+    g_string_append_printf(out, "{\"enabled\": %s, \"sites\": [",
+                           coroutine_profiling ? "true" : "false");
+    coroutine_profile_foreach(coroutine_profile_json_cb, out);
+    g_string_append(out, "]}");
+
+    return g_string_free(out, FALSE);
+}
@@ -16,6 +16,7 @@
 #include <glib-2.0/glib.h>
 
 #define COROUTINE_FRAME_SIZE (7*8)
+// Depth for coroutines that run arbitrary commands through callbacks
 #define COROUTINE_STACK_SIZE 32
 
 typedef struct CoroutineFrame {
@@ -23,15 +24,113 @@ typedef struct CoroutineFrame {
     unsigned int line;
 } CoroutineFrame;
 
+// Declared once for each kind of coroutine. Objects of types with a size
+// come from a per-type pool and carry their stack in the same allocation.
+typedef struct CoroutineType CoroutineType;
+struct CoroutineType {
+    const char *name;
+    unsigned int depth;
+    size_t size;
+
+    // High-water marks, to tune the depths and COROUTINE_FRAME_SIZE
+    unsigned int depth_high;
+    size_t frame_high;
+    unsigned int live, live_high;
+    guint64 allocated;
+
+    gpointer pool;
+    unsigned int pooled;
+    // Yield site -> CoroutineProfileSite, only filled while profiling
+    GHashTable *profile;
+    gboolean registered;
+    CoroutineType *next;
+};
+
+#define COROUTINE_TYPE(_name, _depth) \
+    { .name = (_name), .depth = (_depth) }
+#define COROUTINE_POOL(_name, _type, _depth) \
+    { .name = (_name), .depth = (_depth), .size = sizeof(_type) }
+
 typedef struct Coroutine {
     int quit;
     int yield;
     void *yield_value;
     CoroutineFrame *frame;
-    CoroutineFrame stack[COROUTINE_STACK_SIZE];
+    CoroutineFrame *stack;
+    CoroutineType *type;
     GSourceFunc cb;
+    // Where the coroutine last yielded and when, for the profiler
+    const char *site;
+    gint64 yield_time;
+    // Absolute deadline of the current operation, see colod_deadline_enter()
+    gint64 deadline;
 } Coroutine;
 
+// For coroutines embedded in objects that are allocated elsewhere
+void coroutine_init(Coroutine *coroutine, CoroutineType *type);
+void coroutine_destroy(Coroutine *coroutine);
+// Zeroed object of a pooled type, the Coroutine has to be the first member
+gpointer coroutine_new(CoroutineType *type);
+void coroutine_free(gpointer coroutine);
+
+gchar *coroutine_stats_to_json(void);
+
+// Opt-in profiler: resumes, cpu time spent inside and wall time spent
+// waiting, per coroutine type and yield site
+extern gboolean coroutine_profiling;
+
+typedef struct CoroutineProfileFrame CoroutineProfileFrame;
+struct CoroutineProfileFrame {
+    gboolean active;
+    const char *site;
+    gint64 cpu_start;
+    // Cpu time of coroutines entered from within this one
+    gint64 cpu_nested;
+    CoroutineProfileFrame *parent;
+};
+
+typedef void (*CoroutineProfileFunc)(const char *type, const char *site,
+                                     guint64 resumes, guint64 cpu_us,
+                                     guint64 wait_us, gpointer data);
+
+void _coroutine_profile_enter(Coroutine *coroutine,
+                              CoroutineProfileFrame *profile);
+void _coroutine_profile_leave(Coroutine *coroutine,
+                              CoroutineProfileFrame *profile);
+// Sites sorted by resumes for each type
+void coroutine_profile_foreach(CoroutineProfileFunc func, gpointer data);
+gchar *coroutine_profile_to_json(void);
+
+static inline void coroutine_note_frame(Coroutine *coroutine, size_t size) {
+    if (size > coroutine->type->frame_high) {
+        coroutine->type->frame_high = size;
+    }
+}
+
+static inline void coroutine_note_depth(Coroutine *coroutine) {
+    unsigned int depth = coroutine->frame - coroutine->stack + 1;
+
+    assert(depth <= coroutine->type->depth);
+    if (depth > coroutine->type->depth_high) {
+        coroutine->type->depth_high = depth;
+    }
+}
+
+static inline void coroutine_profile_enter(Coroutine *coroutine,
+                                           CoroutineProfileFrame *profile) {
+    profile->active = coroutine_profiling;
+    if (profile->active) {
+        _coroutine_profile_enter(coroutine, profile);
+    }
+}
+
+static inline void coroutine_profile_leave(Coroutine *coroutine,
+                                           CoroutineProfileFrame *profile) {
+    if (profile->active) {
+        _coroutine_profile_leave(coroutine, profile);
+    }
+}
+
 static __attribute__((unused)) int coroutine_giofunc_cb(GIOChannel *ch, GIOCondition cond, gpointer data) {
     (void) ch;
     (void) cond;
@@ -52,6 +151,7 @@ static __attribute__((unused)) void coroutine_wait_cb(GPid pid, gint status, gpo
 #define co_frame(co, size) \
     do { \
         _Static_assert((size) <= COROUTINE_FRAME_SIZE, "size <= COROUTINE_FRAME_SIZE failed"); \
+        coroutine_note_frame(coroutine, (size)); \
         (co) = (void *)coroutine->frame->data; \
     } while (0)
 
@@ -59,6 +159,7 @@ static __attribute__((unused)) void coroutine_wait_cb(GPid pid, gint status, gpo
     do { \
         coroutine->yield = 1; \
         coroutine->yield_value = (void *) (value); \
+        coroutine->site = G_STRLOC; \
         _co_yield(coroutine_yield_ret); \
     } while (0)
 
@@ -67,13 +168,17 @@ static __attribute__((unused)) void coroutine_wait_cb(GPid pid, gint status, gpo
 
 #define co_enter(coroutine, expr) \
     do { \
+        CoroutineProfileFrame __profile; \
+        assert((coroutine)->stack); \
         if (!(coroutine)->frame) { \
             (coroutine)->frame = (coroutine)->stack; \
         } \
         (coroutine)->yield = 0; \
         assert(!(coroutine)->quit); \
         assert((coroutine)->frame == (coroutine)->stack); \
+        coroutine_profile_enter((coroutine), &__profile); \
         expr; \
+        coroutine_profile_leave((coroutine), &__profile); \
         assert((coroutine)->frame == (coroutine)->stack); \
         if (!(coroutine)->yield) { \
             (coroutine)->frame->line = 0; \
@@ -84,7 +189,7 @@ static __attribute__((unused)) void coroutine_wait_cb(GPid pid, gint status, gpo
 #define co_recurse(expr) \
     while(1) { \
         coroutine->frame++; \
-        assert(coroutine->frame - coroutine->stack < COROUTINE_STACK_SIZE); \
+        coroutine_note_depth(coroutine); \
         int __use_co_recurse = 1; \
         expr; \
         coroutine->frame--; \
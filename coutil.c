@@ -7,12 +7,17 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <errno.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <glib-2.0/glib.h>
 
 #include "coutil.h"
 #include "util.h"
 #include "daemon.h"
+#include "timer_wheel.h"
+#include "poller.h"
 
 #include "coroutine_stack.h"
 
@@ -20,9 +25,487 @@ GSource *get_source_by_id(guint id) {
     return g_main_context_find_source_by_id(g_main_context_default(), id);
 }
 
+typedef struct CoroutineLockWaiter {
+    Coroutine *coroutine;
+    int priority;
+    gboolean cancellable;
+    guint wake_source_id;
+} CoroutineLockWaiter;
+
+void colod_lock_enqueue(CoroutineLock *lock, Coroutine *coroutine,
+                        int priority, gboolean cancellable) {
+    CoroutineLockWaiter *waiter = g_new0(CoroutineLockWaiter, 1);
+    GList *entry;
+
+    assert(lock->holder && lock->holder != coroutine);
+
+    waiter->coroutine = coroutine;
+    waiter->priority = priority;
+    waiter->cancellable = cancellable;
+
+    for (entry = lock->waiters.head; entry; entry = entry->next) {
+        CoroutineLockWaiter *other = entry->data;
+        if (other->priority < priority) {
+            break;
+        }
+    }
+
+    if (entry) {
+        g_queue_insert_before(&lock->waiters, entry, waiter);
+    } else {
+        g_queue_push_tail(&lock->waiters, waiter);
+    }
+}
+
+// The coroutine may have been resumed by some other source before the
+// wake source fired, don't let that one wake it again later
+static void colod_lock_remove_wake(guint source_id) {
+    GSource *current = g_main_current_source();
+
+    if (!current || g_source_get_id(current) != source_id) {
+        g_source_remove(source_id);
+    }
+}
+
+// Returns 1 if the lock was handed to coroutine, -1 if the wait was
+// cancelled and 0 if it is still waiting
+int colod_lock_woken(CoroutineLock *lock, Coroutine *coroutine) {
+    if (lock->holder == coroutine) {
+        if (lock->wake_source_id) {
+            colod_lock_remove_wake(lock->wake_source_id);
+            lock->wake_source_id = 0;
+        }
+        return 1;
+    }
+
+    for (GList *entry = lock->cancelled.head; entry; entry = entry->next) {
+        CoroutineLockWaiter *waiter = entry->data;
+        if (waiter->coroutine == coroutine) {
+            colod_lock_remove_wake(waiter->wake_source_id);
+            g_queue_delete_link(&lock->cancelled, entry);
+            g_free(waiter);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void colod_lock_release(CoroutineLock *lock) {
+    CoroutineLockWaiter *waiter;
+
+    lock->count--;
+    if (lock->count) {
+        return;
+    }
+
+    waiter = g_queue_pop_head(&lock->waiters);
+    if (!waiter) {
+        lock->holder = NULL;
+        return;
+    }
+
+    assert(!lock->wake_source_id);
+    lock->holder = waiter->coroutine;
+    lock->count = 1;
+    lock->wake_source_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                           waiter->coroutine->cb,
+                                           waiter->coroutine, NULL);
+    g_source_set_name_by_id(lock->wake_source_id, "lock handoff");
+    g_free(waiter);
+}
+
+gint64 colod_deadline_enter(Coroutine *coroutine, MyTimeout *timeout) {
+    gint64 previous = coroutine->deadline;
+
+    if (timeout) {
+        gint64 deadline = my_timeout_deadline(timeout);
+        if (!previous || deadline < previous) {
+            coroutine->deadline = deadline;
+        }
+    }
+
+    return previous;
+}
+
+void colod_deadline_restore(Coroutine *coroutine, gint64 previous) {
+    coroutine->deadline = previous;
+}
+
+gboolean colod_deadline_expired(Coroutine *coroutine) {
+    return coroutine->deadline
+            && g_get_monotonic_time() >= coroutine->deadline;
+}
+
+guint colod_deadline_remaining_ms(Coroutine *coroutine) {
+    gint64 now = g_get_monotonic_time();
+
+    if (!coroutine->deadline || now >= coroutine->deadline) {
+        return 0;
+    }
+
+    return (coroutine->deadline - now + 999) / 1000;
+}
+
+guint colod_deadline_clamp(Coroutine *coroutine, guint timeout) {
+    guint remaining;
+
+    if (!coroutine->deadline) {
+        return timeout;
+    }
+
+    remaining = MAX(colod_deadline_remaining_ms(coroutine), 1);
+    if (!timeout) {
+        return remaining;
+    }
+    return MIN(timeout, remaining);
+}
+
+typedef struct CoroutineCondWaiter {
+    Coroutine *coroutine;
+    guint wake_source_id;
+} CoroutineCondWaiter;
+
+void colod_cond_wait(CoroutineCond *cond, Coroutine *coroutine) {
+    CoroutineCondWaiter *waiter = g_new0(CoroutineCondWaiter, 1);
+
+    waiter->coroutine = coroutine;
+    g_queue_push_tail(&cond->waiters, waiter);
+}
+
+gboolean colod_cond_woken(CoroutineCond *cond, Coroutine *coroutine) {
+    for (GList *entry = cond->waiters.head; entry; entry = entry->next) {
+        CoroutineCondWaiter *waiter = entry->data;
+        gboolean signalled = !!waiter->wake_source_id;
+
+        if (waiter->coroutine != coroutine) {
+            continue;
+        }
+
+        if (signalled) {
+            colod_lock_remove_wake(waiter->wake_source_id);
+        }
+        g_queue_delete_link(&cond->waiters, entry);
+        g_free(waiter);
+        return signalled;
+    }
+
+    return FALSE;
+}
+
+void colod_cond_broadcast(CoroutineCond *cond) {
+    for (GList *entry = cond->waiters.head; entry; entry = entry->next) {
+        CoroutineCondWaiter *waiter = entry->data;
+
+        if (waiter->wake_source_id) {
+            continue;
+        }
+
+        waiter->wake_source_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                                 waiter->coroutine->cb,
+                                                 waiter->coroutine, NULL);
+        g_source_set_name_by_id(waiter->wake_source_id, "cond broadcast");
+    }
+}
+
+guint colod_lock_cancel(CoroutineLock *lock, int priority) {
+    guint cancelled = 0;
+    GList *entry, *prev;
+
+    // Sorted by priority, so the ones to cancel are at the tail
+    for (entry = lock->waiters.tail; entry; entry = prev) {
+        CoroutineLockWaiter *waiter = entry->data;
+        prev = entry->prev;
+        if (waiter->priority >= priority) {
+            break;
+        }
+        if (!waiter->cancellable) {
+            continue;
+        }
+
+        g_queue_delete_link(&lock->waiters, entry);
+        waiter->wake_source_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                                 waiter->coroutine->cb,
+                                                 waiter->coroutine, NULL);
+        g_source_set_name_by_id(waiter->wake_source_id, "lock cancelled");
+        g_queue_push_tail(&lock->cancelled, waiter);
+        cancelled++;
+    }
+
+    return cancelled;
+}
+
+// Initial size of the waiter array, it grows if more coroutines wait
+#define WATCH_WAITERS 4
+
+typedef struct CoroutineWatchWaiter {
+    Coroutine *coroutine;
+    GIOCondition condition;
+    gint priority;
+    guint64 serial;
+} CoroutineWatchWaiter;
+
+typedef struct CoroutineWatchSource {
+    GSource source;
+    CoroutineWatch *watch;
+} CoroutineWatchSource;
+
+struct CoroutineWatch {
+    int fd;
+    // Either polled by its own GSource or by the epoll backend
+    CoroutineWatchSource *source;
+    // NULL while the fd isn't polled at all
+    gpointer tag;
+    PollerEntry *entry;
+    CoroutineWatchPending pending;
+    gpointer pending_data;
+    CoroutineWatchWaiter *waiters;
+    guint count, size;
+    GIOCondition events;
+    guint64 serial;
+    gboolean dispatching, freed;
+};
+
+static void colod_watch_update(CoroutineWatch *this) {
+    GSource *source;
+    GIOCondition events = 0;
+    gint priority = G_PRIORITY_LOW;
+
+    for (guint i = 0; i < this->count; i++) {
+        events |= this->waiters[i].condition;
+        priority = MIN(priority, this->waiters[i].priority);
+    }
+
+    if (events) {
+        events |= G_IO_HUP | G_IO_ERR;
+    }
+
+    if (this->entry) {
+        poller_entry_set_events(this->entry, events);
+        this->events = events;
+        return;
+    }
+
+    // Without waiters the fd stays registered with an empty mask
+    source = &this->source->source;
+    if (events && priority != g_source_get_priority(source)) {
+        g_source_set_priority(source, priority);
+    }
+    if (events && !this->tag) {
+        this->tag = g_source_add_unix_fd(source, this->fd, events);
+    } else if (events != this->events) {
+        g_source_modify_unix_fd(source, this->tag, events);
+    }
+    this->events = events;
+}
+
+static void colod_watch_remove(CoroutineWatch *this, guint index) {
+    this->count--;
+    memmove(&this->waiters[index], &this->waiters[index + 1],
+            (this->count - index) * sizeof(CoroutineWatchWaiter));
+    colod_watch_update(this);
+}
+
+static gboolean colod_watch_eligible(CoroutineWatchWaiter *waiter,
+                                     GIOCondition revents, guint64 serial) {
+    return waiter->serial < serial
+            && revents & (waiter->condition | G_IO_HUP | G_IO_ERR);
+}
+
+// Returns FALSE if one of the coroutines freed the watch
+static gboolean colod_watch_wake(CoroutineWatch *this, GIOCondition revents) {
+    // Coroutines that re-arm from their callback wait for the next poll
+    guint64 serial = ++this->serial;
+    gint priority = G_MAXINT;
+
+    // Only wake the highest priority ones that are ready
+    for (guint i = 0; i < this->count; i++) {
+        if (colod_watch_eligible(&this->waiters[i], revents, serial)) {
+            priority = MIN(priority, this->waiters[i].priority);
+        }
+    }
+
+    this->dispatching = TRUE;
+    while (TRUE) {
+        Coroutine *coroutine = NULL;
+
+        for (guint i = 0; i < this->count; i++) {
+            CoroutineWatchWaiter *waiter = &this->waiters[i];
+            if (waiter->priority == priority
+                    && colod_watch_eligible(waiter, revents, serial)) {
+                coroutine = waiter->coroutine;
+                colod_watch_remove(this, i);
+                break;
+            }
+        }
+
+        if (!coroutine) {
+            break;
+        }
+        coroutine->cb(coroutine);
+    }
+    this->dispatching = FALSE;
+
+    if (this->freed) {
+        g_free(this->waiters);
+        g_free(this);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GIOCondition colod_watch_revents(CoroutineWatch *this) {
+    GIOCondition revents = 0;
+
+    if (this->tag) {
+        revents = g_source_query_unix_fd(&this->source->source, this->tag);
+    }
+
+    if (this->pending && this->pending(this->pending_data)) {
+        revents |= G_IO_IN;
+    }
+
+    return revents;
+}
+
+static gboolean colod_watch_ready(CoroutineWatch *this, GIOCondition revents) {
+    for (guint i = 0; i < this->count; i++) {
+        if (revents & (this->waiters[i].condition | G_IO_HUP | G_IO_ERR)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean colod_watch_prepare(GSource *source, gint *timeout) {
+    CoroutineWatch *this = ((CoroutineWatchSource *) source)->watch;
+
+    *timeout = -1;
+    return this->pending && (this->events & G_IO_IN)
+            && this->pending(this->pending_data);
+}
+
+static gboolean colod_watch_check(GSource *source) {
+    CoroutineWatch *this = ((CoroutineWatchSource *) source)->watch;
+
+    return colod_watch_ready(this, colod_watch_revents(this));
+}
+
+static gboolean colod_watch_dispatch(GSource *source,
+                                     G_GNUC_UNUSED GSourceFunc callback,
+                                     G_GNUC_UNUSED gpointer data) {
+    CoroutineWatch *this = ((CoroutineWatchSource *) source)->watch;
+    GIOCondition revents = colod_watch_revents(this);
+
+    if (!colod_watch_wake(this, revents)) {
+        return G_SOURCE_REMOVE;
+    }
+
+    // HUP and ERR are reported even with an empty mask, stop polling the
+    // fd until somebody waits on it again
+    if (!this->count && this->tag && revents & (G_IO_HUP | G_IO_ERR)) {
+        g_source_remove_unix_fd(source, this->tag);
+        this->tag = NULL;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs colod_watch_funcs = {
+    colod_watch_prepare,
+    colod_watch_check,
+    colod_watch_dispatch,
+    NULL, NULL, NULL
+};
+
+static void colod_watch_poller_cb(gpointer data, GIOCondition revents) {
+    colod_watch_wake(data, revents);
+}
+
+CoroutineWatch *colod_watch_new(int fd, const gchar *name) {
+    CoroutineWatch *this = g_new0(CoroutineWatch, 1);
+    GSource *source;
+
+    this->fd = fd;
+    this->size = WATCH_WAITERS;
+    this->waiters = g_new(CoroutineWatchWaiter, this->size);
+    if (colod_poller_enabled()) {
+        this->entry = poller_entry_new(fd, colod_watch_poller_cb, this);
+        return this;
+    }
+
+    source = g_source_new(&colod_watch_funcs, sizeof(CoroutineWatchSource));
+    this->source = (CoroutineWatchSource *) source;
+    this->source->watch = this;
+    this->tag = g_source_add_unix_fd(source, fd, 0);
+    g_source_set_name(source, name);
+    g_source_attach(source, NULL);
+
+    return this;
+}
+
+void colod_watch_set_pending(CoroutineWatch *this,
+                             CoroutineWatchPending pending, gpointer data) {
+    this->pending = pending;
+    this->pending_data = data;
+    if (this->entry) {
+        poller_entry_set_pending(this->entry, pending, data);
+    }
+}
+
+void colod_watch_free(CoroutineWatch *this) {
+    assert(!this->count);
+
+    if (this->entry) {
+        poller_entry_free(this->entry);
+    } else {
+        g_source_destroy(&this->source->source);
+        g_source_unref(&this->source->source);
+    }
+
+    // colod_watch_wake() frees it once the coroutine returns
+    if (this->dispatching) {
+        this->freed = TRUE;
+        return;
+    }
+
+    g_free(this->waiters);
+    g_free(this);
+}
+
+void colod_watch_arm(CoroutineWatch *this, Coroutine *coroutine,
+                     GIOCondition condition, gint priority) {
+    CoroutineWatchWaiter *waiter;
+
+    if (this->count == this->size) {
+        this->size *= 2;
+        this->waiters = g_renew(CoroutineWatchWaiter, this->waiters,
+                                this->size);
+    }
+    waiter = &this->waiters[this->count++];
+    waiter->coroutine = coroutine;
+    waiter->condition = condition;
+    waiter->priority = priority;
+    waiter->serial = this->serial;
+    colod_watch_update(this);
+}
+
+gboolean colod_watch_woken(CoroutineWatch *this, Coroutine *coroutine) {
+    for (guint i = 0; i < this->count; i++) {
+        if (this->waiters[i].coroutine == coroutine) {
+            colod_watch_remove(this, i);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 struct WaitSourceTmp {
     Coroutine *coroutine;
-    guint timeout_source_id, wait_source_id;
+    guint timeout_id, wait_source_id;
     GSource *wait_source;
     GPid pid;
     int status;
@@ -41,6 +524,7 @@ int _colod_wait_co(Coroutine *coroutine, GPid pid, guint timeout, GError **errp)
     struct WaitSourceTmp *co;
     int ret;
 
+    timeout = colod_deadline_clamp(coroutine, timeout);
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
@@ -48,8 +532,7 @@ int _colod_wait_co(Coroutine *coroutine, GPid pid, guint timeout, GError **errp)
     CO pid = pid;
 
     if (timeout) {
-        CO timeout_source_id = g_timeout_add(timeout, coroutine->cb, coroutine);
-        g_source_set_name_by_id(CO timeout_source_id, "child wait timeout");
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
     }
 
     CO wait_source_id = g_child_watch_add(CO pid, colod_execute_wait_cb, co);
@@ -60,7 +543,7 @@ int _colod_wait_co(Coroutine *coroutine, GPid pid, guint timeout, GError **errp)
         co_yield_int(G_SOURCE_REMOVE);
 
         guint source_id = g_source_get_id(g_main_current_source());
-        if (timeout && source_id == CO timeout_source_id) {
+        if (timeout && colod_timer_current() == CO timeout_id) {
             g_source_set_callback(CO wait_source, G_SOURCE_FUNC(coroutine_wait_cb),
                                   coroutine, NULL);
 
@@ -90,7 +573,7 @@ int _colod_wait_co(Coroutine *coroutine, GPid pid, guint timeout, GError **errp)
     }
 
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
 
     return co->status;
@@ -126,23 +609,43 @@ int _colod_execute_sync_co(Coroutine *coroutine, MyArray *argv, GError **errp) {
     return _colod_execute_sync_timeout_co(coroutine, argv, 0, errp);
 }
 
+// Returns the watch to use, creates a temporary one if the caller has none
+static CoroutineWatch *colod_channel_watch(GIOChannel *channel,
+                                           CoroutineWatch *watch,
+                                           const gchar *name) {
+    if (watch) {
+        return watch;
+    }
+
+    return colod_watch_new(g_io_channel_unix_get_fd(channel), name);
+}
+
+static void colod_channel_watch_done(CoroutineWatch *watch,
+                                     CoroutineWatch *tmp) {
+    if (!watch) {
+        colod_watch_free(tmp);
+    }
+}
+
 int _colod_channel_read_line_timeout_co(Coroutine *coroutine,
                                         GIOChannel *channel,
+                                        CoroutineWatch *watch,
                                         gchar **line,
                                         gsize *len,
                                         guint timeout,
                                         GError **errp) {
     struct {
-        guint timeout_source_id, io_source_id;
+        CoroutineWatch *watch;
+        guint timeout_id;
     } *co;
 
+    timeout = colod_deadline_clamp(coroutine, timeout);
     co_frame(co, sizeof(*co));
     co_begin(int, 0);
 
+    CO watch = colod_channel_watch(channel, watch, "channel read watch");
     if (timeout) {
-        CO timeout_source_id = g_timeout_add(timeout, coroutine->cb,
-                                             coroutine);
-        g_source_set_name_by_id(CO timeout_source_id, "channel read timeout");
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
     }
 
     while (TRUE) {
@@ -150,24 +653,19 @@ int _colod_channel_read_line_timeout_co(Coroutine *coroutine,
 
         if ((ret == G_IO_STATUS_NORMAL && *len == 0) ||
                 ret == G_IO_STATUS_AGAIN) {
-            CO io_source_id = g_io_add_watch(channel,
-                                             G_IO_IN | G_IO_HUP,
-                                             coroutine_giofunc_cb,
-                                             coroutine);
-            g_source_set_name_by_id(CO io_source_id, "channel read io watch");
+            colod_watch_arm(CO watch, coroutine, G_IO_IN, G_PRIORITY_DEFAULT);
             co_yield_int(G_SOURCE_REMOVE);
 
-            guint source_id = g_source_get_id(g_main_current_source());
-            if (timeout && source_id == CO timeout_source_id) {
-                g_source_remove(CO io_source_id);
+            if (colod_watch_woken(CO watch, coroutine)) {
+                continue;
+            }
+            if (timeout && colod_timer_current() == CO timeout_id) {
                 g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
                             "Channel read timed out");
                 goto err;
-            } else if (source_id != CO io_source_id) {
-                g_source_remove(CO io_source_id);
-                colod_trace("%s:%u: Got woken by unknown source\n",
-                            __func__, __LINE__);
             }
+            colod_trace("%s:%u: Got woken by unknown source\n",
+                        __func__, __LINE__);
         } else if (ret == G_IO_STATUS_NORMAL) {
             break;
         } else if (ret == G_IO_STATUS_ERROR) {
@@ -179,46 +677,70 @@ int _colod_channel_read_line_timeout_co(Coroutine *coroutine,
     }
 
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
+    colod_channel_watch_done(watch, CO watch);
     co_end;
 
     return 0;
 
 err:
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
+    colod_channel_watch_done(watch, CO watch);
 
     return -1;
 }
 
 int _colod_channel_read_line_co(Coroutine *coroutine,
-                                GIOChannel *channel, gchar **line,
+                                GIOChannel *channel, CoroutineWatch *watch,
+                                gchar **line,
                                 gsize *len, GError **errp) {
-    return _colod_channel_read_line_timeout_co(coroutine, channel, line,
+    return _colod_channel_read_line_timeout_co(coroutine, channel, watch, line,
                                                len, 0, errp);
 }
 
+// Returns 1 if ready, 0 if woken by something else and -1 on timeout
+#define colod_channel_wait_out_co(ret) \
+    do { \
+        colod_watch_arm(CO watch, coroutine, G_IO_OUT, G_PRIORITY_DEFAULT); \
+        co_yield_int(G_SOURCE_REMOVE); \
+        if (colod_watch_woken(CO watch, coroutine)) { \
+            (ret) = 1; \
+        } else if (timeout && colod_timer_current() == CO timeout_id) { \
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT, \
+                        "Channel write timed out"); \
+            (ret) = -1; \
+        } else { \
+            colod_trace("%s:%u: Got woken by unknown source\n", \
+                        __func__, __LINE__); \
+            (ret) = 0; \
+        } \
+    } while (0)
+
 int _colod_channel_write_timeout_co(Coroutine *coroutine,
                                     GIOChannel *channel,
+                                    CoroutineWatch *watch,
                                     const gchar *buf,
                                     gsize len,
                                     guint timeout,
                                     GError **errp) {
     struct {
-        guint timeout_source_id, io_source_id;
+        CoroutineWatch *watch;
+        guint timeout_id;
         gsize offset;
     } *co;
     gsize write_len;
+    int wait_ret;
 
+    timeout = colod_deadline_clamp(coroutine, timeout);
     co_frame(co, sizeof(*co));
     co_begin(int, 0);
 
+    CO watch = colod_channel_watch(channel, watch, "channel write watch");
     if (timeout) {
-        CO timeout_source_id = g_timeout_add(timeout, coroutine->cb,
-                                             coroutine);
-        g_source_set_name_by_id(CO timeout_source_id, "channel write timeout");
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
     }
 
     CO offset = 0;
@@ -231,22 +753,9 @@ int _colod_channel_write_timeout_co(Coroutine *coroutine,
 
         if (ret == G_IO_STATUS_NORMAL || ret == G_IO_STATUS_AGAIN) {
             if (write_len == 0) {
-                CO io_source_id = g_io_add_watch(channel, G_IO_OUT | G_IO_HUP,
-                                                 coroutine_giofunc_cb,
-                                                 coroutine);
-                g_source_set_name_by_id(CO io_source_id, "channel write io watch");
-                co_yield_int(G_SOURCE_REMOVE);
-
-                guint source_id = g_source_get_id(g_main_current_source());
-                if (timeout && source_id == CO timeout_source_id) {
-                    g_source_remove(CO io_source_id);
-                    g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
-                                "Channel write timed out");
+                colod_channel_wait_out_co(wait_ret);
+                if (wait_ret < 0) {
                     goto err;
-                } else if (source_id != CO io_source_id) {
-                    g_source_remove(CO io_source_id);
-                    colod_trace("%s:%u: Got woken by unknown source\n",
-                                __func__, __LINE__);
                 }
             }
         } else if (ret == G_IO_STATUS_ERROR) {
@@ -261,22 +770,9 @@ int _colod_channel_write_timeout_co(Coroutine *coroutine,
         GIOStatus ret = g_io_channel_flush(channel, errp);
 
         if (ret == G_IO_STATUS_AGAIN) {
-            CO io_source_id = g_io_add_watch(channel, G_IO_OUT | G_IO_HUP,
-                                             coroutine_giofunc_cb,
-                                             coroutine);
-            g_source_set_name_by_id(CO io_source_id, "channel flush io watch");
-            co_yield_int(G_SOURCE_REMOVE);
-
-            guint source_id = g_source_get_id(g_main_current_source());
-            if (timeout && source_id == CO timeout_source_id) {
-                g_source_remove(CO io_source_id);
-                g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
-                            "Channel write timed out");
+            colod_channel_wait_out_co(wait_ret);
+            if (wait_ret < 0) {
                 goto err;
-            } else if (source_id != CO io_source_id) {
-                g_source_remove(CO io_source_id);
-                colod_trace("%s:%u: Got woken by unknown source\n",
-                            __func__, __LINE__);
             }
         } else if (ret == G_IO_STATUS_NORMAL) {
             break;
@@ -289,8 +785,9 @@ int _colod_channel_write_timeout_co(Coroutine *coroutine,
     }
 
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
+    colod_channel_watch_done(watch, CO watch);
 
     co_end;
 
@@ -298,15 +795,213 @@ int _colod_channel_write_timeout_co(Coroutine *coroutine,
 
 err:
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
+    colod_channel_watch_done(watch, CO watch);
 
     return -1;
 }
 
 int _colod_channel_write_co(Coroutine *coroutine,
-                            GIOChannel *channel, const gchar *buf,
+                            GIOChannel *channel, CoroutineWatch *watch,
+                            const gchar *buf,
                             gsize len, GError **errp) {
-    return _colod_channel_write_timeout_co(coroutine, channel, buf, len, 0,
-                                           errp);
+    return _colod_channel_write_timeout_co(coroutine, channel, watch, buf, len,
+                                           0, errp);
+}
+
+// Requests sent with one writev() at most
+#define COLOD_WRITER_IOV_MAX 64
+
+typedef struct ColodWriteRequest {
+    // NULL once the writer owns the rest of the data
+    Coroutine *coroutine;
+    const gchar *buf;
+    gsize len;
+    gsize offset;
+    gchar *owned;
+    gboolean done, failed;
+} ColodWriteRequest;
+
+struct ColodWriter {
+    int fd;
+    CoroutineWatch *watch;
+    GQueue queue;
+    CoroutineCond done;
+    GError *error;
+};
+
+static void colod_writer_complete(ColodWriter *this, ColodWriteRequest *req) {
+    req->done = TRUE;
+    if (!req->coroutine) {
+        g_free(req->owned);
+        g_free(req);
+        return;
+    }
+
+    colod_cond_broadcast(&this->done);
+}
+
+// Writes the queue of all writers as far as the fd takes it. Returns -1 and
+// fails every queued request if the fd broke.
+static int colod_writer_flush(ColodWriter *this) {
+    while (!g_queue_is_empty(&this->queue)) {
+        struct iovec iov[COLOD_WRITER_IOV_MAX];
+        int iovcnt = 0;
+
+        for (GList *entry = this->queue.head;
+             entry && iovcnt < COLOD_WRITER_IOV_MAX; entry = entry->next) {
+            ColodWriteRequest *req = entry->data;
+
+            iov[iovcnt].iov_base = (gchar *) req->buf + req->offset;
+            iov[iovcnt].iov_len = req->len - req->offset;
+            iovcnt++;
+        }
+
+        ssize_t ret = writev(this->fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+
+            g_set_error(&this->error, COLOD_ERROR, COLOD_ERROR_FATAL,
+                        "Channel write failed: %s", g_strerror(errno));
+            while (!g_queue_is_empty(&this->queue)) {
+                ColodWriteRequest *req = g_queue_pop_head(&this->queue);
+
+                req->failed = TRUE;
+                colod_writer_complete(this, req);
+            }
+            return -1;
+        }
+
+        gsize left = ret;
+        while (left) {
+            ColodWriteRequest *req = g_queue_peek_head(&this->queue);
+            gsize rest = req->len - req->offset;
+
+            if (left < rest) {
+                req->offset += left;
+                break;
+            }
+
+            left -= rest;
+            g_queue_pop_head(&this->queue);
+            colod_writer_complete(this, req);
+        }
+    }
+
+    return 0;
+}
+
+// A request that timed out halfway can't be dropped without corrupting the
+// stream, so the rest is copied and sent with the next write
+static void colod_writer_abandon(ColodWriter *this, ColodWriteRequest *req) {
+    if (!req->offset) {
+        g_queue_remove(&this->queue, req);
+        g_free(req);
+        return;
+    }
+
+    req->owned = g_memdup2(req->buf + req->offset, req->len - req->offset);
+    req->buf = req->owned;
+    req->len -= req->offset;
+    req->offset = 0;
+    req->coroutine = NULL;
+}
+
+int _colod_writer_write_co(Coroutine *coroutine, ColodWriter *this,
+                           const gchar *buf, gsize len, guint timeout,
+                           GError **errp) {
+    struct {
+        ColodWriteRequest *req;
+        guint timeout_id;
+    } *co;
+    gboolean timed_out;
+
+    timeout = colod_deadline_clamp(coroutine, timeout);
+    co_frame(co, sizeof(*co));
+    co_begin(int, 0);
+
+    if (this->error) {
+        g_propagate_error(errp, g_error_copy(this->error));
+        return -1;
+    }
+    if (!len) {
+        return 0;
+    }
+
+    CO req = g_new0(ColodWriteRequest, 1);
+    CO req->coroutine = coroutine;
+    CO req->buf = buf;
+    CO req->len = len;
+    g_queue_push_tail(&this->queue, CO req);
+
+    CO timeout_id = 0;
+    if (timeout) {
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
+    }
+
+    while (!CO req->done) {
+        if (colod_writer_flush(this) < 0 || CO req->done) {
+            break;
+        }
+
+        // Wait until the fd takes more or another writer sent our data
+        colod_watch_arm(this->watch, coroutine, G_IO_OUT, G_PRIORITY_DEFAULT);
+        colod_cond_wait(&this->done, coroutine);
+        co_yield_int(G_SOURCE_REMOVE);
+        // The timer fires only once, also if a wakeup was pending then
+        timed_out = timeout && colod_timer_current() == CO timeout_id;
+        colod_cond_woken(&this->done, coroutine);
+        colod_watch_woken(this->watch, coroutine);
+
+        if (timed_out && !CO req->done) {
+            colod_timer_remove(CO timeout_id);
+            colod_writer_abandon(this, CO req);
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
+                        "Channel write timed out");
+            return -1;
+        }
+    }
+
+    if (timeout) {
+        colod_timer_remove(CO timeout_id);
+    }
+    if (CO req->failed) {
+        g_free(CO req);
+        g_propagate_error(errp, g_error_copy(this->error));
+        return -1;
+    }
+    g_free(CO req);
+
+    co_end;
+
+    return 0;
+}
+
+ColodWriter *colod_writer_new(int fd, CoroutineWatch *watch) {
+    ColodWriter *this = g_new0(ColodWriter, 1);
+
+    this->fd = fd;
+    this->watch = watch;
+    return this;
+}
+
+void colod_writer_free(ColodWriter *this) {
+    assert(g_queue_is_empty(&this->done.waiters));
+
+    while (!g_queue_is_empty(&this->queue)) {
+        ColodWriteRequest *req = g_queue_pop_head(&this->queue);
+
+        assert(!req->coroutine);
+        g_free(req->owned);
+        g_free(req);
+    }
+    if (this->error) {
+        g_error_free(this->error);
+    }
+    g_free(this);
 }
@@ -15,36 +15,116 @@
 #include "coroutine.h"
 #include "util.h"
 
+// Waiters sleep in a queue ordered by priority, FIFO within the same
+// priority. Unlocking hands the lock directly to the first waiter and wakes
+// only that coroutine.
 typedef struct CoroutineLock {
     Coroutine *holder;
     unsigned int count;
+    GQueue waiters;
+    GQueue cancelled;
+    guint wake_source_id;
 } CoroutineLock;
 
-#define colod_lock_co(lock) \
+void colod_lock_enqueue(CoroutineLock *lock, Coroutine *coroutine,
+                        int priority, gboolean cancellable);
+int colod_lock_woken(CoroutineLock *lock, Coroutine *coroutine);
+void colod_lock_release(CoroutineLock *lock);
+// Wakes all cancellable waiters below priority without the lock, returns
+// their number
+guint colod_lock_cancel(CoroutineLock *lock, int priority);
+
+#define colod_lock_wait_co(lock, priority, cancellable, ret) \
     do { \
+        (ret) = 0; \
         if ((lock).holder == coroutine) { \
             assert((lock).count); \
             (lock).count++; \
             break; \
         } \
-        while ((lock).holder) { \
-            progress_source_add(coroutine->cb, coroutine); \
-            co_yield_int(G_SOURCE_REMOVE); \
+        if ((lock).holder) { \
+            colod_lock_enqueue(&(lock), coroutine, (priority), \
+                               (cancellable)); \
+            do { \
+                co_yield_int(G_SOURCE_REMOVE); \
+            } while (!((ret) = colod_lock_woken(&(lock), coroutine))); \
+            (ret) = MIN((ret), 0); \
+            break; \
         } \
         assert((lock).count == 0); \
         (lock).holder = coroutine; \
         (lock).count++; \
     } while(0)
 
+// Higher priority waiters get the lock first. ret is set to -1 if the wait
+// was cancelled with colod_lock_cancel(), the lock isn't held then.
+#define colod_lock_cancellable_co(lock, priority, ret) \
+    colod_lock_wait_co(lock, priority, TRUE, ret)
+
+// Like colod_lock_cancellable_co(), but colod_lock_cancel() skips the wait
+#define colod_lock_prio_co(lock, priority) \
+    do { \
+        int __lock_ret; \
+        colod_lock_wait_co(lock, priority, FALSE, __lock_ret); \
+        assert(!__lock_ret); \
+    } while(0)
+
+#define colod_lock_co(lock) colod_lock_prio_co(lock, 0)
+
 #define colod_unlock_co(lock) \
     do { \
         assert((lock).holder == coroutine && (lock).count); \
-        (lock).count--; \
-        if (!(lock).count) { \
-            (lock).holder = NULL; \
-        } \
+        colod_lock_release(&(lock)); \
     } while(0)
 
+// A coroutine may run an operation under an absolute deadline. The
+// timeouts of the coroutine io below and of qmp calls are cut down to the
+// time left, so the whole operation can't take longer than its budget.
+// A deadline only ever gets tighter, NULL leaves it as is. Returns the
+// previous one to pass to colod_deadline_restore() afterwards.
+gint64 colod_deadline_enter(Coroutine *coroutine, MyTimeout *timeout);
+void colod_deadline_restore(Coroutine *coroutine, gint64 previous);
+gboolean colod_deadline_expired(Coroutine *coroutine);
+// Time left, 0 if there is no deadline
+guint colod_deadline_remaining_ms(Coroutine *coroutine);
+// timeout 0 means none. Never returns 0 under a deadline, an expired one
+// times out right away.
+guint colod_deadline_clamp(Coroutine *coroutine, guint timeout);
+
+// Condition variable for coroutines. Waiting on several conditions and a
+// timer at once works like select, the coroutine is resumed by the first
+// one. Waiters always have to re-check their predicate after waking.
+typedef struct CoroutineCond {
+    GQueue waiters;
+} CoroutineCond;
+
+void colod_cond_wait(CoroutineCond *cond, Coroutine *coroutine);
+// Returns TRUE if cond was signalled, the coroutine doesn't wait on cond
+// anymore in any case
+gboolean colod_cond_woken(CoroutineCond *cond, Coroutine *coroutine);
+// Resumes all waiters from an idle source, safe to call from any callback
+void colod_cond_broadcast(CoroutineCond *cond);
+
+// Persistent readiness watch on a fd, one GSource for the whole lifetime of
+// the fd or an entry in the epoll backend if that is enabled. Waiting only
+// toggles the interest mask of the fd.
+typedef struct CoroutineWatch CoroutineWatch;
+// Data that is already buffered in userspace counts as readable
+typedef gboolean (*CoroutineWatchPending)(gpointer data);
+
+CoroutineWatch *colod_watch_new(int fd, const gchar *name);
+void colod_watch_set_pending(CoroutineWatch *this,
+                             CoroutineWatchPending pending, gpointer data);
+void colod_watch_free(CoroutineWatch *this);
+// Resumes coroutine once when the fd is ready for condition or got HUP/ERR.
+// If several waiters are ready, only the ones with the highest priority are
+// woken. The others get woken later if the fd is still ready then.
+void colod_watch_arm(CoroutineWatch *this, Coroutine *coroutine,
+                     GIOCondition condition, gint priority);
+// Returns TRUE if the watch resumed coroutine, else the coroutine got
+// resumed by something else and is disarmed
+gboolean colod_watch_woken(CoroutineWatch *this, Coroutine *coroutine);
+
 #define colod_wait_co(...) \
     co_wrap(_colod_wait_co(__VA_ARGS__))
 int _colod_wait_co(Coroutine *coroutine, GPid pid, guint timeout, GError **errp);
@@ -60,8 +140,10 @@ int _colod_execute_sync_co(Coroutine *coroutine, MyArray *argv, GError **errp);
 
 #define colod_channel_read_line_timeout_co(...) \
     co_wrap(_colod_channel_read_line_timeout_co(__VA_ARGS__))
+// watch may be NULL, a temporary one is used for this call then
 int _colod_channel_read_line_timeout_co(Coroutine *coroutine,
                                         GIOChannel *channel,
+                                        CoroutineWatch *watch,
                                         gchar **line,
                                         gsize *len,
                                         guint timeout,
@@ -70,13 +152,15 @@ int _colod_channel_read_line_timeout_co(Coroutine *coroutine,
 #define colod_channel_read_line_co(...) \
     co_wrap(_colod_channel_read_line_co(__VA_ARGS__))
 int _colod_channel_read_line_co(Coroutine *coroutine,
-                                GIOChannel *channel, gchar **line,
+                                GIOChannel *channel, CoroutineWatch *watch,
+                                gchar **line,
                                 gsize *len, GError **errp);
 
 #define colod_channel_write_timeout_co(...) \
     co_wrap(_colod_channel_write_timeout_co(__VA_ARGS__))
 int _colod_channel_write_timeout_co(Coroutine *coroutine,
                                     GIOChannel *channel,
+                                    CoroutineWatch *watch,
                                     const gchar *buf,
                                     gsize len,
                                     guint timeout,
@@ -85,7 +169,26 @@ int _colod_channel_write_timeout_co(Coroutine *coroutine,
 #define colod_channel_write_co(...) \
     co_wrap(_colod_channel_write_co(__VA_ARGS__))
 int _colod_channel_write_co(Coroutine *coroutine,
-                            GIOChannel *channel, const gchar *buf,
+                            GIOChannel *channel, CoroutineWatch *watch,
+                            const gchar *buf,
                             gsize len, GError **errp);
 
+// Output queue of a nonblocking fd. Data is written straight from the
+// caller's buffer with writev(), all queued writes of the fd go out
+// together. The progress of a partial write is kept here, not by the
+// writer, so a write that timed out halfway is finished by the next one.
+// After a failed write, all writes fail.
+typedef struct ColodWriter ColodWriter;
+
+// watch may be shared with a reader of the fd
+ColodWriter *colod_writer_new(int fd, CoroutineWatch *watch);
+void colod_writer_free(ColodWriter *this);
+
+#define colod_writer_write_co(...) \
+    co_wrap(_colod_writer_write_co(__VA_ARGS__))
+// buf has to stay valid until this returns
+int _colod_writer_write_co(Coroutine *coroutine, ColodWriter *this,
+                           const gchar *buf, gsize len, guint timeout,
+                           GError **errp);
+
 #endif // COUTIL_H
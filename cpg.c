@@ -7,6 +7,8 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <assert.h>
+
 #include <glib-2.0/glib.h>
 #include <glib-2.0/glib-unix.h>
 
@@ -15,6 +17,8 @@
 
 #include "cpg.h"
 #include "daemon.h"
+#include "metrics.h"
+#include "poller.h"
 
 struct Cpg {
     cpg_handle_t handle;
@@ -22,8 +26,21 @@ struct Cpg {
     ColodCallbackHead callbacks;
     guint retransmit_source_id;
     gboolean retransmit[MESSAGE_MAX];
+    CpgMux *mux;
+    gchar *instance;
+    // Learned from the messages of the peer
+    CpgPeer peer;
+};
+
+struct CpgMux {
+    cpg_handle_t handle;
+    guint source_id;
+    // instance name -> Cpg, the Cpgs hold a reference to the mux
+    GHashTable *instances;
 };
 
+static CpgMux *cpg_mux_ref(CpgMux *this);
+
 void colod_cpg_add_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
     ColodCallbackFunc func = (ColodCallbackFunc) _func;
     colod_callback_add(&this->callbacks, func, user_data);
@@ -52,6 +69,9 @@ static gboolean colod_cpg_retransmit(Cpg *cpg) {
     for (int message = 0; message < MESSAGE_MAX; message++) {
         if (cpg->retransmit[message]) {
             colod_cpg_send(cpg, message);
+            metrics_inc(metrics_instance_counter(cpg->instance,
+                                                 "cpg_retransmits", NULL,
+                                                 NULL), 1);
             retransmitted = TRUE;
         }
     }
@@ -74,6 +94,30 @@ static gboolean node_equal(uint32_t ida, uint32_t pida, uint32_t idb, uint32_t p
     return ida == idb && pida == pidb;
 }
 
+static void colod_cpg_deliver_message(Cpg *cpg, uint32_t conv,
+                                      uint32_t nodeid, uint32_t pid) {
+    uint32_t myid;
+    uint32_t mypid;
+    gboolean from_this_node;
+
+    cpg_local_get(cpg->handle, &myid);
+    mypid = getpid();
+
+    if (conv >= MESSAGE_MAX) {
+        log_error_fmt("cpg: Got invalid message %u", conv);
+        return;
+    }
+
+    from_this_node = node_equal(nodeid, pid, myid, mypid);
+    if (from_this_node) {
+        cpg->retransmit[conv] = FALSE;
+    } else if (cpg->mux) {
+        cpg_peer_seen(&cpg->peer, nodeid, pid);
+    }
+
+    notify(cpg, conv, from_this_node, FALSE);
+}
+
 static void colod_cpg_deliver(cpg_handle_t handle,
                               G_GNUC_UNUSED const struct cpg_name *group_name,
                               uint32_t nodeid,
@@ -82,12 +126,8 @@ static void colod_cpg_deliver(cpg_handle_t handle,
                               size_t msg_len) {
     Cpg *cpg;
     uint32_t conv;
-    uint32_t myid;
-    uint32_t mypid;
 
     cpg_context_get(handle, (void**) &cpg);
-    cpg_local_get(handle, &myid);
-    mypid = getpid();
 
     if (msg_len != sizeof(conv)) {
         log_error_fmt("cpg: Got message of invalid length %zu", msg_len);
@@ -95,11 +135,36 @@ static void colod_cpg_deliver(cpg_handle_t handle,
     }
     conv = ntohl((*(uint32_t*)msg));
 
-    if (node_equal(nodeid, pid, myid, mypid)) {
-        cpg->retransmit[conv] = FALSE;
+    colod_cpg_deliver_message(cpg, conv, nodeid, pid);
+}
+
+static void colod_cpg_mux_deliver(cpg_handle_t handle,
+                                  G_GNUC_UNUSED const struct cpg_name *group_name,
+                                  uint32_t nodeid,
+                                  uint32_t pid,
+                                  void *msg,
+                                  size_t msg_len) {
+    CpgMux *mux;
+    Cpg *cpg;
+    uint32_t conv;
+    g_autofree gchar *instance = NULL;
+
+    cpg_context_get(handle, (void**) &mux);
+
+    if (msg_len <= sizeof(conv)) {
+        log_error_fmt("cpg: Got message of invalid length %zu", msg_len);
+        return;
+    }
+    conv = ntohl((*(uint32_t*)msg));
+    instance = g_strndup((gchar *) msg + sizeof(conv), msg_len - sizeof(conv));
+
+    cpg = g_hash_table_lookup(mux->instances, instance);
+    if (!cpg) {
+        // The peer hosts an instance that we don't
+        return;
     }
 
-    notify(cpg, conv, node_equal(nodeid, pid, myid, mypid), FALSE);
+    colod_cpg_deliver_message(cpg, conv, nodeid, pid);
 }
 
 static void colod_cpg_confchg(cpg_handle_t handle,
@@ -120,6 +185,58 @@ static void colod_cpg_confchg(cpg_handle_t handle,
     }
 }
 
+static gboolean colod_cpg_peer_left(Cpg *cpg,
+                                    const struct cpg_address *left_list,
+                                    size_t left_list_entries) {
+    for (size_t i = 0; i < left_list_entries; i++) {
+        if (cpg_peer_left(&cpg->peer, left_list[i].nodeid,
+                          left_list[i].pid)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Everyone shares the group, only tell the instances whose peer left
+static void colod_cpg_mux_confchg(cpg_handle_t handle,
+    G_GNUC_UNUSED const struct cpg_name *group_name,
+    G_GNUC_UNUSED const struct cpg_address *member_list,
+    G_GNUC_UNUSED size_t member_list_entries,
+    const struct cpg_address *left_list,
+    size_t left_list_entries,
+    G_GNUC_UNUSED const struct cpg_address *joined_list,
+    G_GNUC_UNUSED size_t joined_list_entries) {
+    CpgMux *mux;
+    GList *cpgs, *entry;
+
+    cpg_context_get(handle, (void**) &mux);
+
+    if (!left_list_entries) {
+        return;
+    }
+
+    // The callbacks may drop the last reference to a Cpg or the mux
+    cpg_mux_ref(mux);
+    cpgs = g_hash_table_get_values(mux->instances);
+    for (entry = cpgs; entry; entry = entry->next) {
+        cpg_ref(entry->data);
+    }
+
+    for (entry = cpgs; entry; entry = entry->next) {
+        Cpg *cpg = entry->data;
+
+        if (colod_cpg_peer_left(cpg, left_list, left_list_entries)) {
+            colod_cpg_retransmit(cpg);
+            notify(cpg, MESSAGE_NONE, FALSE, TRUE);
+        }
+        cpg_unref(cpg);
+    }
+
+    g_list_free(cpgs);
+    cpg_mux_unref(mux);
+}
+
 static void colod_cpg_totem_confchg(G_GNUC_UNUSED cpg_handle_t handle,
                                     G_GNUC_UNUSED struct cpg_ring_id ring_id,
                                     G_GNUC_UNUSED uint32_t member_list_entries,
@@ -135,8 +252,16 @@ static gboolean colod_cpg_readable(G_GNUC_UNUSED gint fd,
     return G_SOURCE_CONTINUE;
 }
 
+static gboolean colod_cpg_mux_readable(G_GNUC_UNUSED gint fd,
+                                       G_GNUC_UNUSED GIOCondition events,
+                                       gpointer data) {
+    CpgMux *mux = data;
+    cpg_dispatch(mux->handle, CS_DISPATCH_ALL);
+    return G_SOURCE_CONTINUE;
+}
+
 void colod_cpg_send(Cpg *cpg, uint32_t message) {
-    struct iovec vec;
+    struct iovec vec[2];
     uint32_t conv = htonl(message);
 
     cpg->retransmit[message] = TRUE;
@@ -145,9 +270,13 @@ void colod_cpg_send(Cpg *cpg, uint32_t message) {
                                                   cpg);
     }
 
-    vec.iov_len = sizeof(conv);
-    vec.iov_base = &conv;
-    cpg_mcast_joined(cpg->handle, CPG_TYPE_AGREED, &vec, 1);
+    vec[0].iov_len = sizeof(conv);
+    vec[0].iov_base = &conv;
+    if (cpg->mux) {
+        vec[1].iov_len = strlen(cpg->instance);
+        vec[1].iov_base = cpg->instance;
+    }
+    cpg_mcast_joined(cpg->handle, CPG_TYPE_AGREED, vec, cpg->mux ? 2 : 1);
 }
 
 cpg_model_v1_data_t cpg_data = {
@@ -158,32 +287,54 @@ cpg_model_v1_data_t cpg_data = {
     0
 };
 
-Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
+cpg_model_v1_data_t cpg_mux_data = {
+    CPG_MODEL_V1,
+    colod_cpg_mux_deliver,
+    colod_cpg_mux_confchg,
+    colod_cpg_totem_confchg,
+    0
+};
+
+static int colod_cpg_join(cpg_handle_t *handle, cpg_model_v1_data_t *data,
+                          gpointer context, const gchar *group,
+                          GError **errp) {
     cs_error_t ret;
     struct cpg_name name;
-    Cpg *cpg;
 
-    if (strlen(ctx->instance_name) +1 >= sizeof(name.value)) {
-        colod_error_set(errp, "Instance name too long");
-        return NULL;
+    if (strlen(group) +1 >= sizeof(name.value)) {
+        colod_error_set(errp, "CPG group name too long");
+        return -1;
     }
-    strcpy(name.value, ctx->instance_name);
+    strcpy(name.value, group);
     name.length = strlen(name.value);
 
-    cpg = g_rc_box_new0(Cpg);
-
-    ret = cpg_model_initialize(&cpg->handle, CPG_MODEL_V1,
-                               (cpg_model_data_t*) &cpg_data, cpg);
+    ret = cpg_model_initialize(handle, CPG_MODEL_V1,
+                               (cpg_model_data_t*) data, context);
     if (ret != CS_OK) {
         colod_error_set(errp, "Failed to initialize cpg: %s", cs_strerror(ret));
-        cpg_unref(cpg);
-        return NULL;
+        return -1;
     }
 
-    ret = cpg_join(cpg->handle, &name);
+    ret = cpg_join(*handle, &name);
     if (ret != CS_OK) {
         colod_error_set(errp, "Failed to join cpg group: %s", cs_strerror(ret));
-        cpg_finalize(cpg->handle);
+        cpg_finalize(*handle);
+        return -1;
+    }
+
+    return 0;
+}
+
+Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
+    int ret;
+    Cpg *cpg;
+
+    cpg = g_rc_box_new0(Cpg);
+    cpg->instance = g_strdup(ctx->instance_name);
+
+    ret = colod_cpg_join(&cpg->handle, &cpg_data, cpg, ctx->instance_name,
+                         errp);
+    if (ret < 0) {
         cpg_unref(cpg);
         return NULL;
     }
@@ -191,18 +342,84 @@ Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
     return cpg;
 }
 
-Cpg *cpg_new(Cpg *cpg, GError **errp) {
+CpgMux *colod_open_cpg_mux(const gchar *group, GError **errp) {
+    int ret;
+    CpgMux *mux;
+
+    mux = g_rc_box_new0(CpgMux);
+    mux->instances = g_hash_table_new(g_str_hash, g_str_equal);
+
+    ret = colod_cpg_join(&mux->handle, &cpg_mux_data, mux, group, errp);
+    if (ret < 0) {
+        g_hash_table_unref(mux->instances);
+        g_rc_box_release(mux);
+        return NULL;
+    }
+
+    return mux;
+}
+
+Cpg *colod_cpg_mux_join(CpgMux *mux, const gchar *instance, GError **errp) {
+    struct cpg_name name;
+    Cpg *cpg;
+
+    // Keep messages within what a group name may be
+    if (strlen(instance) +1 >= sizeof(name.value)) {
+        colod_error_set(errp, "Instance name too long");
+        return NULL;
+    }
+
+    if (g_hash_table_contains(mux->instances, instance)) {
+        colod_error_set(errp, "Instance %s given twice", instance);
+        return NULL;
+    }
+
+    cpg = g_rc_box_new0(Cpg);
+    cpg->handle = mux->handle;
+    cpg->mux = cpg_mux_ref(mux);
+    cpg->instance = g_strdup(instance);
+    g_hash_table_insert(mux->instances, cpg->instance, cpg);
+
+    return cpg;
+}
+
+static int cpg_fd_add(cpg_handle_t handle, guint *source_id,
+                      GUnixFDSourceFunc func, gpointer data, GError **errp) {
     cs_error_t ret;
     int fd;
 
-    ret = cpg_fd_get(cpg->handle, &fd);
+    ret = cpg_fd_get(handle, &fd);
     if (ret != CS_OK) {
         colod_error_set(errp, "Failed to get cpg file descriptor: %s",
                         cs_strerror(ret));
+        return -1;
+    }
+
+    *source_id = colod_fd_add(fd, G_IO_IN | G_IO_HUP, func, data);
+    return 0;
+}
+
+Cpg *cpg_new(Cpg *cpg, GError **errp) {
+    int ret;
+
+    if (cpg->mux) {
+        // The first instance to start dispatches for all of them
+        if (!cpg->mux->source_id) {
+            ret = cpg_fd_add(cpg->mux->handle, &cpg->mux->source_id,
+                             colod_cpg_mux_readable, cpg->mux, errp);
+            if (ret < 0) {
+                return NULL;
+            }
+        }
+        return cpg;
+    }
+
+    ret = cpg_fd_add(cpg->handle, &cpg->source_id, colod_cpg_readable, cpg,
+                     errp);
+    if (ret < 0) {
         return NULL;
     }
 
-    cpg->source_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP, colod_cpg_readable, cpg);
     return cpg;
 }
 
@@ -214,8 +431,13 @@ static void cpg_free(gpointer data) {
         g_source_remove(cpg->retransmit_source_id);
     }
     if (cpg->source_id) {
-        g_source_remove(cpg->source_id);
+        colod_fd_remove(cpg->source_id);
+    }
+    if (cpg->mux) {
+        g_hash_table_remove(cpg->mux->instances, cpg->instance);
+        cpg_mux_unref(cpg->mux);
     }
+    g_free(cpg->instance);
 }
 
 Cpg *cpg_ref(Cpg *this) {
@@ -225,3 +447,22 @@ Cpg *cpg_ref(Cpg *this) {
 void cpg_unref(Cpg *this) {
     g_rc_box_release_full(this, cpg_free);
 }
+
+static void cpg_mux_free(gpointer data) {
+    CpgMux *mux = data;
+
+    assert(!g_hash_table_size(mux->instances));
+    if (mux->source_id) {
+        colod_fd_remove(mux->source_id);
+    }
+    cpg_finalize(mux->handle);
+    g_hash_table_unref(mux->instances);
+}
+
+static CpgMux *cpg_mux_ref(CpgMux *this) {
+    return g_rc_box_acquire(this);
+}
+
+void cpg_mux_unref(CpgMux *this) {
+    g_rc_box_release_full(this, cpg_mux_free);
+}
@@ -28,9 +28,49 @@ void colod_cpg_del_notify(Cpg *this, CpgCallback _func, gpointer user_data);
 void colod_cpg_stub_notify(Cpg *this, ColodMessage message,
                            gboolean message_from_this_node,
                            gboolean peer_left_group);
+void colod_cpg_stub_set_loopback(Cpg *this, gboolean loopback);
+// A message for instance from another node, and that node leaving the group
+void colod_cpg_stub_mux_deliver(CpgMux *mux, const gchar *instance,
+                                ColodMessage message, uint32_t nodeid,
+                                uint32_t pid);
+void colod_cpg_stub_mux_leave(CpgMux *mux, uint32_t nodeid, uint32_t pid);
 
 void colod_cpg_send(Cpg *cpg, uint32_t message);
 Cpg *colod_open_cpg(ColodContext *ctx, GError **errp);
+
+// One cpg handle shared by all instances of this process. It joins a single
+// group and each message carries the instance name, so every node in the
+// cluster has to run its instances this way. An instance learns where its
+// peer runs from the peer's messages (the hello exchange at startup) and
+// only hears of the peer leaving the group if that member left.
+CpgMux *colod_open_cpg_mux(const gchar *group, GError **errp);
+Cpg *colod_cpg_mux_join(CpgMux *mux, const gchar *instance, GError **errp);
+void cpg_mux_unref(CpgMux *this);
+
+// Where the peer of a muxed instance runs
+typedef struct CpgPeer {
+    gboolean known;
+    uint32_t nodeid, pid;
+} CpgPeer;
+
+static inline void cpg_peer_seen(CpgPeer *this, uint32_t nodeid,
+                                 uint32_t pid) {
+    this->known = TRUE;
+    this->nodeid = nodeid;
+    this->pid = pid;
+}
+
+// Forgets the peer if it is the member that left
+static inline gboolean cpg_peer_left(CpgPeer *this, uint32_t nodeid,
+                                     uint32_t pid) {
+    if (!this->known || this->nodeid != nodeid || this->pid != pid) {
+        return FALSE;
+    }
+
+    this->known = FALSE;
+    return TRUE;
+}
+
 Cpg *cpg_new(Cpg *cpg, GError **errp);
 Cpg *cpg_ref(Cpg *this);
 void cpg_unref(Cpg *this);
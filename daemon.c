@@ -35,6 +35,7 @@
 #include "cpg.h"
 #include "qemulauncher.h"
 #include "peer_manager.h"
+#include "poller.h"
 
 FILE *trace = NULL;
 gboolean do_syslog = FALSE;
@@ -50,6 +51,12 @@ struct DaemonCoroutine {
     Coroutine *command_wake;
 };
 
+static CoroutineType daemon_coroutine_type =
+    COROUTINE_TYPE("daemon", COROUTINE_STACK_SIZE);
+
+// The mainloop runs until every instance has quit
+static guint daemon_instances_running = 0;
+
 static gboolean daemon_co(gpointer data);
 static DaemonCoroutine *daemon_co_ref(DaemonCoroutine *this);
 static void daemon_co_unref(DaemonCoroutine *this);
@@ -134,7 +141,10 @@ static gboolean daemon_co(gpointer data) {
         return GPOINTER_TO_INT(coroutine->yield_value);
     }
 
-    g_main_loop_quit(this->mainloop);
+    daemon_instances_running--;
+    if (!daemon_instances_running) {
+        g_main_loop_quit(this->mainloop);
+    }
     colod_assert_remove_one_source(this);
     return G_SOURCE_REMOVE;
 }
@@ -225,15 +235,19 @@ static gboolean _daemon_co(Coroutine *coroutine, DaemonCoroutine *this) {
 static DaemonCoroutine *daemon_co_new(ColodContext *mctx, GMainLoop *mainloop) {
     DaemonCoroutine *this = g_rc_box_new0(DaemonCoroutine);
     Coroutine *coroutine = &this->coroutine;
+    coroutine_init(coroutine, &daemon_coroutine_type);
     coroutine->cb = daemon_co;
     this->ctx = mctx;
     this->mainloop = mainloop;
+    daemon_instances_running++;
     g_idle_add(coroutine->cb, coroutine);
     return this;
 }
 
 static void daemon_co_free(gpointer data) {
-    (void) data;
+    DaemonCoroutine *this = data;
+
+    coroutine_destroy(&this->coroutine);
 }
 
 static DaemonCoroutine *daemon_co_ref(DaemonCoroutine *this) {
@@ -244,14 +258,12 @@ static void daemon_co_unref(DaemonCoroutine *this) {
     g_rc_box_release_full(this, daemon_co_free);
 }
 
-void daemon_mainloop(ColodContext *mctx) {
+static DaemonCoroutine *daemon_instance_start(ColodContext *mctx,
+                                              GMainLoop *mainloop,
+                                              ColodClientListener *root) {
     const ColodContext *ctx = mctx;
     GError *local_errp = NULL;
 
-    // g_main_context_default creates the global context on demand
-    GMainContext *main_context = g_main_context_default();
-    GMainLoop *mainloop = g_main_loop_new(main_context, FALSE);
-
     mctx->commands = qmp_commands_new(ctx->instance_name, ctx->base_dir,
                                       ctx->active_hidden_dir,
                                       ctx->listen_address, ctx->qemu,
@@ -279,6 +291,11 @@ void daemon_mainloop(ColodContext *mctx) {
         exit(EXIT_FAILURE);
     }
 
+    if (ctx->failover_slots_state) {
+        mctx->failover_slot = failover_slot_new(ctx->failover_slots_state,
+                                                ctx->failover_priority);
+    }
+
     mctx->peer = peer_manager_new(ctx->cpg);
     if (ctx->host_map) {
         int ret = peer_manager_host_map(ctx->peer, ctx->host_map, &local_errp);
@@ -288,21 +305,99 @@ void daemon_mainloop(ColodContext *mctx) {
         }
     }
 
-    mctx->listener = client_listener_new(ctx->mngmt_listen_fd, ctx->commands, ctx->peer);
-
-    DaemonCoroutine *daemon = daemon_co_new(mctx, mainloop);
+    if (root) {
+        mctx->listener = client_listener_new_instance(root, ctx->instance_name,
+                                                      ctx->commands);
+    } else {
+        mctx->listener = client_listener_new(ctx->mngmt_listen_fd,
+                                             ctx->commands);
+    }
+    peer_manager_register_commands(ctx->peer, ctx->listener);
 
-    g_main_loop_run(mainloop);
-    g_main_loop_unref(mainloop);
+    return daemon_co_new(mctx, mainloop);
+}
 
+static void daemon_instance_stop(const ColodContext *ctx,
+                                 DaemonCoroutine *daemon) {
     daemon_co_unref(daemon);
+    peer_manager_unregister_commands(ctx->peer, ctx->listener);
     client_listener_free(ctx->listener);
-    peer_manager_shutdown(ctx->peer);
+    peer_manager_stop(ctx->peer);
     peer_manager_unref(ctx->peer);
+    failover_slot_free(ctx->failover_slot);
     cpg_unref(ctx->cpg);
     qmp_commands_free(ctx->commands);
 }
 
+// The process-wide state is set up from the first instance
+static void daemon_run(ColodContext *mctxs, guint count, gboolean multi) {
+    const ColodContext *ctx = &mctxs[0];
+    GError *local_errp = NULL;
+    ColodNetlink *netlink;
+    MetricsExporter *metrics_exporter = NULL;
+    ColodClientListener *root = NULL;
+    DaemonCoroutine **daemons;
+    FailoverSlots *failover_slots = NULL;
+
+    // g_main_context_default creates the global context on demand
+    GMainContext *main_context = g_main_context_default();
+    GMainLoop *mainloop = g_main_loop_new(main_context, FALSE);
+
+    netlink = netlink_new(&local_errp);
+    if (!netlink) {
+        log_error(local_errp->message);
+        exit(1);
+    }
+
+    if (ctx->metrics_socket) {
+        metrics_exporter = metrics_exporter_new(ctx->metrics_socket,
+                                                &local_errp);
+        if (!metrics_exporter) {
+            log_error(local_errp->message);
+            exit(1);
+        }
+    }
+
+    if (multi) {
+        root = client_listener_new(ctx->mngmt_listen_fd, NULL);
+    }
+
+    if (ctx->failover_slot_dir) {
+        failover_slots = failover_slots_new(ctx->failover_slot_dir,
+                                            ctx->failover_slots);
+    }
+
+    daemons = g_new0(DaemonCoroutine *, count);
+    for (guint i = 0; i < count; i++) {
+        mctxs[i].netlink = netlink;
+        mctxs[i].metrics_exporter = metrics_exporter;
+        mctxs[i].failover_slots_state = failover_slots;
+        daemons[i] = daemon_instance_start(&mctxs[i], mainloop, root);
+    }
+
+    g_main_loop_run(mainloop);
+    g_main_loop_unref(mainloop);
+
+    for (guint i = 0; i < count; i++) {
+        daemon_instance_stop(&mctxs[i], daemons[i]);
+    }
+    g_free(daemons);
+    failover_slots_free(failover_slots);
+    if (root) {
+        client_listener_free(root);
+    }
+    netlink_free(netlink);
+    metrics_exporter_free(metrics_exporter);
+}
+
+void daemon_mainloop(ColodContext *mctx) {
+    daemon_run(mctx, 1, FALSE);
+}
+
+void daemon_mainloop_instances(ColodContext *mctxs, guint count) {
+    daemon_run(mctxs, count, TRUE);
+}
+
 static int daemon_open_mngmt(ColodContext *ctx, GError **errp) {
     int sockfd, ret;
     struct sockaddr_un address = { 0 };
@@ -393,6 +488,20 @@ static int daemonize(ColodContext *ctx) {
     return pipefd;
 }
 
+static void daemon_profile_log_cb(const char *type, const char *site,
+                                  guint64 resumes, guint64 cpu_us,
+                                  guint64 wait_us,
+                                  G_GNUC_UNUSED gpointer data) {
+    colod_syslog(LOG_INFO, "profile: %s %s resumes %" G_GUINT64_FORMAT
+                 " cpu %" G_GUINT64_FORMAT "us wait %" G_GUINT64_FORMAT "us",
+                 type, site, resumes, cpu_us, wait_us);
+}
+
+static gboolean daemon_profile_dump_cb(G_GNUC_UNUSED gpointer data) {
+    coroutine_profile_foreach(daemon_profile_log_cb, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
 static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
                                GError **errp) {
     gboolean ret;
@@ -406,8 +515,10 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
         {"base_directory", 0, 0, G_OPTION_ARG_FILENAME, &ctx->base_dir, "The base directory to store logs and sockets", NULL},
         {"qemu", 0, 0, G_OPTION_ARG_FILENAME, &ctx->qemu, "The path to the qmp socket", NULL},
         {"qemu_img", 0, 0, G_OPTION_ARG_FILENAME, &ctx->qemu_img, "The path to the qmp socket used for yank", NULL},
-        {"timeout_low", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_low, "Low qmp timeout", NULL},
-        {"timeout_high", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_high, "High qmp timeout", NULL},
+        {"timeout_low", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_low, "Minimum qmp timeout, it adapts to the qmp round-trip time above this", NULL},
+        {"timeout_high", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_high, "Minimum qmp timeout while qemu is busy migrating or after a reset", NULL},
+        {"timeout_max", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_max, "Maximum qmp timeout, 0 to use timeout_high", NULL},
+        {"timeout_health", 0, 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_health, "Health check qmp timeout, 0 to use the regular one", NULL},
         {"command_timeout", 0, 0, G_OPTION_ARG_INT, &ctx->command_timeout, "Timeout for commands", NULL},
         {"watchdog_interval", 0, 0, G_OPTION_ARG_INT, &ctx->watchdog_interval, "Watchdog interval (0 to disable)", NULL},
         {"trace", 0, 0, G_OPTION_ARG_NONE, &ctx->do_trace, "Enable tracing", NULL},
@@ -418,11 +529,21 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
         {"qemu_options", 0, 0, G_OPTION_ARG_STRING, &ctx->qemu_options, "qemu options", NULL},
         {"base_port", 0, 0, G_OPTION_ARG_INT, &ctx->base_port, "Base port", NULL},
         {"host_map", 0, 0, G_OPTION_ARG_STRING, &ctx->host_map, "Host map", NULL},
+        {"failover_slot_dir", 0, 0, G_OPTION_ARG_FILENAME, &ctx->failover_slot_dir, "Directory shared by all instances on this host to limit concurrent failovers", NULL},
+        {"failover_slots", 0, 0, G_OPTION_ARG_INT, &ctx->failover_slots, "Maximum number of concurrent failovers on this host", NULL},
+        {"failover_priority", 0, 0, G_OPTION_ARG_INT, &ctx->failover_priority, "Failover priority, lower fails over first", NULL},
+        {"metrics_socket", 0, 0, G_OPTION_ARG_FILENAME, &ctx->metrics_socket, "Unix socket to export metrics in OpenMetrics format", NULL},
+        {"instances", 0, 0, G_OPTION_ARG_FILENAME, &ctx->instances, "Key file with one group per instance to host in this process, instead of --instance_name", NULL},
+        {"cpg_group", 0, 0, G_OPTION_ARG_STRING, &ctx->cpg_group, "The CPG group shared by all instances with --instances", NULL},
+        {"epoll", 0, 0, G_OPTION_ARG_NONE, &ctx->epoll, "Poll the qmp, client, cpg and netlink fds with epoll", NULL},
+        {"profile", 0, 0, G_OPTION_ARG_NONE, &coroutine_profiling, "Profile coroutines, see query-profile, dumped to the log on SIGUSR1", NULL},
         {0}
     };
 
     ctx->qmp_timeout_low = 600;
     ctx->qmp_timeout_high = 10000;
+    ctx->failover_slots = 4;
+    ctx->cpg_group = "colod";
 
     context = g_option_context_new("- qemu colo heartbeat daemon");
     g_option_context_set_help_enabled(context, TRUE);
@@ -434,7 +555,12 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
         return -1;
     }
 
-    if (!ctx->node_name || !ctx->instance_name || !ctx->base_dir) {
+    if (ctx->instances && ctx->instance_name) {
+        colod_error_set(errp, "--instance_name and --instances are mutually exclusive");
+        return -1;
+    }
+
+    if (!ctx->node_name || !(ctx->instance_name || ctx->instances) || !ctx->base_dir) {
         g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
                     "--instance_name, --node_name, --base_directory and --qmp_path need to be given.");
         return -1;
@@ -448,10 +574,162 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
     return 0;
 }
 
+static const gchar *daemon_instance_keys[] = {
+    "base_directory", "qemu", "qemu_img", "monitor_interface",
+    "listen_address", "active_hidden_dir", "advanced_config", "qemu_options",
+    "base_port", "host_map", "failover_priority", NULL
+};
+
+static void daemon_key_string(GKeyFile *file, const gchar *group,
+                              const gchar *key, const gchar **value) {
+    gchar *str = g_key_file_get_string(file, group, key, NULL);
+    if (str) {
+        *value = str;
+    }
+}
+
+static int daemon_key_uint(GKeyFile *file, const gchar *group,
+                           const gchar *key, guint *value, GError **errp) {
+    GError *local_errp = NULL;
+    gint ret;
+
+    if (!g_key_file_has_key(file, group, key, NULL)) {
+        return 0;
+    }
+
+    ret = g_key_file_get_integer(file, group, key, &local_errp);
+    if (local_errp) {
+        g_propagate_error(errp, local_errp);
+        return -1;
+    }
+    if (ret < 0) {
+        colod_error_set(errp, "%s: %s must not be negative", group, key);
+        return -1;
+    }
+
+    *value = ret;
+    return 0;
+}
+
+// Options given on the command line are the defaults for every instance
+static int daemon_load_instance(GKeyFile *file, const gchar *group,
+                                ColodContext *ctx, GError **errp) {
+    gchar **keys;
+    int ret;
+
+    keys = g_key_file_get_keys(file, group, NULL, NULL);
+    for (guint i = 0; keys[i]; i++) {
+        if (!g_strv_contains(daemon_instance_keys, keys[i])) {
+            colod_error_set(errp, "%s: Unknown key %s", group, keys[i]);
+            g_strfreev(keys);
+            return -1;
+        }
+    }
+    g_strfreev(keys);
+
+    ctx->instance_name = g_strdup(group);
+    ctx->base_dir = g_build_filename(ctx->base_dir, group, NULL);
+
+    daemon_key_string(file, group, "base_directory", &ctx->base_dir);
+    daemon_key_string(file, group, "qemu", &ctx->qemu);
+    daemon_key_string(file, group, "qemu_img", &ctx->qemu_img);
+    daemon_key_string(file, group, "monitor_interface",
+                      &ctx->monitor_interface);
+    daemon_key_string(file, group, "listen_address", &ctx->listen_address);
+    daemon_key_string(file, group, "active_hidden_dir",
+                      &ctx->active_hidden_dir);
+    daemon_key_string(file, group, "advanced_config", &ctx->advanced_config);
+    daemon_key_string(file, group, "qemu_options", &ctx->qemu_options);
+    daemon_key_string(file, group, "host_map", &ctx->host_map);
+
+    ret = daemon_key_uint(file, group, "base_port", &ctx->base_port, errp);
+    if (ret < 0) {
+        return -1;
+    }
+    ret = daemon_key_uint(file, group, "failover_priority",
+                          &ctx->failover_priority, errp);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (g_mkdir_with_parents(ctx->base_dir, 0700) < 0) {
+        colod_error_set(errp, "Failed to create %s: %s", ctx->base_dir,
+                        g_strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+ColodContext *daemon_load_instances(const ColodContext *template,
+                                    guint *count, GError **errp) {
+    GKeyFile *file = g_key_file_new();
+    ColodContext *ctxs = NULL;
+    gchar **groups = NULL;
+    gsize len;
+    int ret;
+
+    if (!g_key_file_load_from_file(file, template->instances,
+                                   G_KEY_FILE_NONE, errp)) {
+        goto err;
+    }
+
+    groups = g_key_file_get_groups(file, &len);
+    if (!len) {
+        colod_error_set(errp, "No instances in %s", template->instances);
+        goto err;
+    }
+
+    ctxs = g_new0(ColodContext, len);
+    for (gsize i = 0; i < len; i++) {
+        ctxs[i] = *template;
+        ret = daemon_load_instance(file, groups[i], &ctxs[i], errp);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    g_strfreev(groups);
+    g_key_file_free(file);
+    *count = len;
+    return ctxs;
+
+err:
+    g_free(ctxs);
+    g_strfreev(groups);
+    g_key_file_free(file);
+    return NULL;
+}
+
+static int daemon_open_cpg_mux(ColodContext *ctx, ColodContext *ctxs,
+                               guint count, GError **errp) {
+    CpgMux *mux;
+
+    mux = colod_open_cpg_mux(ctx->cpg_group, errp);
+    if (!mux) {
+        return -1;
+    }
+
+    for (guint i = 0; i < count; i++) {
+        ctxs[i].mngmt_listen_fd = ctx->mngmt_listen_fd;
+        ctxs[i].cpg = colod_cpg_mux_join(mux, ctxs[i].instance_name, errp);
+        if (!ctxs[i].cpg) {
+            cpg_mux_unref(mux);
+            return -1;
+        }
+    }
+
+    // Now held by the instances
+    cpg_mux_unref(mux);
+    return 0;
+}
+
 int daemon_main(int argc, char **argv) {
     GError *errp = NULL;
     ColodContext ctx_struct = { 0 };
     ColodContext *ctx = &ctx_struct;
+    ColodContext *ctxs = NULL;
+    guint count = 0;
     int ret;
     int pipefd = 0;
 
@@ -462,6 +740,15 @@ int daemon_main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (ctx->instances) {
+        ctxs = daemon_load_instances(ctx, &count, &errp);
+        if (!ctxs) {
+            fprintf(stderr, "%s\n", errp->message);
+            g_error_free(errp);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (ctx->daemonize) {
         pipefd = daemonize(ctx);
     }
@@ -469,15 +756,32 @@ int daemon_main(int argc, char **argv) {
     prctl(PR_SET_DUMPABLE, 1);
 
     signal(SIGPIPE, SIG_IGN); // TODO: Handle this properly
+    if (coroutine_profiling) {
+        g_unix_signal_add(SIGUSR1, daemon_profile_dump_cb, NULL);
+    }
+
+    if (ctx->epoll) {
+        ret = colod_poller_enable(&errp);
+        if (ret < 0) {
+            goto err;
+        }
+    }
 
     ret = daemon_open_mngmt(ctx, &errp);
     if (ret < 0) {
         goto err;
     }
 
-    ctx->cpg = colod_open_cpg(ctx, &errp);
-    if (!ctx->cpg) {
-        goto err;
+    if (ctxs) {
+        ret = daemon_open_cpg_mux(ctx, ctxs, count, &errp);
+        if (ret < 0) {
+            goto err;
+        }
+    } else {
+        ctx->cpg = colod_open_cpg(ctx, &errp);
+        if (!ctx->cpg) {
+            goto err;
+        }
     }
 
     if (ctx->daemonize) {
@@ -487,7 +791,11 @@ int daemon_main(int argc, char **argv) {
         }
     }
 
-    daemon_mainloop(ctx);
+    if (ctxs) {
+        daemon_mainloop_instances(ctxs, count);
+    } else {
+        daemon_mainloop(ctx);
+    }
     g_main_context_unref(g_main_context_default());
 
     // cleanup pidfile, cpg, qmp and mgmt connection
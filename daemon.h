@@ -19,6 +19,9 @@
 #include "util.h"
 #include "qmp.h"
 #include "qmpcommands.h"
+#include "netlink.h"
+#include "failover_slots.h"
+#include "metrics_exporter.h"
 
 typedef struct ColodContext {
     /* Parameters */
@@ -28,12 +31,18 @@ typedef struct ColodContext {
     const gchar *advanced_config;
     const gchar *qemu_options;
     const gchar *host_map;
+    const gchar *failover_slot_dir;
+    const gchar *metrics_socket;
+    const gchar *instances, *cpg_group;
+    guint failover_slots, failover_priority;
     gboolean daemonize;
-    guint qmp_timeout_low, qmp_timeout_high;
+    guint qmp_timeout_low, qmp_timeout_high, qmp_timeout_max;
+    guint qmp_timeout_health;
     guint command_timeout;
     guint watchdog_interval;
     guint base_port;
     gboolean do_trace;
+    gboolean epoll;
 
     /* Variables */
     int mngmt_listen_fd;
@@ -42,6 +51,11 @@ typedef struct ColodContext {
     ColodClientListener *listener;
     Cpg *cpg;
     PeerManager *peer;
+    ColodNetlink *netlink;
+    // Shared by all instances of the process
+    FailoverSlots *failover_slots_state;
+    FailoverSlot *failover_slot;
+    MetricsExporter *metrics_exporter;
 } ColodContext;
 
 void colod_syslog(int pri, const char *fmt, ...)
@@ -54,6 +68,12 @@ void colod_syslog(int pri, const char *fmt, ...)
 void colod_trace(const char *fmt, ...);
 
 void daemon_mainloop(ColodContext *mctx);
+// Host several instances in this process. They share the netlink monitor,
+// metrics exporter and management socket of the first one.
+void daemon_mainloop_instances(ColodContext *mctxs, guint count);
+// Read the instances key file, the template supplies the defaults
+ColodContext *daemon_load_instances(const ColodContext *template,
+                                    guint *count, GError **errp);
 int daemon_main(int argc, char **argv);
 
 #endif // DAEMON_H
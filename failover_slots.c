@@ -0,0 +1,260 @@
+/*
+ * COLO background daemon host-wide failover slots
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <glib-2.0/glib.h>
+
+#include "failover_slots.h"
+#include "coroutine_stack.h"
+#include "coutil.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+// How long expected instances may hold back the others
+#define FAILOVER_SLOTS_GATHER_MS 200
+// Only slots taken by other processes are polled
+#define FAILOVER_SLOTS_RETRY_MS 5
+
+struct FailoverSlots {
+    gchar *dir;
+    guint slots;
+    GList *members;
+    // Instances of this process that hold a slot
+    guint running;
+    // Nobody gets a slot while expected instances are still on their way
+    guint expected;
+    guint gather_id;
+    // Sorted by priority, the head is next
+    GQueue waiting;
+    CoroutineCond changed;
+};
+
+struct FailoverSlot {
+    FailoverSlots *slots;
+    guint priority;
+    gboolean expected;
+    int fd;
+};
+
+int failover_slot_try_lock(FailoverSlot *this, GError **errp) {
+    FailoverSlots *slots = this->slots;
+
+    assert(this->fd < 0);
+
+    for (guint i = 0; i < slots->slots; i++) {
+        g_autofree gchar *path = g_strdup_printf("%s/failover-slot-%u.lock",
+                                                 slots->dir, i);
+
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            colod_error_set(errp, "Failed to open %s: %s", path,
+                            g_strerror(errno));
+            return -1;
+        }
+
+        int ret = flock(fd, LOCK_EX | LOCK_NB);
+        if (ret < 0) {
+            int err = errno;
+            close(fd);
+            if (err == EWOULDBLOCK) {
+                continue;
+            }
+            colod_error_set(errp, "Failed to lock %s: %s", path,
+                            g_strerror(err));
+            return -1;
+        }
+
+        this->fd = fd;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void failover_slot_arrived(FailoverSlot *this) {
+    FailoverSlots *slots = this->slots;
+
+    if (!this->expected) {
+        return;
+    }
+
+    this->expected = FALSE;
+    slots->expected--;
+    if (!slots->expected) {
+        if (slots->gather_id) {
+            colod_timer_remove(slots->gather_id);
+            slots->gather_id = 0;
+        }
+        colod_cond_broadcast(&slots->changed);
+    }
+}
+
+static gboolean failover_slots_gathered(gpointer data) {
+    FailoverSlots *this = data;
+
+    this->gather_id = 0;
+    for (GList *entry = this->members; entry; entry = entry->next) {
+        failover_slot_arrived(entry->data);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void failover_slot_expect(FailoverSlot *this) {
+    FailoverSlots *slots = this->slots;
+
+    if (this->expected) {
+        return;
+    }
+
+    this->expected = TRUE;
+    slots->expected++;
+    // Instances that don't fail over after all don't hold up the others
+    if (!slots->gather_id) {
+        slots->gather_id = colod_timer_add(FAILOVER_SLOTS_GATHER_MS,
+                                           failover_slots_gathered, slots);
+    }
+}
+
+static gint failover_slot_compare(gconstpointer a, gconstpointer b,
+                                  G_GNUC_UNUSED gpointer data) {
+    const FailoverSlot *queued = a, *new = b;
+
+    // Equal priorities keep their order of arrival
+    return queued->priority <= new->priority ? -1 : 1;
+}
+
+static gboolean failover_slot_turn(FailoverSlot *this) {
+    FailoverSlots *slots = this->slots;
+
+    return !slots->expected && slots->running < slots->slots
+            && g_queue_peek_head(&slots->waiting) == this;
+}
+
+int _failover_slot_acquire_co(Coroutine *coroutine, FailoverSlot *this,
+                              guint timeout, GError **errp) {
+    struct {
+        guint timeout_id, retry_id;
+    } *co;
+    FailoverSlots *slots = this->slots;
+    gboolean timed_out;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    failover_slot_arrived(this);
+    g_queue_insert_sorted(&slots->waiting, this, failover_slot_compare, NULL);
+    CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
+    CO retry_id = 0;
+
+    while (TRUE) {
+        if (failover_slot_turn(this)) {
+            ret = failover_slot_try_lock(this, errp);
+            if (ret < 0) {
+                break;
+            } else if (ret > 0) {
+                slots->running++;
+                ret = 0;
+                break;
+            }
+
+            // Other processes hold all slots, they can't wake us
+            CO retry_id = colod_timer_add(FAILOVER_SLOTS_RETRY_MS
+                                              * (this->priority + 1),
+                                          coroutine->cb, coroutine);
+        }
+
+        colod_cond_wait(&slots->changed, coroutine);
+        co_yield_int(G_SOURCE_REMOVE);
+        timed_out = colod_timer_current() == CO timeout_id;
+        colod_cond_woken(&slots->changed, coroutine);
+        if (CO retry_id) {
+            colod_timer_remove(CO retry_id);
+            CO retry_id = 0;
+        }
+
+        if (timed_out) {
+            colod_error_set(errp, "Timed out waiting for a failover slot");
+            ret = -1;
+            break;
+        }
+    }
+
+    colod_timer_remove(CO timeout_id);
+    g_queue_remove(&slots->waiting, this);
+    // The next one may be able to go now
+    colod_cond_broadcast(&slots->changed);
+
+    co_end;
+
+    return ret;
+}
+
+void failover_slot_release(FailoverSlot *this) {
+    if (this->fd < 0) {
+        return;
+    }
+
+    close(this->fd);
+    this->fd = -1;
+    this->slots->running--;
+    colod_cond_broadcast(&this->slots->changed);
+}
+
+FailoverSlot *failover_slot_new(FailoverSlots *slots, guint priority) {
+    FailoverSlot *this = g_new0(FailoverSlot, 1);
+
+    this->slots = slots;
+    this->priority = priority;
+    this->fd = -1;
+    slots->members = g_list_prepend(slots->members, this);
+
+    return this;
+}
+
+void failover_slot_free(FailoverSlot *this) {
+    if (!this) {
+        return;
+    }
+
+    failover_slot_release(this);
+    failover_slot_arrived(this);
+    assert(!g_queue_find(&this->slots->waiting, this));
+    this->slots->members = g_list_remove(this->slots->members, this);
+    g_free(this);
+}
+
+FailoverSlots *failover_slots_new(const gchar *dir, guint slots) {
+    FailoverSlots *this = g_new0(FailoverSlots, 1);
+
+    this->dir = g_strdup(dir);
+    this->slots = MAX(slots, 1);
+    g_queue_init(&this->waiting);
+
+    return this;
+}
+
+void failover_slots_free(FailoverSlots *this) {
+    if (!this) {
+        return;
+    }
+
+    assert(!this->members);
+    if (this->gather_id) {
+        colod_timer_remove(this->gather_id);
+    }
+    g_free(this->dir);
+    g_free(this);
+}
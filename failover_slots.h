@@ -0,0 +1,48 @@
+/*
+ * COLO background daemon host-wide failover slots
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef FAILOVER_SLOTS_H
+#define FAILOVER_SLOTS_H
+
+#include <glib-2.0/glib.h>
+
+#include "coroutine.h"
+
+// Limits how many colod instances on this host fail over at the same time.
+// The instances of one process take turns by failover priority and a
+// released slot goes straight to the next one. Between processes each slot
+// is a lock file in a directory shared by all instances, a slot is taken by
+// flock()ing it. The kernel releases it if colod dies.
+typedef struct FailoverSlots FailoverSlots;
+// The slot of one instance
+typedef struct FailoverSlot FailoverSlot;
+
+FailoverSlots *failover_slots_new(const gchar *dir, guint slots);
+void failover_slots_free(FailoverSlots *this);
+
+FailoverSlot *failover_slot_new(FailoverSlots *slots, guint priority);
+void failover_slot_free(FailoverSlot *this);
+
+// The instance is about to fail over. Instances that lost their peer in the
+// same confchg are collected before the first one gets a slot, so the ones
+// with a lower priority value go first.
+void failover_slot_expect(FailoverSlot *this);
+
+// Returns 1 if a lock file was taken, 0 if all are busy
+int failover_slot_try_lock(FailoverSlot *this, GError **errp);
+
+// Waits for the turn of this instance and a free slot. Returns -1 on
+// timeout or error, the caller should fail over anyway then.
+#define failover_slot_acquire_co(...) \
+    co_wrap(_failover_slot_acquire_co(__VA_ARGS__))
+int _failover_slot_acquire_co(Coroutine *coroutine, FailoverSlot *this,
+                              guint timeout, GError **errp);
+void failover_slot_release(FailoverSlot *this);
+
+#endif // FAILOVER_SLOTS_H
@@ -14,247 +14,374 @@
 #include "formater.h"
 #include "util.h"
 
-struct Formater {
-    const char *instance_name;
-    const char *base_dir;
-    const char *active_hidden_dir;
-    const char *address;
-    const char *listen_address;
-    const char *qemu_binary;
-    const char *qemu_img_binary;
-    const char *disk_size;
-    gboolean filter_rewriter;
-    gboolean newline;
-    JsonNode *comp_prop;
-    JsonNode *mig_prop;
-    JsonNode *throttle_prop;
-    JsonNode *blk_mirror_prop;
-    JsonNode *qemu_options;
-
-    char *decl_comp_prop;
-    char *decl_mig_cap;
-    char *decl_mig_prop;
-    char *decl_throttle_prop;
-    char *decl_blk_mirror_prop;
-
-    char *active_image;
-    char *hidden_image;
-    char *qmp_sock;
-    char *qmp_yank_sock;
-    char *comp_pri_sock;
-    char *comp_out_sock;
-    char *nbd_port;
-    char *migrate_port;
-    char *mirror_port;
-    char *compare_in_port;
+// Values substituted into command templates
+typedef enum FormaterSlot {
+    FORMATER_ADDRESS,
+    FORMATER_LISTEN_ADDRESS,
+    FORMATER_QEMU_BINARY,
+    FORMATER_QEMU_IMG_BINARY,
+    FORMATER_DISK_SIZE,
+    FORMATER_ACTIVE_IMAGE,
+    FORMATER_HIDDEN_IMAGE,
+    FORMATER_QMP_SOCK,
+    FORMATER_QMP_YANK_SOCK,
+    FORMATER_QMP_HEALTH_SOCK,
+    FORMATER_COMP_PRI_SOCK,
+    FORMATER_COMP_OUT_SOCK,
+    FORMATER_NBD_PORT,
+    FORMATER_MIGRATE_PORT,
+    FORMATER_MIRROR_PORT,
+    FORMATER_COMPARE_IN_PORT,
+    FORMATER_MIG_CAP,
+    // Declared per template, in the order of FormaterProp
+    FORMATER_COMP_PROP,
+    FORMATER_MIG_PROP,
+    FORMATER_THROTTLE_PROP,
+    FORMATER_BLK_MIRROR_PROP,
+    FORMATER_SLOT_MAX
+} FormaterSlot;
+
+typedef enum FormaterProp {
+    FORMATER_PROP_COMP,
+    FORMATER_PROP_MIG,
+    FORMATER_PROP_THROTTLE,
+    FORMATER_PROP_BLK_MIRROR,
+    FORMATER_PROP_MAX
+} FormaterProp;
+
+static const char *slot_names[FORMATER_SLOT_MAX] = {
+    [FORMATER_ADDRESS] = "ADDRESS",
+    [FORMATER_LISTEN_ADDRESS] = "LISTEN_ADDRESS",
+    [FORMATER_QEMU_BINARY] = "QEMU_BINARY",
+    [FORMATER_QEMU_IMG_BINARY] = "QEMU_IMG_BINARY",
+    [FORMATER_DISK_SIZE] = "DISK_SIZE",
+    [FORMATER_ACTIVE_IMAGE] = "ACTIVE_IMAGE",
+    [FORMATER_HIDDEN_IMAGE] = "HIDDEN_IMAGE",
+    [FORMATER_QMP_SOCK] = "QMP_SOCK",
+    [FORMATER_QMP_YANK_SOCK] = "QMP_YANK_SOCK",
+    [FORMATER_QMP_HEALTH_SOCK] = "QMP_HEALTH_SOCK",
+    [FORMATER_COMP_PRI_SOCK] = "COMP_PRI_SOCK",
+    [FORMATER_COMP_OUT_SOCK] = "COMP_OUT_SOCK",
+    [FORMATER_NBD_PORT] = "NBD_PORT",
+    [FORMATER_MIGRATE_PORT] = "MIGRATE_PORT",
+    [FORMATER_MIRROR_PORT] = "MIRROR_PORT",
+    [FORMATER_COMPARE_IN_PORT] = "COMPARE_IN_PORT",
+    [FORMATER_MIG_CAP] = "MIG_CAP",
+    [FORMATER_COMP_PROP] = "COMP_PROP",
+    [FORMATER_MIG_PROP] = "MIG_PROP",
+    [FORMATER_THROTTLE_PROP] = "THROTTLE_PROP",
+    [FORMATER_BLK_MIRROR_PROP] = "BLK_MIRROR_PROP"
 };
 
-static const char *decl_fmts[] = {
+static const char *decl_fmts[FORMATER_PROP_MAX] = {
     "@@DECL_COMP_PROP@@",
     "@@DECL_MIG_PROP@@",
     "@@DECL_THROTTLE_PROP@@",
     "@@DECL_BLK_MIRROR_PROP@@"
 };
 
-static const char *prop_fmts[] = {
-    "@@COMP_PROP@@",
-    "@@MIG_PROP@@",
-    "@@THROTTLE_PROP@@",
-    "@@BLK_MIRROR_PROP@@"
-};
+struct Formater {
+    JsonNode *props[FORMATER_PROP_MAX];
+    JsonNode *qemu_options;
 
-static char **props(Formater *this, int i) {
-    char **props[] = {
-        &this->decl_comp_prop,
-        &this->decl_mig_prop,
-        &this->decl_throttle_prop,
-        &this->decl_blk_mirror_prop
-    };
+    // Owned, except for the per-call address and disk size
+    char *values[FORMATER_SLOT_MAX];
+    gsize lens[FORMATER_SLOT_MAX];
+};
 
-    return props[i];
+typedef enum FormaterLineType {
+    FORMATER_LINE_COMMAND,
+    FORMATER_LINE_DECL,
+    FORMATER_LINE_QEMU_OPTIONS
+} FormaterLineType;
+
+typedef struct FormaterSegment {
+    const char *literal;
+    gsize len;
+    int slot;
+} FormaterSegment;
+
+typedef struct FormaterLine {
+    FormaterLineType type;
+    gboolean if_rewriter, if_not_rewriter;
+    FormaterProp prop;
+    JsonNode *decl;
+
+    // The literals point into str
+    char *str;
+    gsize literal_len;
+    GArray *segments;
+} FormaterLine;
+
+struct FormaterTemplate {
+    GPtrArray *lines;
 };
 
-static gboolean formater_is_decl(const char *str) {
-    for (int i = 0; i < (int) (sizeof(decl_fmts)/sizeof(decl_fmts[0])); i++) {
-        const char *decl = decl_fmts[i];
+static void formater_line_free(gpointer data) {
+    FormaterLine *line = data;
 
-        if (strstr(str, decl)) {
-            return TRUE;
-        }
+    if (line->decl) {
+        json_node_unref(line->decl);
+    }
+    if (line->segments) {
+        g_array_free(line->segments, TRUE);
+    }
+    g_free(line->str);
+    g_free(line);
+}
+
+static void formater_line_literal(FormaterLine *line, const char *literal,
+                                  gsize len) {
+    FormaterSegment segment = {.literal = literal, .len = len, .slot = -1};
+
+    if (!len) {
+        return;
     }
 
-    return FALSE;
+    g_array_append_val(line->segments, segment);
+    line->literal_len += len;
 }
 
-static void formater_update(JsonObject* object G_GNUC_UNUSED,
-                     const gchar* member_name,
-                     JsonNode* member_node, gpointer user_data) {
-    JsonObject *to = user_data;
+static int formater_lookup_slot(const char *name, gsize len) {
+    for (int i = 0; i < FORMATER_SLOT_MAX; i++) {
+        if (strlen(slot_names[i]) == len && !strncmp(slot_names[i], name, len)) {
+            return i;
+        }
+    }
 
-    json_object_set_member(to, member_name, json_node_ref(member_node));
-};
+    return -1;
+}
 
-static int formater_handle_decl(Formater *this, const char *_str) {
-    JsonNode *froms[] = {
-        this->comp_prop,
-        this->mig_prop,
-        this->throttle_prop,
-        this->blk_mirror_prop
-    };
+static int formater_compile_command(FormaterLine *line, guint declared) {
+    const char *pos = line->str;
 
-    for (int i = 0; i < (int) (sizeof(decl_fmts)/sizeof(decl_fmts[0])); i++) {
-        const char *decl_fmt = decl_fmts[i];
-        char **prop = props(this, i);
-        JsonObject *from = json_node_get_object(froms[i]);
+    line->segments = g_array_new(FALSE, FALSE, sizeof(FormaterSegment));
 
-        if (!strstr(_str, decl_fmt)) {
-            continue;
+    while (TRUE) {
+        const char *start = strstr(pos, "@@");
+        if (!start) {
+            formater_line_literal(line, pos, strlen(pos));
+            break;
         }
 
-        if (*prop) {
+        const char *name = start + 2;
+        const char *end = strstr(name, "@@");
+        if (!end) {
             return -1;
         }
+        gsize len = end - name;
 
-        GString *str = g_string_new(_str);
-
-        g_string_replace(str, decl_fmt, "", 0);
+        formater_line_literal(line, pos, start - pos);
+        pos = end + 2;
 
-        if (strstr(str->str, "@@")) {
-            g_string_free(str, TRUE);
-            return -1;
+        if (len == strlen("IF_REWRITER")
+                && !strncmp(name, "IF_REWRITER", len)) {
+            line->if_rewriter = TRUE;
+            continue;
+        } else if (len == strlen("IF_NOT_REWRITER")
+                && !strncmp(name, "IF_NOT_REWRITER", len)) {
+            line->if_not_rewriter = TRUE;
+            continue;
         }
 
-        JsonNode *json = json_from_string(str->str, NULL);
-        if (!json) {
-            g_string_free(str, TRUE);
+        int slot = formater_lookup_slot(name, len);
+        if (slot < 0) {
             return -1;
         }
 
-        if (!JSON_NODE_HOLDS_OBJECT(json)) {
-            json_node_unref(json);
-            g_string_free(str, TRUE);
+        // Props have to be declared earlier in the same template
+        if (slot >= FORMATER_COMP_PROP
+                && !(declared & (1u << (slot - FORMATER_COMP_PROP)))) {
             return -1;
         }
 
-        JsonObject *to = json_node_get_object(json);
-        json_object_foreach_member(from, formater_update, to);
-
-        *prop = json_to_string(json, FALSE);
-        json_node_unref(json);
-
-        g_string_free(str, TRUE);
-        break;
+        FormaterSegment segment = {.literal = NULL, .len = 0, .slot = slot};
+        g_array_append_val(line->segments, segment);
     }
 
     return 0;
 }
 
-static int formater_replace_props(Formater *this, GString *command) {
-    for (int i = 0; i < (int) (sizeof(prop_fmts)/sizeof(prop_fmts[0])); i++) {
-           const char *prop_fmt = prop_fmts[i];
-           char **prop = props(this, i);
+static int formater_compile_decl(FormaterLine *line, guint *declared) {
+    const char *decl_fmt = decl_fmts[line->prop];
 
-           guint num = g_string_replace(command, prop_fmt,
-                                        (*prop ? *prop: "{}"), 0);
-           if (num && !*prop) {
-               return -1;
-           }
+    if (*declared & (1u << line->prop)) {
+        return -1;
     }
 
-    return 0;
-}
+    GString *str = g_string_new(line->str);
+    g_string_replace(str, decl_fmt, "", 0);
 
-static int formater_qemu_options(Formater *this, MyArray *out) {
-    JsonArray *array = json_node_get_array(this->qemu_options);
+    if (strstr(str->str, "@@")) {
+        g_string_free(str, TRUE);
+        return -1;
+    }
 
-    int len = json_array_get_length(array);
-    for (int i = 0; i < len; i++) {
-        JsonNode *node = json_array_get_element(array, i);
-        my_array_append(out, g_strdup(json_node_get_string(node)));
+    JsonNode *json = json_from_string(str->str, NULL);
+    g_string_free(str, TRUE);
+    if (!json) {
+        return -1;
+    }
+
+    if (!JSON_NODE_HOLDS_OBJECT(json)) {
+        json_node_unref(json);
+        return -1;
     }
 
+    line->decl = json;
+    *declared |= 1u << line->prop;
     return 0;
 }
 
-static int formater_format_one(Formater *this, MyArray *out, const char *str) {
-    gboolean if_rewriter = !!strstr(str, "@@IF_REWRITER@@");
-    gboolean if_not_rewriter = !!strstr(str, "@@IF_NOT_REWRITER@@");
-    gboolean qemu_options = !!strstr(str, "@@QEMU_OPTIONS@@");
+static int formater_compile_one(FormaterTemplate *template, const char *str,
+                                guint *declared) {
+    FormaterLine *line = g_new0(FormaterLine, 1);
 
-    if (qemu_options) {
-        return formater_qemu_options(this, out);
-    }
+    line->str = g_strdup(str);
+    g_ptr_array_add(template->lines, line);
 
-    if (formater_is_decl(str)) {
-        return formater_handle_decl(this, str);
+    if (strstr(str, "@@QEMU_OPTIONS@@")) {
+        line->type = FORMATER_LINE_QEMU_OPTIONS;
+        return 0;
     }
 
-    if (this->filter_rewriter) {
-        if (if_not_rewriter) {
-            return 0;
+    for (int i = 0; i < FORMATER_PROP_MAX; i++) {
+        if (strstr(str, decl_fmts[i])) {
+            line->type = FORMATER_LINE_DECL;
+            line->prop = i;
+            return formater_compile_decl(line, declared);
         }
-    } else {
-        if (if_rewriter) {
-            return 0;
+    }
+
+    line->type = FORMATER_LINE_COMMAND;
+    return formater_compile_command(line, *declared);
+}
+
+FormaterTemplate *formater_compile(const MyArray *entry) {
+    FormaterTemplate *template = g_new0(FormaterTemplate, 1);
+    guint declared = 0;
+
+    template->lines = g_ptr_array_new_with_free_func(formater_line_free);
+
+    for (int i = 0; i < entry->size; i++) {
+        int ret = formater_compile_one(template, entry->array[i], &declared);
+        if (ret < 0) {
+            formater_template_free(template);
+            return NULL;
         }
     }
 
-    GString *command = g_string_new(str);
+    return template;
+}
 
-    g_string_replace(command, "@@IF_REWRITER@@", "", 0);
-    g_string_replace(command, "@@IF_NOT_REWRITER@@", "", 0);
+void formater_template_free(FormaterTemplate *template) {
+    g_ptr_array_free(template->lines, TRUE);
+    g_free(template);
+}
 
-    g_string_replace(command, "@@ADDRESS@@", this->address, 0);
-    g_string_replace(command, "@@LISTEN_ADDRESS@@", this->listen_address, 0);
-    g_string_replace(command, "@@QEMU_BINARY@@", this->qemu_binary, 0);
-    g_string_replace(command, "@@QEMU_IMG_BINARY@@", this->qemu_img_binary, 0);
-    g_string_replace(command, "@@DISK_SIZE@@", this->disk_size, 0);
+static void formater_update(JsonObject* object G_GNUC_UNUSED,
+                     const gchar* member_name,
+                     JsonNode* member_node, gpointer user_data) {
+    JsonObject *to = user_data;
+
+    json_object_set_member(to, member_name, json_node_ref(member_node));
+};
 
-    g_string_replace(command, "@@ACTIVE_IMAGE@@", this->active_image, 0);
-    g_string_replace(command, "@@HIDDEN_IMAGE@@", this->hidden_image, 0);
-    g_string_replace(command, "@@QMP_SOCK@@", this->qmp_sock, 0);
-    g_string_replace(command, "@@QMP_YANK_SOCK@@", this->qmp_yank_sock, 0);
-    g_string_replace(command, "@@COMP_PRI_SOCK@@", this->comp_pri_sock, 0);
-    g_string_replace(command, "@@COMP_OUT_SOCK@@", this->comp_out_sock, 0);
+static char *formater_format_decl(Formater *this, const FormaterLine *line) {
+    JsonObject *to = json_object_new();
+    JsonNode *json = json_node_alloc();
 
-    g_string_replace(command, "@@NBD_PORT@@", this->nbd_port, 0);
-    g_string_replace(command, "@@MIGRATE_PORT@@", this->migrate_port, 0);
-    g_string_replace(command, "@@MIRROR_PORT@@", this->mirror_port, 0);
-    g_string_replace(command, "@@COMPARE_IN_PORT@@", this->compare_in_port, 0);
+    // Don't touch the compiled declaration, it is reused
+    json_object_foreach_member(json_node_get_object(line->decl),
+                               formater_update, to);
+    json_object_foreach_member(json_node_get_object(this->props[line->prop]),
+                               formater_update, to);
 
-    g_string_replace(command, "@@MIG_CAP@@", this->decl_mig_cap, 0);
+    json_node_init_object(json, to);
+    json_object_unref(to);
 
-    int ret = formater_replace_props(this, command);
-    if (ret < 0) {
-        g_string_free(command, TRUE);
-        return -1;
+    char *ret = json_to_string(json, FALSE);
+    json_node_unref(json);
+    return ret;
+}
+
+static void formater_qemu_options(Formater *this, MyArray *out) {
+    JsonArray *array = json_node_get_array(this->qemu_options);
+
+    int len = json_array_get_length(array);
+    for (int i = 0; i < len; i++) {
+        JsonNode *node = json_array_get_element(array, i);
+        my_array_append(out, g_strdup(json_node_get_string(node)));
     }
+}
 
-    if (strstr(command->str, "@@")) {
-        g_string_free(command, TRUE);
-        return -1;
+static char *formater_format_command(const FormaterLine *line,
+                                     char * const *values, const gsize *lens,
+                                     gboolean newline) {
+    gsize size = line->literal_len + (newline ? 1 : 0);
+
+    for (guint i = 0; i < line->segments->len; i++) {
+        FormaterSegment *segment = &g_array_index(line->segments,
+                                                  FormaterSegment, i);
+        if (segment->slot >= 0) {
+            size += lens[segment->slot];
+        }
     }
 
-    if (this->newline) {
-        g_string_append_c(command, '\n');
+    GString *command = g_string_sized_new(size);
+    for (guint i = 0; i < line->segments->len; i++) {
+        FormaterSegment *segment = &g_array_index(line->segments,
+                                                  FormaterSegment, i);
+        if (segment->slot >= 0) {
+            g_string_append_len(command, values[segment->slot],
+                                lens[segment->slot]);
+        } else {
+            g_string_append_len(command, segment->literal, segment->len);
+        }
     }
 
-    my_array_append(out, g_string_free(command, FALSE));
+    if (newline) {
+        g_string_append_c(command, '\n');
+    }
 
-    return 0;
+    return g_string_free(command, FALSE);
 }
 
-MyArray *formater_format(Formater *this, const MyArray *entry) {
+MyArray *formater_format(Formater *this, const FormaterTemplate *template,
+                         const char *address, const char *disk_size,
+                         gboolean filter_rewriter, gboolean newline) {
     MyArray *array = my_array_new(g_free);
-
-    for (int i = 0; i < entry->size; i++) {
-        int ret = formater_format_one(this, array, entry->array[i]);
-        if (ret < 0) {
-            my_array_unref(array);
-            return NULL;
+    char *values[FORMATER_SLOT_MAX];
+    gsize lens[FORMATER_SLOT_MAX];
+
+    memcpy(values, this->values, sizeof(values));
+    memcpy(lens, this->lens, sizeof(lens));
+    values[FORMATER_ADDRESS] = (char *) (address ? address : "");
+    lens[FORMATER_ADDRESS] = strlen(values[FORMATER_ADDRESS]);
+    values[FORMATER_DISK_SIZE] = (char *) (disk_size ? disk_size : "");
+    lens[FORMATER_DISK_SIZE] = strlen(values[FORMATER_DISK_SIZE]);
+
+    for (guint i = 0; i < template->lines->len; i++) {
+        const FormaterLine *line = template->lines->pdata[i];
+
+        if (line->type == FORMATER_LINE_QEMU_OPTIONS) {
+            formater_qemu_options(this, array);
+        } else if (line->type == FORMATER_LINE_DECL) {
+            int slot = FORMATER_COMP_PROP + line->prop;
+
+            values[slot] = formater_format_decl(this, line);
+            lens[slot] = strlen(values[slot]);
+        } else if (!(filter_rewriter ? line->if_not_rewriter
+                                     : line->if_rewriter)) {
+            my_array_append(array, formater_format_command(line, values, lens,
+                                                           newline));
         }
     }
 
+    for (int i = FORMATER_COMP_PROP; i < FORMATER_SLOT_MAX; i++) {
+        g_free(values[i]);
+    }
+
     return array;
 }
 
@@ -292,80 +419,74 @@ char *formater_qmp_yank_sock(const char *base_dir) {
     return g_build_filename(base_dir, "qmp-yank.sock", NULL);
 }
 
+char *formater_qmp_health_sock(const char *base_dir) {
+    return g_build_filename(base_dir, "qmp-health.sock", NULL);
+}
+
 Formater *formater_new(const char *instance_name, const char *base_dir,
-                       const char *active_hidden_dir, const char *address,
+                       const char *active_hidden_dir,
                        const char *listen_address, const char *qemu_binary,
-                       const char *qemu_img_binary, const char *disk_size,
-                       gboolean filter_rewriter, gboolean newline,
+                       const char *qemu_img_binary,
                        JsonNode *comp_prop,
                        JsonNode *mig_cap, JsonNode *mig_prop,
                        JsonNode *throttle_prop, JsonNode *blk_mirror_prop,
                        JsonNode *qemu_options, const int base_port) {
     Formater *this = g_new0(Formater, 1);
+    char **values = this->values;
 
-    this->instance_name = formater_set_string(instance_name);
-    this->base_dir = formater_set_string(base_dir);
-    this->active_hidden_dir = formater_set_string(active_hidden_dir);
-    this->address = formater_set_string(address);
-    this->listen_address = formater_set_string(listen_address);
-    this->qemu_binary = formater_set_string(qemu_binary);
-    this->qemu_img_binary = formater_set_string(qemu_img_binary);
-    this->disk_size = formater_set_string(disk_size);
-    this->filter_rewriter = filter_rewriter;
-    this->newline = newline;
-
-    this->comp_prop = formater_set_prop(comp_prop);
+    instance_name = formater_set_string(instance_name);
+    base_dir = formater_set_string(base_dir);
+    active_hidden_dir = formater_set_string(active_hidden_dir);
+
+    values[FORMATER_LISTEN_ADDRESS] = g_strdup(formater_set_string(listen_address));
+    values[FORMATER_QEMU_BINARY] = g_strdup(formater_set_string(qemu_binary));
+    values[FORMATER_QEMU_IMG_BINARY] = g_strdup(formater_set_string(qemu_img_binary));
+
+    this->props[FORMATER_PROP_COMP] = formater_set_prop(comp_prop);
     if (mig_cap) {
-        this->decl_mig_cap = json_to_string(mig_cap, FALSE);
+        values[FORMATER_MIG_CAP] = json_to_string(mig_cap, FALSE);
     } else {
-        this->decl_mig_cap = g_strdup("[]");
+        values[FORMATER_MIG_CAP] = g_strdup("[]");
     }
-    this->mig_prop = formater_set_prop(mig_prop);
-    this->throttle_prop = formater_set_prop(throttle_prop);
-    this->blk_mirror_prop = formater_set_prop(blk_mirror_prop);
+    this->props[FORMATER_PROP_MIG] = formater_set_prop(mig_prop);
+    this->props[FORMATER_PROP_THROTTLE] = formater_set_prop(throttle_prop);
+    this->props[FORMATER_PROP_BLK_MIRROR] = formater_set_prop(blk_mirror_prop);
     this->qemu_options = formater_set_array(qemu_options);
 
-    char *tmp = g_strdup_printf("%s-active.qcow2", this->instance_name);
-    this->active_image = g_build_filename(this->active_hidden_dir, tmp, NULL);
+    char *tmp = g_strdup_printf("%s-active.qcow2", instance_name);
+    values[FORMATER_ACTIVE_IMAGE] = g_build_filename(active_hidden_dir, tmp, NULL);
     g_free(tmp);
-    tmp = g_strdup_printf("%s-hidden.qcow2", this->instance_name);
-    this->hidden_image = g_build_filename(this->active_hidden_dir, tmp, NULL);
+    tmp = g_strdup_printf("%s-hidden.qcow2", instance_name);
+    values[FORMATER_HIDDEN_IMAGE] = g_build_filename(active_hidden_dir, tmp, NULL);
     g_free(tmp);
-    this->qmp_sock = formater_qmp_sock(this->base_dir);
-    this->qmp_yank_sock = formater_qmp_yank_sock(this->base_dir);
-    this->comp_pri_sock = g_build_filename(this->base_dir, "comp-pri-in0.sock", NULL);
-    this->comp_out_sock = g_build_filename(this->base_dir, "comp-out0.sock", NULL);
-    this->nbd_port = g_strdup_printf("%i", base_port);
-    this->migrate_port = g_strdup_printf("%i", base_port + 1);
-    this->mirror_port = g_strdup_printf("%i", base_port + 2);
-    this->compare_in_port = g_strdup_printf("%i", base_port + 3);
+    values[FORMATER_QMP_SOCK] = formater_qmp_sock(base_dir);
+    values[FORMATER_QMP_YANK_SOCK] = formater_qmp_yank_sock(base_dir);
+    values[FORMATER_QMP_HEALTH_SOCK] = formater_qmp_health_sock(base_dir);
+    values[FORMATER_COMP_PRI_SOCK] = g_build_filename(base_dir, "comp-pri-in0.sock", NULL);
+    values[FORMATER_COMP_OUT_SOCK] = g_build_filename(base_dir, "comp-out0.sock", NULL);
+    values[FORMATER_NBD_PORT] = g_strdup_printf("%i", base_port);
+    values[FORMATER_MIGRATE_PORT] = g_strdup_printf("%i", base_port + 1);
+    values[FORMATER_MIRROR_PORT] = g_strdup_printf("%i", base_port + 2);
+    values[FORMATER_COMPARE_IN_PORT] = g_strdup_printf("%i", base_port + 3);
+
+    for (int i = 0; i < FORMATER_SLOT_MAX; i++) {
+        if (values[i]) {
+            this->lens[i] = strlen(values[i]);
+        }
+    }
 
     return this;
 }
 
 void formater_free(Formater *this) {
-    json_node_unref(this->comp_prop);
-    json_node_unref(this->mig_prop);
-    json_node_unref(this->throttle_prop);
-    json_node_unref(this->blk_mirror_prop);
+    for (int i = 0; i < FORMATER_PROP_MAX; i++) {
+        json_node_unref(this->props[i]);
+    }
     json_node_unref(this->qemu_options);
 
-    g_free(this->decl_comp_prop);
-    g_free(this->decl_mig_cap);
-    g_free(this->decl_mig_prop);
-    g_free(this->decl_throttle_prop);
-    g_free(this->decl_blk_mirror_prop);
-
-    g_free(this->active_image);
-    g_free(this->hidden_image);
-    g_free(this->qmp_sock);
-    g_free(this->qmp_yank_sock);
-    g_free(this->comp_pri_sock);
-    g_free(this->comp_out_sock);
-    g_free(this->nbd_port);
-    g_free(this->migrate_port);
-    g_free(this->mirror_port);
-    g_free(this->compare_in_port);
+    for (int i = 0; i < FORMATER_SLOT_MAX; i++) {
+        g_free(this->values[i]);
+    }
 
     g_free(this);
 }
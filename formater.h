@@ -15,16 +15,22 @@
 #include "base_types.h"
 #include "util.h"
 
-MyArray *formater_format(Formater *this, const MyArray *entry);
+// Parsed once, formating a template is a single pass over its segments
+FormaterTemplate *formater_compile(const MyArray *entry);
+void formater_template_free(FormaterTemplate *template);
+
+MyArray *formater_format(Formater *this, const FormaterTemplate *template,
+                         const char *address, const char *disk_size,
+                         gboolean filter_rewriter, gboolean newline);
 
 char *formater_qmp_sock(const char *base_dir);
 char *formater_qmp_yank_sock(const char *base_dir);
+char *formater_qmp_health_sock(const char *base_dir);
 
 Formater *formater_new(const char *instance_name, const char *base_dir,
-                       const char *active_hidden_dir, const char *address,
+                       const char *active_hidden_dir,
                        const char *listen_address, const char *qemu_binary,
-                       const char *qemu_img_binary, const char *disk_size,
-                       gboolean filter_rewriter, gboolean newline,
+                       const char *qemu_img_binary,
                        JsonNode *comp_prop,
                        JsonNode *mig_cap, JsonNode *mig_prop,
                        JsonNode *throttle_prop, JsonNode *blk_mirror_prop,
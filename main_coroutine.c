@@ -26,6 +26,9 @@
 #include "qmpexectx.h"
 #include "peer_manager.h"
 #include "cluster_resource.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "coutil.h"
 
 typedef enum MainState {
     STATE_SECONDARY_WAIT,
@@ -64,6 +67,7 @@ struct ColodMainCoroutine {
     guint link_broken_delay2_id;
 
     MainState state;
+    gint64 state_start;
     gboolean transitioning;
     gboolean failed, yellow;
     gboolean qemu_quit;
@@ -76,13 +80,35 @@ struct ColodMainCoroutine {
 
     Coroutine *wake_on_exit;
     MainReturn main_return;
+    CoroutineCond changed;
 
     MainReturn command;
     Coroutine *command_wake;
 
+    // Failover commands ready to send, NULL if they don't validate
+    QmpBatch *failover_plan;
+    guint failover_plan_version;
+
     ColodMainCache cache;
 };
 
+static CoroutineType main_coroutine_type =
+    COROUTINE_TYPE("main", COROUTINE_STACK_SIZE);
+
+static QmpEventMatch match_resume = QMP_EVENT_MATCH("{'event': 'RESUME'}");
+static QmpEventMatch match_migration_active = QMP_EVENT_MATCH(
+        "{'event': 'MIGRATION', 'data': {'status': 'active'}}");
+static QmpEventMatch match_migration_pre_switchover = QMP_EVENT_MATCH(
+        "{'event': 'MIGRATION', 'data': {'status': 'pre-switchover'}}");
+static QmpEventMatch match_migration_colo = QMP_EVENT_MATCH(
+        "{'event': 'MIGRATION', 'data': {'status': 'colo'}}");
+static QmpEventMatch match_resync_ready = QMP_EVENT_MATCH(
+        "{'event': 'JOB_STATUS_CHANGE',"
+        " 'data': {'status': 'ready', 'id': 'resync'}}");
+static QmpEventMatch match_resync_concluded = QMP_EVENT_MATCH(
+        "{'event': 'JOB_STATUS_CHANGE',"
+        " 'data': {'status': 'concluded', 'id': 'resync'}}");
+
 static void colod_link_broken_delay_stop(ColodMainCoroutine *this);
 
 #define colod_trace_source(data) \
@@ -130,6 +156,38 @@ static const gchar *event_str(ColodEvent event) {
     abort();
 }
 
+static const gchar *state_str(MainState state) {
+    switch (state) {
+        case STATE_SECONDARY_WAIT: return "secondary_wait";
+        case STATE_PRIMARY_STARTUP: return "primary_startup";
+        case STATE_PRIMARY_WAIT: return "primary_wait";
+        case STATE_PRIMARY_RESYNC: return "primary_resync";
+        case STATE_PRIMARY_CONT_REPL: return "primary_cont_repl";
+        case STATE_PRIMARY_START_MIGRATION: return "primary_start_migration";
+        case STATE_COLO_RUNNING: return "colo_running";
+        case STATE_FAILOVER_SYNC: return "failover_sync";
+        case STATE_SHUTDOWN: return "shutdown";
+        case STATE_GUEST_SHUTDOWN: return "guest_shutdown";
+        case STATE_GUEST_REBOOT: return "guest_reboot";
+        case STATE_FAILED: return "failed";
+        case STATE_QUIT: return "quit";
+        case STATE_RETURN_NONE: return "return_none";
+    }
+    abort();
+}
+
+static void colod_main_observe_state(ColodMainCoroutine *this) {
+    if (!this->state_start) {
+        return;
+    }
+
+    metrics_observe_since(metrics_instance_histogram(this->ctx->instance_name,
+                                                     "main_state", "state",
+                                                     state_str(this->state)),
+                          this->state_start);
+    this->state_start = 0;
+}
+
 static EventQueue *colod_eventqueue_new() {
     return eventqueue_new(32, EVENT_FAILED, EVENT_QUIT, EVENT_GUEST_SHUTDOWN, 0);
 }
@@ -202,6 +260,7 @@ static void _colod_event_queue(ColodMainCoroutine *this, ColodEvent event,
 
     colod_trace("%s:%u: queued %s (%s)\n", func, line, event_str(event),
                 reason);
+    colod_cond_broadcast(&this->changed);
 
     if (this->mainco_running && !this->wake_source_id) {
         if (!eventqueue_pending(this->queue)
@@ -242,9 +301,14 @@ static ColodEvent __colod_eventqueue_remove(ColodMainCoroutine *this,
 static ColodEvent _colod_event_wait(Coroutine *coroutine,
                                     ColodMainCoroutine *this,
                                     const gchar *func, int line) {
+    struct {
+        gint64 start;
+    } *co;
 
+    co_frame(co, sizeof(*co));
     co_begin(ColodEvent, EVENT_FAILED);
 
+    CO start = g_get_monotonic_time();
     guint source_id = g_source_get_id(g_main_current_source());
     if (source_id == this->wake_source_id) {
         this->wake_source_id = 0;
@@ -258,6 +322,10 @@ static ColodEvent _colod_event_wait(Coroutine *coroutine,
         }
     }
 
+    metrics_observe_since(metrics_instance_histogram(this->ctx->instance_name,
+                                                     "eventqueue_wait", NULL,
+                                                     NULL),
+                          CO start);
     return __colod_eventqueue_remove(this, func, line);
     co_end;
 }
@@ -291,7 +359,7 @@ static ColodEvent _colod_interrupting_wait(Coroutine *coroutine,
     co_wrap(_colod_qmp_event_wait_co(__VA_ARGS__))
 static int _colod_qmp_event_wait_co(Coroutine *coroutine,
                                     ColodMainCoroutine *this,
-                                    guint timeout, const gchar* match,
+                                    guint timeout, QmpEventMatch *match,
                                     GError **errp) {
     int ret;
     GError *local_errp = NULL;
@@ -322,43 +390,35 @@ static int _colod_qmp_event_wait_co(Coroutine *coroutine,
     return ret;
 }
 
+// Sleeps until expr turns false or timeout. Whatever may change expr
+// signals this->changed: qmp events, cpg messages and queued events.
 #define wait_while_timeout(...) co_wrap(_wait_while_timeout(__VA_ARGS__))
-static int _wait_while_timeout(Coroutine *coroutine, gboolean expr, guint timeout) {
+static int _wait_while_timeout(Coroutine *coroutine, ColodMainCoroutine *this,
+                               gboolean expr, guint timeout) {
     struct {
-        guint timeout_source_id, progress_source_id;
+        guint timeout_id;
     } *co;
 
+    timeout = colod_deadline_clamp(coroutine, timeout);
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    CO timeout_source_id = g_timeout_add(timeout, coroutine->cb, coroutine);
-    g_source_set_name_by_id(CO timeout_source_id, "wait_while timeout");
-    CO progress_source_id = progress_source_add(coroutine->cb, coroutine);
-    g_source_set_name_by_id(CO progress_source_id, "wait_while progress");
+    CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
 
-    while (TRUE) {
+    while (expr) {
+        colod_cond_wait(&this->changed, coroutine);
         co_yield_int(G_SOURCE_REMOVE);
 
-        guint source_id = g_source_get_id(g_main_current_source());
-        if (source_id == CO timeout_source_id) {
-            g_source_remove(CO progress_source_id);
-            if (expr) {
-                return -1;
-            } else {
-                return 0;
-            }
-        } else if (source_id == CO progress_source_id) {
-            if (expr) {
-                CO progress_source_id = progress_source_add(coroutine->cb, coroutine);
-                g_source_set_name_by_id(CO progress_source_id, "wait_while progress");
-            } else {
-                g_source_remove(CO timeout_source_id);
-                return 0;
-            }
-        } else {
+        gboolean signalled = colod_cond_woken(&this->changed, coroutine);
+        if (colod_timer_current() == CO timeout_id) {
+            return expr ? -1 : 0;
+        } else if (!signalled) {
             colod_trace("%s:%u: Got woken by unknown source\n", __func__, __LINE__);
         }
     }
+
+    colod_timer_remove(CO timeout_id);
+    return 0;
     co_end;
 }
 
@@ -395,9 +455,13 @@ static ColodQmpResult *__colod_execute_nocheck_co(Coroutine *coroutine, gpointer
     colod_main_ref(this);
     colod_watchdog_refresh(this->watchdog);
 
-    co_recurse(result = qmp_execute_nocheck_co(coroutine, this->qmp, &local_errp, command));
+    co_recurse(result = qmp_execute_nocheck_prio_co(coroutine, this->qmp,
+                                                    QMP_PRIORITY_CLIENT,
+                                                    &local_errp, command));
     if (!result) {
-        colod_event_queue(this, EVENT_FAILED, local_errp->message);
+        if (!g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_CANCELLED)) {
+            colod_event_queue(this, EVENT_FAILED, local_errp->message);
+        }
         g_propagate_error(errp, local_errp);
         colod_main_unref(this);
         return NULL;
@@ -422,7 +486,7 @@ static ColodQmpResult *__colod_execute_co(Coroutine *coroutine, gpointer data,
     if (!result) {
         return NULL;
     }
-    if (has_member(result->json_root, "error")) {
+    if (qmp_result_is_error(result)) {
         g_set_error(errp, COLOD_ERROR, COLOD_ERROR_QMP,
                     "qmp command returned error: %s %s",
                     command, result->line);
@@ -477,6 +541,7 @@ static QmpEctx *_qemu_query_status_co(Coroutine *coroutine, ColodMainCoroutine *
 
     CO ectx = qmp_ectx_new(this->qmp);
     qmp_ectx_set_ignore_yank(CO ectx);
+    qmp_ectx_set_priority(CO ectx, QMP_PRIORITY_WATCHDOG);
 
     if (ignore_state(this->state)) {
         *primary = this->primary;
@@ -505,11 +570,11 @@ static QmpEctx *_qemu_query_status_co(Coroutine *coroutine, ColodMainCoroutine *
     co_end;
 
     const gchar *status, *colo_mode, *colo_reason;
-    status = get_member_member_str(CO qemu_status->json_root,
+    status = get_member_member_str(qmp_result_get_json(CO qemu_status),
                                    "return", "status");
-    colo_mode = get_member_member_str(CO colo_status->json_root,
+    colo_mode = get_member_member_str(qmp_result_get_json(CO colo_status),
                                       "return", "mode");
-    colo_reason = get_member_member_str(CO colo_status->json_root,
+    colo_reason = get_member_member_str(qmp_result_get_json(CO colo_status),
                                         "return", "reason");
     if (!status || !colo_mode || !colo_reason) {
         colod_error_set(errp, "Failed to parse query-status "
@@ -562,7 +627,9 @@ static int _colod_check_health_co(Coroutine *coroutine, ColodMainCoroutine *this
 
     co_recurse(ret = qemu_query_status_co(coroutine, this, &primary, &replication, &local_errp));
     if (!ret) {
-        colod_event_queue(this, EVENT_FAILED, local_errp->message);
+        if (!g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_CANCELLED)) {
+            colod_event_queue(this, EVENT_FAILED, local_errp->message);
+        }
         g_propagate_error(errp, local_errp);
         return -1;
     }
@@ -713,10 +780,79 @@ const ClientCallbacks colod_client_callbacks = {
     __colod_execute_co
 };
 
+// Built ahead of time so that failover only has to send it
+static void colod_failover_plan_build(ColodMainCoroutine *this) {
+    QmpCommands *qmpcommands = this->ctx->commands;
+    GError *local_errp = NULL;
+    MyArray *commands;
+
+    if (this->failover_plan) {
+        qmp_batch_unref(this->failover_plan);
+    }
+
+    if (this->primary) {
+        commands = qmp_commands_get_failover_primary(qmpcommands);
+    } else {
+        commands = qmp_commands_get_failover_secondary(qmpcommands);
+    }
+    this->failover_plan = qmp_batch_new(commands, &local_errp);
+    my_array_unref(commands);
+    if (!this->failover_plan) {
+        colod_syslog(LOG_WARNING, "failover plan: %s", local_errp->message);
+        g_error_free(local_errp);
+    }
+
+    this->failover_plan_version = qmp_commands_get_version(qmpcommands);
+}
+
+static void colod_commands_changed_cb(gpointer data) {
+    ColodMainCoroutine *this = data;
+    colod_failover_plan_build(this);
+}
+
+static void colod_set_primary(ColodMainCoroutine *this, gboolean primary) {
+    if (this->primary != primary) {
+        this->primary = primary;
+        colod_failover_plan_build(this);
+    }
+}
+
+static ColodQmpResult *colod_handle_query_failover_plan(G_GNUC_UNUSED Coroutine *coroutine,
+                                                        G_GNUC_UNUSED ColodClient *client,
+                                                        G_GNUC_UNUSED ColodQmpResult *request,
+                                                        gpointer data) {
+    ColodMainCoroutine *this = data;
+    QmpBatch *plan = this->failover_plan;
+    JsonObject *object = json_object_new();
+    JsonArray *array = json_array_new();
+    JsonNode *node = json_node_alloc();
+    ColodQmpResult *result;
+
+    json_object_set_int_member(object, "version", this->failover_plan_version);
+    json_object_set_boolean_member(object, "primary", this->primary);
+    json_object_set_boolean_member(object, "valid", !!plan);
+    if (plan) {
+        MyArray *commands = qmp_batch_get_commands(plan);
+        for (int i = 0; i < commands->size; i++) {
+            json_array_add_string_element(array, commands->array[i]);
+        }
+    }
+    json_object_set_array_member(object, "commands", array);
+    json_node_init_object(node, object);
+    json_object_unref(object);
+
+    gchar *member = json_to_string(node, FALSE);
+    json_node_unref(node);
+    result = client_create_reply(member);
+    g_free(member);
+    return result;
+}
+
 #define colod_failover_co(...) co_wrap(_colod_failover_co(__VA_ARGS__))
 static int _colod_failover_co(Coroutine* coroutine, ColodMainCoroutine *this) {
     struct {
         QmpEctx *ectx;
+        QmpBatch *plan;
         MyArray *commands;
     } *co;
     QmpCommands *qmpcommands = this->ctx->commands;
@@ -727,17 +863,26 @@ static int _colod_failover_co(Coroutine* coroutine, ColodMainCoroutine *this) {
     CO ectx = qmp_ectx_new(this->qmp);
     qmp_ectx_set_ignore_yank(CO ectx);
     qmp_ectx_set_ignore_qmp_error(CO ectx);
+    qmp_ectx_set_priority(CO ectx, QMP_PRIORITY_FAILOVER);
+    qmp_ectx_set_timeout(CO ectx, this->ctx->command_timeout);
 
     co_recurse(qmp_ectx_yank(coroutine, CO ectx));
 
     this->transitioning = TRUE;
-    if (this->primary) {
-        CO commands = qmp_commands_get_failover_primary(qmpcommands);
+    CO plan = this->failover_plan;
+    if (CO plan) {
+        qmp_batch_ref(CO plan);
+        co_recurse(qmp_ectx_batch(coroutine, CO ectx, CO plan));
+        qmp_batch_unref(CO plan);
     } else {
-        CO commands = qmp_commands_get_failover_secondary(qmpcommands);
+        if (this->primary) {
+            CO commands = qmp_commands_get_failover_primary(qmpcommands);
+        } else {
+            CO commands = qmp_commands_get_failover_secondary(qmpcommands);
+        }
+        co_recurse(qmp_ectx_array(coroutine, CO ectx, CO commands));
+        my_array_unref(CO commands);
     }
-    co_recurse(qmp_ectx_array(coroutine, CO ectx, CO commands));
-    my_array_unref(CO commands);
 
     if (qmp_ectx_failed(CO ectx)) {
         qmp_ectx_log_error(CO ectx);
@@ -753,8 +898,22 @@ static int _colod_failover_co(Coroutine* coroutine, ColodMainCoroutine *this) {
 #define colod_failover_sync_co(...) co_wrap(_colod_failover_sync_co(__VA_ARGS__))
 static MainState _colod_failover_sync_co(Coroutine *coroutine,
                                          ColodMainCoroutine *this) {
+    struct {
+        gint64 start, slot_wait;
+    } *co;
+    FailoverSlot *slot = this->ctx->failover_slot;
+    int ret;
+
+    co_frame(co, sizeof(*co));
     co_begin(MainState, STATE_FAILED);
 
+    CO start = g_get_monotonic_time();
+    // Don't let queued client and health check commands delay the failover
+    guint cancelled = qmp_cancel_queued(this->qmp, QMP_PRIORITY_STATE);
+    if (cancelled) {
+        colod_syslog(LOG_INFO, "Cancelled %u queued qmp commands for failover",
+                     cancelled);
+    }
     eventqueue_set_interrupting(this->queue, EVENT_FAILOVER_WIN, 0);
     colod_cpg_send(this->ctx->cpg, MESSAGE_FAILOVER);
 
@@ -770,12 +929,40 @@ static MainState _colod_failover_sync_co(Coroutine *coroutine,
         }
     }
 
-    int ret;
+    CO slot_wait = 0;
+    if (slot) {
+        GError *local_errp = NULL;
+        gint64 slot_start = g_get_monotonic_time();
+
+        co_recurse(ret = failover_slot_acquire_co(coroutine, slot,
+                                                  this->ctx->command_timeout,
+                                                  &local_errp));
+        if (ret < 0) {
+            log_error(local_errp->message);
+            g_error_free(local_errp);
+        }
+        CO slot_wait = g_get_monotonic_time() - slot_start;
+    }
+
+    // Failover commands may need a yank at any time
+    qmp_hold_yank_refresh(this->qmp);
     co_recurse(ret = colod_failover_co(coroutine, this));
+    qmp_release_yank_refresh(this->qmp);
+    if (slot) {
+        failover_slot_release(slot);
+    }
+    metrics_inc(metrics_instance_counter(this->ctx->instance_name,
+                                         "failovers", "result",
+                                         ret < 0 ? "failed" : "ok"), 1);
     if (ret < 0) {
         return STATE_FAILED;
     }
 
+    colod_syslog(LOG_INFO, "Failover done in %" G_GINT64_FORMAT " ms, "
+                 "waited %" G_GINT64_FORMAT " ms for a failover slot",
+                 (g_get_monotonic_time() - CO start) / 1000,
+                 CO slot_wait / 1000);
+
     colod_link_broken_delay_stop(this);
     peer_manager_clear_peer(this->ctx->peer);
 
@@ -807,7 +994,7 @@ static MainState _colod_secondary_wait_co(Coroutine *coroutine,
 
     while (TRUE) {
         co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 0,
-                                                 "{'event': 'MIGRATION', 'data': {'status': 'active'}}",
+                                                 &match_migration_active,
                                                  &local_errp));
 
         if (ret < 0) {
@@ -823,7 +1010,7 @@ static MainState _colod_secondary_wait_co(Coroutine *coroutine,
             } else if (event == EVENT_SHUTDOWN) {
                 eventqueue_set_interrupting(this->queue, EVENT_FAILOVER_SYNC, 0);
 
-                co_recurse(wait_while_timeout(coroutine, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
+                co_recurse(wait_while_timeout(coroutine, this, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
                 return STATE_RETURN_NONE;
             }
             continue;
@@ -836,7 +1023,7 @@ static MainState _colod_secondary_wait_co(Coroutine *coroutine,
     this->transitioning = TRUE;
 
     co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 5*60*1000,
-                                             "{'event': 'RESUME'}",
+                                             &match_resume,
                                              &local_errp));
     if (ret < 0) {
         if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_INTERRUPT)) {
@@ -850,7 +1037,7 @@ static MainState _colod_secondary_wait_co(Coroutine *coroutine,
             } else if (event == EVENT_SHUTDOWN) {
                 eventqueue_set_interrupting(this->queue, EVENT_FAILOVER_SYNC, 0);
 
-                co_recurse(wait_while_timeout(coroutine, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
+                co_recurse(wait_while_timeout(coroutine, this, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
                 return STATE_RETURN_NONE;
             } else {
                 abort();
@@ -890,7 +1077,7 @@ static MainState _colod_colo_running_co(Coroutine *coroutine,
 
     if (this->primary) {
         co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 0,
-                                        "{'event': 'RESUME'}", &local_errp));
+                                        &match_resume, &local_errp));
 
         if (ret < 0) {
             // Interrupted
@@ -899,7 +1086,7 @@ static MainState _colod_colo_running_co(Coroutine *coroutine,
         }
 
         co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 0,
-                                        "{'event': 'RESUME'}", &local_errp));
+                                        &match_resume, &local_errp));
 
         if (ret < 0) {
             // Interrupted
@@ -1006,13 +1193,15 @@ static MainState _colod_primary_start_resync(Coroutine *coroutine, ColodMainCoro
     }
 
     co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 24*60*60*1000,
-                    "{'event': 'JOB_STATUS_CHANGE',"
-                    " 'data': {'status': 'ready', 'id': 'resync'}}",
+                    &match_resync_ready,
                     &local_errp));
     if (ret < 0) {
         goto wait_error;
     }
 
+    // The guest is stopped from here on, bound the whole switch over
+    qmp_ectx_set_timeout(CO ectx, this->ctx->command_timeout);
+
     CO commands = qmp_commands_adhoc(qmpcommands, peer_manager_get_ip(this->ctx->peer),
                                      "{'execute': 'stop'}",
                                      "{'execute': 'block-job-cancel', 'arguments': {'device': 'resync'}}",
@@ -1025,8 +1214,7 @@ static MainState _colod_primary_start_resync(Coroutine *coroutine, ColodMainCoro
     }
 
     co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 10*1000,
-                    "{'event': 'JOB_STATUS_CHANGE',"
-                    " 'data': {'status': 'concluded', 'id': 'resync'}}",
+                    &match_resync_concluded,
                     &local_errp));
     if (ret < 0) {
         goto wait_error;
@@ -1102,8 +1290,7 @@ failover:
         qmp_result_free(result);
 
         co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 10*1000,
-                        "{'event': 'JOB_STATUS_CHANGE',"
-                        " 'data': {'status': 'concluded', 'id': 'resync'}}",
+                        &match_resync_concluded,
                         &local_errp));
         if (ret < 0) {
             if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_INTERRUPT)) {
@@ -1288,8 +1475,7 @@ static MainState _colod_primary_start_migration_co(Coroutine *coroutine,
 
     this->transitioning = TRUE;
     co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 5*60*1000,
-                    "{'event': 'MIGRATION',"
-                    " 'data': {'status': 'pre-switchover'}}",
+                    &match_migration_pre_switchover,
                     &local_errp));
     if (ret < 0) {
         goto wait_error;
@@ -1308,16 +1494,15 @@ static MainState _colod_primary_start_migration_co(Coroutine *coroutine,
     qmp_result_free(result);
 
     if (qmp_ectx_failed(CO ectx)) {
-        qmp_set_timeout(this->qmp, this->ctx->qmp_timeout_low);
+        qmp_set_busy(this->qmp, FALSE);
         goto ectx_failed;
     }
 
     co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 10000,
-                    "{'event': 'MIGRATION',"
-                    " 'data': {'status': 'colo'}}",
+                    &match_migration_colo,
                     &local_errp));
     if (ret < 0) {
-        qmp_set_timeout(this->qmp, this->ctx->qmp_timeout_low);
+        qmp_set_busy(this->qmp, FALSE);
         goto wait_error;
     }
 
@@ -1396,7 +1581,11 @@ static int _colod_quit_co(Coroutine *coroutine, ColodMainCoroutine *this) {
 
     CO timeout = my_timeout_new(10*1000);
 
-    qmp_set_timeout(this->qmp, MIN(5*1000, this->ctx->qmp_timeout_low));
+    // Leave time to wait for qemu to exit
+    CO timeout_ms = MIN(5*1000, this->ctx->qmp_timeout_low);
+    qmp_set_timeout_bounds(this->qmp, CO timeout_ms, CO timeout_ms,
+                           CO timeout_ms);
+    qmp_set_busy(this->qmp, FALSE);
     co_recurse(result = qmp_execute_co(coroutine, this->qmp, &local_errp,
                                        "{'execute': 'quit'}\n"));
     if (!result) {
@@ -1448,7 +1637,7 @@ static int _colod_shutdown_co(Coroutine *coroutine, ColodMainCoroutine *this) {
         while (!this->guest_shutdown) {
             CO timeout_ms = my_timeout_remaining_minus_ms(CO timeout, 10*1000);
             co_recurse(ret = qmp_wait_event_co(coroutine, this->qmp, CO timeout_ms,
-                                               "{'event': 'RESUME'}", &local_errp));
+                                               &match_resume, &local_errp));
             if (ret < 0) {
                 if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_INTERRUPT)) {
                     g_error_free(local_errp);
@@ -1469,7 +1658,7 @@ static int _colod_shutdown_co(Coroutine *coroutine, ColodMainCoroutine *this) {
     }
 
     CO timeout_ms = my_timeout_remaining_minus_ms(CO timeout, 10*1000);
-    co_recurse(wait_while_timeout(coroutine, !this->guest_shutdown, CO timeout_ms));
+    co_recurse(wait_while_timeout(coroutine, this, !this->guest_shutdown, CO timeout_ms));
     if (peer_manager_failover(this->ctx->peer)) {
         my_timeout_unref(CO timeout);
         return -1;
@@ -1477,7 +1666,7 @@ static int _colod_shutdown_co(Coroutine *coroutine, ColodMainCoroutine *this) {
 
     if (!this->primary) {
         CO timeout_ms = my_timeout_remaining_minus_ms(CO timeout, 10*1000);
-        co_recurse(wait_while_timeout(coroutine, !this->peer_shutdown_done, CO timeout_ms));
+        co_recurse(wait_while_timeout(coroutine, this, !this->peer_shutdown_done, CO timeout_ms));
         if (peer_manager_failover(this->ctx->peer)) {
             my_timeout_unref(CO timeout);
             return -1;
@@ -1518,7 +1707,7 @@ static int _colod_guest_shutdown_co(Coroutine *coroutine, ColodMainCoroutine *th
     } else {
         if (this->replication) {
             CO timeout_ms = my_timeout_remaining_minus_ms(CO timeout, 10*1000);
-            co_recurse(wait_while_timeout(coroutine, !this->guest_shutdown, CO timeout_ms));
+            co_recurse(wait_while_timeout(coroutine, this, !this->guest_shutdown, CO timeout_ms));
         }
         co_recurse(result = qmp_execute_co(coroutine, this->qmp, NULL,
                                            "{'execute': 'yank', 'arguments': {"
@@ -1527,7 +1716,7 @@ static int _colod_guest_shutdown_co(Coroutine *coroutine, ColodMainCoroutine *th
         co_recurse(result = qmp_execute_co(coroutine, this->qmp, NULL,
                                            "{'execute': 'stop'}\n"));
         qmp_result_free(result);
-        co_recurse(wait_while_timeout(coroutine, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
+        co_recurse(wait_while_timeout(coroutine, this, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
     }
 
     if (peer_manager_failover(this->ctx->peer)) {
@@ -1551,12 +1740,12 @@ static int _colod_guest_reboot_co(Coroutine *coroutine, ColodMainCoroutine *this
         colod_cpg_send(this->ctx->cpg, MESSAGE_SHUTDOWN_DONE);
         if (strlen(peer_manager_get_peer(this->ctx->peer))
                 && !peer_manager_failed(this->ctx->peer)) {
-            co_recurse(wait_while_timeout(coroutine, !this->peer_reboot_restart, this->ctx->command_timeout - 10*1000));
-            co_recurse(wait_while_timeout(coroutine, TRUE, 5*1000));
+            co_recurse(wait_while_timeout(coroutine, this, !this->peer_reboot_restart, this->ctx->command_timeout - 10*1000));
+            co_recurse(wait_while_timeout(coroutine, this, TRUE, 5*1000));
         }
     } else {
         if (this->replication) {
-            co_recurse(wait_while_timeout(coroutine, !this->guest_shutdown, this->ctx->command_timeout - 10*1000));
+            co_recurse(wait_while_timeout(coroutine, this, !this->guest_shutdown, this->ctx->command_timeout - 10*1000));
         }
         co_recurse(result = qmp_execute_co(coroutine, this->qmp, NULL,
                                            "{'execute': 'yank', 'arguments': {"
@@ -1565,7 +1754,7 @@ static int _colod_guest_reboot_co(Coroutine *coroutine, ColodMainCoroutine *this
         co_recurse(result = qmp_execute_co(coroutine, this->qmp, NULL,
                                            "{'execute': 'stop'}\n"));
         qmp_result_free(result);
-        co_recurse(wait_while_timeout(coroutine, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
+        co_recurse(wait_while_timeout(coroutine, this, !this->peer_shutdown_done, this->ctx->command_timeout - 10*1000));
     }
 
     if (peer_manager_failover(this->ctx->peer)) {
@@ -1584,6 +1773,8 @@ static int _colod_guest_reboot_co(Coroutine *coroutine, ColodMainCoroutine *this
 }
 
 static MainReturn handle_pending_command(ColodMainCoroutine *this, MainReturn ret) {
+    colod_main_observe_state(this);
+
     if (this->command_wake) {
         this->cache.valid = FALSE;
         g_idle_add(this->command_wake->cb, this->command_wake);
@@ -1644,8 +1835,10 @@ static MainReturn _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this)
     colod_cpg_send(this->ctx->cpg, MESSAGE_HELLO);
 
     while (TRUE) {
+        colod_main_observe_state(this);
         this->transitioning = FALSE;
         this->state = new_state;
+        this->state_start = g_get_monotonic_time();
         if (this->state == STATE_SECONDARY_WAIT) {
             co_recurse(new_state = colod_secondary_wait_co(coroutine, this));
         } else if (this->state == STATE_PRIMARY_STARTUP) {
@@ -1664,7 +1857,7 @@ static MainReturn _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this)
             new_state = STATE_PRIMARY_WAIT;
         } else if (this->state == STATE_PRIMARY_WAIT) {
             // Now running primary standalone
-            this->primary = TRUE;
+            colod_set_primary(this, TRUE);
             this->replication = FALSE;
 
             co_recurse(new_state = colod_primary_wait_co(coroutine, this));
@@ -1725,14 +1918,14 @@ static MainReturn _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this)
             this->failed = TRUE;
             colod_cpg_send(this->ctx->cpg, MESSAGE_FAILED);
 
-            qmp_set_timeout(this->qmp, this->ctx->qmp_timeout_low);
+            qmp_set_busy(this->qmp, FALSE);
             co_recurse(colod_quit_co(coroutine, this));
 
             return handle_pending_command(this, MAIN_NONE);
         } else if (this->state == STATE_QUIT) {
             if (this->replication) {
                 colod_cpg_send(this->ctx->cpg, MESSAGE_FAILED);
-                co_recurse(wait_while_timeout(coroutine,
+                co_recurse(wait_while_timeout(coroutine, this,
                                               !peer_manager_failover(this->ctx->peer)
                                                 && !peer_manager_failed(this->ctx->peer),
                                               this->ctx->command_timeout - 10*1000));
@@ -1799,74 +1992,139 @@ static void colod_link_broken_delay_stop(ColodMainCoroutine *this) {
     }
 }
 
-static void colod_qmp_event_cb(gpointer data, ColodQmpResult *result) {
+static void colod_qmp_quorum_cb(gpointer data, ColodQmpResult *result) {
     ColodMainCoroutine *this = data;
-    const gchar *event;
+    const gchar *node, *type;
+    JsonNode *json = qmp_result_get_json(result);
 
-    event = get_member_str(result->json_root, "event");
+    node = get_member_member_str(json, "data", "node-name");
+    type = get_member_member_str(json, "data", "type");
 
-    if (!strcmp(event, "QUORUM_REPORT_BAD")) {
-        const gchar *node, *type;
-        node = get_member_member_str(result->json_root, "data", "node-name");
-        type = get_member_member_str(result->json_root, "data", "type");
+    metrics_inc(metrics_instance_counter(this->ctx->instance_name,
+                                         "quorum_report_bad", "node", node),
+                1);
 
-        if (!strcmp(node, "nbd0")) {
-            if (!!strcmp(type, "read")) {
-                colod_event_queue(this, EVENT_FAILOVER_SYNC,
-                                  "nbd write/flush error");
-            }
-        } else {
-            if (!!strcmp(type, "read")) {
-                this->yellow = TRUE;
-                colod_cpg_send(this->ctx->cpg, MESSAGE_YELLOW);
-                yellow_shutdown(this->yellow_co);
-                colod_event_queue(this, EVENT_KICK,
-                                  "local disk write/flush error");
-            }
-        }
-    } else if (!strcmp(event, "MIGRATION")) {
-        const gchar *status;
-        status = get_member_member_str(result->json_root, "data", "status");
-        if (!strcmp(status, "failed") && this->state == STATE_PRIMARY_START_MIGRATION) {
-            colod_event_queue(this, EVENT_FAILOVER_SYNC, "migration failed qmp event");
+    if (!strcmp(node, "nbd0")) {
+        if (!!strcmp(type, "read")) {
+            colod_event_queue(this, EVENT_FAILOVER_SYNC,
+                              "nbd write/flush error");
         }
-    } else if (!strcmp(event, "COLO_EXIT")) {
-        const gchar *reason;
-        reason = get_member_member_str(result->json_root, "data", "reason");
-
-        if (!strcmp(reason, "error")) {
-            this->link_broken_delay_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
-                                                            1000, colo_link_broken_delay,
-                                                            this, delay_destroy_cb);
-            colod_main_ref(this);
+    } else {
+        if (!!strcmp(type, "read")) {
+            this->yellow = TRUE;
+            colod_cpg_send(this->ctx->cpg, MESSAGE_YELLOW);
+            yellow_shutdown(this->yellow_co);
+            colod_event_queue(this, EVENT_KICK,
+                              "local disk write/flush error");
         }
-    } else if (!strcmp(event, "SHUTDOWN")) {
-        const gchar *reason = get_member_member_str(result->json_root, "data", "reason");
-        this->guest_shutdown = TRUE;
-        if (!strcmp(reason, "guest-shutdown")) {
-            this->guest_reboot = FALSE;
-        } else if (!strcmp(reason, "guest-reset") && !strcmp(reason, "host-qmp-system-reset")) {
-            this->guest_reboot = TRUE;
-        } else {
-            return;
+    }
+}
+
+static void colod_qmp_migration_cb(gpointer data, ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+    const gchar *status;
+
+    status = qmp_result_get_status(result);
+    if (!strcmp(status, "failed") && this->state == STATE_PRIMARY_START_MIGRATION) {
+        colod_event_queue(this, EVENT_FAILOVER_SYNC, "migration failed qmp event");
+    }
+}
+
+static void colod_qmp_migration_pass_cb(gpointer data,
+                                        G_GNUC_UNUSED ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+
+    metrics_inc(metrics_instance_counter(this->ctx->instance_name,
+                                         "migration_passes", NULL, NULL), 1);
+}
+
+static void colod_qmp_colo_exit_cb(gpointer data, ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+    const gchar *reason;
+
+    reason = get_member_member_str(qmp_result_get_json(result),
+                                   "data", "reason");
+    if (!strcmp(reason, "error")) {
+        this->link_broken_delay_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
+                                                        1000, colo_link_broken_delay,
+                                                        this, delay_destroy_cb);
+        colod_main_ref(this);
+    }
+}
+
+static void colod_qmp_shutdown_cb(gpointer data, ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+    const gchar *reason;
+
+    reason = get_member_member_str(qmp_result_get_json(result),
+                                   "data", "reason");
+    this->guest_shutdown = TRUE;
+    colod_cond_broadcast(&this->changed);
+    if (!strcmp(reason, "guest-shutdown")) {
+        this->guest_reboot = FALSE;
+    } else if (!strcmp(reason, "guest-reset") && !strcmp(reason, "host-qmp-system-reset")) {
+        this->guest_reboot = TRUE;
+    } else {
+        return;
+    }
+    colod_event_queue(this, EVENT_GUEST_SHUTDOWN, "guest shutdown");
+}
+
+static void colod_qmp_reset_cb(gpointer data,
+                               G_GNUC_UNUSED ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+
+    colod_raise_timeout_coroutine(&this->raise_timeout_coroutine, this->qmp,
+                                  this->ctx);
+}
+
+static void colod_qmp_block_job_cb(gpointer data, ColodQmpResult *result) {
+    ColodMainCoroutine *this = data;
+    const gchar *id;
+
+    id = get_member_member_str(qmp_result_get_json(result), "data", "device");
+    if (!strcmp(id, "resync")) {
+        JsonObject *obj = json_node_get_object(qmp_result_get_json(result));
+        JsonObject *data = json_object_get_object_member(obj, "data");
+        assert(data);
+        if (json_object_has_member(data, "offset")) {
+            metrics_inc(metrics_instance_counter(this->ctx->instance_name,
+                                                 "resync_bytes", NULL, NULL),
+                        json_object_get_int_member(data, "offset"));
         }
-        colod_event_queue(this, EVENT_GUEST_SHUTDOWN, "guest shutdown");
-    } else if (!strcmp(event, "RESET")) {
-        colod_raise_timeout_coroutine(&this->raise_timeout_coroutine, this->qmp,
-                                      this->ctx);
-    } else if (!strcmp(event, "BLOCK_JOB_COMPLETED")) {
-        const gchar *id = get_member_member_str(result->json_root, "data", "device");
-        if (!strcmp(id, "resync")) {
-            JsonObject *obj = json_node_get_object(result->json_root);
-            JsonObject *data = json_object_get_object_member(obj, "data");
-            assert(data);
-            if (json_object_has_member(data, "error")) {
-                colod_event_queue(this, EVENT_FAILOVER_SYNC, "block job failed");
-            }
+        if (json_object_has_member(data, "error")) {
+            colod_event_queue(this, EVENT_FAILOVER_SYNC, "block job failed");
         }
     }
 }
 
+static const struct {
+    const gchar *event;
+    QmpEventCallback func;
+} colod_qmp_events[] = {
+    {"QUORUM_REPORT_BAD", colod_qmp_quorum_cb},
+    {"MIGRATION", colod_qmp_migration_cb},
+    {"MIGRATION_PASS", colod_qmp_migration_pass_cb},
+    {"COLO_EXIT", colod_qmp_colo_exit_cb},
+    {"SHUTDOWN", colod_qmp_shutdown_cb},
+    {"RESET", colod_qmp_reset_cb},
+    {"BLOCK_JOB_COMPLETED", colod_qmp_block_job_cb},
+};
+
+static void colod_qmp_events_subscribe(ColodMainCoroutine *this) {
+    for (guint i = 0; i < G_N_ELEMENTS(colod_qmp_events); i++) {
+        qmp_add_notify_event_name(this->qmp, colod_qmp_events[i].event,
+                                  colod_qmp_events[i].func, this);
+    }
+}
+
+static void colod_qmp_events_unsubscribe(ColodMainCoroutine *this) {
+    for (guint i = 0; i < G_N_ELEMENTS(colod_qmp_events); i++) {
+        qmp_del_notify_event_name(this->qmp, colod_qmp_events[i].event,
+                                  colod_qmp_events[i].func, this);
+    }
+}
+
 static void colod_failover_cb(gpointer data, ColodEvent event) {
     ColodMainCoroutine *this = data;
     colod_event_queue(this, event, "Got failover msg");
@@ -1877,6 +2135,9 @@ static void colod_cpg_event_cb(gpointer data, ColodMessage message,
                                gboolean peer_left_group) {
     ColodMainCoroutine *this = data;
 
+    // Peer state is updated by the other cpg callbacks before the wake
+    colod_cond_broadcast(&this->changed);
+
     if (message == MESSAGE_SHUTDOWN_REQUEST) {
         if (this->state == STATE_PRIMARY_RESYNC
                 || this->state == STATE_PRIMARY_START_MIGRATION
@@ -1887,6 +2148,12 @@ static void colod_cpg_event_cb(gpointer data, ColodMessage message,
     } else if (message_from_this_node) {
         return;
     } else if (message == MESSAGE_FAILED || peer_left_group) {
+        // Let the instances that lost their peer together go by priority
+        if (this->ctx->failover_slot
+                && eventqueue_event_interrupting(this->queue,
+                                                 EVENT_FAILOVER_SYNC)) {
+            failover_slot_expect(this->ctx->failover_slot);
+        }
         colod_event_queue(this, EVENT_FAILOVER_SYNC, "got MESSAGE_FAILED or peer left group");
     } else if (message == MESSAGE_HELLO) {
         if (this->yellow) {
@@ -1928,9 +2195,12 @@ static void colod_yellow_event_cb(gpointer data, YellowStatus event) {
 void colod_main_client_register(ColodMainCoroutine *this) {
     colod_main_ref(this);
     client_register(this->ctx->listener, &colod_client_callbacks, this);
+    client_register_command(this->ctx->listener, "query-failover-plan",
+                            colod_handle_query_failover_plan, 0, this);
 }
 
 void colod_main_client_unregister(ColodMainCoroutine *this) {
+    client_unregister_command(this->ctx->listener, "query-failover-plan");
     client_unregister(this->ctx->listener, &colod_client_callbacks, this);
     colod_main_unref(this);
 }
@@ -1973,10 +2243,14 @@ ColodMainCoroutine *colod_main_new(const ColodContext *ctx, QemuLauncher *launch
 
     this = g_rc_box_new0(ColodMainCoroutine);
     coroutine = &this->coroutine;
+    coroutine_init(coroutine, &main_coroutine_type);
     coroutine->cb = colod_main_co;
     this->ctx = ctx;
     this->launcher = qemu_launcher_ref(launcher);
     this->qmp = qmp_ref(qmp);
+    qmp_set_timeout_bounds(this->qmp, ctx->qmp_timeout_low,
+                           ctx->qmp_timeout_high, ctx->qmp_timeout_max);
+    qmp_set_health_timeout(this->qmp, ctx->qmp_timeout_health);
 
     this->yellow_co = yellow_coroutine_new(ctx->cpg, ctx, 500, 1000, errp);
     if (!this->yellow_co) {
@@ -1991,7 +2265,9 @@ ColodMainCoroutine *colod_main_new(const ColodContext *ctx, QemuLauncher *launch
         this->cache = *cache;
         g_free(cache);
     }
-    qmp_add_notify_event(this->qmp, colod_qmp_event_cb, this);
+    colod_failover_plan_build(this);
+    qmp_commands_add_notify(ctx->commands, colod_commands_changed_cb, this);
+    colod_qmp_events_subscribe(this);
     qmp_add_notify_hup(this->qmp, colod_hup_cb, this);
 
     peer_manager_add_notify(ctx->peer, colod_failover_cb, this);
@@ -2007,6 +2283,7 @@ ColodMainCoroutine *colod_main_new(const ColodContext *ctx, QemuLauncher *launch
 static void colod_main_free(gpointer _this) {
     ColodMainCoroutine *this = _this;
     assert(!this->mainco_running);
+    assert(g_queue_is_empty(&this->changed.waiters));
 
     yellow_del_notify(this->yellow_co, colod_yellow_event_cb, this);
     yellow_coroutine_free(this->yellow_co);
@@ -2015,7 +2292,9 @@ static void colod_main_free(gpointer _this) {
     peer_manager_del_notify(this->ctx->peer, colod_failover_cb, this);
 
     qmp_del_notify_hup(this->qmp, colod_hup_cb, this);
-    qmp_del_notify_event(this->qmp, colod_qmp_event_cb, this);
+    colod_qmp_events_unsubscribe(this);
+    qmp_commands_del_notify(this->ctx->commands, colod_commands_changed_cb,
+                            this);
     colod_raise_timeout_coroutine_free(&this->raise_timeout_coroutine);
 
     colod_watchdog_free(this->watchdog);
@@ -2023,7 +2302,12 @@ static void colod_main_free(gpointer _this) {
     qmp_unref(this->qmp);
     qemu_launcher_unref(this->launcher);
 
+    if (this->failover_plan) {
+        qmp_batch_unref(this->failover_plan);
+    }
+
     eventqueue_free(this->queue);
+    coroutine_destroy(&this->coroutine);
 }
 
 ColodMainCoroutine *colod_main_ref(ColodMainCoroutine *this) {
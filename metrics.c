@@ -0,0 +1,452 @@
+/*
+ * COLO background daemon latency metrics
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "metrics.h"
+
+// Upper bounds in microseconds, the last bucket catches everything above
+static const gint64 metrics_bounds[] = {
+    50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+#define METRICS_BUCKETS (G_N_ELEMENTS(metrics_bounds) + 1)
+#define METRICS_MAX_VALUES 64
+
+struct ColodHistogram {
+    guint64 buckets[METRICS_BUCKETS];
+    guint64 count;
+    gint64 sum, max;
+};
+
+struct ColodCounter {
+    guint64 value;
+};
+
+struct ColodGauge {
+    gint64 value;
+};
+
+typedef enum MetricsType {
+    METRICS_HISTOGRAM,
+    METRICS_COUNTER,
+    METRICS_GAUGE
+} MetricsType;
+
+typedef struct MetricsFamily {
+    MetricsType type;
+    gboolean instanced;
+    gchar *label;
+    // instance ("" if not instanced) -> label value -> metric
+    GHashTable *instances;
+} MetricsFamily;
+
+static GHashTable *families = NULL;
+
+static void metrics_family_free(gpointer data) {
+    MetricsFamily *family = data;
+
+    g_free(family->label);
+    g_hash_table_unref(family->instances);
+    g_free(family);
+}
+
+static gboolean metrics_value_valid(const gchar *value) {
+    for (const gchar *c = value; *c; c++) {
+        if (!g_ascii_isalnum(*c) && *c != '_' && *c != '-') {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gpointer metrics_get(const gchar *instance, const gchar *name,
+                            MetricsType type, const gchar *label,
+                            const gchar *value) {
+    MetricsFamily *family;
+    GHashTable *values;
+    gpointer metric;
+
+    if (!families) {
+        families = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         metrics_family_free);
+    }
+
+    family = g_hash_table_lookup(families, name);
+    if (!family) {
+        family = g_new0(MetricsFamily, 1);
+        family->type = type;
+        family->instanced = !!instance;
+        family->label = g_strdup(label);
+        family->instances = g_hash_table_new_full(
+                g_str_hash, g_str_equal, g_free,
+                (GDestroyNotify) g_hash_table_unref);
+        g_hash_table_insert(families, g_strdup(name), family);
+    }
+    assert(family->type == type);
+    assert(family->instanced == !!instance);
+
+    if (!instance) {
+        instance = "";
+    } else if (!metrics_value_valid(instance)) {
+        instance = "other";
+    }
+
+    values = g_hash_table_lookup(family->instances, instance);
+    if (!values) {
+        values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       g_free);
+        g_hash_table_insert(family->instances, g_strdup(instance), values);
+    }
+
+    if (!label || !value) {
+        value = "";
+    }
+
+    metric = g_hash_table_lookup(values, value);
+    if (metric) {
+        return metric;
+    }
+
+    if (!metrics_value_valid(value)
+            || g_hash_table_size(values) >= METRICS_MAX_VALUES) {
+        value = "other";
+        metric = g_hash_table_lookup(values, value);
+        if (metric) {
+            return metric;
+        }
+    }
+
+    if (type == METRICS_HISTOGRAM) {
+        metric = g_new0(ColodHistogram, 1);
+    } else if (type == METRICS_COUNTER) {
+        metric = g_new0(ColodCounter, 1);
+    } else {
+        metric = g_new0(ColodGauge, 1);
+    }
+    g_hash_table_insert(values, g_strdup(value), metric);
+    return metric;
+}
+
+ColodHistogram *metrics_histogram(const gchar *name, const gchar *label,
+                                  const gchar *value) {
+    return metrics_get(NULL, name, METRICS_HISTOGRAM, label, value);
+}
+
+ColodHistogram *metrics_instance_histogram(const gchar *instance,
+                                           const gchar *name,
+                                           const gchar *label,
+                                           const gchar *value) {
+    return metrics_get(instance, name, METRICS_HISTOGRAM, label, value);
+}
+
+ColodCounter *metrics_counter(const gchar *name, const gchar *label,
+                              const gchar *value) {
+    return metrics_get(NULL, name, METRICS_COUNTER, label, value);
+}
+
+ColodCounter *metrics_instance_counter(const gchar *instance,
+                                       const gchar *name, const gchar *label,
+                                       const gchar *value) {
+    return metrics_get(instance, name, METRICS_COUNTER, label, value);
+}
+
+void metrics_inc(ColodCounter *this, guint64 n) {
+    this->value += n;
+}
+
+ColodGauge *metrics_gauge(const gchar *name, const gchar *label,
+                          const gchar *value) {
+    return metrics_get(NULL, name, METRICS_GAUGE, label, value);
+}
+
+ColodGauge *metrics_instance_gauge(const gchar *instance, const gchar *name,
+                                   const gchar *label, const gchar *value) {
+    return metrics_get(instance, name, METRICS_GAUGE, label, value);
+}
+
+void metrics_set(ColodGauge *this, gint64 value) {
+    this->value = value;
+}
+
+void metrics_observe(ColodHistogram *this, gint64 usec) {
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(metrics_bounds); i++) {
+        if (usec <= metrics_bounds[i]) {
+            break;
+        }
+    }
+
+    this->buckets[i]++;
+    this->count++;
+    this->sum += usec;
+    this->max = MAX(this->max, usec);
+}
+
+void metrics_observe_since(ColodHistogram *this, gint64 start) {
+    metrics_observe(this, g_get_monotonic_time() - start);
+}
+
+typedef void (*MetricsFunc)(GString *out, const gchar *name,
+                            MetricsFamily *family, const gchar *instance,
+                            const gchar *value, gpointer metric,
+                            gboolean first, gboolean family_first);
+
+static void metrics_foreach(GString *out, MetricsType type, MetricsFunc func) {
+    gboolean first = TRUE;
+
+    if (!families) {
+        return;
+    }
+
+    GList *names = g_list_sort(g_hash_table_get_keys(families),
+                               (GCompareFunc) strcmp);
+    for (GList *name = names; name; name = name->next) {
+        MetricsFamily *family = g_hash_table_lookup(families, name->data);
+        if (family->type != type) {
+            continue;
+        }
+
+        gboolean family_first = TRUE;
+        GList *instances = g_list_sort(g_hash_table_get_keys(family->instances),
+                                       (GCompareFunc) strcmp);
+        for (GList *instance = instances; instance; instance = instance->next) {
+            GHashTable *table = g_hash_table_lookup(family->instances,
+                                                    instance->data);
+            GList *values = g_list_sort(g_hash_table_get_keys(table),
+                                        (GCompareFunc) strcmp);
+            for (GList *value = values; value; value = value->next) {
+                func(out, name->data, family, instance->data, value->data,
+                     g_hash_table_lookup(table, value->data), first,
+                     family_first);
+                first = FALSE;
+                family_first = FALSE;
+            }
+            g_list_free(values);
+        }
+        g_list_free(instances);
+    }
+    g_list_free(names);
+}
+
+static void metrics_json_head(GString *out, const gchar *name,
+                              MetricsFamily *family, const gchar *instance,
+                              const gchar *value, gboolean first) {
+    g_string_append_printf(out, "%s{\"name\": \"%s\", ", first ? "" : ", ",
+                           name);
+    if (family->instanced) {
+        g_string_append_printf(out, "\"instance\": \"%s\", ", instance);
+    }
+    if (family->label) {
+        g_string_append_printf(out, "\"%s\": \"%s\", ", family->label, value);
+    }
+}
+
+static void metrics_histogram_to_json(GString *out, const gchar *name,
+                                      MetricsFamily *family,
+                                      const gchar *instance,
+                                      const gchar *value, gpointer metric,
+                                      gboolean first,
+                                      G_GNUC_UNUSED gboolean family_first) {
+    ColodHistogram *histogram = metric;
+
+    metrics_json_head(out, name, family, instance, value, first);
+    g_string_append_printf(out, "\"count\": %" G_GUINT64_FORMAT ", "
+                           "\"sum-us\": %" G_GINT64_FORMAT ", "
+                           "\"max-us\": %" G_GINT64_FORMAT ", \"buckets\": [",
+                           histogram->count, histogram->sum, histogram->max);
+    for (guint i = 0; i < METRICS_BUCKETS; i++) {
+        g_string_append_printf(out, "%s%" G_GUINT64_FORMAT, i ? ", " : "",
+                               histogram->buckets[i]);
+    }
+    g_string_append(out, "]}");
+}
+
+static void metrics_counter_to_json(GString *out, const gchar *name,
+                                    MetricsFamily *family,
+                                    const gchar *instance,
+                                    const gchar *value, gpointer metric,
+                                    gboolean first,
+                                    G_GNUC_UNUSED gboolean family_first) {
+    ColodCounter *counter = metric;
+
+    metrics_json_head(out, name, family, instance, value, first);
+    g_string_append_printf(out, "\"value\": %" G_GUINT64_FORMAT "}",
+                           counter->value);
+}
+
+static void metrics_gauge_to_json(GString *out, const gchar *name,
+                                  MetricsFamily *family,
+                                  const gchar *instance,
+                                  const gchar *value, gpointer metric,
+                                  gboolean first,
+                                  G_GNUC_UNUSED gboolean family_first) {
+    ColodGauge *gauge = metric;
+
+    metrics_json_head(out, name, family, instance, value, first);
+    g_string_append_printf(out, "\"value\": %" G_GINT64_FORMAT "}",
+                           gauge->value);
+}
+
+gchar *metrics_to_json(void) {
+    GString *out = g_string_new("{\"bounds-us\": [");
+
+    for (guint i = 0; i < G_N_ELEMENTS(metrics_bounds); i++) {
+        g_string_append_printf(out, "%s%" G_GINT64_FORMAT, i ? ", " : "",
+                               metrics_bounds[i]);
+    }
+    g_string_append(out, "], \"histograms\": [");
+    metrics_foreach(out, METRICS_HISTOGRAM, metrics_histogram_to_json);
+    g_string_append(out, "], \"counters\": [");
+    metrics_foreach(out, METRICS_COUNTER, metrics_counter_to_json);
+    g_string_append(out, "], \"gauges\": [");
+    metrics_foreach(out, METRICS_GAUGE, metrics_gauge_to_json);
+    g_string_append(out, "]}");
+
+    return g_string_free(out, FALSE);
+}
+
+// Exact decimal seconds, the le labels need to be identical across scrapes
+static void metrics_format_seconds(GString *out, gint64 usec) {
+    gsize len;
+
+    g_string_append_printf(out, "%" G_GINT64_FORMAT ".%06" G_GINT64_FORMAT,
+                           usec / 1000000, usec % 1000000);
+    len = out->len;
+    while (out->str[len - 1] == '0' && out->str[len - 2] != '.') {
+        len--;
+    }
+    g_string_truncate(out, len);
+}
+
+static void metrics_openmetrics_labels(GString *out, MetricsFamily *family,
+                                       const gchar *instance,
+                                       const gchar *value, gint64 le) {
+    if (!family->instanced && !family->label && !le) {
+        return;
+    }
+
+    g_string_append_c(out, '{');
+    if (family->instanced) {
+        g_string_append_printf(out, "instance=\"%s\"%s", instance,
+                               family->label || le ? "," : "");
+    }
+    if (family->label) {
+        g_string_append_printf(out, "%s=\"%s\"%s", family->label, value,
+                               le ? "," : "");
+    }
+    if (le > 0) {
+        g_string_append(out, "le=\"");
+        metrics_format_seconds(out, le);
+        g_string_append_c(out, '"');
+    } else if (le < 0) {
+        g_string_append(out, "le=\"+Inf\"");
+    }
+    g_string_append_c(out, '}');
+}
+
+static void metrics_openmetrics_type(GString *out, const gchar *name,
+                                     MetricsFamily *family) {
+    if (family->type == METRICS_HISTOGRAM) {
+        g_string_append_printf(out, "# TYPE colod_%s_seconds histogram\n"
+                               "# UNIT colod_%s_seconds seconds\n", name, name);
+    } else if (family->type == METRICS_COUNTER) {
+        g_string_append_printf(out, "# TYPE colod_%s counter\n", name);
+    } else {
+        g_string_append_printf(out, "# TYPE colod_%s gauge\n", name);
+    }
+}
+
+static void metrics_histogram_to_openmetrics(GString *out, const gchar *name,
+                                             MetricsFamily *family,
+                                             const gchar *instance,
+                                             const gchar *value,
+                                             gpointer metric,
+                                             G_GNUC_UNUSED gboolean first,
+                                             gboolean family_first) {
+    ColodHistogram *histogram = metric;
+    guint64 cumulative = 0;
+
+    if (family_first) {
+        metrics_openmetrics_type(out, name, family);
+    }
+
+    for (guint i = 0; i < METRICS_BUCKETS; i++) {
+        // 0 means no le label, -1 is +Inf
+        gint64 le = i < G_N_ELEMENTS(metrics_bounds) ? metrics_bounds[i] : -1;
+
+        cumulative += histogram->buckets[i];
+        g_string_append_printf(out, "colod_%s_seconds_bucket", name);
+        metrics_openmetrics_labels(out, family, instance, value, le);
+        g_string_append_printf(out, " %" G_GUINT64_FORMAT "\n", cumulative);
+    }
+
+    g_string_append_printf(out, "colod_%s_seconds_count", name);
+    metrics_openmetrics_labels(out, family, instance, value, 0);
+    g_string_append_printf(out, " %" G_GUINT64_FORMAT "\n", histogram->count);
+
+    g_string_append_printf(out, "colod_%s_seconds_sum", name);
+    metrics_openmetrics_labels(out, family, instance, value, 0);
+    g_string_append_c(out, ' ');
+    metrics_format_seconds(out, histogram->sum);
+    g_string_append_c(out, '\n');
+}
+
+static void metrics_counter_to_openmetrics(GString *out, const gchar *name,
+                                           MetricsFamily *family,
+                                           const gchar *instance,
+                                           const gchar *value,
+                                           gpointer metric,
+                                           G_GNUC_UNUSED gboolean first,
+                                           gboolean family_first) {
+    ColodCounter *counter = metric;
+
+    if (family_first) {
+        metrics_openmetrics_type(out, name, family);
+    }
+
+    g_string_append_printf(out, "colod_%s_total", name);
+    metrics_openmetrics_labels(out, family, instance, value, 0);
+    g_string_append_printf(out, " %" G_GUINT64_FORMAT "\n", counter->value);
+}
+
+static void metrics_gauge_to_openmetrics(GString *out, const gchar *name,
+                                         MetricsFamily *family,
+                                         const gchar *instance,
+                                         const gchar *value,
+                                         gpointer metric,
+                                         G_GNUC_UNUSED gboolean first,
+                                         gboolean family_first) {
+    ColodGauge *gauge = metric;
+
+    if (family_first) {
+        metrics_openmetrics_type(out, name, family);
+    }
+
+    g_string_append_printf(out, "colod_%s", name);
+    metrics_openmetrics_labels(out, family, instance, value, 0);
+    g_string_append_printf(out, " %" G_GINT64_FORMAT "\n", gauge->value);
+}
+
+gchar *metrics_to_openmetrics(void) {
+    GString *out = g_string_new(NULL);
+
+    metrics_foreach(out, METRICS_COUNTER, metrics_counter_to_openmetrics);
+    metrics_foreach(out, METRICS_GAUGE, metrics_gauge_to_openmetrics);
+    metrics_foreach(out, METRICS_HISTOGRAM, metrics_histogram_to_openmetrics);
+    g_string_append(out, "# EOF\n");
+
+    return g_string_free(out, FALSE);
+}
@@ -0,0 +1,56 @@
+/*
+ * COLO background daemon latency metrics
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib-2.0/glib.h>
+
+// Fixed bucket latency histograms. colod is single threaded, so recording
+// is just a few increments without any locking.
+typedef struct ColodHistogram ColodHistogram;
+
+// Returns the histogram of family name, optionally split by a label. The
+// label value may only contain [a-zA-Z0-9_-], else it's recorded as "other".
+ColodHistogram *metrics_histogram(const gchar *name, const gchar *label,
+                                  const gchar *value);
+void metrics_observe(ColodHistogram *this, gint64 usec);
+void metrics_observe_since(ColodHistogram *this, gint64 start);
+
+// Monotonic event counters, same naming and label rules as histograms
+typedef struct ColodCounter ColodCounter;
+
+ColodCounter *metrics_counter(const gchar *name, const gchar *label,
+                              const gchar *value);
+void metrics_inc(ColodCounter *this, guint64 n);
+
+// Current values like the state of an estimator, same naming and label rules
+typedef struct ColodGauge ColodGauge;
+
+ColodGauge *metrics_gauge(const gchar *name, const gchar *label,
+                          const gchar *value);
+void metrics_set(ColodGauge *this, gint64 value);
+
+// Metrics of one COLO instance carry an instance label in addition, a
+// family is either always or never split by instance
+ColodHistogram *metrics_instance_histogram(const gchar *instance,
+                                           const gchar *name,
+                                           const gchar *label,
+                                           const gchar *value);
+ColodCounter *metrics_instance_counter(const gchar *instance,
+                                       const gchar *name, const gchar *label,
+                                       const gchar *value);
+ColodGauge *metrics_instance_gauge(const gchar *instance, const gchar *name,
+                                   const gchar *label, const gchar *value);
+
+gchar *metrics_to_json(void);
+// OpenMetrics text exposition format, histograms are exported in seconds
+gchar *metrics_to_openmetrics(void);
+
+#endif // METRICS_H
@@ -0,0 +1,186 @@
+/*
+ * COLO background daemon OpenMetrics exporter
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "metrics_exporter.h"
+#include "metrics.h"
+#include "daemon.h"
+#include "util.h"
+#include "queue.h"
+
+typedef struct MetricsConnection {
+    QLIST_ENTRY(MetricsConnection) next;
+    int fd;
+    guint source_id;
+    gchar *buf;
+    gsize len, offset;
+} MetricsConnection;
+
+struct MetricsExporter {
+    gchar *path;
+    int socket;
+    guint listen_source_id;
+    QLIST_HEAD(, MetricsConnection) head;
+};
+
+static void metrics_connection_free(MetricsConnection *this) {
+    QLIST_REMOVE(this, next);
+    if (this->source_id) {
+        g_source_remove(this->source_id);
+    }
+    close(this->fd);
+    g_free(this->buf);
+    g_free(this);
+}
+
+static gboolean metrics_connection_write(G_GNUC_UNUSED int fd,
+                                         G_GNUC_UNUSED GIOCondition condition,
+                                         gpointer data) {
+    MetricsConnection *this = data;
+
+    while (this->offset < this->len) {
+        ssize_t ret = write(this->fd, this->buf + this->offset,
+                            this->len - this->offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EWOULDBLOCK) {
+                return G_SOURCE_CONTINUE;
+            }
+            break;
+        }
+        this->offset += ret;
+    }
+
+    this->source_id = 0;
+    metrics_connection_free(this);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean metrics_exporter_accept(G_GNUC_UNUSED int fd,
+                                        G_GNUC_UNUSED GIOCondition condition,
+                                        gpointer data) {
+    MetricsExporter *this = data;
+    GError *local_errp = NULL;
+
+    while (TRUE) {
+        int clientfd = accept(this->socket, NULL, NULL);
+        if (clientfd < 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                colod_syslog(LOG_ERR, "Failed to accept() metrics client: %s",
+                             g_strerror(errno));
+                this->listen_source_id = 0;
+                return G_SOURCE_REMOVE;
+            }
+
+            if (errno == EWOULDBLOCK) {
+                break;
+            }
+            continue;
+        }
+
+        if (colod_fd_set_blocking(clientfd, FALSE, &local_errp) < 0) {
+            colod_syslog(LOG_WARNING, "%s", local_errp->message);
+            g_error_free(local_errp);
+            local_errp = NULL;
+            close(clientfd);
+            continue;
+        }
+
+        MetricsConnection *conn = g_new0(MetricsConnection, 1);
+        conn->fd = clientfd;
+        conn->buf = metrics_to_openmetrics();
+        conn->len = strlen(conn->buf);
+        QLIST_INSERT_HEAD(&this->head, conn, next);
+
+        conn->source_id = g_unix_fd_add(clientfd, G_IO_OUT,
+                                        metrics_connection_write, conn);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+MetricsExporter *metrics_exporter_new(const gchar *path, GError **errp) {
+    MetricsExporter *this;
+    struct sockaddr_un address = { 0 };
+    int sockfd, ret;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        colod_error_set(errp, "Metrics unix path too long");
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+    address.sun_family = AF_UNIX;
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        colod_error_set(errp, "Failed to create metrics socket: %s",
+                        g_strerror(errno));
+        return NULL;
+    }
+
+    unlink(path);
+    ret = bind(sockfd, (const struct sockaddr *) &address, sizeof(address));
+    if (ret < 0) {
+        colod_error_set(errp, "Failed to bind metrics socket: %s",
+                        g_strerror(errno));
+        goto err;
+    }
+
+    ret = listen(sockfd, 8);
+    if (ret < 0) {
+        colod_error_set(errp, "Failed to listen metrics socket: %s",
+                        g_strerror(errno));
+        goto err;
+    }
+
+    ret = colod_fd_set_blocking(sockfd, FALSE, errp);
+    if (ret < 0) {
+        goto err;
+    }
+
+    this = g_new0(MetricsExporter, 1);
+    this->path = g_strdup(path);
+    this->socket = sockfd;
+    QLIST_INIT(&this->head);
+    this->listen_source_id = g_unix_fd_add(sockfd, G_IO_IN,
+                                           metrics_exporter_accept, this);
+
+    return this;
+
+err:
+    close(sockfd);
+    return NULL;
+}
+
+void metrics_exporter_free(MetricsExporter *this) {
+    if (!this) {
+        return;
+    }
+
+    while (!QLIST_EMPTY(&this->head)) {
+        metrics_connection_free(QLIST_FIRST(&this->head));
+    }
+
+    if (this->listen_source_id) {
+        g_source_remove(this->listen_source_id);
+    }
+    close(this->socket);
+    unlink(this->path);
+    g_free(this->path);
+    g_free(this);
+}
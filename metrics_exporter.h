@@ -0,0 +1,22 @@
+/*
+ * COLO background daemon OpenMetrics exporter
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef METRICS_EXPORTER_H
+#define METRICS_EXPORTER_H
+
+#include <glib-2.0/glib.h>
+
+// Serves metrics_to_openmetrics() to every connection on a unix socket and
+// closes it. Runs only from the mainloop and never waits for qmp or clients.
+typedef struct MetricsExporter MetricsExporter;
+
+MetricsExporter *metrics_exporter_new(const gchar *path, GError **errp);
+void metrics_exporter_free(MetricsExporter *this);
+
+#endif // METRICS_EXPORTER_H
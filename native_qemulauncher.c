@@ -21,6 +21,7 @@
 #include "formater.h"
 #include "daemon.h"
 #include "json_util.h"
+#include "timer_wheel.h"
 
 #include "coroutine_stack.h"
 #include "qmpexectx.h"
@@ -59,7 +60,8 @@ static int execute_qemu(MyArray *argv, GError **errp) {
     return pid;
 }
 
-static int open_qmp_sockets(QemuLauncher *this, int *qmp_fd, int *qmp_yank_fd, GError **errp) {
+static int open_qmp_sockets(QemuLauncher *this, int *qmp_fd, int *qmp_yank_fd,
+                            int *qmp_health_fd, GError **errp) {
     int ret;
 
     char *qmp_path = formater_qmp_sock(this->base_dir);
@@ -80,6 +82,18 @@ static int open_qmp_sockets(QemuLauncher *this, int *qmp_fd, int *qmp_yank_fd, G
     }
     *qmp_yank_fd = ret;
 
+    char *qmp_health_path = formater_qmp_health_sock(this->base_dir);
+    ret = colod_unix_connect(qmp_health_path, errp);
+    g_free(qmp_health_path);
+    if (ret < 0) {
+        close(*qmp_fd);
+        close(*qmp_yank_fd);
+        *qmp_fd = 0;
+        *qmp_yank_fd = 0;
+        return -1;
+    }
+    *qmp_health_fd = ret;
+
     return 0;
 }
 
@@ -106,10 +120,9 @@ static ColodQmpState *_qemu_launcher_launch_co(Coroutine *coroutine, QemuLaunche
 
     for (CO i = 0; CO i < 100; CO i++) {
         ColodQmpState *qmp;
-        int qmp_fd, qmp_yank_fd;
+        int qmp_fd, qmp_yank_fd, qmp_health_fd;
 
-        guint timeout_source_id = g_timeout_add(100, coroutine->cb, coroutine);
-        g_source_set_name_by_id(timeout_source_id, "reconnect sleep timer");
+        colod_timer_add(100, coroutine->cb, coroutine);
         co_yield_int(G_SOURCE_REMOVE);
 
         ret = waitpid(this->pid, NULL, WNOHANG);
@@ -118,15 +131,19 @@ static ColodQmpState *_qemu_launcher_launch_co(Coroutine *coroutine, QemuLaunche
             return NULL;
         }
 
-        ret = open_qmp_sockets(this, &qmp_fd, &qmp_yank_fd, NULL);
+        ret = open_qmp_sockets(this, &qmp_fd, &qmp_yank_fd,
+                               &qmp_health_fd, NULL);
         if (ret < 0) {
             continue;
         }
 
-        qmp = qmp_new(qmp_fd, qmp_yank_fd, this->qmp_timeout, &CO local_errp);
+        qmp = qmp_new(qmp_commands_get_instance_name(this->commands),
+                      qmp_fd, qmp_yank_fd, qmp_health_fd, this->qmp_timeout,
+                      &CO local_errp);
         if (!qmp) {
             close(qmp_fd);
             close(qmp_yank_fd);
+            close(qmp_health_fd);
             break;
         }
 
@@ -151,7 +168,7 @@ static ColodQmpState *_qemu_launcher_launch_co(Coroutine *coroutine, QemuLaunche
 }
 
 static char *get_disk_size(ColodQmpResult *res, GError **errp) {
-    JsonNode *_array = get_member_node(res->json_root, "return");
+    JsonNode *_array = get_member_node(qmp_result_get_json(res), "return");
 
     assert(JSON_NODE_HOLDS_ARRAY(_array));
     JsonArray *array = json_node_get_array(_array);
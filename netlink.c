@@ -25,6 +25,7 @@
 #include "util.h"
 #include "daemon.h"
 #include "netlink.h"
+#include "poller.h"
 
 struct ColodNetlink {
     struct nl_sock *sock;
@@ -124,7 +125,7 @@ void netlink_free(ColodNetlink *this) {
     colod_callback_clear(&this->callbacks);
 
     if (this->source_id) {
-        g_source_remove(this->source_id);
+        colod_fd_remove(this->source_id);
     }
     nl_socket_free(this->sock);
     g_free(this);
@@ -176,8 +177,8 @@ ColodNetlink *netlink_new(GError **errp) {
     }
 
     int fd = nl_socket_get_fd(sock);
-    this->source_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP,
-                                    netlink_io_watch, this);
+    this->source_id = colod_fd_add(fd, G_IO_IN | G_IO_HUP,
+                                   netlink_io_watch, this);
 
     return this;
 
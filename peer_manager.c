@@ -4,6 +4,9 @@
 #include "peer_manager.h"
 #include "coroutine_stack.h"
 #include "cpg.h"
+#include "client.h"
+#include "json_util.h"
+#include "qmp.h"
 
 typedef struct PeerStatus PeerStatus;
 struct PeerStatus {
@@ -170,7 +173,65 @@ void peer_manager_clear_failover_win(PeerManager *this) {
     }
 }
 
-void peer_manager_shudown(PeerManager *this) {
+static ColodQmpResult *peer_manager_handle_set_peer(G_GNUC_UNUSED Coroutine *coroutine,
+                                                    G_GNUC_UNUSED ColodClient *client,
+                                                    ColodQmpResult *request,
+                                                    gpointer data) {
+    PeerManager *this = data;
+
+    if (!has_member(qmp_result_get_json(request), "peer")) {
+        return client_create_error_reply("Member 'peer' missing");
+    }
+
+    peer_manager_set_peer(this, get_member_str(qmp_result_get_json(request),
+                                               "peer"));
+    return client_create_reply("{}");
+}
+
+static ColodQmpResult *peer_manager_handle_query_peer(G_GNUC_UNUSED Coroutine *coroutine,
+                                                      G_GNUC_UNUSED ColodClient *client,
+                                                      G_GNUC_UNUSED ColodQmpResult *request,
+                                                      gpointer data) {
+    PeerManager *this = data;
+    ColodQmpResult *result;
+
+    gchar *member = g_strdup_printf("{\"peer\": \"%s\"}",
+                                    peer_manager_get_peer(this));
+    result = client_create_reply(member);
+    g_free(member);
+    return result;
+}
+
+static ColodQmpResult *peer_manager_handle_clear_peer(G_GNUC_UNUSED Coroutine *coroutine,
+                                                      G_GNUC_UNUSED ColodClient *client,
+                                                      G_GNUC_UNUSED ColodQmpResult *request,
+                                                      gpointer data) {
+    PeerManager *this = data;
+
+    peer_manager_clear_peer(this);
+    return client_create_reply("{}");
+}
+
+void peer_manager_register_commands(PeerManager *this,
+                                    ColodClientListener *listener) {
+    client_register_command(listener, "set-peer",
+                            peer_manager_handle_set_peer, 0, this);
+    client_register_command(listener, "query-peer",
+                            peer_manager_handle_query_peer, 0, this);
+    client_register_command(listener, "clear-peer",
+                            peer_manager_handle_clear_peer, 0, this);
+    peer_manager_ref(this);
+}
+
+void peer_manager_unregister_commands(PeerManager *this,
+                                      ColodClientListener *listener) {
+    client_unregister_command(listener, "set-peer");
+    client_unregister_command(listener, "query-peer");
+    client_unregister_command(listener, "clear-peer");
+    peer_manager_unref(this);
+}
+
+void peer_manager_stop(PeerManager *this) {
     peer_manager_clear_failover_win(this);
 }
 
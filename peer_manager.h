@@ -23,7 +23,12 @@ gboolean peer_manager_failover(PeerManager *this);
 gboolean peer_manager_shutdown(PeerManager *this);
 int peer_manager_host_map(PeerManager *this, const gchar *json, GError **errp);
 
+void peer_manager_register_commands(PeerManager *this,
+                                    ColodClientListener *listener);
+void peer_manager_unregister_commands(PeerManager *this,
+                                      ColodClientListener *listener);
+
 PeerManager *peer_manager_new(Cpg *cpg);
-void peer_manager_shudown(PeerManager *this);
+void peer_manager_stop(PeerManager *this);
 PeerManager *peer_manager_ref(PeerManager *this);
 void peer_manager_unref(PeerManager *this);
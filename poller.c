@@ -0,0 +1,319 @@
+/*
+ * COLO background daemon epoll backend
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "poller.h"
+#include "util.h"
+#include "daemon.h"
+
+#define POLLER_BATCH 64
+// GIOCondition uses the poll() bits, epoll has the same values
+#define POLLER_EPOLL_EVENTS (G_IO_IN | G_IO_OUT | G_IO_PRI)
+
+struct PollerEntry {
+    int fd;
+    PollerFunc func;
+    gpointer data;
+    PollerPending pending;
+    gpointer pending_data;
+    GIOCondition events;
+    // Mask in the epoll set, only valid if added
+    guint32 registered;
+    gboolean added;
+    // Freed while dispatching, the memory is released afterwards
+    gboolean dead;
+    GIOCondition revents, kernel_revents;
+    PollerEntry *ready_next, *dead_next;
+};
+
+typedef struct Poller {
+    GSource source;
+    int epfd;
+    gpointer tag;
+    // Entries with a pending callback
+    GQueue pending;
+    gboolean dispatching;
+    PollerEntry *dead;
+    GHashTable *fds;
+    guint next_id;
+} Poller;
+
+static Poller *poller = NULL;
+
+static void poller_entry_ctl(PollerEntry *this, int op, guint32 events) {
+    struct epoll_event event = { .events = events, .data.ptr = this };
+    int ret;
+
+    ret = epoll_ctl(poller->epfd, op, this->fd, &event);
+    // Closing the fd already took it out of the epoll set
+    if (ret < 0 && op != EPOLL_CTL_DEL) {
+        log_error_fmt("epoll_ctl() failed: %s", g_strerror(errno));
+        abort();
+    }
+}
+
+PollerEntry *poller_entry_new(int fd, PollerFunc func, gpointer data) {
+    PollerEntry *this = g_new0(PollerEntry, 1);
+
+    assert(poller);
+    this->fd = fd;
+    this->func = func;
+    this->data = data;
+
+    return this;
+}
+
+void poller_entry_set_pending(PollerEntry *this, PollerPending pending,
+                              gpointer data) {
+    if (!this->pending) {
+        g_queue_push_tail(&poller->pending, this);
+    }
+    this->pending = pending;
+    this->pending_data = data;
+}
+
+void poller_entry_set_events(PollerEntry *this, GIOCondition events) {
+    guint32 want = events & POLLER_EPOLL_EVENTS;
+
+    this->events = events;
+    if (!events) {
+        return;
+    }
+
+    if (!this->added) {
+        poller_entry_ctl(this, EPOLL_CTL_ADD, want);
+        this->added = TRUE;
+        this->registered = want;
+    } else if (want & ~this->registered) {
+        poller_entry_ctl(this, EPOLL_CTL_MOD, want);
+        this->registered = want;
+    }
+}
+
+// Drop interest that isn't wanted anymore, now that it caused a wakeup
+static void poller_entry_settle(PollerEntry *this, GIOCondition revents) {
+    guint32 want = this->events & POLLER_EPOLL_EVENTS;
+
+    if (!this->added) {
+        return;
+    }
+
+    // HUP and ERR are always reported, only removing the fd stops them
+    if (!this->events) {
+        poller_entry_ctl(this, EPOLL_CTL_DEL, 0);
+        this->added = FALSE;
+    } else if (revents & ~(this->events | G_IO_HUP | G_IO_ERR)) {
+        poller_entry_ctl(this, EPOLL_CTL_MOD, want);
+        this->registered = want;
+    }
+}
+
+void poller_entry_free(PollerEntry *this) {
+    if (this->added) {
+        poller_entry_ctl(this, EPOLL_CTL_DEL, 0);
+    }
+    if (this->pending) {
+        g_queue_remove(&poller->pending, this);
+    }
+
+    // A later event of the same batch may still point to it
+    if (poller->dispatching) {
+        this->dead = TRUE;
+        this->dead_next = poller->dead;
+        poller->dead = this;
+        return;
+    }
+
+    g_free(this);
+}
+
+static gboolean poller_entry_pending(PollerEntry *this) {
+    return this->events & G_IO_IN && this->pending(this->pending_data);
+}
+
+static gboolean poller_pending_ready() {
+    for (GList *l = poller->pending.head; l; l = l->next) {
+        if (poller_entry_pending(l->data)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean poller_prepare(G_GNUC_UNUSED GSource *source, gint *timeout) {
+    *timeout = -1;
+    return poller_pending_ready();
+}
+
+static gboolean poller_check(GSource *source) {
+    return (g_source_query_unix_fd(source, poller->tag) & G_IO_IN)
+            || poller_pending_ready();
+}
+
+static void poller_ready(PollerEntry ***tail, PollerEntry *entry,
+                         GIOCondition revents) {
+    if (!entry->revents) {
+        entry->ready_next = NULL;
+        **tail = entry;
+        *tail = &entry->ready_next;
+    }
+    entry->revents |= revents;
+}
+
+static gboolean poller_dispatch(G_GNUC_UNUSED GSource *source,
+                                G_GNUC_UNUSED GSourceFunc callback,
+                                G_GNUC_UNUSED gpointer data) {
+    struct epoll_event events[POLLER_BATCH];
+    PollerEntry *head = NULL, **tail = &head;
+    int ret;
+
+    // More ready fds than fit in a batch are picked up on the next iteration
+    ret = epoll_wait(poller->epfd, events, POLLER_BATCH, 0);
+    if (ret < 0 && errno != EINTR) {
+        log_error_fmt("epoll_wait() failed: %s", g_strerror(errno));
+        abort();
+    }
+
+    for (int i = 0; i < ret; i++) {
+        PollerEntry *entry = events[i].data.ptr;
+        GIOCondition revents = events[i].events
+                & (POLLER_EPOLL_EVENTS | G_IO_HUP | G_IO_ERR);
+
+        entry->kernel_revents = revents;
+        poller_ready(&tail, entry, revents);
+    }
+
+    for (GList *l = poller->pending.head; l; l = l->next) {
+        PollerEntry *entry = l->data;
+
+        if (poller_entry_pending(entry)) {
+            poller_ready(&tail, entry, G_IO_IN);
+        }
+    }
+
+    poller->dispatching = TRUE;
+    for (PollerEntry *entry = head; entry; entry = entry->ready_next) {
+        GIOCondition revents = entry->revents;
+        GIOCondition kernel_revents = entry->kernel_revents;
+
+        entry->revents = entry->kernel_revents = 0;
+        if (entry->dead) {
+            continue;
+        }
+
+        entry->func(entry->data, revents);
+        if (!entry->dead && kernel_revents) {
+            poller_entry_settle(entry, kernel_revents);
+        }
+    }
+    poller->dispatching = FALSE;
+
+    while (poller->dead) {
+        PollerEntry *entry = poller->dead;
+        poller->dead = entry->dead_next;
+        g_free(entry);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs poller_source_funcs = {
+    poller_prepare, poller_check, poller_dispatch, NULL, NULL, NULL
+};
+
+typedef struct PollerFd {
+    PollerEntry *entry;
+    int fd;
+    guint id;
+    GUnixFDSourceFunc func;
+    gpointer data;
+} PollerFd;
+
+static void poller_fd_free(gpointer data) {
+    PollerFd *this = data;
+
+    poller_entry_free(this->entry);
+    g_free(this);
+}
+
+static void poller_fd_cb(gpointer data, GIOCondition revents) {
+    PollerFd *this = data;
+    guint id = this->id;
+
+    // func may remove itself, don't touch this afterwards
+    if (!this->func(this->fd, revents, this->data)) {
+        g_hash_table_remove(poller->fds, GUINT_TO_POINTER(id));
+    }
+}
+
+int colod_poller_enable(GError **errp) {
+    int epfd;
+
+    assert(!poller);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        colod_error_set(errp, "Failed to create epoll fd: %s",
+                        g_strerror(errno));
+        return -1;
+    }
+
+    poller = (Poller *) g_source_new(&poller_source_funcs, sizeof(Poller));
+    poller->epfd = epfd;
+    g_queue_init(&poller->pending);
+    poller->fds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        poller_fd_free);
+    poller->tag = g_source_add_unix_fd(&poller->source, epfd, G_IO_IN);
+    g_source_set_name(&poller->source, "epoll poller");
+    g_source_attach(&poller->source, NULL);
+
+    return 0;
+}
+
+gboolean colod_poller_enabled(void) {
+    return !!poller;
+}
+
+guint colod_fd_add(int fd, GIOCondition condition, GUnixFDSourceFunc func,
+                   gpointer data) {
+    PollerFd *this;
+
+    if (!poller) {
+        return g_unix_fd_add(fd, condition, func, data);
+    }
+
+    this = g_new0(PollerFd, 1);
+    this->fd = fd;
+    this->id = ++poller->next_id;
+    this->func = func;
+    this->data = data;
+    this->entry = poller_entry_new(fd, poller_fd_cb, this);
+    // glib reports these even if not asked for
+    poller_entry_set_events(this->entry, condition | G_IO_HUP | G_IO_ERR);
+    g_hash_table_insert(poller->fds, GUINT_TO_POINTER(this->id), this);
+
+    return this->id;
+}
+
+void colod_fd_remove(guint id) {
+    if (!poller) {
+        g_source_remove(id);
+        return;
+    }
+
+    g_hash_table_remove(poller->fds, GUINT_TO_POINTER(id));
+}
@@ -0,0 +1,43 @@
+/*
+ * COLO background daemon epoll backend
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+// Optional epoll backend for fd watches. All fds share one epoll fd, which
+// is the only one of them the main context polls, and readiness is fetched
+// in batches. Dropping interest in a fd is lazy: epoll_ctl() is only called
+// once an unwanted event actually shows up.
+typedef struct PollerEntry PollerEntry;
+typedef void (*PollerFunc)(gpointer data, GIOCondition revents);
+// Data that is already buffered in userspace counts as readable
+typedef gboolean (*PollerPending)(gpointer data);
+
+// Call before any fd is watched, everything is polled by glib otherwise
+int colod_poller_enable(GError **errp);
+gboolean colod_poller_enabled(void);
+
+PollerEntry *poller_entry_new(int fd, PollerFunc func, gpointer data);
+void poller_entry_set_pending(PollerEntry *this, PollerPending pending,
+                              gpointer data);
+// func is called while the fd is ready for events or got HUP/ERR, 0 to stop
+void poller_entry_set_events(PollerEntry *this, GIOCondition events);
+// May be called from func
+void poller_entry_free(PollerEntry *this);
+
+// g_unix_fd_add() that uses the epoll backend if it is enabled. The
+// returned id is only valid for colod_fd_remove().
+guint colod_fd_add(int fd, GIOCondition condition, GUnixFDSourceFunc func,
+                   gpointer data);
+void colod_fd_remove(guint id);
+
+#endif // POLLER_H
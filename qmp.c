@@ -8,6 +8,7 @@
  */
 
 #include <assert.h>
+#include <poll.h>
 
 #include <glib-2.0/glib.h>
 #include <glib-2.0/glib-unix.h>
@@ -19,22 +20,57 @@
 #include "json_util.h"
 #include "coroutine_stack.h"
 #include "daemon.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "qmp_rtt.h"
 
 typedef struct QmpChannel {
     GIOChannel *channel;
+    QmpReader *reader;
+    // Shared by the reader and writer of the channel
+    CoroutineWatch *watch;
+    ColodWriter *writer;
+    // The last line read, pointing into the reader buffer
+    ColodQmpResult current;
     CoroutineLock lock;
     gboolean discard_events;
+    // Fixed read timeout, 0 to adapt to the round-trip time
+    guint timeout;
+    // Replies to commands that stopped waiting for them, qemu still sends
+    // them and they are discarded before the next command
+    guint stale_replies;
 } QmpChannel;
 
+typedef struct ColodWaitState ColodWaitState;
+typedef struct QmpWaitHead {
+    QLIST_HEAD(, ColodWaitState) head;
+} QmpWaitHead;
+
 struct ColodQmpState {
     QmpChannel channel;
     QmpChannel yank_channel;
-    guint timeout;
+    // Optional, only used for health checks
+    QmpChannel health_channel;
+    gboolean has_health_channel;
+    gchar *instance;
+    QmpRtt *rtt;
     JsonNode *yank_instances;
+    // Pre-serialized yank command for the current instances, NULL while
+    // it is refreshed in the background
+    gchar *yank_command;
+    guint64 yank_generation;
+    gboolean yank_refreshing;
+    // No refresh is started while a yank or failover holds it back
+    guint yank_refresh_holds;
     ColodCallbackHead event_callbacks;
+    // event name -> ColodCallbackHead
+    GHashTable *event_subscribers;
+    // event name -> QmpWaitHead
+    GHashTable *event_waiters;
     ColodCallbackHead hup_callbacks;
     guint inflight;
     guint hup_source_id;
+    guint64 events;
 };
 
 void qmp_add_notify_event(ColodQmpState *state, QmpEventCallback _func,
@@ -49,6 +85,29 @@ void qmp_del_notify_event(ColodQmpState *state, QmpEventCallback _func,
     colod_callback_del(&state->event_callbacks, func, user_data);
 }
 
+void qmp_add_notify_event_name(ColodQmpState *state, const gchar *event,
+                               QmpEventCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    ColodCallbackHead *head;
+
+    head = g_hash_table_lookup(state->event_subscribers, event);
+    if (!head) {
+        head = g_new0(ColodCallbackHead, 1);
+        g_hash_table_insert(state->event_subscribers, g_strdup(event), head);
+    }
+    colod_callback_add(head, func, user_data);
+}
+
+void qmp_del_notify_event_name(ColodQmpState *state, const gchar *event,
+                               QmpEventCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    ColodCallbackHead *head;
+
+    head = g_hash_table_lookup(state->event_subscribers, event);
+    assert(head);
+    colod_callback_del(head, func, user_data);
+}
+
 void qmp_add_notify_hup(ColodQmpState *state, QmpYankCallback _func,
                         gpointer user_data) {
     ColodCallbackFunc func = (ColodCallbackFunc) _func;
@@ -61,14 +120,61 @@ void qmp_del_notify_hup(ColodQmpState *state, QmpYankCallback _func,
     colod_callback_del(&state->hup_callbacks, func, user_data);
 }
 
-static void notify_event(ColodQmpState *state, ColodQmpResult *result) {
+static void colod_callback_head_free(gpointer data) {
+    ColodCallbackHead *head = data;
+
+    colod_callback_clear(head);
+    g_free(head);
+}
+
+static void notify_callbacks(ColodCallbackHead *head, ColodQmpResult *result) {
     ColodCallback *entry, *next_entry;
-    QLIST_FOREACH_SAFE(entry, &state->event_callbacks, next, next_entry) {
+    QLIST_FOREACH_SAFE(entry, head, next, next_entry) {
         QmpEventCallback func = (QmpEventCallback) entry->func;
         func(entry->user_data, result);
     }
 }
 
+static void notify_waiters(ColodQmpState *state, ColodQmpResult *result);
+static void qmp_yank_invalidate(ColodQmpState *state);
+static void qmp_yank_refresh_start(ColodQmpState *state);
+static void notify_event(ColodQmpState *state, ColodQmpResult *result) {
+    const gchar *event = qmp_result_get_event(result);
+    ColodCallbackHead *head;
+
+    notify_callbacks(&state->event_callbacks, result);
+
+    if (!event) {
+        return;
+    }
+
+    head = g_hash_table_lookup(state->event_subscribers, event);
+    if (head) {
+        notify_callbacks(head, result);
+    }
+    notify_waiters(state, result);
+}
+
+// Whether anybody is interested in this event at all
+static gboolean event_subscribed(ColodQmpState *state, ColodQmpResult *result) {
+    const gchar *event;
+    ColodCallbackHead *head;
+    QmpWaitHead *waiters;
+
+    if (!QLIST_EMPTY(&state->event_callbacks)) {
+        return TRUE;
+    }
+
+    event = qmp_result_get_event(result);
+    if (!event) {
+        return FALSE;
+    }
+
+    head = g_hash_table_lookup(state->event_subscribers, event);
+    waiters = g_hash_table_lookup(state->event_waiters, event);
+    return (head && !QLIST_EMPTY(head)) || (waiters && !QLIST_EMPTY(&waiters->head));
+}
+
 static void notify_hup(ColodQmpState *state) {
     ColodCallback *entry, *next_entry;
     QLIST_FOREACH_SAFE(entry, &state->hup_callbacks, next, next_entry) {
@@ -109,33 +215,217 @@ ColodQmpResult *qmp_parse_result(gchar *line, gsize len, GError **errp) {
     return result;
 }
 
+JsonNode *qmp_result_get_json(ColodQmpResult *result) {
+    GError *local_errp = NULL;
+
+    if (result->json_root) {
+        return result->json_root;
+    }
+
+    result->json_root = json_from_string(result->line, &local_errp);
+    if (!result->json_root || !JSON_NODE_HOLDS_OBJECT(result->json_root)) {
+        if (local_errp) {
+            log_error_fmt("Failed to parse qmp result: %s", local_errp->message);
+            g_error_free(local_errp);
+        }
+        if (result->json_root) {
+            json_node_unref(result->json_root);
+        }
+        result->json_root = json_from_string("{}", NULL);
+    }
+
+    return result->json_root;
+}
+
+const gchar *qmp_result_get_event(ColodQmpResult *result) {
+    if (!result->fields.valid) {
+        JsonNode *json = qmp_result_get_json(result);
+        return has_member(json, "event") ? get_member_str(json, "event") : NULL;
+    }
+
+    return result->fields.has_event ? result->fields.event : NULL;
+}
+
+gboolean qmp_result_is_event(ColodQmpResult *result) {
+    return !!qmp_result_get_event(result);
+}
+
+gboolean qmp_result_is_error(ColodQmpResult *result) {
+    if (!result->fields.valid) {
+        return has_member(qmp_result_get_json(result), "error");
+    }
+
+    return result->fields.has_error;
+}
+
+const gchar *qmp_result_get_id(ColodQmpResult *result) {
+    if (!result->fields.valid) {
+        JsonNode *json = qmp_result_get_json(result);
+        return has_member(json, "id") ? get_member_str(json, "id") : NULL;
+    }
+
+    return result->fields.has_id ? result->fields.id : NULL;
+}
+
+const gchar *qmp_result_get_data_str(ColodQmpResult *result,
+                                     const gchar *member) {
+    JsonObject *object = json_node_get_object(qmp_result_get_json(result));
+    JsonNode *node;
+
+    node = json_object_get_member(object, "data");
+    if (!node || !JSON_NODE_HOLDS_OBJECT(node)) {
+        return NULL;
+    }
+
+    object = json_node_get_object(node);
+    node = json_object_get_member(object, member);
+    if (!node || json_node_get_value_type(node) != G_TYPE_STRING) {
+        return NULL;
+    }
+
+    return json_node_get_string(node);
+}
+
+const gchar *qmp_result_get_status(ColodQmpResult *result) {
+    if (!result->fields.valid) {
+        return qmp_result_get_data_str(result, "status");
+    }
+
+    return result->fields.has_status ? result->fields.status : NULL;
+}
+
+static ColodQmpResult *qmp_result_copy(ColodQmpResult *result) {
+    ColodQmpResult *copy = g_new0(ColodQmpResult, 1);
+
+    copy->line = g_strndup(result->line, result->len);
+    copy->len = result->len;
+    copy->did_yank = result->did_yank;
+    copy->fields = result->fields;
+    if (result->json_root) {
+        copy->json_root = json_node_ref(result->json_root);
+    }
+
+    return copy;
+}
+
+static void qmp_channel_clear_current(QmpChannel *channel) {
+    if (channel->current.json_root) {
+        json_node_unref(channel->current.json_root);
+    }
+    memset(&channel->current, 0, sizeof(channel->current));
+}
+
+static void qmp_trace_result(QmpChannel *channel, ColodQmpResult *result) {
+    const gchar *event = qmp_result_get_event(result);
+
+    if (!event) {
+        colod_trace("%s", result->line);
+    } else if (strcmp(event, "MIGRATION_PASS") && !channel->discard_events) {
+        colod_trace("%s", result->line);
+    }
+}
+
+// Returns the next result read from the channel. It is owned by the channel
+// and stays valid until the next read.
+#define qmp_channel_read_co(...) \
+    co_wrap(_qmp_channel_read_co(__VA_ARGS__))
+static ColodQmpResult *_qmp_channel_read_co(Coroutine *coroutine,
+                                            ColodQmpState *state,
+                                            QmpChannel *channel,
+                                            guint timeout,
+                                            GError **errp) {
+    struct {
+        guint timeout_id;
+    } *co;
+    ColodQmpResult *current = &channel->current;
+    gchar *line;
+    gsize len;
+    int ret;
+
+    timeout = colod_deadline_clamp(coroutine, timeout);
+    co_frame(co, sizeof(*co));
+    co_begin(ColodQmpResult *, NULL);
+
+    qmp_channel_clear_current(channel);
+
+    if (timeout) {
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
+    }
+
+    while (TRUE) {
+        ret = qmp_reader_next(channel->reader, &line, &len, errp);
+        if (ret < 0) {
+            goto err;
+        } else if (ret > 0) {
+            break;
+        }
+
+        colod_watch_arm(channel->watch, coroutine, G_IO_IN,
+                        G_PRIORITY_DEFAULT);
+        co_yield_int(G_SOURCE_REMOVE);
+
+        if (colod_watch_woken(channel->watch, coroutine)) {
+            continue;
+        }
+        if (timeout && colod_timer_current() == CO timeout_id) {
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
+                        "Channel read timed out");
+            goto err;
+        }
+        colod_trace("%s:%u: Got woken by unknown source\n",
+                    __func__, __LINE__);
+    }
+
+    if (timeout) {
+        colod_timer_remove(CO timeout_id);
+    }
+
+    current->line = line;
+    current->len = len;
+    if (qmp_scan_fields(line, len, &current->fields) < 0) {
+        colod_error_set(errp, "Result is not a json object: %s", line);
+        return NULL;
+    }
+    if (!channel->discard_events && qmp_result_is_event(current)) {
+        state->events++;
+    }
+
+    co_end;
+
+    return current;
+
+err:
+    if (timeout) {
+        colod_timer_remove(CO timeout_id);
+    }
+
+    return NULL;
+}
+
 #define qmp_read_line_co(...) \
     co_wrap(_qmp_read_line_co(__VA_ARGS__))
 static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
                                          ColodQmpState *state,
                                          QmpChannel *channel,
+                                         guint timeout,
                                          gboolean yank,
                                          gboolean skip_events,
                                          GError **errp) {
-    struct {
-        gchar *line;
-        gsize len;
-    } *co;
     ColodQmpResult *result;
     int ret;
     GError *local_errp = NULL;
 
-    co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
     while (TRUE) {
-        co_recurse(ret = colod_channel_read_line_timeout_co(coroutine,
-                            channel->channel, &CO line, &CO len,
-                            state->timeout, &local_errp));
-        if (ret < 0) {
+        co_recurse(result = qmp_channel_read_co(coroutine, state, channel,
+                                                timeout, &local_errp));
+        if (!result) {
             log_error(local_errp->message);
             if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT)) {
-                if (yank) {
+                // qemu isn't hanging if it's only the operation that ran
+                // out of time. The caller counts the reply as stale.
+                if (yank && !colod_deadline_expired(coroutine)) {
                     g_error_free(local_errp);
                     local_errp = NULL;
 
@@ -146,7 +436,8 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
                         return NULL;
                     }
                     co_recurse(result = qmp_read_line_co(coroutine, state, channel,
-                                                         FALSE, skip_events, errp));
+                                                         timeout, FALSE,
+                                                         skip_events, errp));
                     if (result) {
                         result->did_yank = TRUE;
                     }
@@ -157,31 +448,16 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
             return NULL;
         }
 
-        result = qmp_parse_result(CO line, CO len, &local_errp);
-        if (!result) {
-            log_error(local_errp->message);
-            g_propagate_error(errp, local_errp);
-            return NULL;
-        }
+        qmp_trace_result(channel, result);
 
-        if (has_member(result->json_root, "event")) {
-            if (!object_matches_json(result->json_root, "{'event': 'MIGRATION_PASS'}")
-                    && !channel->discard_events) {
-                colod_trace("%s", result->line);
+        if (skip_events && qmp_result_is_event(result)) {
+            if (channel->discard_events || !event_subscribed(state, result)) {
+                continue;
             }
-        } else {
-            colod_trace("%s", result->line);
-        }
 
-        if (skip_events && has_member(result->json_root, "event")) {
-            if (!channel->discard_events) {
-                notify_event(state, result);
-            }
-            qmp_result_free(result);
-            if (!channel->discard_events) {
-                g_idle_add(coroutine->cb, coroutine);
-                co_yield_int(G_SOURCE_REMOVE);
-            }
+            notify_event(state, result);
+            g_idle_add(coroutine->cb, coroutine);
+            co_yield_int(G_SOURCE_REMOVE);
             continue;
         }
 
@@ -190,28 +466,158 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
 
     co_end;
 
-    return result;
+    return qmp_result_copy(result);
+}
+
+static QmpRttClass qmp_channel_class(ColodQmpState *state,
+                                     QmpChannel *channel) {
+    if (channel == &state->yank_channel) {
+        return QMP_RTT_YANK;
+    } else if (channel == &state->health_channel) {
+        return QMP_RTT_HEALTH;
+    }
+
+    return QMP_RTT_COMMAND;
+}
+
+// Queries only read state, they are answered faster than most commands
+static QmpRttClass qmp_command_class(ColodQmpState *state, QmpChannel *channel,
+                                     const gchar *command) {
+    QmpRttClass class = qmp_channel_class(state, channel);
+    QmpFields fields;
+
+    if (class == QMP_RTT_COMMAND
+            && !qmp_scan_fields(command, strlen(command), &fields)
+            && fields.valid && fields.has_execute
+            && g_str_has_prefix(fields.execute, "query-")) {
+        return QMP_RTT_QUERY;
+    }
+
+    return class;
+}
+
+static guint qmp_class_timeout(ColodQmpState *state, QmpChannel *channel,
+                               QmpRttClass class) {
+    if (channel->timeout) {
+        return channel->timeout;
+    }
+
+    return qmp_rtt_timeout(state->rtt, class);
+}
+
+static guint qmp_channel_timeout(ColodQmpState *state, QmpChannel *channel) {
+    return qmp_class_timeout(state, channel, qmp_channel_class(state, channel));
+}
+
+// Commands that may add or remove yank instances
+static const gchar *qmp_yank_changing_commands[] = {
+    "migrate", "migrate-incoming", "migrate_cancel", "blockdev-add",
+    "blockdev-del", "x-blockdev-change", "chardev-add", "chardev-change",
+    "chardev-remove", "object-add", "object-del"
+};
+
+static void qmp_command_done(ColodQmpState *state, const gchar *command,
+                             gint64 start) {
+    QmpFields fields;
+    const gchar *name = "unknown";
+
+    if (!qmp_scan_fields(command, strlen(command), &fields)
+            && fields.valid && fields.has_execute) {
+        name = fields.execute;
+    }
+
+    metrics_observe_since(metrics_instance_histogram(state->instance,
+                                                     "qmp_command", "command",
+                                                     name),
+                          start);
+
+    for (guint i = 0; i < G_N_ELEMENTS(qmp_yank_changing_commands); i++) {
+        if (!strcmp(name, qmp_yank_changing_commands[i])) {
+            qmp_yank_invalidate(state);
+            break;
+        }
+    }
+}
+
+// Read away the replies of commands that timed out, else the next command
+// would take the reply of an earlier one
+#define qmp_channel_drain_co(...) co_wrap(_qmp_channel_drain_co(__VA_ARGS__))
+static int _qmp_channel_drain_co(Coroutine *coroutine, ColodQmpState *state,
+                                 QmpChannel *channel, gboolean yank,
+                                 GError **errp) {
+    ColodQmpResult *result;
+
+    co_begin(int, -1);
+
+    while (channel->stale_replies) {
+        co_recurse(result = qmp_read_line_co(coroutine, state, channel,
+                                             qmp_channel_timeout(state, channel),
+                                             yank, TRUE, errp));
+        if (!result) {
+            return -1;
+        }
+
+        colod_trace("%s:%u: Discarding stale reply\n", __func__, __LINE__);
+        qmp_result_free(result);
+        channel->stale_replies--;
+    }
+
+    co_end;
+
+    return 0;
+}
+
+static void qmp_trace_deadline(Coroutine *coroutine) {
+    if (coroutine->deadline) {
+        colod_trace("%u ms left until the deadline: ",
+                    colod_deadline_remaining_ms(coroutine));
+    }
 }
 
 #define qmp_execute_rec_co(...) co_wrap(_qmp_execute_rec_co(__VA_ARGS__))
 static ColodQmpResult *_qmp_execute_rec_co(Coroutine *coroutine,
                                            ColodQmpState *state,
                                            QmpChannel *channel,
+                                           QmpPriority priority,
                                            gboolean yank,
                                            GError **errp,
                                            const gchar *command) {
+    struct {
+        gint64 start, sent;
+        QmpRttClass class;
+    } *co;
     ColodQmpResult *result;
     int ret;
     GError *local_errp = NULL;
 
+    co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
+    CO start = g_get_monotonic_time();
+    CO class = qmp_command_class(state, channel, command);
     state->inflight++;
-    colod_lock_co(channel->lock);
+    colod_lock_cancellable_co(channel->lock, priority, ret);
+    if (ret < 0) {
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_CANCELLED,
+                    "qmp: Cancelled before sending: %s", command);
+        state->inflight--;
+        return NULL;
+    }
+    co_recurse(ret = qmp_channel_drain_co(coroutine, state, channel, yank,
+                                          &local_errp));
+    if (ret < 0) {
+        g_propagate_prefixed_error(errp, local_errp, "qmp: ");
+        colod_unlock_co(channel->lock);
+        state->inflight--;
+        return NULL;
+    }
+    qmp_trace_deadline(coroutine);
     colod_trace("%s", command);
-    co_recurse(ret = colod_channel_write_timeout_co(coroutine, channel->channel,
-                                   command, strlen(command), state->timeout,
-                                   &local_errp));
+    co_recurse(ret = colod_writer_write_co(coroutine, channel->writer,
+                                           command, strlen(command),
+                                           qmp_class_timeout(state, channel,
+                                                             CO class),
+                                           &local_errp));
     if (ret < 0) {
         log_error(local_errp->message);
         g_propagate_prefixed_error(errp, local_errp, "qmp: ");
@@ -220,35 +626,59 @@ static ColodQmpResult *_qmp_execute_rec_co(Coroutine *coroutine,
         return NULL;
     }
 
-    co_recurse(result = qmp_read_line_co(coroutine, state, channel, yank, TRUE,
-                                         &local_errp));
+    CO sent = g_get_monotonic_time();
+    co_recurse(result = qmp_read_line_co(coroutine, state, channel,
+                                         qmp_class_timeout(state, channel,
+                                                           CO class),
+                                         yank, TRUE, &local_errp));
+    if (!result && g_error_matches(local_errp, COLOD_ERROR,
+                                   COLOD_ERROR_TIMEOUT)) {
+        channel->stale_replies++;
+    }
     colod_unlock_co(channel->lock);
     state->inflight--;
+    qmp_command_done(state, command, CO start);
     if (!result) {
         g_propagate_prefixed_error(errp, local_errp, "qmp: ");
         return NULL;
     }
+    if (!result->did_yank) {
+        qmp_rtt_sample(state->rtt, CO class, g_get_monotonic_time() - CO sent);
+    }
 
     co_end;
 
     return result;
 }
 
-ColodQmpResult *_qmp_execute_co(Coroutine *coroutine,
-                                ColodQmpState *state,
-                                GError **errp,
-                                const gchar *command) {
+// Health checks go to their own channel if qemu has one, so they neither
+// wait behind nor delay anything on the main channel
+static QmpChannel *qmp_priority_channel(ColodQmpState *state,
+                                        QmpPriority priority) {
+    if (priority == QMP_PRIORITY_WATCHDOG && state->has_health_channel) {
+        return &state->health_channel;
+    }
+
+    return &state->channel;
+}
+
+ColodQmpResult *_qmp_execute_prio_co(Coroutine *coroutine,
+                                     ColodQmpState *state,
+                                     QmpPriority priority,
+                                     GError **errp,
+                                     const gchar *command) {
     ColodQmpResult *result;
 
-    result = _qmp_execute_rec_co(coroutine, state, &state->channel, TRUE, errp,
-                                 command);
+    result = _qmp_execute_rec_co(coroutine, state,
+                                 qmp_priority_channel(state, priority),
+                                 priority, TRUE, errp, command);
     if (coroutine->yield) {
         return NULL;
     }
     if (!result) {
         return NULL;
     }
-    if (has_member(result->json_root, "error")) {
+    if (qmp_result_is_error(result)) {
         g_set_error(errp, COLOD_ERROR, COLOD_ERROR_QMP,
                     "qmp command returned error: %s %s",
                     command, result->line);
@@ -259,12 +689,317 @@ ColodQmpResult *_qmp_execute_co(Coroutine *coroutine,
     return result;
 }
 
+ColodQmpResult *_qmp_execute_co(Coroutine *coroutine,
+                                ColodQmpState *state,
+                                GError **errp,
+                                const gchar *command) {
+    return _qmp_execute_prio_co(coroutine, state, QMP_PRIORITY_STATE, errp,
+                                command);
+}
+
+ColodQmpResult *_qmp_execute_nocheck_prio_co(Coroutine *coroutine,
+                                             ColodQmpState *state,
+                                             QmpPriority priority,
+                                             GError **errp,
+                                             const gchar *command) {
+    return _qmp_execute_rec_co(coroutine, state,
+                               qmp_priority_channel(state, priority),
+                               priority, TRUE, errp, command);
+}
+
 ColodQmpResult *_qmp_execute_nocheck_co(Coroutine *coroutine,
                                         ColodQmpState *state,
                                         GError **errp,
                                         const gchar *command) {
-    return _qmp_execute_rec_co(coroutine, state, &state->channel, TRUE, errp,
-                               command);
+    return _qmp_execute_nocheck_prio_co(coroutine, state, QMP_PRIORITY_STATE,
+                                        errp, command);
+}
+
+guint qmp_cancel_queued(ColodQmpState *state, QmpPriority below) {
+    return colod_lock_cancel(&state->channel.lock, below);
+}
+
+struct QmpBatch {
+    MyArray *commands;
+    gchar *str;
+    gsize len;
+};
+
+static void qmp_batch_free(gpointer data) {
+    QmpBatch *batch = data;
+
+    my_array_unref(batch->commands);
+    g_free(batch->str);
+}
+
+// Tag each command with its index, so replies can be matched in order
+static QmpBatch *qmp_batch_build(MyArray *commands) {
+    QmpBatch *batch = g_rc_box_new0(QmpBatch);
+    GString *str = g_string_new(NULL);
+
+    for (int i = 0; i < commands->size; i++) {
+        const gchar *brace = strchr(commands->array[i], '{');
+        assert(brace);
+
+        g_string_append_printf(str, "{'id': 'colod%i', ", i);
+        g_string_append(str, brace + 1);
+    }
+
+    batch->commands = my_array_ref(commands);
+    batch->len = str->len;
+    batch->str = g_string_free(str, FALSE);
+    return batch;
+}
+
+// The tag is inserted as the first member, so the command has to have
+// members and no id of its own. Out-of-band commands may overtake the
+// others, their replies would come out of order.
+static gboolean qmp_command_taggable(const gchar *command) {
+    QmpFields fields;
+
+    if (qmp_scan_fields(command, strlen(command), &fields) < 0) {
+        return FALSE;
+    }
+
+    return fields.has_execute && !fields.has_oob && !fields.has_id;
+}
+
+gboolean qmp_batch_supported(MyArray *commands) {
+    for (int i = 0; i < commands->size; i++) {
+        if (!qmp_command_taggable(commands->array[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+QmpBatch *qmp_batch_new(MyArray *commands, GError **errp) {
+    for (int i = 0; i < commands->size; i++) {
+        const gchar *command = commands->array[i];
+        GError *local_errp = NULL;
+
+        JsonNode *json = json_from_string(command, &local_errp);
+        if (!json) {
+            g_propagate_prefixed_error(errp, local_errp,
+                                       "Invalid command %s: ", command);
+            return NULL;
+        }
+
+        gboolean object = JSON_NODE_HOLDS_OBJECT(json);
+        json_node_unref(json);
+        if (!object) {
+            colod_error_set(errp, "Command is not an object: %s", command);
+            return NULL;
+        }
+
+        if (!qmp_command_taggable(command)) {
+            colod_error_set(errp, "Command can't be batched, it has an id, "
+                            "is out-of-band or doesn't execute anything: %s",
+                            command);
+            return NULL;
+        }
+    }
+
+    return qmp_batch_build(commands);
+}
+
+QmpBatch *qmp_batch_ref(QmpBatch *batch) {
+    return g_rc_box_acquire(batch);
+}
+
+void qmp_batch_unref(QmpBatch *batch) {
+    g_rc_box_release_full(batch, qmp_batch_free);
+}
+
+MyArray *qmp_batch_get_commands(QmpBatch *batch) {
+    return batch->commands;
+}
+
+// The index of the batched command a reply is for, -1 if it isn't a reply
+// to a batch
+static int qmp_result_batch_index(ColodQmpResult *result) {
+    const gchar *result_id = qmp_result_get_id(result);
+    gchar *end;
+    gint64 index;
+
+    if (!result_id || !g_str_has_prefix(result_id, "colod")) {
+        return -1;
+    }
+
+    index = g_ascii_strtoll(result_id + strlen("colod"), &end, 10);
+    if (end == result_id + strlen("colod") || *end || index < 0
+            || index > G_MAXINT) {
+        return -1;
+    }
+
+    return index;
+}
+
+// Read away the replies still outstanding after one came out of order, up to
+// the reply of the last command. Whatever doesn't arrive is left stale.
+#define qmp_batch_drain_co(...) co_wrap(_qmp_batch_drain_co(__VA_ARGS__))
+static int _qmp_batch_drain_co(Coroutine *coroutine, ColodQmpState *state,
+                               QmpChannel *channel, int size, int next) {
+    struct {
+        int next;
+    } *co;
+    ColodQmpResult *result;
+    GError *local_errp = NULL;
+    int index;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    CO next = next;
+    while (CO next < size) {
+        co_recurse(result = qmp_read_line_co(coroutine, state, channel,
+                                             qmp_channel_timeout(state, channel),
+                                             TRUE, TRUE, &local_errp));
+        if (!result) {
+            g_error_free(local_errp);
+            channel->stale_replies += size - CO next;
+            return -1;
+        }
+
+        index = qmp_result_batch_index(result);
+        if (index >= CO next) {
+            CO next = index + 1;
+        }
+        colod_trace("%s:%u: Discarding %s\n", __func__, __LINE__,
+                    result->line);
+        qmp_result_free(result);
+    }
+
+    co_end;
+
+    return 0;
+}
+
+// commands is only used if batch is NULL
+static MyArray *_qmp_execute_batch_co(Coroutine *coroutine, ColodQmpState *state,
+                                      QmpPriority priority, MyArray *commands,
+                                      QmpBatch *batch, GError **errp) {
+    struct {
+        MyArray *results;
+        QmpBatch *batch;
+        gint64 start, sent;
+        int i, size;
+        QmpRttClass class;
+    } *co;
+    QmpChannel *channel = qmp_priority_channel(state, priority);
+    ColodQmpResult *result;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_frame(co, sizeof(*co));
+    co_begin(MyArray *, NULL);
+
+    CO results = my_array_new((GDestroyNotify) qmp_result_free);
+    if (batch) {
+        CO batch = qmp_batch_ref(batch);
+    } else {
+        assert(qmp_batch_supported(commands));
+        CO batch = qmp_batch_build(commands);
+    }
+
+    state->inflight++;
+    colod_lock_cancellable_co(channel->lock, priority, ret);
+    if (ret < 0) {
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_CANCELLED,
+                    "qmp: Cancelled before sending: %s", CO batch->str);
+        qmp_batch_unref(CO batch);
+        state->inflight--;
+        return CO results;
+    }
+    co_recurse(ret = qmp_channel_drain_co(coroutine, state, channel, TRUE,
+                                          &local_errp));
+    if (ret < 0) {
+        g_propagate_prefixed_error(errp, local_errp, "qmp: ");
+        colod_unlock_co(channel->lock);
+        qmp_batch_unref(CO batch);
+        state->inflight--;
+        return CO results;
+    }
+    CO start = g_get_monotonic_time();
+    qmp_trace_deadline(coroutine);
+    colod_trace("%s", CO batch->str);
+    co_recurse(ret = colod_writer_write_co(coroutine, channel->writer,
+                                           CO batch->str, CO batch->len,
+                                           qmp_channel_timeout(state, channel),
+                                           &local_errp));
+    if (ret < 0) {
+        log_error(local_errp->message);
+        g_propagate_prefixed_error(errp, local_errp, "qmp: ");
+        colod_unlock_co(channel->lock);
+        qmp_batch_unref(CO batch);
+        state->inflight--;
+        return CO results;
+    }
+
+    CO sent = g_get_monotonic_time();
+    CO size = CO batch->commands->size;
+    for (CO i = 0; CO i < CO size; CO i++) {
+        CO class = qmp_command_class(state, channel,
+                                     CO batch->commands->array[CO i]);
+        co_recurse(result = qmp_read_line_co(coroutine, state, channel,
+                                             qmp_class_timeout(state, channel,
+                                                               CO class),
+                                             TRUE, TRUE, &local_errp));
+        qmp_command_done(state, CO batch->commands->array[CO i], CO start);
+        if (!result) {
+            // The replies still come, the next command discards them
+            channel->stale_replies += CO size - CO i;
+            g_propagate_prefixed_error(errp, local_errp, "qmp: ");
+            break;
+        }
+        if (qmp_result_batch_index(result) != CO i) {
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
+                        "qmp: Reply out of order for %s: %s",
+                        (gchar *) CO batch->commands->array[CO i],
+                        result->line);
+            // Unless the reply is for a later command, ours is still to come
+            CO i = MAX(qmp_result_batch_index(result) + 1, CO i);
+            qmp_result_free(result);
+            // Leave the channel in step for the next command
+            co_recurse(qmp_batch_drain_co(coroutine, state, channel,
+                                          CO size, CO i));
+            break;
+        }
+        // Only the first reply is a clean round trip, the later ones also
+        // waited for qemu to read them from the socket behind the others
+        if (CO i == 0 && !result->did_yank) {
+            qmp_rtt_sample(state->rtt, CO class,
+                           g_get_monotonic_time() - CO sent);
+        }
+        my_array_append(CO results, result);
+    }
+    colod_unlock_co(channel->lock);
+    qmp_batch_unref(CO batch);
+    state->inflight--;
+
+    co_end;
+
+    return CO results;
+}
+
+MyArray *_qmp_execute_batch_prio_co(Coroutine *coroutine, ColodQmpState *state,
+                                    QmpPriority priority, QmpBatch *batch,
+                                    GError **errp) {
+    return _qmp_execute_batch_co(coroutine, state, priority, NULL, batch, errp);
+}
+
+MyArray *_qmp_execute_array_prio_co(Coroutine *coroutine, ColodQmpState *state,
+                                    QmpPriority priority, MyArray *commands,
+                                    GError **errp) {
+    return _qmp_execute_batch_co(coroutine, state, priority, commands, NULL,
+                                 errp);
+}
+
+MyArray *_qmp_execute_array_co(Coroutine *coroutine, ColodQmpState *state,
+                               MyArray *commands, GError **errp) {
+    return _qmp_execute_array_prio_co(coroutine, state, QMP_PRIORITY_STATE,
+                                      commands, errp);
 }
 
 static gchar *pick_yank_instances(JsonNode *result,
@@ -298,49 +1033,70 @@ static gchar *pick_yank_instances(JsonNode *result,
     return output_str;
 }
 
-int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state,
-                 GError **errp) {
+static gchar *qmp_yank_command(ColodQmpState *state, ColodQmpResult *result) {
+    gchar *instances = pick_yank_instances(qmp_result_get_json(result),
+                                           state->yank_instances);
+    gchar *command = g_strdup_printf("{'exec-oob': 'yank', 'id': 'yank0', "
+                                            "'arguments':{ 'instances': %s }}\n",
+                                     instances);
+    g_free(instances);
+    return command;
+}
+
+#define qmp_do_yank_co(...) co_wrap(_qmp_do_yank_co(__VA_ARGS__))
+static int _qmp_do_yank_co(Coroutine *coroutine, ColodQmpState *state,
+                           gboolean cached, GError **errp) {
     struct {
         gchar *command;
+        guint64 generation;
     } *co;
     ColodQmpResult *result;
 
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    co_recurse(result = qmp_execute_rec_co(coroutine, state, &state->yank_channel,
-                                           FALSE, errp,
-                                           "{'exec-oob': 'query-yank', 'id': 'yank0'}\n"));
-    if (!result) {
-        return -1;
-    }
-    if (has_member(result->json_root, "error")) {
-        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
-                    "qmp query-yank: %s", result->line);
+    if (cached && state->yank_command) {
+        CO command = g_strdup(state->yank_command);
+    } else {
+        CO generation = state->yank_generation;
+        co_recurse(result = qmp_execute_rec_co(coroutine, state, &state->yank_channel,
+                                               QMP_PRIORITY_FAILOVER, FALSE, errp,
+                                               "{'exec-oob': 'query-yank', 'id': 'yank0'}\n"));
+        if (!result) {
+            return -1;
+        }
+        if (qmp_result_is_error(result)) {
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
+                        "qmp query-yank: %s", result->line);
+            qmp_result_free(result);
+            return -1;
+        }
+
+        CO command = qmp_yank_command(state, result);
         qmp_result_free(result);
-        return -1;
-    }
 
-    gchar *instances = pick_yank_instances(result->json_root, state->yank_instances);
-    CO command = g_strdup_printf("{'exec-oob': 'yank', 'id': 'yank0', "
-                                        "'arguments':{ 'instances': %s }}\n",
-                                 instances);
-    g_free(instances);
-    qmp_result_free(result);
+        // Spares the refresh once the yank is done
+        if (CO generation == state->yank_generation && !state->yank_command) {
+            state->yank_command = g_strdup(CO command);
+        }
+    }
 
     co_recurse(result = qmp_execute_rec_co(coroutine, state, &state->yank_channel,
-                                           FALSE, errp, CO command));
+                                           QMP_PRIORITY_FAILOVER, FALSE, errp, CO command));
     if (!result) {
         g_free(CO command);
         return -1;
     }
-    if (has_member(result->json_root, "error")) {
-        const char *class = get_member_member_str(result->json_root, "error", "class");
+    if (qmp_result_is_error(result)) {
+        const char *class = get_member_member_str(qmp_result_get_json(result),
+                                                  "error", "class");
         if (!strcmp(class, "DeviceNotFound")) {
+            g_free(state->yank_command);
+            state->yank_command = NULL;
             g_free(CO command);
             qmp_result_free(result);
             int ret;
-            co_recurse(ret = qmp_yank_co(coroutine, state, errp))
+            co_recurse(ret = qmp_do_yank_co(coroutine, state, FALSE, errp));
             return ret;
         }
         g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
@@ -358,12 +1114,49 @@ int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state,
     return 0;
 }
 
+int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state, GError **errp) {
+    struct {
+        gint64 start, deadline;
+    } *co;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    CO start = g_get_monotonic_time();
+    // Yank is what gets a hanging qemu going again, it has to run even if
+    // the operation that needs it is out of time
+    CO deadline = coroutine->deadline;
+    colod_deadline_restore(coroutine, 0);
+    qmp_hold_yank_refresh(state);
+    co_recurse(ret = qmp_do_yank_co(coroutine, state, TRUE, errp));
+    qmp_release_yank_refresh(state);
+    colod_deadline_restore(coroutine, CO deadline);
+    metrics_observe_since(metrics_instance_histogram(state->instance,
+                                                     "qmp_yank", NULL, NULL),
+                          CO start);
+    metrics_inc(metrics_instance_counter(state->instance, "yanks", NULL, NULL),
+                1);
+
+    co_end;
+
+    return ret;
+}
+
 typedef struct QmpCoroutine {
     Coroutine coroutine;
     ColodQmpState *state;
     QmpChannel *channel;
 } QmpCoroutine;
 
+// qmp_capabilities may yank, which recurses into another execute
+static CoroutineType qmp_handshake_coroutine_type =
+    COROUTINE_POOL("qmp handshake", QmpCoroutine, 16);
+static CoroutineType qmp_event_coroutine_type =
+    COROUTINE_POOL("qmp event", QmpCoroutine, 4);
+static CoroutineType qmp_yank_refresh_coroutine_type =
+    COROUTINE_POOL("qmp yank refresh", QmpCoroutine, 8);
+
 static gboolean _qmp_handshake_readable_co(Coroutine *coroutine);
 static gboolean qmp_handshake_readable_co(gpointer data) {
     QmpCoroutine *qmpco = data;
@@ -377,7 +1170,7 @@ static gboolean qmp_handshake_readable_co(gpointer data) {
 
     colod_assert_remove_one_source(coroutine);
     qmpco->state->inflight--;
-    g_free(coroutine);
+    coroutine_free(qmpco);
     return ret;
 }
 
@@ -390,6 +1183,7 @@ static gboolean _qmp_handshake_readable_co(Coroutine *coroutine) {
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
     co_recurse(result = qmp_read_line_co(coroutine, qmp, qmpco->channel,
+                                         qmp_channel_timeout(qmp, qmpco->channel),
                                          FALSE, TRUE, &local_errp));
     if (!result) {
         log_error(local_errp->message);
@@ -399,7 +1193,8 @@ static gboolean _qmp_handshake_readable_co(Coroutine *coroutine) {
     }
     qmp_result_free(result);
 
-    co_recurse(result = qmp_execute_rec_co(coroutine, qmp, qmpco->channel, FALSE, &local_errp,
+    co_recurse(result = qmp_execute_rec_co(coroutine, qmp, qmpco->channel,
+                                           QMP_PRIORITY_STATE, FALSE, &local_errp,
                                            "{'execute': 'qmp_capabilities', "
                                            "'arguments': {'enable': ['oob']}}\n"));
     colod_unlock_co(qmpco->channel->lock);
@@ -408,7 +1203,7 @@ static gboolean _qmp_handshake_readable_co(Coroutine *coroutine) {
         g_error_free(local_errp);
         return G_SOURCE_REMOVE;
     }
-    if (has_member(result->json_root, "error")) {
+    if (qmp_result_is_error(result)) {
         log_error_fmt("qmp_capabilities: %s", result->line);
         qmp_result_free(result);
         return G_SOURCE_REMOVE;
@@ -425,7 +1220,7 @@ static Coroutine *qmp_handshake_coroutine(ColodQmpState *state,
     QmpCoroutine *qmpco;
     Coroutine *coroutine;
 
-    qmpco = g_new0(QmpCoroutine, 1);
+    qmpco = coroutine_new(&qmp_handshake_coroutine_type);
     coroutine = &qmpco->coroutine;
     coroutine->cb = qmp_handshake_readable_co;
     qmpco->state = state;
@@ -441,69 +1236,171 @@ static Coroutine *qmp_handshake_coroutine(ColodQmpState *state,
     return coroutine;
 }
 
-typedef struct ColodWaitState {
+static void qmp_event_match_compile(QmpEventMatch *match) {
+    JsonNode *parsed;
+    JsonObject *object;
+    JsonObjectIter iter;
+    const gchar *member;
+    JsonNode *node;
+
+    parsed = json_from_string(match->json, NULL);
+    assert(parsed && JSON_NODE_HOLDS_OBJECT(parsed));
+    object = json_node_get_object(parsed);
+    assert(json_object_has_member(object, "event"));
+
+    match->event = g_strdup(json_object_get_string_member(object, "event"));
+    match->data_keys = my_array_new(g_free);
+    match->data_values = my_array_new(g_free);
+
+    json_object_iter_init(&iter, object);
+    while (json_object_iter_next(&iter, &member, &node)) {
+        if (!strcmp(member, "event")) {
+            continue;
+        }
+        if (strcmp(member, "data") || !JSON_NODE_HOLDS_OBJECT(node)) {
+            match->fallback = json_node_ref(parsed);
+            break;
+        }
+
+        JsonObjectIter data_iter;
+        const gchar *data_member;
+        JsonNode *data_node;
+        json_object_iter_init(&data_iter, json_node_get_object(node));
+        while (json_object_iter_next(&data_iter, &data_member, &data_node)) {
+            if (json_node_get_value_type(data_node) != G_TYPE_STRING) {
+                match->fallback = json_node_ref(parsed);
+                break;
+            }
+            my_array_append(match->data_keys, g_strdup(data_member));
+            my_array_append(match->data_values,
+                            g_strdup(json_node_get_string(data_node)));
+        }
+        if (match->fallback) {
+            break;
+        }
+    }
+
+    json_node_unref(parsed);
+    match->compiled = TRUE;
+}
+
+gboolean qmp_event_match(QmpEventMatch *match, ColodQmpResult *event) {
+    const gchar *name;
+
+    if (!match->compiled) {
+        qmp_event_match_compile(match);
+    }
+
+    name = qmp_result_get_event(event);
+    if (!name || strcmp(name, match->event)) {
+        return FALSE;
+    }
+
+    if (match->fallback) {
+        return object_matches(qmp_result_get_json(event), match->fallback);
+    }
+
+    for (int i = 0; i < match->data_keys->size; i++) {
+        const gchar *key = match->data_keys->array[i];
+        const gchar *value;
+
+        if (!strcmp(key, "status")) {
+            value = qmp_result_get_status(event);
+        } else {
+            value = qmp_result_get_data_str(event, key);
+        }
+
+        if (!value || strcmp(value, match->data_values->array[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+struct ColodWaitState {
+    QLIST_ENTRY(ColodWaitState) next;
     Coroutine *coroutine;
-    JsonNode *match;
-    ColodQmpState *state;
+    QmpEventMatch *match;
     gboolean fired;
-} ColodWaitState;
+};
 
-static void qmp_wait_event_cb(gpointer data, ColodQmpResult *result) {
-    ColodWaitState *state = data;
+static void notify_waiters(ColodQmpState *state, ColodQmpResult *result) {
+    ColodWaitState *entry, *next_entry;
+    const gchar *event = qmp_result_get_event(result);
+    QmpWaitHead *waiters;
 
-    if (object_matches(result->json_root, state->match)) {
-        state->fired = TRUE;
-        g_idle_add_full(G_PRIORITY_HIGH, state->coroutine->cb,
-                        state->coroutine, NULL);
-        qmp_del_notify_event(state->state, qmp_wait_event_cb, state);
+    waiters = g_hash_table_lookup(state->event_waiters, event);
+    if (!waiters) {
+        return;
     }
+
+    QLIST_FOREACH_SAFE(entry, &waiters->head, next, next_entry) {
+        if (qmp_event_match(entry->match, result)) {
+            entry->fired = TRUE;
+            g_idle_add_full(G_PRIORITY_HIGH, entry->coroutine->cb,
+                            entry->coroutine, NULL);
+            QLIST_REMOVE(entry, next);
+        }
+    }
+}
+
+static void qmp_add_waiter(ColodQmpState *state, ColodWaitState *wait_state) {
+    QmpWaitHead *waiters;
+
+    waiters = g_hash_table_lookup(state->event_waiters, wait_state->match->event);
+    if (!waiters) {
+        waiters = g_new0(QmpWaitHead, 1);
+        g_hash_table_insert(state->event_waiters,
+                            g_strdup(wait_state->match->event), waiters);
+    }
+
+    QLIST_INSERT_HEAD(&waiters->head, wait_state, next);
 }
 
 int _qmp_wait_event_co(Coroutine *coroutine, ColodQmpState *state,
-                       guint timeout, const gchar *match, GError **errp) {
+                       guint timeout, QmpEventMatch *match, GError **errp) {
     struct {
         ColodWaitState *wait_state;
-        guint timeout_source_id;
+        guint timeout_id;
     } *co;
-    JsonNode *parsed;
     int ret = 0;
 
+    timeout = colod_deadline_clamp(coroutine, timeout);
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    parsed = json_from_string(match, NULL);
-    assert(parsed);
+    if (!match->compiled) {
+        qmp_event_match_compile(match);
+    }
 
     CO wait_state = g_new0(ColodWaitState, 1);
     CO wait_state->coroutine = coroutine;
-    CO wait_state->match = parsed;
-    CO wait_state->state = state;
-    qmp_add_notify_event(state, qmp_wait_event_cb, CO wait_state);
-    CO timeout_source_id = 0;
+    CO wait_state->match = match;
+    qmp_add_waiter(state, CO wait_state);
+    CO timeout_id = 0;
     if (timeout) {
-        CO timeout_source_id = g_timeout_add(timeout, coroutine->cb,
-                                             coroutine);
+        CO timeout_id = colod_timer_add(timeout, coroutine->cb, coroutine);
     }
 
     co_yield_int(G_SOURCE_REMOVE);
     if (!CO wait_state->fired) {
-        if (g_source_get_id(g_main_current_source()) == CO timeout_source_id) {
+        if (timeout && colod_timer_current() == CO timeout_id) {
             g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
                         "Timeout reached while waiting for qmp event: %s",
-                        match);
+                        match->json);
         } else {
             g_set_error(errp, COLOD_ERROR, COLOD_ERROR_INTERRUPT,
                         "Got interrupted while waiting for qmp event: %s",
-                        match);
+                        match->json);
         }
-        qmp_del_notify_event(state, qmp_wait_event_cb, CO wait_state);
+        QLIST_REMOVE(CO wait_state, next);
         ret = -1;
     }
 
     if (timeout) {
-        g_source_remove(CO timeout_source_id);
+        colod_timer_remove(CO timeout_id);
     }
-    json_node_unref(CO wait_state->match);
     g_free(CO wait_state);
 
     co_end;
@@ -524,10 +1421,24 @@ static gboolean qmp_event_co(gpointer data) {
 
     colod_assert_remove_one_source(coroutine);
     qmpco->state->inflight--;
-    g_free(qmpco);
+    coroutine_free(qmpco);
     return ret;
 }
 
+// Whether a read would make progress without blocking
+static gboolean qmp_channel_readable(QmpChannel *channel) {
+    struct pollfd pfd = {
+        .fd = g_io_channel_unix_get_fd(channel->channel),
+        .events = POLLIN
+    };
+
+    if (qmp_reader_pending(channel->reader)) {
+        return TRUE;
+    }
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
 static gboolean _qmp_event_co(Coroutine *coroutine) {
     QmpCoroutine *qmpco = (QmpCoroutine *) coroutine;
     QmpChannel *channel = qmpco->channel;
@@ -537,34 +1448,52 @@ static gboolean _qmp_event_co(Coroutine *coroutine) {
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
     while (TRUE) {
-        g_io_add_watch_full(channel->channel, G_PRIORITY_DEFAULT_IDLE,
-                            G_IO_IN | G_IO_HUP, coroutine_giofunc_cb, coroutine,
-                            NULL);
+        colod_watch_arm(channel->watch, coroutine, G_IO_IN,
+                        G_PRIORITY_DEFAULT_IDLE);
         co_yield_int(G_SOURCE_REMOVE);
-
-        while (channel->lock.holder) {
-            co_yield_int(G_SOURCE_CONTINUE);
+        if (!colod_watch_woken(channel->watch, coroutine)) {
+            continue;
         }
+
         colod_lock_co(channel->lock);
+        // A command may have read the event while we waited for the lock
+        if (!qmp_channel_readable(channel)) {
+            colod_unlock_co(channel->lock);
+            continue;
+        }
 
-        co_recurse(result = qmp_read_line_co(coroutine, qmpco->state, channel,
-                                             FALSE, FALSE, &local_errp));
+        co_recurse(result = qmp_channel_read_co(coroutine, qmpco->state,
+                                                channel,
+                                                qmp_channel_timeout(qmpco->state,
+                                                                    channel),
+                                                &local_errp));
         colod_unlock_co(channel->lock);
         if (!result) {
             log_error(local_errp->message);
+            if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT)) {
+                // Only part of a line arrived, the rest comes later
+                g_error_free(local_errp);
+                local_errp = NULL;
+                continue;
+            }
             g_error_free(local_errp);
             return G_SOURCE_REMOVE;
         }
-        if (!has_member(result->json_root, "event")) {
-            log_error_fmt("Not an event: %s", result->line);
-            qmp_result_free(result);
+        qmp_trace_result(channel, result);
+        if (!qmp_result_is_event(result)) {
+            if (channel->stale_replies) {
+                colod_trace("%s:%u: Discarding stale reply\n",
+                            __func__, __LINE__);
+                channel->stale_replies--;
+            } else {
+                log_error_fmt("Not an event: %s", result->line);
+            }
             continue;
         }
 
-        if (!channel->discard_events) {
+        if (!channel->discard_events && event_subscribed(qmpco->state, result)) {
             notify_event(qmpco->state, result);
         }
-        qmp_result_free(result);
     }
 
     co_end;
@@ -589,31 +1518,166 @@ static Coroutine *qmp_event_coroutine(ColodQmpState *state,
     QmpCoroutine *qmpco;
     Coroutine *coroutine;
 
-    qmpco = g_new0(QmpCoroutine, 1);
+    qmpco = coroutine_new(&qmp_event_coroutine_type);
     coroutine = &qmpco->coroutine;
     coroutine->cb = qmp_event_co;
     qmpco->state = state;
     qmpco->channel = channel;
 
-    g_io_add_watch_full(channel->channel, G_PRIORITY_DEFAULT_IDLE,
-                        G_IO_IN | G_IO_HUP, coroutine_giofunc_cb, coroutine,
-                        NULL);
+    colod_watch_arm(channel->watch, coroutine, G_IO_IN,
+                    G_PRIORITY_DEFAULT_IDLE);
 
     state->inflight++;
     return coroutine;
 }
 
+static gboolean _qmp_yank_refresh_co(Coroutine *coroutine);
+static gboolean qmp_yank_refresh_co(gpointer data) {
+    QmpCoroutine *qmpco = data;
+    Coroutine *coroutine = &qmpco->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _qmp_yank_refresh_co(coroutine));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    qmpco->state->yank_refreshing = FALSE;
+    qmpco->state->inflight--;
+    coroutine_free(qmpco);
+    return ret;
+}
+
+// Queries the yank instances until no command changed them meanwhile
+static gboolean _qmp_yank_refresh_co(Coroutine *coroutine) {
+    QmpCoroutine *qmpco = (QmpCoroutine *) coroutine;
+    ColodQmpState *state = qmpco->state;
+    struct {
+        guint64 generation;
+    } *co;
+    ColodQmpResult *result;
+    GError *local_errp = NULL;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    while (TRUE) {
+        // qmp_release_yank_refresh() starts a new refresh
+        if (state->yank_refresh_holds) {
+            return G_SOURCE_REMOVE;
+        }
+
+        CO generation = state->yank_generation;
+        co_recurse(result = qmp_execute_rec_co(coroutine, state,
+                                               &state->yank_channel,
+                                               QMP_PRIORITY_CLIENT, FALSE,
+                                               &local_errp,
+                                               "{'exec-oob': 'query-yank', 'id': 'yank0'}\n"));
+        if (!result) {
+            log_error(local_errp->message);
+            g_error_free(local_errp);
+            return G_SOURCE_REMOVE;
+        }
+        if (qmp_result_is_error(result)) {
+            log_error_fmt("qmp query-yank: %s", result->line);
+            qmp_result_free(result);
+            return G_SOURCE_REMOVE;
+        }
+
+        if (CO generation == state->yank_generation) {
+            g_free(state->yank_command);
+            state->yank_command = qmp_yank_command(state, result);
+            qmp_result_free(result);
+            break;
+        }
+        qmp_result_free(result);
+    }
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static void qmp_yank_invalidate(ColodQmpState *state) {
+    g_free(state->yank_command);
+    state->yank_command = NULL;
+    state->yank_generation++;
+
+    qmp_yank_refresh_start(state);
+}
+
+static void qmp_yank_refresh_start(ColodQmpState *state) {
+    QmpCoroutine *qmpco;
+
+    if (!state->yank_instances || state->yank_command
+            || state->yank_refreshing || state->yank_refresh_holds) {
+        return;
+    }
+
+    qmpco = coroutine_new(&qmp_yank_refresh_coroutine_type);
+    qmpco->coroutine.cb = qmp_yank_refresh_co;
+    qmpco->state = state;
+    qmpco->channel = &state->yank_channel;
+    g_idle_add(qmp_yank_refresh_co, qmpco);
+
+    state->yank_refreshing = TRUE;
+    state->inflight++;
+}
+
+void qmp_hold_yank_refresh(ColodQmpState *state) {
+    state->yank_refresh_holds++;
+}
+
+void qmp_release_yank_refresh(ColodQmpState *state) {
+    assert(state->yank_refresh_holds);
+    state->yank_refresh_holds--;
+    qmp_yank_refresh_start(state);
+}
+
 void qmp_set_yank_instances(ColodQmpState *state, JsonNode *instances) {
     if (state->yank_instances) {
         json_node_unref(state->yank_instances);
     }
     state->yank_instances = json_node_ref(instances);
+    qmp_yank_invalidate(state);
 }
 
-void qmp_set_timeout(ColodQmpState *state, guint timeout) {
-    assert(timeout);
+// Incremented for every event received on the main channel
+guint64 qmp_get_events(ColodQmpState *state) {
+    return state->events;
+}
+
+void qmp_set_timeout_bounds(ColodQmpState *state, guint floor,
+                            guint busy_floor, guint ceiling) {
+    qmp_rtt_set_bounds(state->rtt, floor, busy_floor, ceiling);
+}
+
+void qmp_set_busy(ColodQmpState *state, gboolean busy) {
+    qmp_rtt_set_busy(state->rtt, busy);
+}
+
+void qmp_set_health_timeout(ColodQmpState *state, guint timeout) {
+    state->health_channel.timeout = timeout;
+}
 
-    state->timeout = timeout;
+// qmp_new() may have failed before the channel was set up
+static void qmp_channel_shutdown(QmpChannel *channel) {
+    if (channel->channel) {
+        colod_shutdown_channel(channel->channel);
+    }
+}
+
+static void qmp_channel_free(QmpChannel *channel) {
+    if (!channel->channel) {
+        return;
+    }
+
+    qmp_channel_clear_current(channel);
+    qmp_reader_free(channel->reader);
+    colod_writer_free(channel->writer);
+    colod_watch_free(channel->watch);
+    g_io_channel_unref(channel->channel);
 }
 
 static void qmp_free(gpointer _this) {
@@ -624,44 +1688,86 @@ static void qmp_free(gpointer _this) {
 
     colod_callback_clear(&state->event_callbacks);
     colod_callback_clear(&state->hup_callbacks);
+    g_hash_table_unref(state->event_subscribers);
+    g_hash_table_unref(state->event_waiters);
 
-    colod_shutdown_channel(state->yank_channel.channel);
-    colod_shutdown_channel(state->channel.channel);
+    qmp_channel_shutdown(&state->yank_channel);
+    qmp_channel_shutdown(&state->channel);
+    qmp_channel_shutdown(&state->health_channel);
 
     while (state->inflight) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
-    g_io_channel_unref(state->yank_channel.channel);
-    g_io_channel_unref(state->channel.channel);
+    qmp_channel_free(&state->yank_channel);
+    qmp_channel_free(&state->channel);
+    qmp_channel_free(&state->health_channel);
     if (state->yank_instances) {
         json_node_unref(state->yank_instances);
     }
+    g_free(state->yank_command);
+    qmp_rtt_free(state->rtt);
+    g_free(state->instance);
+}
+
+static gboolean qmp_channel_pending(gpointer data) {
+    QmpChannel *channel = data;
+
+    return qmp_reader_pending(channel->reader);
 }
 
-ColodQmpState *qmp_new(int fd, int yank_fd, guint timeout, GError **errp) {
+static void qmp_channel_init(QmpChannel *channel, int fd) {
+    channel->reader = qmp_reader_new(fd);
+    channel->watch = colod_watch_new(fd, "qmp watch");
+    colod_watch_set_pending(channel->watch, qmp_channel_pending, channel);
+    channel->writer = colod_writer_new(fd, channel->watch);
+}
+
+ColodQmpState *qmp_new(const gchar *instance, int fd, int yank_fd,
+                       int health_fd, guint timeout, GError **errp) {
     ColodQmpState *state;
 
     state = g_rc_box_new0(ColodQmpState);
-    state->timeout = timeout;
+    state->instance = g_strdup(instance);
+    state->rtt = qmp_rtt_new(instance, timeout, timeout, timeout);
+    state->event_subscribers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                     g_free, colod_callback_head_free);
+    state->event_waiters = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
     state->channel.channel = colod_create_channel(fd, errp);
     if (!state->channel.channel) {
         qmp_unref(state);
         return NULL;
     }
+    qmp_channel_init(&state->channel, fd);
 
     state->yank_channel.channel = colod_create_channel(yank_fd, errp);
     state->yank_channel.discard_events = TRUE;
     if (!state->yank_channel.channel) {
-        g_io_channel_unref(state->channel.channel);
         qmp_unref(state);
         return NULL;
     }
+    qmp_channel_init(&state->yank_channel, yank_fd);
+
+    if (health_fd >= 0) {
+        state->health_channel.channel = colod_create_channel(health_fd, errp);
+        state->health_channel.discard_events = TRUE;
+        if (!state->health_channel.channel) {
+            qmp_unref(state);
+            return NULL;
+        }
+        qmp_channel_init(&state->health_channel, health_fd);
+        state->has_health_channel = TRUE;
+    }
 
     qmp_handshake_coroutine(state, &state->channel);
     qmp_handshake_coroutine(state, &state->yank_channel);
     qmp_event_coroutine(state, &state->channel);
     qmp_event_coroutine(state, &state->yank_channel);
+    if (state->has_health_channel) {
+        qmp_handshake_coroutine(state, &state->health_channel);
+        qmp_event_coroutine(state, &state->health_channel);
+    }
 
     state->hup_source_id = g_io_add_watch(state->channel.channel, G_IO_HUP,
                                           qmp_hup_cb, state);
@@ -17,35 +17,133 @@
 #include "coroutine.h"
 #include "coutil.h"
 #include "base_types.h"
+#include "qmpreader.h"
 
 typedef struct ColodQmpResult {
+    // Built on demand, use qmp_result_get_json()
     JsonNode *json_root;
     gchar *line;
     gsize len;
     gboolean did_yank;
+    QmpFields fields;
 } ColodQmpResult;
 
+// Event filter compiled on first use, meant to be declared static:
+// static QmpEventMatch match_resume = QMP_EVENT_MATCH("{'event': 'RESUME'}");
+typedef struct QmpEventMatch {
+    const gchar *json;
+    gboolean compiled;
+    gchar *event;
+    // string members of 'data', compared with strcmp
+    MyArray *data_keys;
+    MyArray *data_values;
+    // set if the filter can't be expressed as above
+    JsonNode *fallback;
+} QmpEventMatch;
+
+#define QMP_EVENT_MATCH(_json) { .json = (_json) }
+
+// Access classes for the qmp channel, higher classes are sent first
+typedef enum QmpPriority {
+    QMP_PRIORITY_CLIENT,
+    QMP_PRIORITY_WATCHDOG,
+    QMP_PRIORITY_STATE,
+    QMP_PRIORITY_FAILOVER
+} QmpPriority;
+
 typedef void (*QmpYankCallback)(gpointer user_data);
 typedef void (*QmpEventCallback)(gpointer user_data, ColodQmpResult *event);
 
 void qmp_result_free(ColodQmpResult *result);
 ColodQmpResult *qmp_parse_result(gchar *line, gsize len, GError **errp);
+JsonNode *qmp_result_get_json(ColodQmpResult *result);
+const gchar *qmp_result_get_event(ColodQmpResult *result);
+gboolean qmp_result_is_event(ColodQmpResult *result);
+gboolean qmp_result_is_error(ColodQmpResult *result);
+const gchar *qmp_result_get_id(ColodQmpResult *result);
+const gchar *qmp_result_get_status(ColodQmpResult *result);
+const gchar *qmp_result_get_data_str(ColodQmpResult *result, const gchar *member);
+
+gboolean qmp_event_match(QmpEventMatch *match, ColodQmpResult *event);
 
+// The variants without priority use QMP_PRIORITY_STATE
 #define qmp_execute_co(...) co_wrap(_qmp_execute_co(__VA_ARGS__))
 ColodQmpResult *_qmp_execute_co(Coroutine *coroutine, ColodQmpState *state,
                                 GError **errp, const gchar *command);
 
+#define qmp_execute_prio_co(...) co_wrap(_qmp_execute_prio_co(__VA_ARGS__))
+ColodQmpResult *_qmp_execute_prio_co(Coroutine *coroutine, ColodQmpState *state,
+                                     QmpPriority priority, GError **errp,
+                                     const gchar *command);
+
 #define qmp_execute_nocheck_co(...) co_wrap(_qmp_execute_nocheck_co(__VA_ARGS__))
 ColodQmpResult *_qmp_execute_nocheck_co(Coroutine *coroutine, ColodQmpState *state,
                                         GError **errp, const gchar *command);
 
+#define qmp_execute_nocheck_prio_co(...) \
+    co_wrap(_qmp_execute_nocheck_prio_co(__VA_ARGS__))
+ColodQmpResult *_qmp_execute_nocheck_prio_co(Coroutine *coroutine,
+                                             ColodQmpState *state,
+                                             QmpPriority priority,
+                                             GError **errp,
+                                             const gchar *command);
+
+// Write all commands at once and read the replies in order. Returns the
+// results received so far, errp is set if not all replies arrived.
+// Requires qmp_batch_supported(commands).
+#define qmp_execute_array_co(...) co_wrap(_qmp_execute_array_co(__VA_ARGS__))
+MyArray *_qmp_execute_array_co(Coroutine *coroutine, ColodQmpState *state,
+                               MyArray *commands, GError **errp);
+
+#define qmp_execute_array_prio_co(...) \
+    co_wrap(_qmp_execute_array_prio_co(__VA_ARGS__))
+MyArray *_qmp_execute_array_prio_co(Coroutine *coroutine, ColodQmpState *state,
+                                    QmpPriority priority, MyArray *commands,
+                                    GError **errp);
+
+// Commands tagged and joined ahead of time, to be sent with a single write
+typedef struct QmpBatch QmpBatch;
+
+// Fails unless every command parses as a json object that executes
+// something and has no id, the batch tags each command with its own id
+QmpBatch *qmp_batch_new(MyArray *commands, GError **errp);
+// Whether qmp_execute_array_co() can batch commands, else they have to be
+// executed one by one
+gboolean qmp_batch_supported(MyArray *commands);
+QmpBatch *qmp_batch_ref(QmpBatch *batch);
+void qmp_batch_unref(QmpBatch *batch);
+MyArray *qmp_batch_get_commands(QmpBatch *batch);
+
+#define qmp_execute_batch_prio_co(...) \
+    co_wrap(_qmp_execute_batch_prio_co(__VA_ARGS__))
+MyArray *_qmp_execute_batch_prio_co(Coroutine *coroutine, ColodQmpState *state,
+                                    QmpPriority priority, QmpBatch *batch,
+                                    GError **errp);
+
+// Commands below priority that wait for the channel and weren't sent yet
+// fail with COLOD_ERROR_CANCELLED. Returns the number of cancelled commands.
+// The event reader and other internal users of the channel keep waiting.
+guint qmp_cancel_queued(ColodQmpState *state, QmpPriority below);
+
 #define qmp_yank_co(...) co_wrap(_qmp_yank_co(__VA_ARGS__))
 int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state, GError **errp);
 
+// The yank command is cached and refreshed in the background with a
+// query-yank on the yank channel. While held, no new refresh starts, so a
+// yank doesn't have to wait for one. A query-yank that is already sent
+// still finishes. Yanks hold it themselves, holds nest.
+void qmp_hold_yank_refresh(ColodQmpState *state);
+void qmp_release_yank_refresh(ColodQmpState *state);
+
 void qmp_add_notify_event(ColodQmpState *state, QmpEventCallback _func,
                           gpointer user_data);
 void qmp_del_notify_event(ColodQmpState *state, QmpEventCallback _func,
                           gpointer user_data);
+// Only called for events with this name
+void qmp_add_notify_event_name(ColodQmpState *state, const gchar *event,
+                               QmpEventCallback _func, gpointer user_data);
+void qmp_del_notify_event_name(ColodQmpState *state, const gchar *event,
+                               QmpEventCallback _func, gpointer user_data);
 void qmp_add_notify_hup(ColodQmpState *state, QmpYankCallback _func,
                         gpointer user_data);
 void qmp_del_notify_hup(ColodQmpState *state, QmpYankCallback _func,
@@ -53,12 +151,23 @@ void qmp_del_notify_hup(ColodQmpState *state, QmpYankCallback _func,
 
 #define qmp_wait_event_co(...) co_wrap(_qmp_wait_event_co(__VA_ARGS__))
 int _qmp_wait_event_co(Coroutine *coroutine, ColodQmpState *state,
-                       guint timeout, const gchar *match, GError **errp);
+                       guint timeout, QmpEventMatch *match, GError **errp);
 
 void qmp_set_yank_instances(ColodQmpState *state, JsonNode *instances);
-void qmp_set_timeout(ColodQmpState *state, guint timeout);
+// The qmp timeout adapts to the round-trip time of each command class
+// within these bounds, see qmp_rtt.h. qmp_new() starts with a fixed timeout.
+void qmp_set_timeout_bounds(ColodQmpState *state, guint floor,
+                            guint busy_floor, guint ceiling);
+void qmp_set_busy(ColodQmpState *state, gboolean busy);
+// Fixed read timeout of the health channel, 0 to adapt like the others
+void qmp_set_health_timeout(ColodQmpState *state, guint timeout);
+guint64 qmp_get_events(ColodQmpState *state);
 
-ColodQmpState *qmp_new(int fd, int yank_fd, guint timeout, GError **errp);
+// health_fd is optional (-1). If given, QMP_PRIORITY_WATCHDOG commands are
+// sent there instead of queueing on the main channel. The metrics are
+// labelled with instance.
+ColodQmpState *qmp_new(const gchar *instance, int fd, int yank_fd,
+                       int health_fd, guint timeout, GError **errp);
 ColodQmpState *qmp_ref(ColodQmpState *state);
 void qmp_unref(ColodQmpState *state);
 
@@ -0,0 +1,130 @@
+/*
+ * COLO background daemon adaptive qmp timeouts
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+
+#include <glib-2.0/glib.h>
+
+#include "qmp_rtt.h"
+#include "metrics.h"
+
+// Lower bound of the variance term, the timers tick in milliseconds
+#define QMP_RTT_GRANULARITY_US 1000
+
+static const gchar *qmp_rtt_class_names[QMP_RTT_CLASSES] = {
+    [QMP_RTT_QUERY] = "query",
+    [QMP_RTT_COMMAND] = "command",
+    [QMP_RTT_YANK] = "yank",
+    [QMP_RTT_HEALTH] = "health"
+};
+
+typedef struct QmpRttEstimate {
+    gint64 srtt, rttvar;
+    guint64 samples;
+    ColodGauge *srtt_gauge, *rttvar_gauge, *timeout_gauge;
+} QmpRttEstimate;
+
+struct QmpRtt {
+    QmpRttEstimate classes[QMP_RTT_CLASSES];
+    guint floor, busy_floor, ceiling;
+    gboolean busy;
+};
+
+const gchar *qmp_rtt_class_name(QmpRttClass class) {
+    assert(class < QMP_RTT_CLASSES);
+    return qmp_rtt_class_names[class];
+}
+
+guint qmp_rtt_timeout(QmpRtt *this, QmpRttClass class) {
+    QmpRttEstimate *estimate = &this->classes[class];
+    guint floor = this->busy ? this->busy_floor : this->floor;
+    gint64 rto = 0;
+
+    if (estimate->samples) {
+        rto = estimate->srtt + MAX(4 * estimate->rttvar,
+                                   QMP_RTT_GRANULARITY_US);
+        rto = (rto + 999) / 1000;
+    }
+
+    return CLAMP(rto, floor, this->ceiling);
+}
+
+static void qmp_rtt_export(QmpRtt *this, QmpRttClass class) {
+    QmpRttEstimate *estimate = &this->classes[class];
+
+    metrics_set(estimate->srtt_gauge, estimate->srtt);
+    metrics_set(estimate->rttvar_gauge, estimate->rttvar);
+    metrics_set(estimate->timeout_gauge, qmp_rtt_timeout(this, class));
+}
+
+static void qmp_rtt_export_all(QmpRtt *this) {
+    for (guint i = 0; i < QMP_RTT_CLASSES; i++) {
+        qmp_rtt_export(this, i);
+    }
+}
+
+void qmp_rtt_sample(QmpRtt *this, QmpRttClass class, gint64 usec) {
+    QmpRttEstimate *estimate = &this->classes[class];
+
+    usec = MAX(usec, 0);
+    if (!estimate->samples) {
+        estimate->srtt = usec;
+        estimate->rttvar = usec / 2;
+    } else {
+        gint64 delta = estimate->srtt - usec;
+
+        // alpha = 1/8, beta = 1/4
+        estimate->rttvar = (3 * estimate->rttvar + ABS(delta)) / 4;
+        estimate->srtt = (7 * estimate->srtt + usec) / 8;
+    }
+    estimate->samples++;
+
+    qmp_rtt_export(this, class);
+}
+
+void qmp_rtt_set_bounds(QmpRtt *this, guint floor, guint busy_floor,
+                        guint ceiling) {
+    assert(floor);
+
+    this->floor = floor;
+    this->busy_floor = MAX(busy_floor, floor);
+    this->ceiling = MAX(ceiling, this->busy_floor);
+    qmp_rtt_export_all(this);
+}
+
+void qmp_rtt_set_busy(QmpRtt *this, gboolean busy) {
+    this->busy = busy;
+    qmp_rtt_export_all(this);
+}
+
+QmpRtt *qmp_rtt_new(const gchar *instance, guint floor, guint busy_floor,
+                    guint ceiling) {
+    QmpRtt *this = g_new0(QmpRtt, 1);
+
+    for (guint i = 0; i < QMP_RTT_CLASSES; i++) {
+        QmpRttEstimate *estimate = &this->classes[i];
+        const gchar *name = qmp_rtt_class_names[i];
+
+        estimate->srtt_gauge = metrics_instance_gauge(instance, "qmp_srtt_us",
+                                                      "class", name);
+        estimate->rttvar_gauge = metrics_instance_gauge(instance,
+                                                        "qmp_rttvar_us",
+                                                        "class", name);
+        estimate->timeout_gauge = metrics_instance_gauge(instance,
+                                                         "qmp_timeout_ms",
+                                                         "class", name);
+    }
+    qmp_rtt_set_bounds(this, floor, busy_floor, ceiling);
+
+    return this;
+}
+
+void qmp_rtt_free(QmpRtt *this) {
+    g_free(this);
+}
@@ -0,0 +1,48 @@
+/*
+ * COLO background daemon adaptive qmp timeouts
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QMP_RTT_H
+#define QMP_RTT_H
+
+#include <glib-2.0/glib.h>
+
+// Commands of one class are expected to take about the same time
+typedef enum QmpRttClass {
+    QMP_RTT_QUERY,
+    QMP_RTT_COMMAND,
+    QMP_RTT_YANK,
+    QMP_RTT_HEALTH,
+    QMP_RTT_CLASSES
+} QmpRttClass;
+
+// Smoothed qmp round-trip time and its variance per class, estimated like
+// the TCP retransmission timeout (RFC 6298). The timeout of a class is
+// srtt + 4 * rttvar, at least floor (busy_floor while qemu is busy) and at
+// most ceiling. The estimates are exported as metrics.
+typedef struct QmpRtt QmpRtt;
+
+// Timeouts are in milliseconds. The ceiling is raised to the floors if it
+// is below them, so floor == ceiling gives a fixed timeout. The metrics are
+// labelled with instance.
+QmpRtt *qmp_rtt_new(const gchar *instance, guint floor, guint busy_floor,
+                    guint ceiling);
+void qmp_rtt_free(QmpRtt *this);
+void qmp_rtt_set_bounds(QmpRtt *this, guint floor, guint busy_floor,
+                        guint ceiling);
+// Migration, checkpoints and guest resets stall qmp for longer than
+// any sample so far may show
+void qmp_rtt_set_busy(QmpRtt *this, gboolean busy);
+
+// Only sample replies that came without a timeout or yank in between
+void qmp_rtt_sample(QmpRtt *this, QmpRttClass class, gint64 usec);
+guint qmp_rtt_timeout(QmpRtt *this, QmpRttClass class);
+
+const gchar *qmp_rtt_class_name(QmpRttClass class);
+
+#endif // QMP_RTT_H
@@ -15,6 +15,13 @@
 #include "util.h"
 #include "formater.h"
 
+// Rendered ahead of time whenever the template or its inputs change
+typedef struct QmpCommandSet {
+    FormaterTemplate *template;
+    gboolean cmdline;
+    MyArray *rendered;
+} QmpCommandSet;
+
 struct QmpCommands {
     char *instance_name;
     char *base_dir;
@@ -32,32 +39,103 @@ struct QmpCommands {
     JsonNode *qemu_options;
     JsonNode *yank_instances;
 
-    MyArray *qemu_primary, *qemu_secondary;
-    MyArray *qemu_dummy;
+    Formater *fmt;
+    guint version;
+    ColodCallbackHead callbacks;
+    QmpCommandSet qemu_primary, qemu_secondary;
+    QmpCommandSet qemu_dummy;
 
-    MyArray *prepare_primary, *prepare_secondary;
-    MyArray *migration_start, *migration_switchover;
-    MyArray *failover_primary, *failover_secondary;
+    QmpCommandSet prepare_primary, prepare_secondary;
+    FormaterTemplate *migration_start;
+    QmpCommandSet migration_switchover;
+    QmpCommandSet failover_primary, failover_secondary;
 };
 
-static int qmp_commands_format_check(MyArray *new) {
-    Formater *fmt = formater_new(NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-                                 FALSE, TRUE, NULL, NULL, NULL, NULL, NULL, NULL,
-                                 9000);
-    MyArray *formated = formater_format(fmt, new);
+void qmp_commands_add_notify(QmpCommands *this, QmpCommandsCallback _func,
+                             gpointer data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->callbacks, func, data);
+}
 
-    if (!formated) {
-        formater_free(fmt);
-        return -1;
+void qmp_commands_del_notify(QmpCommands *this, QmpCommandsCallback _func,
+                             gpointer data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->callbacks, func, data);
+}
+
+static void qmp_commands_bump_version(QmpCommands *this) {
+    ColodCallback *entry, *next_entry;
+
+    this->version++;
+    QLIST_FOREACH_SAFE(entry, &this->callbacks, next, next_entry) {
+        QmpCommandsCallback func = (QmpCommandsCallback) entry->func;
+        func(entry->user_data);
     }
-    my_array_unref(formated);
-    formater_free(fmt);
+}
 
-    return 0;
+static void qmp_commands_render(QmpCommands *this, QmpCommandSet *set) {
+    if (set->rendered) {
+        my_array_unref(set->rendered);
+    }
+
+    set->rendered = formater_format(this->fmt, set->template, NULL, NULL,
+                                    this->filter_rewriter, !set->cmdline);
+    if (set->cmdline) {
+        my_array_append(set->rendered, NULL);
+    }
+}
+
+static void qmp_commands_set_free(G_GNUC_UNUSED QmpCommands *this,
+                                  QmpCommandSet *set) {
+    formater_template_free(set->template);
+    my_array_unref(set->rendered);
+}
+
+static void qmp_commands_foreach_set(QmpCommands *this,
+                                     void (*func)(QmpCommands *this,
+                                                  QmpCommandSet *set)) {
+    QmpCommandSet *sets[] = {
+        &this->qemu_primary,
+        &this->qemu_secondary,
+        &this->qemu_dummy,
+        &this->prepare_primary,
+        &this->prepare_secondary,
+        &this->migration_switchover,
+        &this->failover_primary,
+        &this->failover_secondary
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS(sets); i++) {
+        func(this, sets[i]);
+    }
 }
 
-static int qmp_commands_set_json(MyArray **entry, JsonNode *commands, GError **errp) {
+static void qmp_commands_update(QmpCommands *this) {
+    if (this->fmt) {
+        formater_free(this->fmt);
+    }
+    this->fmt = formater_new(this->instance_name,
+                             this->base_dir,
+                             this->active_hidden_dir,
+                             this->listen_address,
+                             this->qemu_binary,
+                             this->qemu_img_binary,
+                             this->comp_prop,
+                             this->mig_cap,
+                             this->mig_prop,
+                             this->throttle_prop,
+                             this->blk_mirror_prop,
+                             this->qemu_options,
+                             this->base_port);
+
+    qmp_commands_foreach_set(this, qmp_commands_render);
+    qmp_commands_bump_version(this);
+}
+
+static int qmp_commands_set_json(FormaterTemplate **entry, JsonNode *commands,
+                                 GError **errp) {
     MyArray *new = my_array_new(g_free);
+    FormaterTemplate *template;
     JsonArray *array;
     int size;
     int ret = 0;
@@ -87,15 +165,15 @@ static int qmp_commands_set_json(MyArray **entry, JsonNode *commands, GError **e
         my_array_append(new, g_strdup(str));
     }
 
-    ret = qmp_commands_format_check(new);
-    if (ret < 0) {
+    template = formater_compile(new);
+    if (!template) {
         g_set_error(errp, COLOD_ERROR, COLOD_ERROR_QMP, "Invalid format");
         ret = -1;
         goto out;
     }
 
-    my_array_unref(*entry);
-    *entry = my_array_ref(new);
+    formater_template_free(*entry);
+    *entry = template;
 
 out:
     my_array_unref(new);
@@ -103,11 +181,21 @@ out:
     return ret;
 }
 
-static MyArray *qmp_commands_static(int dummy, ...) {
-    va_list args;
+static int qmp_commands_set_rendered(QmpCommands *this, QmpCommandSet *set,
+                                     JsonNode *commands, GError **errp) {
+    int ret = qmp_commands_set_json(&set->template, commands, errp);
+    if (ret < 0) {
+        return -1;
+    }
+
+    qmp_commands_render(this, set);
+    qmp_commands_bump_version(this);
+    return 0;
+}
+
+static MyArray *qmp_commands_va(va_list args) {
     MyArray *array = my_array_new(g_free);
 
-    va_start(args, dummy);
     while (TRUE) {
         const char *str = va_arg(args, const char *);
         if (!str) {
@@ -116,32 +204,42 @@ static MyArray *qmp_commands_static(int dummy, ...) {
 
         my_array_append(array, g_strdup(str));
     }
+
+    return array;
+}
+
+static FormaterTemplate *qmp_commands_static(int dummy, ...) {
+    va_list args;
+
+    va_start(args, dummy);
+    MyArray *array = qmp_commands_va(args);
     va_end(args);
 
-    int ret = qmp_commands_format_check(array);
-    assert(ret == 0);
+    FormaterTemplate *template = formater_compile(array);
+    assert(template);
+    my_array_unref(array);
 
-    return array;
+    return template;
 }
 
 int qmp_commands_set_qemu_primary(QmpCommands *this, JsonNode *commands,
                                   GError **errp) {
-    return qmp_commands_set_json(&this->qemu_primary, commands, errp);
+    return qmp_commands_set_rendered(this, &this->qemu_primary, commands, errp);
 }
 
 int qmp_commands_set_qemu_secondary(QmpCommands *this, JsonNode *commands,
                                     GError **errp) {
-    return qmp_commands_set_json(&this->qemu_secondary, commands, errp);
+    return qmp_commands_set_rendered(this, &this->qemu_secondary, commands, errp);
 }
 
 int qmp_commands_set_prepare_primary(QmpCommands *this, JsonNode *commands,
                                      GError **errp) {
-    return qmp_commands_set_json(&this->prepare_primary, commands, errp);
+    return qmp_commands_set_rendered(this, &this->prepare_primary, commands, errp);
 }
 
 int qmp_commands_set_prepare_secondary(QmpCommands *this, JsonNode *commands,
                                        GError **errp) {
-    return qmp_commands_set_json(&this->prepare_secondary, commands, errp);
+    return qmp_commands_set_rendered(this, &this->prepare_secondary, commands, errp);
 }
 
 int qmp_commands_set_migration_start(QmpCommands *this, JsonNode *commands,
@@ -151,154 +249,98 @@ int qmp_commands_set_migration_start(QmpCommands *this, JsonNode *commands,
 
 int qmp_commands_set_migration_switchover(QmpCommands *this, JsonNode *commands,
                                           GError **errp) {
-    return qmp_commands_set_json(&this->migration_switchover, commands, errp);
+    return qmp_commands_set_rendered(this, &this->migration_switchover, commands, errp);
 }
 
 int qmp_commands_set_failover_primary(QmpCommands *this, JsonNode *commands,
                                       GError **errp) {
-    return qmp_commands_set_json(&this->failover_primary, commands, errp);
+    return qmp_commands_set_rendered(this, &this->failover_primary, commands, errp);
 }
 
 int qmp_commands_set_failover_secondary(QmpCommands *this, JsonNode *commands,
                                         GError **errp) {
-    return qmp_commands_set_json(&this->failover_secondary, commands, errp);
-}
-
-static MyArray *_qmp_commands_format(const QmpCommands *this,
-                                     gboolean newline,
-                                     const MyArray *entry,
-                                     const char *address,
-                                     const char *disk_size,
-                                     gboolean filter_rewriter) {
-    Formater *fmt = formater_new(
-                this->instance_name,
-                this->base_dir,
-                this->active_hidden_dir,
-                address,
-                this->listen_address,
-                this->qemu_binary,
-                this->qemu_img_binary,
-                disk_size,
-                filter_rewriter,
-                newline,
-                this->comp_prop,
-                this->mig_cap,
-                this->mig_prop,
-                this->throttle_prop,
-                this->blk_mirror_prop,
-                this->qemu_options,
-                this->base_port);
-
-    MyArray *ret = formater_format(fmt, entry);
-
-    formater_free(fmt);
-    return ret;
+    return qmp_commands_set_rendered(this, &this->failover_secondary, commands, errp);
 }
 
-static MyArray *qmp_commands_format(const QmpCommands *this,
-                                    const MyArray *entry,
-                                    const char *address,
+static MyArray *qmp_commands_format(QmpCommands *this, gboolean cmdline,
+                                    MyArray *entry, const char *address,
                                     const char *disk_size) {
-    return _qmp_commands_format(this, TRUE, entry, address, disk_size, this->filter_rewriter);
-}
-
-static MyArray *qmp_commands_format_migration_start(const QmpCommands *this,
-                                                    const MyArray *entry,
-                                                    const char *address,
-                                                    const char *disk_size,
-                                                    gboolean filter_rewriter) {
-    return _qmp_commands_format(this, TRUE, entry, address, disk_size, filter_rewriter);
-}
-
-static MyArray *qmp_commands_format_cmdline(const QmpCommands *this,
-                                            const MyArray *entry,
-                                            const char *address,
-                                            const char *disk_size) {
-    MyArray *ret = _qmp_commands_format(this, FALSE, entry, address, disk_size, this->filter_rewriter);
-    if (!ret) {
+    FormaterTemplate *template = formater_compile(entry);
+    my_array_unref(entry);
+    if (!template) {
         return NULL;
     }
 
-    my_array_append(ret, NULL);
+    MyArray *ret = formater_format(this->fmt, template, address, disk_size,
+                                   this->filter_rewriter, !cmdline);
+    formater_template_free(template);
+
+    if (cmdline) {
+        my_array_append(ret, NULL);
+    }
     return ret;
 }
 
 MyArray *qmp_commands_cmdline(QmpCommands *this, const char *address,
                               const char *disk_size, ...) {
     va_list args;
-    MyArray *array = my_array_new(g_free);
 
     va_start(args, disk_size);
-    while (TRUE) {
-        const char *str = va_arg(args, const char *);
-        if (!str) {
-            break;
-        }
-
-        my_array_append(array, g_strdup(str));
-    }
+    MyArray *array = qmp_commands_va(args);
     va_end(args);
 
-    MyArray *ret = qmp_commands_format_cmdline(this, array, address, disk_size);
-    my_array_unref(array);
-
-    return ret;
+    return qmp_commands_format(this, TRUE, array, address, disk_size);
 }
 
 MyArray *qmp_commands_adhoc(QmpCommands *this, const char *address, ...) {
     va_list args;
-    MyArray *array = my_array_new(g_free);
 
     va_start(args, address);
-    while (TRUE) {
-        const char *str = va_arg(args, const char *);
-        if (!str) {
-            break;
-        }
-
-        my_array_append(array, g_strdup(str));
-    }
+    MyArray *array = qmp_commands_va(args);
     va_end(args);
 
-    MyArray *ret = qmp_commands_format(this, array, address, NULL);
-    my_array_unref(array);
-    return ret;
+    return qmp_commands_format(this, FALSE, array, address, NULL);
 }
 
 MyArray *qmp_commands_get_qemu_primary(QmpCommands *this) {
-    return qmp_commands_format_cmdline(this, this->qemu_primary, NULL, NULL);
+    return my_array_ref(this->qemu_primary.rendered);
 }
 
 MyArray *qmp_commands_get_qemu_secondary(QmpCommands *this) {
-    return qmp_commands_format_cmdline(this, this->qemu_secondary, NULL, NULL);
+    return my_array_ref(this->qemu_secondary.rendered);
 }
 
 MyArray *qmp_commands_get_qemu_dummy(QmpCommands *this) {
-    return qmp_commands_format_cmdline(this, this->qemu_dummy, NULL, NULL);
+    return my_array_ref(this->qemu_dummy.rendered);
 }
 
 MyArray *qmp_commands_get_prepare_primary(QmpCommands *this) {
-    return qmp_commands_format(this, this->prepare_primary, NULL, NULL);
+    return my_array_ref(this->prepare_primary.rendered);
 }
 
 MyArray *qmp_commands_get_prepare_secondary(QmpCommands *this) {
-    return qmp_commands_format(this, this->prepare_secondary, NULL, NULL);
+    return my_array_ref(this->prepare_secondary.rendered);
 }
 
 MyArray *qmp_commands_get_migration_start(QmpCommands *this, const char *address, gboolean filter_rewriter) {
-    return qmp_commands_format_migration_start(this, this->migration_start, address, NULL, filter_rewriter);
+    return formater_format(this->fmt, this->migration_start, address, NULL,
+                           filter_rewriter, TRUE);
 }
 
 MyArray *qmp_commands_get_migration_switchover(QmpCommands *this) {
-    return qmp_commands_format(this, this->migration_switchover, NULL, NULL);
+    return my_array_ref(this->migration_switchover.rendered);
 }
 
 MyArray *qmp_commands_get_failover_primary(QmpCommands *this) {
-    return qmp_commands_format(this, this->failover_primary, NULL, NULL);
+    return my_array_ref(this->failover_primary.rendered);
 }
 
 MyArray *qmp_commands_get_failover_secondary(QmpCommands *this) {
-    return qmp_commands_format(this, this->failover_secondary, NULL, NULL);
+    return my_array_ref(this->failover_secondary.rendered);
+}
+
+guint qmp_commands_get_version(QmpCommands *this) {
+    return this->version;
 }
 
 static JsonNode *qmp_commands_set_prop(JsonNode *prop) {
@@ -327,36 +369,43 @@ static void qmp_commands_node_unref(JsonNode *prop) {
 
 void qmp_commands_set_filter_rewriter(QmpCommands *this, gboolean filter_rewriter) {
     this->filter_rewriter = filter_rewriter;
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_comp_prop(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->comp_prop);
     this->comp_prop = qmp_commands_set_prop(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_mig_cap(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->mig_cap);
     this->mig_cap = qmp_commands_set_array(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_mig_prop(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->mig_prop);
     this->mig_prop = qmp_commands_set_prop(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_throttle_prop(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->throttle_prop);
     this->throttle_prop = qmp_commands_set_prop(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_blk_mirror_prop(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->blk_mirror_prop);
     this->blk_mirror_prop = qmp_commands_set_prop(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_qemu_options(QmpCommands *this, JsonNode *prop) {
     qmp_commands_node_unref(this->qemu_options);
     this->qemu_options = qmp_commands_set_array(prop);
+    qmp_commands_update(this);
 }
 
 void qmp_commands_set_yank_instances(QmpCommands *this, JsonNode *prop) {
@@ -368,6 +417,10 @@ JsonNode *qmp_commands_get_yank_instances(QmpCommands *this) {
     return json_node_ref(this->yank_instances);
 }
 
+const char *qmp_commands_get_instance_name(QmpCommands *this) {
+    return this->instance_name;
+}
+
 static void _json_object_update(JsonObject* object G_GNUC_UNUSED,
                                 const gchar* member_name,
                                 JsonNode* member_node, gpointer user_data) {
@@ -575,7 +628,7 @@ int qmp_commands_read_config(QmpCommands *this, const char *config_str, const ch
 
     JsonObject *object = json_node_get_object(config);
 
-    this->filter_rewriter = json_object_get_boolean_member(object, "filter-rewriter");
+    qmp_commands_set_filter_rewriter(this, json_object_get_boolean_member(object, "filter-rewriter"));
 
     ret = qmp_commands_set_qemu_options_str(this, json_object_get_string_member(object, "qemu-options-str"),
                                                 errp);
@@ -610,7 +663,7 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
     this->qemu_img_binary = g_strdup(qemu_img_binary);
     this->base_port = base_port;
 
-    this->qemu_primary = qmp_commands_static(0,
+    this->qemu_primary.template = qmp_commands_static(0,
         "@@QEMU_BINARY@@",
         "@@QEMU_OPTIONS@@",
         "-drive", "if=none,node-name=quorum0,driver=quorum,read-pattern=fifo,vote-threshold=1,children.0=parent0",
@@ -618,11 +671,12 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
         "-no-shutdown",
         "-qmp", "unix:@@QMP_SOCK@@,server=on,wait=off",
         "-qmp", "unix:@@QMP_YANK_SOCK@@,server=on,wait=off",
+        "-qmp", "unix:@@QMP_HEALTH_SOCK@@,server=on,wait=off",
         "-object", "throttle-group,id=throttle0",
         "-S",
         NULL);
 
-    this->qemu_secondary = qmp_commands_static(0,
+    this->qemu_secondary.template = qmp_commands_static(0,
         "@@QEMU_BINARY@@",
         "@@QEMU_OPTIONS@@",
         "-chardev", "socket,id=mirror0,host=@@LISTEN_ADDRESS@@,port=@@MIRROR_PORT@@,server=on,wait=off,nodelay=on",
@@ -639,24 +693,26 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
         "-no-shutdown",
         "-qmp", "unix:@@QMP_SOCK@@,server=on,wait=off",
         "-qmp", "unix:@@QMP_YANK_SOCK@@,server=on,wait=off",
+        "-qmp", "unix:@@QMP_HEALTH_SOCK@@,server=on,wait=off",
         "-object", "throttle-group,id=throttle0",
         NULL);
 
-    this->qemu_dummy = qmp_commands_static(0,
+    this->qemu_dummy.template = qmp_commands_static(0,
         "@@QEMU_BINARY@@",
         "@@QEMU_OPTIONS@@",
         "-drive", "if=none,node-name=colo-disk0,driver=null-co",
         "-S",
         "-qmp", "unix:@@QMP_SOCK@@,server=on,wait=off",
         "-qmp", "unix:@@QMP_YANK_SOCK@@,server=on,wait=off",
+        "-qmp", "unix:@@QMP_HEALTH_SOCK@@,server=on,wait=off",
         NULL);
 
-    this->prepare_primary = qmp_commands_static(0,
+    this->prepare_primary.template = qmp_commands_static(0,
         "@@DECL_THROTTLE_PROP@@ {}",
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/throttle0', 'property': 'limits', 'value': @@THROTTLE_PROP@@}}",
         NULL);
 
-    this->prepare_secondary = qmp_commands_static(0,
+    this->prepare_secondary.template = qmp_commands_static(0,
         "@@DECL_THROTTLE_PROP@@ {}",
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/throttle0', 'property': 'limits', 'value': @@THROTTLE_PROP@@}}",
         "{'execute': 'migrate-set-capabilities', 'arguments': {'capabilities': [{'capability': 'x-colo', 'state': true}, {'capability': 'events', 'state': true}]}}",
@@ -691,12 +747,12 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
         "{'execute': 'migrate', 'arguments': {'uri': 'tcp:@@ADDRESS@@:@@MIGRATE_PORT@@'}}",
         NULL);
 
-    this->migration_switchover = qmp_commands_static(0,
+    this->migration_switchover.template = qmp_commands_static(0,
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/mirror0', 'property': 'status', 'value': 'on'}}",
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/comp_pri_in0', 'property': 'status', 'value': 'on'}}",
         NULL);
 
-    this->failover_primary = qmp_commands_static(0,
+    this->failover_primary.template = qmp_commands_static(0,
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/mirror0', 'property': 'status', 'value': 'off'}}",
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/comp_pri_in0', 'property': 'status', 'value': 'off'}}",
         "{'execute': 'x-blockdev-change', 'arguments': {'parent': 'quorum0', 'child': 'children.1'}}",
@@ -716,7 +772,7 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
         "{'execute': 'cont'}",
         NULL);
 
-    this->failover_secondary = qmp_commands_static(0,
+    this->failover_secondary.template = qmp_commands_static(0,
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/drop0', 'property': 'status', 'value': 'off'}}",
         "{'execute': 'qom-set', 'arguments': {'path': '/objects/comp_sec_in0', 'property': 'status', 'value': 'off'}}",
         "{'execute': 'nbd-server-stop'}",
@@ -736,6 +792,11 @@ QmpCommands *qmp_commands_new(const char *instance_name, const char *base_dir,
                 "{'type': 'migration'}]", NULL);
     assert(this->yank_instances);
 
+    this->qemu_primary.cmdline = TRUE;
+    this->qemu_secondary.cmdline = TRUE;
+    this->qemu_dummy.cmdline = TRUE;
+    qmp_commands_update(this);
+
     return this;
 }
 
@@ -754,15 +815,10 @@ void qmp_commands_free(QmpCommands *this) {
     qmp_commands_node_unref(this->qemu_options);
     qmp_commands_node_unref(this->yank_instances);
 
-    my_array_unref(this->qemu_primary);
-    my_array_unref(this->qemu_secondary);
-    my_array_unref(this->qemu_dummy);
-    my_array_unref(this->prepare_primary);
-    my_array_unref(this->prepare_secondary);
-    my_array_unref(this->migration_start);
-    my_array_unref(this->migration_switchover);
-    my_array_unref(this->failover_primary);
-    my_array_unref(this->failover_secondary);
+    qmp_commands_foreach_set(this, qmp_commands_set_free);
+    formater_template_free(this->migration_start);
+    formater_free(this->fmt);
+    colod_callback_clear(&this->callbacks);
 
     g_free(this);
 }
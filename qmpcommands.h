@@ -37,6 +37,15 @@ MyArray *qmp_commands_get_migration_start(QmpCommands *this, const char *address
 MyArray *qmp_commands_get_migration_switchover(QmpCommands *this);
 MyArray *qmp_commands_get_failover_primary(QmpCommands *this);
 MyArray *qmp_commands_get_failover_secondary(QmpCommands *this);
+// Bumped whenever the pre-rendered command sets change
+guint qmp_commands_get_version(QmpCommands *this);
+
+typedef void (*QmpCommandsCallback)(gpointer data);
+// Called after each version bump
+void qmp_commands_add_notify(QmpCommands *this, QmpCommandsCallback func,
+                             gpointer data);
+void qmp_commands_del_notify(QmpCommands *this, QmpCommandsCallback func,
+                             gpointer data);
 
 void qmp_commands_set_filter_rewriter(QmpCommands *this, gboolean filter_rewriter);
 void qmp_commands_set_comp_prop(QmpCommands *this, JsonNode *prop);
@@ -48,6 +57,7 @@ void qmp_commands_set_qemu_options(QmpCommands *this, JsonNode *prop);
 int qmp_commands_set_qemu_options_str(QmpCommands *this, const char *_qemu_options, GError **errp);
 void qmp_commands_set_yank_instances(QmpCommands *this, JsonNode *prop);
 JsonNode *qmp_commands_get_yank_instances(QmpCommands *this);
+const char *qmp_commands_get_instance_name(QmpCommands *this);
 
 int qmp_commands_read_config(QmpCommands *this, const char *config_str, const char *qemu_options, GError **errp);
 
@@ -18,9 +18,11 @@ struct QmpEctx {
     gboolean ignore_yank;
     gboolean ignore_qmp_error;
     gboolean unchecked;
+    QmpPriority priority;
 
     GSourceFunc cb;
     gpointer cb_data;
+    MyTimeout *deadline;
 };
 
 void qmp_ectx_set_ignore_qmp_error(QmpEctx *this) {
@@ -40,11 +42,29 @@ gboolean qmp_ectx_get_ignore_yank(QmpEctx *this) {
     return this->ignore_yank;
 }
 
+void qmp_ectx_set_priority(QmpEctx *this, QmpPriority priority) {
+    this->priority = priority;
+}
+
 void qmp_ectx_set_interrupt_cb(QmpEctx *this, GSourceFunc cb, gpointer user_data) {
     this->cb = cb;
     this->cb_data = user_data;
 }
 
+void qmp_ectx_set_deadline(QmpEctx *this, MyTimeout *deadline) {
+    if (this->deadline) {
+        my_timeout_unref(this->deadline);
+    }
+    this->deadline = my_timeout_ref(deadline);
+}
+
+void qmp_ectx_set_timeout(QmpEctx *this, guint timeout_ms) {
+    MyTimeout *deadline = my_timeout_new(timeout_ms);
+
+    qmp_ectx_set_deadline(this, deadline);
+    my_timeout_unref(deadline);
+}
+
 // returns true if something happened and it wasn't ignored
 gboolean qmp_ectx_failed(QmpEctx *this) {
     this->unchecked = FALSE;
@@ -109,11 +129,51 @@ void _qmp_ectx_log_error(QmpEctx *this, const gchar *func, int line) {
     g_error_free(local_errp);
 }
 
+static void qmp_ectx_set_error(QmpEctx *this, GError *local_errp) {
+    if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_QMP)) {
+        if (!this->qmp_errp) {
+            this->qmp_errp = g_error_copy(local_errp);
+            this->did_qmp_error = TRUE;
+        }
+
+        if (!qmp_ectx_failed(this)) {
+            colod_syslog(LOG_WARNING, "Ignoring qmp error: %s", local_errp->message);
+        }
+        g_error_free(local_errp);
+        return;
+    }
+
+    if (!this->errp) {
+        this->errp = g_error_copy(local_errp);
+        this->did_error = TRUE;
+    }
+
+    g_error_free(local_errp);
+}
+
+// Returns TRUE if the deadline passed, the error is set then
+static gboolean qmp_ectx_check_deadline(QmpEctx *this, const gchar *command) {
+    GError *local_errp = NULL;
+
+    if (!this->deadline || my_timeout_remaining_ms(this->deadline)) {
+        return FALSE;
+    }
+
+    g_set_error(&local_errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
+                "qmp: Deadline passed before sending: %s", command);
+    qmp_ectx_set_error(this, local_errp);
+    return TRUE;
+}
+
 #define qmp_ectx(...) co_wrap(_qmp_ectx(__VA_ARGS__))
 ColodQmpResult *_qmp_ectx(Coroutine *coroutine, QmpEctx *this, const gchar *command) {
+    struct {
+        gint64 deadline;
+    } *co;
     GError *local_errp = NULL;
     ColodQmpResult *result;
 
+    co_frame(co, sizeof(*co));
     co_begin(ColodQmpResult *, NULL);
 
     this->unchecked = TRUE;
@@ -122,31 +182,16 @@ ColodQmpResult *_qmp_ectx(Coroutine *coroutine, QmpEctx *this, const gchar *comm
         this->did_interrupt |= this->cb(this->cb_data);
     }
 
-    if (qmp_ectx_failed(this)) {
+    if (qmp_ectx_failed(this) || qmp_ectx_check_deadline(this, command)) {
         return NULL;
     }
 
-    co_recurse(result = qmp_execute_co(coroutine, this->qmp, &local_errp, command));
+    CO deadline = colod_deadline_enter(coroutine, this->deadline);
+    co_recurse(result = qmp_execute_prio_co(coroutine, this->qmp, this->priority,
+                                             &local_errp, command));
+    colod_deadline_restore(coroutine, CO deadline);
     if (!result) {
-        if (g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_QMP)) {
-            if (!this->qmp_errp) {
-                this->qmp_errp = g_error_copy(local_errp);
-                this->did_qmp_error = TRUE;
-            }
-
-            if (!qmp_ectx_failed(this)) {
-                colod_syslog(LOG_WARNING, "Ignoring qmp error: %s", local_errp->message);
-            }
-            g_error_free(local_errp);
-            return NULL;
-        }
-
-        if (!this->errp) {
-            this->errp = g_error_copy(local_errp);
-            this->did_error = TRUE;
-        }
-
-        g_error_free(local_errp);
+        qmp_ectx_set_error(this, local_errp);
         return NULL;
     }
 
@@ -180,6 +225,66 @@ int _qmp_ectx_yank(Coroutine *coroutine, QmpEctx *this) {
     co_end;
 }
 
+// Neither qmp errors nor yank stop the array and nothing can interrupt it
+// halfway, so the whole batch can be sent upfront without changing what
+// ends up being executed.
+static gboolean qmp_ectx_can_pipeline(QmpEctx *this) {
+    return this->ignore_yank && this->ignore_qmp_error && !this->cb;
+}
+
+#define qmp_ectx_pipeline(...) co_wrap(_qmp_ectx_pipeline(__VA_ARGS__))
+static int _qmp_ectx_pipeline(Coroutine *coroutine, QmpEctx *this,
+                              MyArray *array, QmpBatch *batch) {
+    struct {
+        gint64 deadline;
+    } *co;
+    GError *local_errp = NULL;
+    MyArray *results;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    this->unchecked = TRUE;
+
+    if (qmp_ectx_failed(this)
+            || qmp_ectx_check_deadline(this, array->array[0])) {
+        return 0;
+    }
+
+    CO deadline = colod_deadline_enter(coroutine, this->deadline);
+    if (batch) {
+        co_recurse(results = qmp_execute_batch_prio_co(coroutine, this->qmp,
+                                                       this->priority, batch,
+                                                       &local_errp));
+    } else {
+        co_recurse(results = qmp_execute_array_prio_co(coroutine, this->qmp,
+                                                       this->priority, array,
+                                                       &local_errp));
+    }
+    colod_deadline_restore(coroutine, CO deadline);
+    for (int i = 0; i < results->size; i++) {
+        ColodQmpResult *result = results->array[i];
+
+        this->did_yank |= result->did_yank;
+        if (qmp_result_is_error(result)) {
+            GError *qmp_errp = NULL;
+            g_set_error(&qmp_errp, COLOD_ERROR, COLOD_ERROR_QMP,
+                        "qmp command returned error: %s %s",
+                        (gchar *) array->array[i], result->line);
+            qmp_ectx_set_error(this, qmp_errp);
+        }
+    }
+    my_array_unref(results);
+
+    if (local_errp) {
+        qmp_ectx_set_error(this, local_errp);
+    }
+
+    return 0;
+
+    co_end;
+}
+
 #define qmp_ectx_array(...) co_wrap(_qmp_ectx_array(__VA_ARGS__))
 int _qmp_ectx_array(Coroutine *coroutine, QmpEctx *this, MyArray *array) {
     struct {
@@ -189,6 +294,13 @@ int _qmp_ectx_array(Coroutine *coroutine, QmpEctx *this, MyArray *array) {
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
+    if (array->size > 1 && qmp_ectx_can_pipeline(this)
+            && qmp_batch_supported(array)) {
+        int ret;
+        co_recurse(ret = qmp_ectx_pipeline(coroutine, this, array, NULL));
+        return ret;
+    }
+
     for (CO i = 0; CO i < array->size; CO i++) {
         ColodQmpResult *result;
         co_recurse(result = qmp_ectx(coroutine, this, array->array[CO i]));
@@ -200,9 +312,20 @@ int _qmp_ectx_array(Coroutine *coroutine, QmpEctx *this, MyArray *array) {
     co_end;
 }
 
+int _qmp_ectx_batch(Coroutine *coroutine, QmpEctx *this, QmpBatch *batch) {
+    MyArray *array = qmp_batch_get_commands(batch);
+
+    if (array->size > 1 && qmp_ectx_can_pipeline(this)) {
+        return _qmp_ectx_pipeline(coroutine, this, array, batch);
+    }
+
+    return _qmp_ectx_array(coroutine, this, array);
+}
+
 QmpEctx *qmp_ectx_new(ColodQmpState *qmp) {
     QmpEctx *this = g_rc_box_new0(QmpEctx);
     this->qmp = qmp_ref(qmp);
+    this->priority = QMP_PRIORITY_STATE;
     return this;
 }
 
@@ -211,6 +334,9 @@ void qmp_ectx_free(gpointer data) {
     assert(!this->unchecked);
 
     qmp_unref(this->qmp);
+    if (this->deadline) {
+        my_timeout_unref(this->deadline);
+    }
     if (this->errp) {
         g_error_free(this->errp);
     }
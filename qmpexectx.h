@@ -9,7 +9,13 @@ void qmp_ectx_set_ignore_qmp_error(QmpEctx *this);
 gboolean qmp_ectx_get_ignore_qmp_error(QmpEctx *this);
 void qmp_ectx_set_ignore_yank(QmpEctx *this);
 gboolean qmp_ectx_get_ignore_yank(QmpEctx *this);
+// QMP_PRIORITY_STATE by default
+void qmp_ectx_set_priority(QmpEctx *this, QmpPriority priority);
 void qmp_ectx_set_interrupt_cb(QmpEctx *this, GSourceFunc cb, gpointer user_data);
+// Bounds all following commands together, not each one on its own.
+// Commands that would start after it fail with COLOD_ERROR_TIMEOUT.
+void qmp_ectx_set_deadline(QmpEctx *this, MyTimeout *deadline);
+void qmp_ectx_set_timeout(QmpEctx *this, guint timeout_ms);
 
 // returns true if something happened and it wasn't ignored
 gboolean qmp_ectx_failed(QmpEctx *this);
@@ -31,6 +37,10 @@ ColodQmpResult *_qmp_ectx(Coroutine *coroutine, QmpEctx *this, const gchar *comm
 #define qmp_ectx_array(...) co_wrap(_qmp_ectx_array(__VA_ARGS__))
 int _qmp_ectx_array(Coroutine *coroutine, QmpEctx *this, MyArray *array);
 
+// Like qmp_ectx_array(), but sends the prebuilt batch when pipelining
+#define qmp_ectx_batch(...) co_wrap(_qmp_ectx_batch(__VA_ARGS__))
+int _qmp_ectx_batch(Coroutine *coroutine, QmpEctx *this, QmpBatch *batch);
+
 #define qmp_ectx_yank(...) co_wrap(_qmp_ectx_yank(__VA_ARGS__))
 int _qmp_ectx_yank(Coroutine *coroutine, QmpEctx *this);
 
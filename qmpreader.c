@@ -0,0 +1,380 @@
+/*
+ * COLO background daemon qmp reader
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "qmpreader.h"
+#include "util.h"
+
+#define QMP_READER_SIZE 4096
+
+typedef struct QmpScanner {
+    const gchar *p, *end;
+} QmpScanner;
+
+typedef int (*QmpScanMember)(QmpScanner *s, const gchar *key, gsize key_len,
+                             QmpFields *fields);
+
+static void scan_ws(QmpScanner *s) {
+    while (s->p < s->end && g_ascii_isspace(*s->p)) {
+        s->p++;
+    }
+}
+
+static gboolean is_quote(gchar c) {
+    return c == '"' || c == '\'';
+}
+
+// json-glib also accepts single quoted strings, clients make use of that
+static int scan_string(QmpScanner *s, const gchar **str, gsize *len,
+                       gboolean *escaped) {
+    gchar quote;
+
+    if (s->p >= s->end || !is_quote(*s->p)) {
+        return -1;
+    }
+    quote = *s->p;
+    s->p++;
+
+    *str = s->p;
+    *escaped = FALSE;
+    while (s->p < s->end) {
+        if (*s->p == '\\') {
+            *escaped = TRUE;
+            s->p += 2;
+            continue;
+        }
+        if (*s->p == quote) {
+            *len = s->p - *str;
+            s->p++;
+            return 0;
+        }
+        s->p++;
+    }
+
+    return -1;
+}
+
+static int scan_skip_value(QmpScanner *s) {
+    const gchar *str;
+    gsize len;
+    gboolean escaped;
+    int depth = 0;
+
+    do {
+        scan_ws(s);
+        if (s->p >= s->end) {
+            return -1;
+        }
+
+        switch (*s->p) {
+            case '"':
+            case '\'':
+                if (scan_string(s, &str, &len, &escaped) < 0) {
+                    return -1;
+                }
+            break;
+
+            case '{':
+            case '[':
+                depth++;
+                s->p++;
+            break;
+
+            case '}':
+            case ']':
+                if (!depth) {
+                    return -1;
+                }
+                depth--;
+                s->p++;
+            break;
+
+            case ',':
+            case ':':
+                if (!depth) {
+                    return -1;
+                }
+                s->p++;
+            break;
+
+            default: {
+                const gchar *start = s->p;
+                while (s->p < s->end && (g_ascii_isalnum(*s->p)
+                                         || strchr("+-.", *s->p))) {
+                    s->p++;
+                }
+                if (s->p == start) {
+                    return -1;
+                }
+            }
+            break;
+        }
+    } while (depth);
+
+    return 0;
+}
+
+static int scan_object(QmpScanner *s, QmpScanMember member,
+                       QmpFields *fields) {
+    scan_ws(s);
+    if (s->p >= s->end || *s->p != '{') {
+        return -1;
+    }
+    s->p++;
+
+    scan_ws(s);
+    if (s->p < s->end && *s->p == '}') {
+        s->p++;
+        return 0;
+    }
+
+    while (TRUE) {
+        const gchar *key;
+        gsize key_len;
+        gboolean escaped;
+
+        scan_ws(s);
+        if (scan_string(s, &key, &key_len, &escaped) < 0) {
+            return -1;
+        }
+        if (escaped) {
+            fields->valid = FALSE;
+        }
+        scan_ws(s);
+        if (s->p >= s->end || *s->p != ':') {
+            return -1;
+        }
+        s->p++;
+        scan_ws(s);
+
+        if (member(s, key, key_len, fields) < 0) {
+            return -1;
+        }
+
+        scan_ws(s);
+        if (s->p >= s->end) {
+            return -1;
+        }
+        if (*s->p == ',') {
+            s->p++;
+            continue;
+        }
+        if (*s->p == '}') {
+            s->p++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static gboolean key_is(const gchar *key, gsize key_len, const gchar *name) {
+    return key_len == strlen(name) && !memcmp(key, name, key_len);
+}
+
+static int scan_string_field(QmpScanner *s, gchar *buf, QmpFields *fields) {
+    const gchar *str;
+    gsize len;
+    gboolean escaped;
+
+    if (s->p >= s->end || !is_quote(*s->p)) {
+        fields->valid = FALSE;
+        return scan_skip_value(s);
+    }
+
+    if (scan_string(s, &str, &len, &escaped) < 0) {
+        return -1;
+    }
+    if (escaped || len >= QMP_FIELD_SIZE) {
+        fields->valid = FALSE;
+        return 0;
+    }
+
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    return 0;
+}
+
+static int scan_data_member(QmpScanner *s, const gchar *key, gsize key_len,
+                            QmpFields *fields) {
+    if (key_is(key, key_len, "status")) {
+        fields->has_status = TRUE;
+        return scan_string_field(s, fields->status, fields);
+    }
+
+    return scan_skip_value(s);
+}
+
+static int scan_toplevel_member(QmpScanner *s, const gchar *key,
+                                gsize key_len, QmpFields *fields) {
+    if (key_is(key, key_len, "event")) {
+        fields->has_event = TRUE;
+        return scan_string_field(s, fields->event, fields);
+    } else if (key_is(key, key_len, "id")) {
+        fields->has_id = TRUE;
+        return scan_string_field(s, fields->id, fields);
+    } else if (key_is(key, key_len, "execute")
+               || key_is(key, key_len, "exec-oob")) {
+        fields->has_execute = TRUE;
+        fields->has_oob = key_is(key, key_len, "exec-oob");
+        return scan_string_field(s, fields->execute, fields);
+    } else if (key_is(key, key_len, "exec-colod")) {
+        fields->has_exec_colod = TRUE;
+        return scan_string_field(s, fields->exec_colod, fields);
+    } else if (key_is(key, key_len, "return")) {
+        fields->has_return = TRUE;
+    } else if (key_is(key, key_len, "error")) {
+        fields->has_error = TRUE;
+    } else if (key_is(key, key_len, "data") && s->p < s->end && *s->p == '{') {
+        return scan_object(s, scan_data_member, fields);
+    }
+
+    return scan_skip_value(s);
+}
+
+int qmp_scan_fields(const gchar *line, gsize len, QmpFields *fields) {
+    QmpScanner s = {line, line + len};
+
+    memset(fields, 0, sizeof(*fields));
+    fields->valid = TRUE;
+
+    if (scan_object(&s, scan_toplevel_member, fields) < 0) {
+        fields->valid = FALSE;
+        return -1;
+    }
+
+    scan_ws(&s);
+    if (s.p != s.end) {
+        fields->valid = FALSE;
+        return -1;
+    }
+
+    return 0;
+}
+
+struct QmpReader {
+    int fd;
+    gchar *buf;
+    gsize size, start, end, scanned;
+    // The byte after the last returned line is replaced by its terminating nul
+    gsize saved_pos;
+    gchar saved;
+    gboolean has_saved;
+};
+
+static void qmp_reader_restore(QmpReader *this) {
+    if (this->has_saved) {
+        this->buf[this->saved_pos] = this->saved;
+        this->has_saved = FALSE;
+    }
+}
+
+static gchar *qmp_reader_find(QmpReader *this) {
+    gchar *newline = memchr(this->buf + this->scanned, '\n',
+                            this->end - this->scanned);
+    if (!newline) {
+        this->scanned = this->end;
+    }
+    return newline;
+}
+
+static int qmp_reader_fill(QmpReader *this, GError **errp) {
+    if (this->start) {
+        memmove(this->buf, this->buf + this->start, this->end - this->start);
+        this->end -= this->start;
+        this->scanned -= this->start;
+        this->start = 0;
+    }
+
+    if (this->end == this->size) {
+        this->size *= 2;
+        this->buf = g_realloc(this->buf, this->size + 1);
+    }
+
+    while (TRUE) {
+        ssize_t ret = read(this->fd, this->buf + this->end,
+                           this->size - this->end);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            colod_error_set(errp, "Channel read failed: %s", g_strerror(errno));
+            return -1;
+        } else if (ret == 0) {
+            g_set_error(errp, COLOD_ERROR, COLOD_ERROR_EOF, "Channel got EOF");
+            return -1;
+        }
+
+        this->end += ret;
+        return 1;
+    }
+}
+
+int qmp_reader_next(QmpReader *this, gchar **line, gsize *len, GError **errp) {
+    qmp_reader_restore(this);
+
+    while (TRUE) {
+        gchar *newline = qmp_reader_find(this);
+        if (newline) {
+            gsize next = newline - this->buf + 1;
+
+            *line = this->buf + this->start;
+            *len = next - this->start;
+
+            this->saved_pos = next;
+            this->saved = this->buf[next];
+            this->has_saved = TRUE;
+            this->buf[next] = '\0';
+
+            this->start = this->scanned = next;
+            return 1;
+        }
+
+        int ret = qmp_reader_fill(this, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+}
+
+// Must not disturb the line that was returned last
+gboolean qmp_reader_pending(QmpReader *this) {
+    if (this->has_saved && this->saved == '\n') {
+        return TRUE;
+    }
+
+    return !!memchr(this->buf + this->scanned, '\n',
+                    this->end - this->scanned);
+}
+
+QmpReader *qmp_reader_new(int fd) {
+    QmpReader *this = g_new0(QmpReader, 1);
+
+    this->fd = fd;
+    this->size = QMP_READER_SIZE;
+    this->buf = g_malloc(this->size + 1);
+
+    return this;
+}
+
+void qmp_reader_free(QmpReader *this) {
+    if (!this) {
+        return;
+    }
+
+    g_free(this->buf);
+    g_free(this);
+}
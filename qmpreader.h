@@ -0,0 +1,45 @@
+/*
+ * COLO background daemon qmp reader
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QMPREADER_H
+#define QMPREADER_H
+
+#include <glib-2.0/glib.h>
+
+#define QMP_FIELD_SIZE 64
+
+// The members colod dispatches on, extracted without building a json tree.
+// If valid is false, the fields couldn't be extracted and the json tree
+// needs to be consulted instead.
+typedef struct QmpFields {
+    gboolean valid;
+    gboolean has_event, has_return, has_error, has_id, has_status;
+    gboolean has_exec_colod, has_execute, has_oob;
+    gchar event[QMP_FIELD_SIZE];
+    gchar id[QMP_FIELD_SIZE];
+    gchar status[QMP_FIELD_SIZE];
+    gchar exec_colod[QMP_FIELD_SIZE];
+    // "execute" or "exec-oob" of a command, has_oob tells which
+    gchar execute[QMP_FIELD_SIZE];
+} QmpFields;
+
+typedef struct QmpReader QmpReader;
+
+int qmp_scan_fields(const gchar *line, gsize len, QmpFields *fields);
+
+// Returns 1 and the next line (including the newline) pointing into the
+// reader buffer. It stays valid until the next call. Returns 0 if no complete
+// line is available yet and -1 on error or EOF.
+int qmp_reader_next(QmpReader *this, gchar **line, gsize *len, GError **errp);
+gboolean qmp_reader_pending(QmpReader *this);
+
+QmpReader *qmp_reader_new(int fd);
+void qmp_reader_free(QmpReader *this);
+
+#endif // QMPREADER_H
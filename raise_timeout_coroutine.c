@@ -10,6 +10,9 @@
 #include "raise_timeout_coroutine.h"
 #include "coroutine_stack.h"
 
+static QmpEventMatch match_stop = QMP_EVENT_MATCH("{'event': 'STOP'}");
+static QmpEventMatch match_resume = QMP_EVENT_MATCH("{'event': 'RESUME'}");
+
 struct ColodRaiseCoroutine {
     Coroutine coroutine;
     ColodRaiseCoroutine **ptr;
@@ -17,6 +20,9 @@ struct ColodRaiseCoroutine {
     const ColodContext *ctx;
 };
 
+static CoroutineType raise_timeout_coroutine_type =
+    COROUTINE_POOL("raise timeout", ColodRaiseCoroutine, 4);
+
 static gboolean _colod_raise_timeout_co(Coroutine *coroutine,
                                         ColodRaiseCoroutine *this) {
     struct {
@@ -28,13 +34,13 @@ static gboolean _colod_raise_timeout_co(Coroutine *coroutine,
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
     co_recurse(ret = qmp_wait_event_co(coroutine, this->qmp, 0,
-                                       "{'event': 'STOP'}", NULL));
+                                       &match_stop, NULL));
     if (ret < 0) {
         return G_SOURCE_REMOVE;
     }
 
     co_recurse(ret = qmp_wait_event_co(coroutine, this->qmp, 0,
-                                       "{'event': 'RESUME'}", NULL));
+                                       &match_resume, NULL));
     if (ret < 0) {
         return G_SOURCE_REMOVE;
     }
@@ -42,13 +48,13 @@ static gboolean _colod_raise_timeout_co(Coroutine *coroutine,
     CO timeout_source_id = g_timeout_add(60*1000, coroutine->cb, coroutine);
     while (TRUE) {
         co_recurse(ret = qmp_wait_event_co(coroutine, this->qmp, 30*1000,
-                                           "{'event': 'STOP'}", NULL));
+                                           &match_stop, NULL));
         if (ret < 0) {
             break;
         }
 
         co_recurse(ret = qmp_wait_event_co(coroutine, this->qmp, 0,
-                                           "{'event': 'RESUME'}", NULL));
+                                           &match_resume, NULL));
         if (ret < 0) {
             break;
         }
@@ -69,12 +75,12 @@ static gboolean colod_raise_timeout_co(gpointer data) {
         return GPOINTER_TO_INT(coroutine->yield_value);
     }
 
-    qmp_set_timeout(this->qmp, this->ctx->qmp_timeout_low);
+    qmp_set_busy(this->qmp, FALSE);
     qmp_unref(this->qmp);
 
     colod_assert_remove_one_source(coroutine);
     *this->ptr = NULL;
-    g_free(this);
+    coroutine_free(this);
     return ret;
 }
 
@@ -100,9 +106,9 @@ void colod_raise_timeout_coroutine(ColodRaiseCoroutine **ptr,
         return;
     }
 
-    qmp_set_timeout(qmp, ctx->qmp_timeout_high);
+    qmp_set_busy(qmp, TRUE);
 
-    this = g_new0(ColodRaiseCoroutine, 1);
+    this = coroutine_new(&raise_timeout_coroutine_type);
     coroutine = &this->coroutine;
     coroutine->cb = colod_raise_timeout_co;
     this->qmp = qmp_ref(qmp);
@@ -16,7 +16,8 @@ void _ch_write_co(Coroutine *coroutine, GIOChannel *channel,
                   const gchar *buf, guint timeout) {
     int ret;
     GError *local_errp = NULL;
-    ret = _colod_channel_write_timeout_co(coroutine, channel, buf, strlen(buf),
+    ret = _colod_channel_write_timeout_co(coroutine, channel, NULL, buf,
+                                          strlen(buf),
                                           timeout, &local_errp);
     if (coroutine->yield) {
         return;
@@ -35,7 +36,7 @@ void _ch_readln_co(Coroutine *coroutine, GIOChannel *channel,
     int ret;
     GError *local_errp = NULL;
 
-    ret = _colod_channel_read_line_timeout_co(coroutine, channel, buf, len,
+    ret = _colod_channel_read_line_timeout_co(coroutine, channel, NULL, buf, len,
                                               timeout, &local_errp);
     if (coroutine->yield) {
         return;
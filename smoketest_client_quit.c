@@ -26,6 +26,9 @@ struct SmokeTestcase {
     gboolean do_quit, quit;
 };
 
+static CoroutineType testcase_type =
+    COROUTINE_POOL("testcase", SmokeTestcase, COROUTINE_STACK_SIZE);
+
 static gboolean logged = FALSE;
 
 void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
@@ -105,7 +108,7 @@ static SmokeTestcase *testcase_new(SmokeColodContext *sctx,
     SmokeTestcase *this;
     Coroutine *coroutine;
 
-    this = g_new0(SmokeTestcase, 1);
+    this = coroutine_new(&testcase_type);
     coroutine = &this->coroutine;
     coroutine->cb = testcase_co;
     this->sctx = sctx;
@@ -124,7 +127,7 @@ static void testcase_free(SmokeTestcase *this) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
-    g_free(this);
+    coroutine_free(this);
 }
 
 static void test_run(gconstpointer opaque) {
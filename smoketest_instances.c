@@ -0,0 +1,277 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "base_types.h"
+#include "smoketest.h"
+#include "coroutine_stack.h"
+#include "smoke_util.h"
+#include "cpg.h"
+
+struct SmokeTestcase {
+    Coroutine coroutine;
+    SmokeColodContext *sctx;
+    CpgMux *mux;
+    gboolean do_quit, quit;
+};
+
+static CoroutineType testcase_type =
+    COROUTINE_POOL("testcase", SmokeTestcase, COROUTINE_STACK_SIZE);
+
+static gchar *write_instances(const gchar *contents) {
+    gchar *path = g_build_filename(smoke_basedir(), "instances.conf", NULL);
+
+    g_assert_true(g_file_set_contents(path, contents, -1, NULL));
+    return path;
+}
+
+static ColodContext *load_instances(const gchar *contents, guint *count,
+                                    GError **errp) {
+    ColodContext template = { 0 };
+    ColodContext *ctxs;
+    gchar *path;
+
+    path = write_instances(contents);
+    template.base_dir = smoke_basedir();
+    template.instances = path;
+    ctxs = daemon_load_instances(&template, count, errp);
+    g_free(path);
+
+    return ctxs;
+}
+
+static void free_instances(ColodContext *ctxs, guint count) {
+    for (guint i = 0; i < count; i++) {
+        g_free((gchar *) ctxs[i].instance_name);
+        g_free((gchar *) ctxs[i].base_dir);
+    }
+    g_free(ctxs);
+}
+
+static void test_load_unknown_key() {
+    GError *errp = NULL;
+    guint count;
+
+    g_assert_null(load_instances("[vm-a]\nbase_port=9000\nqmeu=/bin/true\n",
+                                 &count, &errp));
+    g_assert_nonnull(strstr(errp->message, "Unknown key qmeu"));
+    g_error_free(errp);
+}
+
+static void test_load_negative_port() {
+    GError *errp = NULL;
+    guint count;
+
+    g_assert_null(load_instances("[vm-a]\nbase_port=-1\n", &count, &errp));
+    g_assert_nonnull(strstr(errp->message, "base_port must not be negative"));
+    g_error_free(errp);
+}
+
+static void test_load_base_dir() {
+    GError *errp = NULL;
+    ColodContext *ctxs;
+    gchar *expected;
+    guint count;
+
+    ctxs = load_instances("[vm-a]\nbase_port=9000\n"
+                          "[vm-b]\nbase_port=9100\nfailover_priority=2\n",
+                          &count, &errp);
+    g_assert_nonnull(ctxs);
+    g_assert_cmpuint(count, ==, 2);
+
+    g_assert_cmpstr(ctxs[0].instance_name, ==, "vm-a");
+    g_assert_cmpuint(ctxs[0].base_port, ==, 9000);
+    expected = g_build_filename(smoke_basedir(), "vm-a", NULL);
+    g_assert_cmpstr(ctxs[0].base_dir, ==, expected);
+    g_assert_true(g_file_test(expected, G_FILE_TEST_IS_DIR));
+    g_free(expected);
+
+    g_assert_cmpstr(ctxs[1].instance_name, ==, "vm-b");
+    g_assert_cmpuint(ctxs[1].failover_priority, ==, 2);
+
+    free_instances(ctxs, count);
+}
+
+#define expect_co(...) co_wrap(_expect_co(__VA_ARGS__))
+static int _expect_co(Coroutine *coroutine, GIOChannel *channel,
+                      const gchar *command, const gchar *needle) {
+    gchar *line;
+    gsize len;
+
+    co_begin(int, -1);
+
+    co_recurse(ch_write_co(coroutine, channel, command, 1000));
+    co_recurse(ch_readln_co(coroutine, channel, &line, &len, 1000));
+    if (!strstr(line, needle)) {
+        g_error("Expected %s in reply: %s", needle, line);
+    }
+    g_free(line);
+
+    return 0;
+    co_end;
+}
+
+static gboolean _testcase_co(Coroutine *coroutine, SmokeTestcase *this) {
+    struct {
+        GIOChannel *other_ch;
+    } *co;
+    SmokeColodContext *sctx = this->sctx;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    g_timeout_add(200, coroutine->cb, this);
+    co_yield_int(G_SOURCE_REMOVE);
+
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'query-status'}\n",
+                         "No instance selected"));
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'query-instances'}\n",
+                         "[\"vm-a\",\"vm-b\"]"));
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'select-instance',"
+                         " 'instance': 'vm-c'}\n",
+                         "Unknown instance"));
+
+    // Each instance has its peer on another node, only vm-a's peer leaves
+    colod_cpg_stub_mux_deliver(this->mux, "vm-a", MESSAGE_HELLO, 2, 100);
+    colod_cpg_stub_mux_deliver(this->mux, "vm-b", MESSAGE_HELLO, 3, 200);
+    colod_cpg_stub_mux_leave(this->mux, 4, 300);
+    colod_cpg_stub_mux_leave(this->mux, 2, 100);
+
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'select-instance',"
+                         " 'instance': 'vm-a'}\n",
+                         "\"return\""));
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'query-status'}\n",
+                         "\"peer-failed\": true"));
+
+    CO other_ch = smoke_open_client(NULL);
+    assert(CO other_ch);
+    co_recurse(expect_co(coroutine, CO other_ch,
+                         "{'exec-colod': 'select-instance',"
+                         " 'instance': 'vm-b'}\n",
+                         "\"return\""));
+    co_recurse(expect_co(coroutine, CO other_ch,
+                         "{'exec-colod': 'query-status'}\n",
+                         "\"peer-failed\": false"));
+
+    co_recurse(expect_co(coroutine, sctx->client_ch,
+                         "{'exec-colod': 'quit'}\n", "\"return\""));
+    co_recurse(expect_co(coroutine, CO other_ch,
+                         "{'exec-colod': 'quit'}\n", "\"return\""));
+    g_io_channel_unref(CO other_ch);
+
+    while (!this->do_quit) {
+        progress_source_add(coroutine->cb, this);
+        co_yield_int(G_SOURCE_REMOVE);
+    }
+    this->quit = TRUE;
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean testcase_co(gpointer data) {
+    SmokeTestcase *this = data;
+    Coroutine *coroutine = data;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _testcase_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    return ret;
+}
+
+static SmokeTestcase *testcase_new(SmokeColodContext *sctx, CpgMux *mux) {
+    SmokeTestcase *this;
+    Coroutine *coroutine;
+
+    this = coroutine_new(&testcase_type);
+    coroutine = &this->coroutine;
+    coroutine->cb = testcase_co;
+    this->sctx = sctx;
+    this->mux = mux;
+
+    g_idle_add(testcase_co, this);
+    return this;
+}
+
+static void testcase_free(SmokeTestcase *this) {
+    this->do_quit = TRUE;
+
+    while (!this->quit) {
+        g_main_context_iteration(g_main_context_default(), TRUE);
+    }
+
+    coroutine_free(this);
+}
+
+static void test_two_instances() {
+    GError *errp = NULL;
+    SmokeColodContext *sctx;
+    SmokeTestcase *testcase;
+    ColodContext template;
+    ColodContext *ctxs;
+    CpgMux *mux;
+    gchar *path;
+    guint count;
+
+    sctx = smoke_context_new(&errp);
+    g_assert_true(sctx);
+    // The instances join the mux instead
+    cpg_unref(sctx->cctx.cpg);
+
+    path = write_instances("[vm-a]\nbase_port=9000\n"
+                           "[vm-b]\nbase_port=9100\n");
+    template = sctx->cctx;
+    template.base_dir = smoke_basedir();
+    template.instances = path;
+    ctxs = daemon_load_instances(&template, &count, &errp);
+    g_assert_nonnull(ctxs);
+    g_free(path);
+
+    mux = colod_open_cpg_mux(NULL, &errp);
+    g_assert_nonnull(mux);
+    for (guint i = 0; i < count; i++) {
+        ctxs[i].mngmt_listen_fd = sctx->cctx.mngmt_listen_fd;
+        ctxs[i].cpg = colod_cpg_mux_join(mux, ctxs[i].instance_name, &errp);
+        g_assert_nonnull(ctxs[i].cpg);
+    }
+
+    testcase = testcase_new(sctx, mux);
+
+    daemon_mainloop_instances(ctxs, count);
+
+    testcase_free(testcase);
+    cpg_mux_unref(mux);
+    free_instances(ctxs, count);
+    smoke_context_free(sctx);
+}
+
+int main(int argc, char **argv) {
+    smoke_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/instances/load/unknown_key", test_load_unknown_key);
+    g_test_add_func("/instances/load/negative_port", test_load_negative_port);
+    g_test_add_func("/instances/load/base_dir", test_load_base_dir);
+    g_test_add_func("/instances/two_instances", test_two_instances);
+
+    return g_test_run();
+}
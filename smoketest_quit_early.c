@@ -25,6 +25,9 @@ struct SmokeTestcase {
     gboolean do_quit, quit;
 };
 
+static CoroutineType testcase_type =
+    COROUTINE_POOL("testcase", SmokeTestcase, COROUTINE_STACK_SIZE);
+
 static gboolean _testcase_co(Coroutine *coroutine, SmokeTestcase *this) {
     SmokeColodContext *sctx = this->sctx;
     gchar *line;
@@ -78,7 +81,7 @@ static SmokeTestcase *testcase_new(SmokeColodContext *sctx,
     SmokeTestcase *this;
     Coroutine *coroutine;
 
-    this = g_new0(SmokeTestcase, 1);
+    this = coroutine_new(&testcase_type);
     coroutine = &this->coroutine;
     coroutine->cb = testcase_co;
     this->sctx = sctx;
@@ -97,7 +100,7 @@ static void testcase_free(SmokeTestcase *this) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
-    g_free(this);
+    coroutine_free(this);
 }
 
 static void test_run(gconstpointer opaque) {
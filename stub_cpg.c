@@ -7,6 +7,8 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <assert.h>
+
 #include <glib-2.0/glib.h>
 
 #include "cpg.h"
@@ -14,8 +16,24 @@
 
 struct Cpg {
     ColodCallbackHead callbacks;
+    gboolean loopback;
+    CpgMux *mux;
+    gchar *instance;
+    CpgPeer peer;
+};
+
+struct CpgMux {
+    // instance name -> Cpg, the Cpgs hold a reference to the mux
+    GHashTable *instances;
 };
 
+static CpgMux *cpg_mux_ref(CpgMux *this);
+
+typedef struct CpgLoopback {
+    Cpg *cpg;
+    ColodMessage message;
+} CpgLoopback;
+
 void colod_cpg_add_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
     ColodCallbackFunc func = (ColodCallbackFunc) _func;
     colod_callback_add(&this->callbacks, func, user_data);
@@ -36,12 +54,114 @@ void colod_cpg_stub_notify(Cpg *this, ColodMessage message,
     }
 }
 
-void colod_cpg_send(G_GNUC_UNUSED Cpg *cpg, G_GNUC_UNUSED uint32_t message) {}
+void colod_cpg_stub_set_loopback(Cpg *this, gboolean loopback) {
+    this->loopback = loopback;
+}
+
+void colod_cpg_stub_mux_deliver(CpgMux *mux, const gchar *instance,
+                                ColodMessage message, uint32_t nodeid,
+                                uint32_t pid) {
+    Cpg *cpg = g_hash_table_lookup(mux->instances, instance);
+
+    if (!cpg) {
+        return;
+    }
+
+    cpg_peer_seen(&cpg->peer, nodeid, pid);
+    colod_cpg_stub_notify(cpg, message, FALSE, FALSE);
+}
+
+void colod_cpg_stub_mux_leave(CpgMux *mux, uint32_t nodeid, uint32_t pid) {
+    GList *cpgs, *entry;
+
+    // The callbacks may drop the last reference to a Cpg or the mux
+    cpg_mux_ref(mux);
+    cpgs = g_hash_table_get_values(mux->instances);
+    for (entry = cpgs; entry; entry = entry->next) {
+        cpg_ref(entry->data);
+    }
+
+    for (entry = cpgs; entry; entry = entry->next) {
+        Cpg *cpg = entry->data;
+
+        if (cpg_peer_left(&cpg->peer, nodeid, pid)) {
+            colod_cpg_stub_notify(cpg, MESSAGE_NONE, FALSE, TRUE);
+        }
+        cpg_unref(cpg);
+    }
+
+    g_list_free(cpgs);
+    cpg_mux_unref(mux);
+}
+
+static gboolean colod_cpg_loopback_cb(gpointer data) {
+    CpgLoopback *loopback = data;
+
+    colod_cpg_stub_notify(loopback->cpg, loopback->message, TRUE, FALSE);
+
+    cpg_unref(loopback->cpg);
+    g_free(loopback);
+    return G_SOURCE_REMOVE;
+}
+
+void colod_cpg_send(Cpg *cpg, uint32_t message) {
+    CpgLoopback *loopback;
+
+    if (!cpg->loopback) {
+        return;
+    }
+
+    // Like corosync, deliver our own messages back to us asynchronously
+    loopback = g_new0(CpgLoopback, 1);
+    loopback->cpg = cpg_ref(cpg);
+    loopback->message = message;
+    g_idle_add(colod_cpg_loopback_cb, loopback);
+}
 
 Cpg *colod_open_cpg(G_GNUC_UNUSED ColodContext *ctx, G_GNUC_UNUSED GError **errp) {
     return g_rc_box_new0(Cpg);
 }
 
+CpgMux *colod_open_cpg_mux(G_GNUC_UNUSED const gchar *group,
+                           G_GNUC_UNUSED GError **errp) {
+    CpgMux *mux;
+
+    mux = g_rc_box_new0(CpgMux);
+    mux->instances = g_hash_table_new(g_str_hash, g_str_equal);
+    return mux;
+}
+
+Cpg *colod_cpg_mux_join(CpgMux *mux, const gchar *instance, GError **errp) {
+    Cpg *cpg;
+
+    if (g_hash_table_contains(mux->instances, instance)) {
+        colod_error_set(errp, "Instance %s given twice", instance);
+        return NULL;
+    }
+
+    cpg = g_rc_box_new0(Cpg);
+    cpg->mux = cpg_mux_ref(mux);
+    cpg->instance = g_strdup(instance);
+    g_hash_table_insert(mux->instances, cpg->instance, cpg);
+
+    return cpg;
+}
+
+static void cpg_mux_free(gpointer data) {
+    CpgMux *mux = data;
+
+    assert(!g_hash_table_size(mux->instances));
+    g_hash_table_unref(mux->instances);
+}
+
+static CpgMux *cpg_mux_ref(CpgMux *this) {
+    return g_rc_box_acquire(this);
+}
+
+void cpg_mux_unref(CpgMux *this) {
+    g_rc_box_release_full(this, cpg_mux_free);
+}
+
 Cpg *cpg_new(Cpg *cpg, G_GNUC_UNUSED GError **errp) {
     return cpg;
 }
@@ -50,6 +170,11 @@ void cpg_free(gpointer data) {
     Cpg *cpg = data;
 
     colod_callback_clear(&cpg->callbacks);
+    if (cpg->mux) {
+        g_hash_table_remove(cpg->mux->instances, cpg->instance);
+        cpg_mux_unref(cpg->mux);
+    }
+    g_free(cpg->instance);
 }
 
 Cpg *cpg_ref(Cpg *this) {
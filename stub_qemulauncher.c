@@ -3,10 +3,12 @@
 
 #include "qemulauncher.h"
 #include "qmp.h"
+#include "qmpcommands.h"
 
 struct QemuLauncher {
     int dummy;
     int qmp_timeout;
+    QmpCommands *commands;
 };
 
 static int qmp_fd, qmp_yank_fd;
@@ -29,18 +31,32 @@ int qemu_launcher_kill(QemuLauncher *this) {
     return 0;
 }
 
+static ColodQmpState *qemu_launcher_launch(QemuLauncher *this, GError **errp) {
+    ColodQmpState *qmp;
+
+    qmp = qmp_new(qmp_commands_get_instance_name(this->commands), qmp_fd,
+                  qmp_yank_fd, -1, this->qmp_timeout, errp);
+    if (!qmp) {
+        return NULL;
+    }
+
+    JsonNode *yank_instances = qmp_commands_get_yank_instances(this->commands);
+    qmp_set_yank_instances(qmp, yank_instances);
+    json_node_unref(yank_instances);
+
+    return qmp;
+}
+
 ColodQmpState *_qemu_launcher_launch_primary(Coroutine *coroutine, QemuLauncher *this, GError **errp) {
     (void) coroutine;
-    (void) errp;
 
-    return qmp_new(qmp_fd, qmp_yank_fd, this->qmp_timeout, errp);
+    return qemu_launcher_launch(this, errp);
 }
 
 ColodQmpState *_qemu_launcher_launch_secondary(Coroutine *coroutine, QemuLauncher *this, GError **errp) {
     (void) coroutine;
-    (void) errp;
 
-    return qmp_new(qmp_fd, qmp_yank_fd, this->qmp_timeout, errp);
+    return qemu_launcher_launch(this, errp);
 }
 
 void qemu_launcher_set_disk_size(QemuLauncher *this, char *disk_size) {
@@ -50,10 +66,10 @@ void qemu_launcher_set_disk_size(QemuLauncher *this, char *disk_size) {
 
 QemuLauncher *qemu_launcher_new(QmpCommands *commands, const char *base_dir,
                                 guint qmp_timeout) {
-    (void) commands;
     (void) base_dir;
     QemuLauncher *this = g_rc_box_new0(QemuLauncher);
     this->qmp_timeout = qmp_timeout;
+    this->commands = commands;
     return this;
 }
 
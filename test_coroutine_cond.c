@@ -0,0 +1,153 @@
+/*
+ * COLO background daemon CoroutineCond test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib-2.0/glib.h>
+
+#include "coroutine.h"
+#include "coroutine_stack.h"
+#include "coutil.h"
+#include "timer_wheel.h"
+
+FILE *trace = NULL;
+gboolean do_syslog = FALSE;
+
+void colod_trace(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    vfprintf(stderr, fmt, args);
+    fflush(stderr);
+
+    va_end(args);
+}
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+typedef struct TestCoroutine {
+    Coroutine coroutine;
+    const gchar *name;
+    guint threshold;
+    guint wakes;
+} TestCoroutine;
+
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 1);
+static CoroutineCond cond = { 0 };
+static guint value;
+static GString *order;
+static guint running;
+static GMainLoop *mainloop;
+
+static gboolean _test_cond_co(Coroutine *coroutine, TestCoroutine *this) {
+    struct {
+        guint timeout_id;
+    } *co;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    CO timeout_id = colod_timer_add(30, coroutine->cb, coroutine);
+
+    while (value < this->threshold) {
+        colod_cond_wait(&cond, coroutine);
+        co_yield_int(G_SOURCE_REMOVE);
+
+        gboolean signalled = colod_cond_woken(&cond, coroutine);
+        if (colod_timer_current() == CO timeout_id) {
+            g_string_append_c(order, g_ascii_toupper(this->name[0]));
+            return G_SOURCE_REMOVE;
+        }
+        assert(signalled);
+        this->wakes++;
+    }
+
+    colod_timer_remove(CO timeout_id);
+    g_string_append(order, this->name);
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_cond_co(gpointer data) {
+    TestCoroutine *this = data;
+    Coroutine *coroutine = &this->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_cond_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    running--;
+    if (!running) {
+        g_main_loop_quit(mainloop);
+    }
+    return ret;
+}
+
+static gboolean test_signal_cb(G_GNUC_UNUSED gpointer data) {
+    value++;
+    // Signalling twice before the waiters run wakes them only once
+    colod_cond_broadcast(&cond);
+    colod_cond_broadcast(&cond);
+    return G_SOURCE_REMOVE;
+}
+
+// Waiters are woken on every broadcast, re-check their predicate and the
+// one whose predicate never becomes false runs into its timeout
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    TestCoroutine coroutines[] = {
+        {.name = "a", .threshold = 1},
+        {.name = "b", .threshold = 2},
+        {.name = "c", .threshold = 3},
+    };
+
+    order = g_string_new(NULL);
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+
+    // Nobody waiting
+    colod_cond_broadcast(&cond);
+
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_init(&coroutines[i].coroutine, &test_coroutine_type);
+        coroutines[i].coroutine.cb = test_cond_co;
+        running++;
+        test_cond_co(&coroutines[i]);
+    }
+    assert(g_queue_get_length(&cond.waiters) == 3);
+
+    colod_timer_add(5, test_signal_cb, NULL);
+    colod_timer_add(10, test_signal_cb, NULL);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "abC"));
+    assert(coroutines[0].wakes == 1);
+    assert(coroutines[1].wakes == 2);
+    assert(coroutines[2].wakes == 2);
+    assert(g_queue_is_empty(&cond.waiters));
+
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_destroy(&coroutines[i].coroutine);
+    }
+
+    g_main_loop_unref(mainloop);
+    g_string_free(order, TRUE);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * COLO background daemon CoroutineLock test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib-2.0/glib.h>
+
+#include "coroutine.h"
+#include "coroutine_stack.h"
+#include "coutil.h"
+
+FILE *trace = NULL;
+gboolean do_syslog = FALSE;
+
+void colod_trace(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    vfprintf(stderr, fmt, args);
+    fflush(stderr);
+
+    va_end(args);
+}
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+typedef struct TestCoroutine {
+    Coroutine coroutine;
+    const gchar *name;
+    int priority;
+    // Waits like the qmp event reader, which must never be cancelled
+    gboolean internal;
+} TestCoroutine;
+
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 1);
+static CoroutineLock lock = { 0 };
+static GString *order;
+static guint running;
+static GMainLoop *mainloop;
+static const char *timeout_site;
+static guint64 start_resumes, timeout_resumes, timeout_wait_us;
+
+static gboolean _test_lock_co(Coroutine *coroutine, TestCoroutine *this) {
+    struct {
+        guint source_id;
+    } *co;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    if (this->internal) {
+        colod_lock_prio_co(lock, this->priority);
+        ret = 0;
+    } else {
+        colod_lock_cancellable_co(lock, this->priority, ret);
+    }
+    if (ret < 0) {
+        assert(lock.holder != coroutine);
+        g_string_append_c(order, g_ascii_toupper(this->name[0]));
+        return G_SOURCE_REMOVE;
+    }
+    colod_lock_co(lock);
+    assert(lock.holder == coroutine && lock.count == 2);
+    g_string_append(order, this->name);
+
+    CO source_id = g_timeout_add(10, coroutine->cb, coroutine);
+    co_yield_int(G_SOURCE_REMOVE);
+    timeout_site = coroutine->site;
+
+    colod_unlock_co(lock);
+    colod_unlock_co(lock);
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_lock_co(gpointer data) {
+    TestCoroutine *this = data;
+    Coroutine *coroutine = &this->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_lock_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    running--;
+    if (!running) {
+        g_main_loop_quit(mainloop);
+    }
+    return ret;
+}
+
+static void test_run(TestCoroutine *coroutines, guint num, int cancel,
+                     const gchar *expected) {
+    g_string_truncate(order, 0);
+
+    for (guint i = 0; i < num; i++) {
+        coroutine_init(&coroutines[i].coroutine, &test_coroutine_type);
+        coroutines[i].coroutine.cb = test_lock_co;
+        running++;
+        test_lock_co(&coroutines[i]);
+    }
+
+    // Only the holder's timeout is pending, waiters don't poll
+    assert(order->len == 1);
+    assert(g_queue_get_length(&lock.waiters) == num - 1);
+
+    if (cancel) {
+        colod_lock_cancel(&lock, cancel);
+    }
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, expected));
+    assert(!lock.holder && !lock.count);
+    assert(g_queue_is_empty(&lock.waiters));
+    assert(g_queue_is_empty(&lock.cancelled));
+    assert(!lock.wake_source_id);
+
+    for (guint i = 0; i < num; i++) {
+        coroutine_destroy(&coroutines[i].coroutine);
+    }
+    assert(test_coroutine_type.live == 0);
+}
+
+static void test_profile_cb(G_GNUC_UNUSED const char *type, const char *site,
+                            guint64 resumes, G_GNUC_UNUSED guint64 cpu_us,
+                            guint64 wait_us, G_GNUC_UNUSED gpointer data) {
+    if (!strcmp(site, "start")) {
+        start_resumes += resumes;
+    } else if (!strcmp(site, timeout_site)) {
+        timeout_resumes += resumes;
+        timeout_wait_us += wait_us;
+    }
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    TestCoroutine fifo[] = {
+        {.name = "a", .priority = 0},
+        {.name = "b", .priority = 0},
+        {.name = "c", .priority = 0},
+        {.name = "d", .priority = 1},
+        {.name = "e", .priority = -1},
+        {.name = "f", .priority = 0},
+    };
+    TestCoroutine cancel[] = {
+        {.name = "a", .priority = 0},
+        {.name = "b", .priority = 0},
+        {.name = "c", .priority = 2},
+        {.name = "d", .priority = 1},
+        {.name = "e", .priority = 3},
+        {.name = "f", .priority = 0, .internal = TRUE},
+        {.name = "g", .priority = 0},
+    };
+
+    order = g_string_new(NULL);
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+    coroutine_profiling = TRUE;
+
+    test_run(fifo, G_N_ELEMENTS(fifo), 0, "adbcfe");
+    test_run(cancel, G_N_ELEMENTS(cancel), 2, "aGBDecf");
+    assert(test_coroutine_type.depth_high == 1);
+    assert(test_coroutine_type.frame_high == sizeof(guint));
+
+    // Every coroutine started once, the holders slept 10ms each
+    coroutine_profile_foreach(test_profile_cb, NULL);
+    assert(start_resumes == G_N_ELEMENTS(fifo) + G_N_ELEMENTS(cancel));
+    assert(timeout_resumes == 10);
+    assert(timeout_wait_us >= 10 * 10000);
+
+    g_main_loop_unref(mainloop);
+    g_string_free(order, TRUE);
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * COLO background daemon CoroutineWatch test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib-2.0/glib.h>
+
+#include "coroutine.h"
+#include "coroutine_stack.h"
+#include "coutil.h"
+#include "timer_wheel.h"
+#include "poller.h"
+
+FILE *trace = NULL;
+gboolean do_syslog = FALSE;
+
+void colod_trace(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    vfprintf(stderr, fmt, args);
+    fflush(stderr);
+
+    va_end(args);
+}
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+typedef struct TestCoroutine {
+    Coroutine coroutine;
+    const gchar *name;
+    gint priority;
+    guint timeout;
+} TestCoroutine;
+
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 1);
+static int fds[2];
+static CoroutineWatch *watch;
+static GString *order;
+static guint spurious;
+static guint running;
+static GMainLoop *mainloop;
+
+static gboolean _test_watch_co(Coroutine *coroutine, TestCoroutine *this) {
+    struct {
+        guint timeout_id;
+    } *co;
+    char c;
+    ssize_t ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    CO timeout_id = 0;
+    if (this->timeout) {
+        CO timeout_id = colod_timer_add(this->timeout, coroutine->cb,
+                                        coroutine);
+    }
+
+    while (TRUE) {
+        colod_watch_arm(watch, coroutine, G_IO_IN, this->priority);
+        co_yield_int(G_SOURCE_REMOVE);
+        if (!colod_watch_woken(watch, coroutine)) {
+            assert(CO timeout_id && colod_timer_current() == CO timeout_id);
+            g_string_append_c(order, g_ascii_toupper(this->name[0]));
+            return G_SOURCE_REMOVE;
+        }
+
+        ret = read(fds[0], &c, 1);
+        if (ret < 0) {
+            assert(errno == EAGAIN);
+            spurious++;
+            continue;
+        }
+        break;
+    }
+
+    colod_timer_remove(CO timeout_id);
+    g_string_append(order, this->name);
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_watch_co(gpointer data) {
+    TestCoroutine *this = data;
+    Coroutine *coroutine = &this->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_watch_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    running--;
+    if (!running) {
+        g_main_loop_quit(mainloop);
+    }
+    return ret;
+}
+
+static gboolean test_write_cb(G_GNUC_UNUSED gpointer data) {
+    ssize_t ret = write(fds[1], "x", 1);
+    assert(ret == 1);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_close_cb(G_GNUC_UNUSED gpointer data) {
+    close(fds[1]);
+    return G_SOURCE_REMOVE;
+}
+
+// Each byte only wakes the highest priority waiter, the timeout and the
+// HUP are attributed to the right coroutine
+static void test_run() {
+    TestCoroutine coroutines[] = {
+        {.name = "z", .priority = G_PRIORITY_LOW},
+        {.name = "l", .priority = G_PRIORITY_DEFAULT_IDLE},
+        {.name = "t", .priority = G_PRIORITY_LOW, .timeout = 30},
+        {.name = "h", .priority = G_PRIORITY_DEFAULT},
+    };
+    int ret;
+
+    ret = pipe(fds);
+    assert(!ret);
+    ret = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    assert(!ret);
+
+    g_string_truncate(order, 0);
+    spurious = 0;
+    watch = colod_watch_new(fds[0], "test watch");
+
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_init(&coroutines[i].coroutine, &test_coroutine_type);
+        coroutines[i].coroutine.cb = test_watch_co;
+        running++;
+        test_watch_co(&coroutines[i]);
+    }
+    colod_timer_add(5, test_write_cb, NULL);
+    colod_timer_add(10, test_write_cb, NULL);
+    colod_timer_add(40, test_close_cb, NULL);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "hlTz"));
+    assert(!spurious);
+
+    colod_watch_free(watch);
+    close(fds[0]);
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_destroy(&coroutines[i].coroutine);
+    }
+}
+
+// More coroutines than the initial waiter array holds
+static void test_many() {
+    TestCoroutine coroutines[] = {
+        {.name = "a", .priority = G_PRIORITY_DEFAULT},
+        {.name = "b", .priority = G_PRIORITY_DEFAULT},
+        {.name = "c", .priority = G_PRIORITY_DEFAULT},
+        {.name = "d", .priority = G_PRIORITY_DEFAULT},
+        {.name = "e", .priority = G_PRIORITY_DEFAULT},
+        {.name = "f", .priority = G_PRIORITY_DEFAULT},
+    };
+    ssize_t len;
+    int ret;
+
+    ret = pipe(fds);
+    assert(!ret);
+    ret = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    assert(!ret);
+
+    g_string_truncate(order, 0);
+    spurious = 0;
+    watch = colod_watch_new(fds[0], "test watch");
+
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_init(&coroutines[i].coroutine, &test_coroutine_type);
+        coroutines[i].coroutine.cb = test_watch_co;
+        running++;
+        test_watch_co(&coroutines[i]);
+    }
+    len = write(fds[1], "xxxxxx", 6);
+    assert(len == 6);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "abcdef"));
+    assert(!spurious);
+
+    colod_watch_free(watch);
+    close(fds[0]);
+    close(fds[1]);
+    for (guint i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutine_destroy(&coroutines[i].coroutine);
+    }
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    GError *errp = NULL;
+    int ret;
+
+    order = g_string_new(NULL);
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+
+    test_run();
+    test_many();
+    ret = colod_poller_enable(&errp);
+    assert(!ret);
+    test_run();
+    test_many();
+
+    g_main_loop_unref(mainloop);
+    g_string_free(order, TRUE);
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * COLO background daemon ColodWriter test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib-2.0/glib.h>
+
+#include "coroutine.h"
+#include "coroutine_stack.h"
+#include "coutil.h"
+#include "timer_wheel.h"
+#include "poller.h"
+
+FILE *trace = NULL;
+gboolean do_syslog = FALSE;
+
+void colod_trace(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    vfprintf(stderr, fmt, args);
+    fflush(stderr);
+
+    va_end(args);
+}
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+typedef struct TestCoroutine {
+    Coroutine coroutine;
+    const gchar *name;
+    gsize len;
+    guint timeout;
+    gchar *buf;
+    int ret;
+} TestCoroutine;
+
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 2);
+static int fds[2];
+static CoroutineWatch *write_watch, *read_watch;
+static ColodWriter *writer;
+static GString *order, *received;
+static gsize expected;
+static guint running;
+static GMainLoop *mainloop;
+
+static void test_done() {
+    running--;
+    if (!running) {
+        g_main_loop_quit(mainloop);
+    }
+}
+
+static gboolean _test_write_co(Coroutine *coroutine, TestCoroutine *this) {
+    GError *local_errp = NULL;
+    int ret;
+
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    co_recurse(ret = colod_writer_write_co(coroutine, writer, this->buf,
+                                           this->len, this->timeout,
+                                           &local_errp));
+    this->ret = ret;
+    if (ret < 0) {
+        g_string_append_c(order, g_ascii_toupper(this->name[0]));
+        g_error_free(local_errp);
+    } else {
+        g_string_append(order, this->name);
+    }
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_write_co(gpointer data) {
+    TestCoroutine *this = data;
+    Coroutine *coroutine = &this->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_write_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    test_done();
+    return ret;
+}
+
+static TestCoroutine *test_write_new(const gchar *name, gsize len,
+                                     guint timeout) {
+    TestCoroutine *this = g_new0(TestCoroutine, 1);
+
+    coroutine_init(&this->coroutine, &test_coroutine_type);
+    this->coroutine.cb = test_write_co;
+    this->name = name;
+    this->len = len;
+    this->timeout = timeout;
+    this->buf = g_malloc(len);
+    // Vary the data so reordered or duplicated chunks are noticed
+    for (gsize i = 0; i < len; i++) {
+        this->buf[i] = name[0] + (i % 7);
+    }
+
+    return this;
+}
+
+static void test_write_free(TestCoroutine *this) {
+    coroutine_destroy(&this->coroutine);
+    g_free(this->buf);
+    g_free(this);
+}
+
+static gboolean test_write_start_cb(gpointer data) {
+    test_write_co(data);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean _test_read_co(Coroutine *coroutine) {
+    gchar buf[4096];
+    ssize_t ret;
+
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    while (received->len < expected) {
+        ret = read(fds[0], buf, sizeof(buf));
+        if (ret < 0) {
+            assert(errno == EAGAIN);
+            colod_watch_arm(read_watch, coroutine, G_IO_IN,
+                            G_PRIORITY_DEFAULT);
+            co_yield_int(G_SOURCE_REMOVE);
+            colod_watch_woken(read_watch, coroutine);
+            continue;
+        }
+        assert(ret > 0);
+        g_string_append_len(received, buf, ret);
+    }
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_read_co(gpointer data) {
+    Coroutine *coroutine = data;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_read_co(coroutine));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    test_done();
+    return ret;
+}
+
+static gboolean test_read_start_cb(gpointer data) {
+    test_read_co(data);
+    return G_SOURCE_REMOVE;
+}
+
+static void test_setup() {
+    int size = 4096;
+    int ret;
+
+    ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(!ret);
+    ret = setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    assert(!ret);
+    ret = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    assert(!ret);
+    ret = fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    assert(!ret);
+
+    g_string_truncate(order, 0);
+    g_string_truncate(received, 0);
+    write_watch = colod_watch_new(fds[1], "test write watch");
+    read_watch = colod_watch_new(fds[0], "test read watch");
+    writer = colod_writer_new(fds[1], write_watch);
+}
+
+static void test_teardown() {
+    colod_writer_free(writer);
+    colod_watch_free(read_watch);
+    colod_watch_free(write_watch);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Concurrent writes go out in queue order without interleaving, no matter
+// which writer's flush actually sent them
+static void test_order() {
+    TestCoroutine *writes[] = {
+        test_write_new("a", 64 * 1024, 0),
+        test_write_new("b", 100, 0),
+        test_write_new("c", 64 * 1024, 0),
+    };
+    Coroutine reader = { 0 };
+    gsize offset = 0;
+
+    test_setup();
+
+    expected = 0;
+    running = G_N_ELEMENTS(writes) + 1;
+    for (guint i = 0; i < G_N_ELEMENTS(writes); i++) {
+        expected += writes[i]->len;
+        test_write_start_cb(writes[i]);
+    }
+    coroutine_init(&reader, &test_coroutine_type);
+    reader.cb = test_read_co;
+    colod_timer_add(10, test_read_start_cb, &reader);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "abc"));
+    assert(received->len == expected);
+    for (guint i = 0; i < G_N_ELEMENTS(writes); i++) {
+        assert(!writes[i]->ret);
+        assert(!memcmp(received->str + offset, writes[i]->buf,
+                       writes[i]->len));
+        offset += writes[i]->len;
+        test_write_free(writes[i]);
+    }
+
+    coroutine_destroy(&reader);
+    test_teardown();
+}
+
+// A write that times out halfway is completed by the next write, the
+// stream stays intact
+static void test_timeout() {
+    TestCoroutine *timed = test_write_new("t", 256 * 1024, 20);
+    TestCoroutine *next = test_write_new("n", 100, 0);
+    Coroutine reader = { 0 };
+
+    test_setup();
+
+    expected = timed->len + next->len;
+    running = 3;
+    test_write_start_cb(timed);
+    colod_timer_add(30, test_write_start_cb, next);
+    coroutine_init(&reader, &test_coroutine_type);
+    reader.cb = test_read_co;
+    colod_timer_add(40, test_read_start_cb, &reader);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "Tn"));
+    assert(timed->ret < 0);
+    assert(!next->ret);
+    assert(received->len == expected);
+    assert(!memcmp(received->str, timed->buf, timed->len));
+    assert(!memcmp(received->str + timed->len, next->buf, next->len));
+
+    test_write_free(timed);
+    test_write_free(next);
+    coroutine_destroy(&reader);
+    test_teardown();
+}
+
+// Once the fd broke, queued and later writes fail
+static void test_error() {
+    TestCoroutine *first = test_write_new("f", 256 * 1024, 0);
+    TestCoroutine *later = test_write_new("l", 100, 0);
+
+    test_setup();
+
+    running = 2;
+    test_write_start_cb(first);
+    colod_watch_free(read_watch);
+    close(fds[0]);
+    colod_timer_add(10, test_write_start_cb, later);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "FL"));
+    assert(first->ret < 0 && later->ret < 0);
+
+    test_write_free(first);
+    test_write_free(later);
+    colod_writer_free(writer);
+    colod_watch_free(write_watch);
+    close(fds[1]);
+}
+
+static void test_run() {
+    test_order();
+    test_timeout();
+    test_error();
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    GError *errp = NULL;
+    int ret;
+
+    signal(SIGPIPE, SIG_IGN);
+    order = g_string_new(NULL);
+    received = g_string_new(NULL);
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+
+    test_run();
+    ret = colod_poller_enable(&errp);
+    assert(!ret);
+    test_run();
+
+    g_main_loop_unref(mainloop);
+    g_string_free(received, TRUE);
+    g_string_free(order, TRUE);
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * FailoverSlots tests
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib-2.0/glib.h>
+
+#include "failover_slots.h"
+#include "coroutine_stack.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+FILE *trace = NULL;
+gboolean do_syslog = FALSE;
+
+void colod_trace(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    vfprintf(stderr, fmt, args);
+    fflush(stderr);
+
+    va_end(args);
+}
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+typedef struct TestCoroutine {
+    Coroutine coroutine;
+    const gchar *name;
+    FailoverSlot *slot;
+    // When the instance starts waiting for its slot
+    guint delay;
+} TestCoroutine;
+
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 2);
+static GString *order;
+static guint holding, holding_max;
+static guint running;
+static GMainLoop *mainloop;
+
+// Each slots object stands in for another process
+static void test_slots(const gchar *dir) {
+    FailoverSlots *pa, *pb, *pc;
+    FailoverSlot *a, *b, *c;
+    GError *local_errp = NULL;
+
+    pa = failover_slots_new(dir, 2);
+    pb = failover_slots_new(dir, 2);
+    pc = failover_slots_new(dir, 2);
+    a = failover_slot_new(pa, 0);
+    b = failover_slot_new(pb, 1);
+    c = failover_slot_new(pc, 2);
+
+    assert(failover_slot_try_lock(a, &local_errp) == 1);
+    assert(failover_slot_try_lock(b, &local_errp) == 1);
+    assert(failover_slot_try_lock(c, &local_errp) == 0);
+
+    failover_slot_release(a);
+    assert(failover_slot_try_lock(c, &local_errp) == 1);
+    assert(failover_slot_try_lock(a, &local_errp) == 0);
+
+    failover_slot_free(b);
+    assert(failover_slot_try_lock(a, &local_errp) == 1);
+
+    failover_slot_free(a);
+    failover_slot_free(c);
+    failover_slots_free(pa);
+    failover_slots_free(pb);
+    failover_slots_free(pc);
+    assert(!local_errp);
+}
+
+static void test_error(const gchar *dir) {
+    FailoverSlots *slots;
+    FailoverSlot *a;
+    GError *local_errp = NULL;
+    g_autofree gchar *missing = g_strconcat(dir, "/missing", NULL);
+
+    slots = failover_slots_new(missing, 1);
+    a = failover_slot_new(slots, 0);
+    assert(failover_slot_try_lock(a, &local_errp) < 0);
+    assert(local_errp);
+    g_error_free(local_errp);
+
+    failover_slot_free(a);
+    failover_slots_free(slots);
+}
+
+static gboolean _test_failover_co(Coroutine *coroutine, TestCoroutine *this) {
+    int ret;
+
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    colod_timer_add(this->delay, coroutine->cb, coroutine);
+    co_yield_int(G_SOURCE_REMOVE);
+
+    co_recurse(ret = failover_slot_acquire_co(coroutine, this->slot, 1000,
+                                              NULL));
+    assert(!ret);
+    holding++;
+    holding_max = MAX(holding, holding_max);
+    g_string_append(order, this->name);
+
+    colod_timer_add(5, coroutine->cb, coroutine);
+    co_yield_int(G_SOURCE_REMOVE);
+
+    holding--;
+    failover_slot_release(this->slot);
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean test_failover_co(gpointer data) {
+    TestCoroutine *this = data;
+    Coroutine *coroutine = &this->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _test_failover_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    running--;
+    if (!running) {
+        g_main_loop_quit(mainloop);
+    }
+    return ret;
+}
+
+static void test_run(const gchar *dir, TestCoroutine *coroutines, guint count,
+                     const guint *priorities, guint slot_count,
+                     const gchar *expected_order) {
+    FailoverSlots *slots = failover_slots_new(dir, slot_count);
+
+    g_string_truncate(order, 0);
+    holding_max = 0;
+
+    for (guint i = 0; i < count; i++) {
+        coroutines[i].slot = failover_slot_new(slots, priorities[i]);
+        // Learned from the same confchg
+        failover_slot_expect(coroutines[i].slot);
+    }
+    for (guint i = 0; i < count; i++) {
+        coroutine_init(&coroutines[i].coroutine, &test_coroutine_type);
+        coroutines[i].coroutine.cb = test_failover_co;
+        running++;
+        test_failover_co(&coroutines[i]);
+    }
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, expected_order));
+    assert(holding_max == slot_count);
+
+    for (guint i = 0; i < count; i++) {
+        failover_slot_free(coroutines[i].slot);
+        coroutine_destroy(&coroutines[i].coroutine);
+    }
+    failover_slots_free(slots);
+}
+
+// Instances that lost their peer together go by priority, however late
+// they start to wait, and no more than the slots run at once
+static void test_order(const gchar *dir, guint slot_count) {
+    TestCoroutine coroutines[] = {
+        {.name = "c", .delay = 0},
+        {.name = "a", .delay = 10},
+        {.name = "d", .delay = 1},
+        {.name = "b", .delay = 5},
+    };
+    const guint priorities[] = {2, 0, 3, 1};
+
+    test_run(dir, coroutines, G_N_ELEMENTS(coroutines), priorities,
+             slot_count, "abcd");
+}
+
+// An instance that never fails over only holds up the others for a while
+static void test_gather_timeout(const gchar *dir) {
+    FailoverSlots *slots = failover_slots_new(dir, 1);
+    FailoverSlot *absent = failover_slot_new(slots, 0);
+    TestCoroutine coroutine = {.name = "a"};
+    gint64 start = g_get_monotonic_time();
+
+    g_string_truncate(order, 0);
+    coroutine.slot = failover_slot_new(slots, 1);
+    failover_slot_expect(absent);
+    failover_slot_expect(coroutine.slot);
+
+    coroutine_init(&coroutine.coroutine, &test_coroutine_type);
+    coroutine.coroutine.cb = test_failover_co;
+    running++;
+    test_failover_co(&coroutine);
+
+    g_main_loop_run(mainloop);
+
+    assert(!strcmp(order->str, "a"));
+    assert(g_get_monotonic_time() - start >= 100 * 1000);
+
+    failover_slot_free(coroutine.slot);
+    failover_slot_free(absent);
+    coroutine_destroy(&coroutine.coroutine);
+    failover_slots_free(slots);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    gchar *dir = g_dir_make_tmp("test_failover_slots.XXXXXX", NULL);
+    assert(dir);
+
+    order = g_string_new(NULL);
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+
+    test_slots(dir);
+    test_error(dir);
+    test_order(dir, 1);
+    test_order(dir, 2);
+    test_gather_timeout(dir);
+
+    for (guint i = 0; i < 2; i++) {
+        g_autofree gchar *path = g_strdup_printf("%s/failover-slot-%u.lock",
+                                                 dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    g_free(dir);
+
+    g_main_loop_unref(mainloop);
+    g_string_free(order, TRUE);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Metrics tests
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "metrics.h"
+
+static void test_histogram() {
+    ColodHistogram *stop, *cont;
+    gchar *json;
+
+    stop = metrics_histogram("qmp_command", "command", "stop");
+    cont = metrics_histogram("qmp_command", "command", "cont");
+    assert(stop != cont);
+    assert(stop == metrics_histogram("qmp_command", "command", "stop"));
+
+    metrics_observe(stop, 10);
+    metrics_observe(stop, 50);
+    metrics_observe(stop, 51);
+    metrics_observe(stop, 20*1000*1000);
+    metrics_observe(cont, 700);
+
+    json = metrics_to_json();
+    assert(strstr(json, "{\"name\": \"qmp_command\", \"command\": \"cont\", "
+                        "\"count\": 1, \"sum-us\": 700, \"max-us\": 700, "
+                        "\"buckets\": [0, 0, 0, 0, 1, 0,"));
+    assert(strstr(json, "{\"name\": \"qmp_command\", \"command\": \"stop\", "
+                        "\"count\": 4, \"sum-us\": 20000111, "
+                        "\"max-us\": 20000000, \"buckets\": [2, 1, 0,"));
+    assert(strstr(json, ", 0, 1]}"));
+    g_free(json);
+}
+
+static void test_labels() {
+    gchar *json;
+
+    metrics_observe(metrics_histogram("yank", NULL, "ignored"), 1);
+    assert(metrics_histogram("yank", NULL, NULL)
+           == metrics_histogram("yank", NULL, "ignored"));
+
+    assert(metrics_histogram("state", "state", "a\"b")
+           == metrics_histogram("state", "state", "other"));
+
+    json = metrics_to_json();
+    assert(strstr(json, "{\"name\": \"yank\", \"count\": 1,"));
+    assert(strstr(json, "\"state\": \"other\""));
+    assert(!strstr(json, "a\"b"));
+    g_free(json);
+}
+
+static void test_counter() {
+    ColodCounter *yanks;
+    gchar *json;
+
+    yanks = metrics_counter("yanks", NULL, NULL);
+    assert(yanks == metrics_counter("yanks", NULL, NULL));
+    metrics_inc(yanks, 1);
+    metrics_inc(yanks, 2);
+    metrics_inc(metrics_counter("client_commands", "command", "quit"), 1);
+
+    json = metrics_to_json();
+    assert(strstr(json, "\"counters\": [{\"name\": \"client_commands\", "
+                        "\"command\": \"quit\", \"value\": 1}, "
+                        "{\"name\": \"yanks\", \"value\": 3}]"));
+    g_free(json);
+}
+
+static void test_gauge() {
+    ColodGauge *srtt;
+    gchar *json;
+
+    srtt = metrics_gauge("qmp_srtt_us", "class", "query");
+    assert(srtt == metrics_gauge("qmp_srtt_us", "class", "query"));
+    metrics_set(srtt, 300);
+    metrics_set(srtt, 250);
+
+    json = metrics_to_json();
+    assert(strstr(json, "\"gauges\": [{\"name\": \"qmp_srtt_us\", "
+                        "\"class\": \"query\", \"value\": 250}]"));
+    g_free(json);
+}
+
+// Two instances in one process keep their metrics apart
+static void test_instances() {
+    ColodGauge *a, *b;
+    gchar *json, *text;
+
+    a = metrics_instance_gauge("vm-a", "qmp_timeout_ms", "class", "query");
+    b = metrics_instance_gauge("vm-b", "qmp_timeout_ms", "class", "query");
+    assert(a != b);
+    assert(a == metrics_instance_gauge("vm-a", "qmp_timeout_ms", "class",
+                                       "query"));
+    assert(metrics_instance_gauge("vm a", "qmp_timeout_ms", "class", "query")
+           == metrics_instance_gauge("other", "qmp_timeout_ms", "class",
+                                     "query"));
+    metrics_set(a, 100);
+    metrics_set(b, 200);
+    metrics_inc(metrics_instance_counter("vm-a", "failovers", NULL, NULL), 1);
+
+    json = metrics_to_json();
+    assert(strstr(json, "{\"name\": \"qmp_timeout_ms\", \"instance\": \"vm-a\", "
+                        "\"class\": \"query\", \"value\": 100}, "
+                        "{\"name\": \"qmp_timeout_ms\", \"instance\": \"vm-b\", "
+                        "\"class\": \"query\", \"value\": 200}"));
+    assert(strstr(json, "{\"name\": \"failovers\", \"instance\": \"vm-a\", "
+                        "\"value\": 1}"));
+    g_free(json);
+
+    text = metrics_to_openmetrics();
+    assert(strstr(text, "# TYPE colod_qmp_timeout_ms gauge\n"
+                        "colod_qmp_timeout_ms{instance=\"other\",class=\"query\"} 0\n"
+                        "colod_qmp_timeout_ms{instance=\"vm-a\",class=\"query\"} 100\n"
+                        "colod_qmp_timeout_ms{instance=\"vm-b\",class=\"query\"} 200\n"));
+    assert(strstr(text, "colod_failovers_total{instance=\"vm-a\"} 1\n"));
+    g_free(text);
+}
+
+static void test_openmetrics() {
+    gchar *text;
+
+    text = metrics_to_openmetrics();
+    assert(strstr(text, "# TYPE colod_yanks counter\ncolod_yanks_total 3\n"));
+    assert(strstr(text, "colod_client_commands_total{command=\"quit\"} 1\n"));
+    assert(strstr(text, "# TYPE colod_qmp_command_seconds histogram\n"
+                        "# UNIT colod_qmp_command_seconds seconds\n"
+                        "colod_qmp_command_seconds_bucket"
+                        "{command=\"cont\",le=\"0.00005\"} 0\n"));
+    assert(strstr(text, "colod_qmp_command_seconds_bucket"
+                        "{command=\"stop\",le=\"0.0001\"} 3\n"));
+    assert(strstr(text, "colod_qmp_command_seconds_bucket"
+                        "{command=\"stop\",le=\"+Inf\"} 4\n"
+                        "colod_qmp_command_seconds_count{command=\"stop\"} 4\n"
+                        "colod_qmp_command_seconds_sum{command=\"stop\"} "
+                        "20.000111\n"));
+    assert(strstr(text, "colod_yank_seconds_count 1\n"));
+    assert(strstr(text, "# TYPE colod_qmp_srtt_us gauge\n"
+                        "colod_qmp_srtt_us{class=\"query\"} 250\n"));
+    // Only one TYPE line per family
+    const gchar *type = strstr(text, "# TYPE colod_qmp_command_seconds");
+    assert(!strstr(type + 1, "# TYPE colod_qmp_command_seconds"));
+    assert(g_str_has_suffix(text, "# EOF\n"));
+    g_free(text);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_histogram();
+    test_labels();
+    test_counter();
+    test_gauge();
+    test_openmetrics();
+    test_instances();
+
+    return 0;
+}
@@ -24,6 +24,9 @@ struct TestCoroutine {
     GMainLoop *mainloop;
 };
 
+static CoroutineType test_coroutine_type =
+    COROUTINE_TYPE("test", COROUTINE_STACK_SIZE);
+
 FILE *trace = NULL;
 gboolean do_syslog = FALSE;
 
@@ -261,6 +264,7 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
         }
     }
 
+    coroutine_init(coroutine, &test_coroutine_type);
     coroutine->cb = test_main_co;
     this->commands = test_qmp_commands();
     assert(this->commands);
@@ -273,5 +277,6 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
 
     g_main_loop_unref(this->mainloop);
     qmp_commands_free(this->commands);
+    coroutine_destroy(coroutine);
     return 0;
 }
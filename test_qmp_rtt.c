@@ -0,0 +1,113 @@
+/*
+ * Adaptive qmp timeout tests
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "qmp_rtt.h"
+#include "metrics.h"
+
+static void test_fixed() {
+    QmpRtt *rtt = qmp_rtt_new("test", 600, 600, 600);
+
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 600);
+    qmp_rtt_sample(rtt, QMP_RTT_COMMAND, 2*1000*1000);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 600);
+    qmp_rtt_set_busy(rtt, TRUE);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 600);
+
+    qmp_rtt_free(rtt);
+}
+
+static void test_adapt() {
+    QmpRtt *rtt = qmp_rtt_new("test", 100, 1000, 5000);
+
+    // Without samples the floor applies
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_QUERY) == 100);
+
+    // srtt 200 ms, rttvar 100 ms
+    qmp_rtt_sample(rtt, QMP_RTT_QUERY, 200*1000);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_QUERY) == 600);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 100);
+
+    // The variance decays with steady samples
+    for (guint i = 0; i < 100; i++) {
+        qmp_rtt_sample(rtt, QMP_RTT_QUERY, 200*1000);
+    }
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_QUERY) == 201);
+
+    // One slow reply raises it at once, srtt 425 ms, rttvar 450 ms
+    qmp_rtt_sample(rtt, QMP_RTT_QUERY, 2000*1000);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_QUERY) == 2225);
+
+    qmp_rtt_sample(rtt, QMP_RTT_QUERY, 60*1000*1000);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_QUERY) == 5000);
+
+    qmp_rtt_free(rtt);
+}
+
+static void test_busy() {
+    QmpRtt *rtt = qmp_rtt_new("test", 100, 1000, 5000);
+
+    for (guint i = 0; i < 10; i++) {
+        qmp_rtt_sample(rtt, QMP_RTT_COMMAND, 1000);
+    }
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 100);
+
+    qmp_rtt_set_busy(rtt, TRUE);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 1000);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_YANK) == 1000);
+    qmp_rtt_set_busy(rtt, FALSE);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 100);
+
+    // The ceiling is never below the floors
+    qmp_rtt_set_bounds(rtt, 200, 100, 0);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 200);
+    qmp_rtt_set_busy(rtt, TRUE);
+    assert(qmp_rtt_timeout(rtt, QMP_RTT_COMMAND) == 200);
+
+    qmp_rtt_free(rtt);
+}
+
+static void test_metrics() {
+    QmpRtt *rtt = qmp_rtt_new("test", 100, 1000, 5000);
+    gchar *json;
+
+    qmp_rtt_sample(rtt, QMP_RTT_HEALTH, 400*1000);
+
+    json = metrics_to_json();
+    assert(strstr(json, "{\"name\": \"qmp_srtt_us\", \"instance\": \"test\", "
+                        "\"class\": \"health\", \"value\": 400000}"));
+    assert(strstr(json, "{\"name\": \"qmp_rttvar_us\", \"instance\": \"test\", "
+                        "\"class\": \"health\", \"value\": 200000}"));
+    assert(strstr(json, "{\"name\": \"qmp_timeout_ms\", \"instance\": \"test\", "
+                        "\"class\": \"health\", \"value\": 1200}"));
+    assert(strstr(json, "{\"name\": \"qmp_timeout_ms\", \"instance\": \"test\", "
+                        "\"class\": \"yank\", \"value\": 100}"));
+    g_free(json);
+
+    qmp_rtt_set_busy(rtt, TRUE);
+    json = metrics_to_json();
+    assert(strstr(json, "{\"name\": \"qmp_timeout_ms\", \"instance\": \"test\", "
+                        "\"class\": \"yank\", \"value\": 1000}"));
+    g_free(json);
+
+    qmp_rtt_free(rtt);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_fixed();
+    test_adapt();
+    test_busy();
+    test_metrics();
+
+    return 0;
+}
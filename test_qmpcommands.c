@@ -122,6 +122,15 @@ static void test_d() {
     local_errp = NULL;
     json_node_unref(json);
 
+    json = json_from_string("['@@COMP_OUT_SOCK']", NULL);
+    assert(json);
+    ret = qmp_commands_set_migration_start(commands, json, &local_errp);
+    assert(ret < 0);
+    assert(local_errp);
+    g_error_free(local_errp);
+    local_errp = NULL;
+    json_node_unref(json);
+
     qmp_commands_free(commands);
 }
 
@@ -297,6 +306,39 @@ static void test_l() {
     qmp_commands_free(commands);
 }
 
+static void test_m() {
+    int ret;
+    QmpCommands *commands = test_qmp_commands_new();
+
+    JsonNode *json = json_from_string("['@@IF_REWRITER@@ rewriter', "
+                                      "'@@DECL_THROTTLE_PROP@@ {\"test\": \"test\"}', "
+                                      "'@@THROTTLE_PROP@@']", NULL);
+    assert(json);
+    ret = qmp_commands_set_failover_primary(commands, json, NULL);
+    assert(ret == 0);
+    json_node_unref(json);
+
+    MyArray *array = qmp_commands_get_failover_primary(commands);
+    assert(array->size == 1);
+    assert(!strcmp(array->array[0], "{\"test\":\"test\"}\n"));
+    my_array_unref(array);
+
+    // The pre-rendered commands follow later changes to their inputs
+    JsonNode *throttle_prop = json_from_string("{\"throttle_prop\":\"lol\"}", NULL);
+    assert(throttle_prop);
+    qmp_commands_set_throttle_prop(commands, throttle_prop);
+    json_node_unref(throttle_prop);
+    qmp_commands_set_filter_rewriter(commands, TRUE);
+
+    array = qmp_commands_get_failover_primary(commands);
+    assert(array->size == 2);
+    assert(!strcmp(array->array[0], " rewriter\n"));
+    assert(!strcmp(array->array[1], "{\"test\":\"test\",\"throttle_prop\":\"lol\"}\n"));
+    my_array_unref(array);
+
+    qmp_commands_free(commands);
+}
+
 int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     test_a();
     test_b();
@@ -311,6 +353,7 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     test_j();
     test_k();
     test_l();
+    test_m();
 
     return 0;
 }
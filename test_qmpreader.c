@@ -0,0 +1,142 @@
+/*
+ * QmpReader tests
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <glib-2.0/glib.h>
+
+#include "qmpreader.h"
+#include "util.h"
+
+static int scan(const gchar *line, QmpFields *fields) {
+    return qmp_scan_fields(line, strlen(line), fields);
+}
+
+static void test_scan() {
+    QmpFields fields;
+
+    assert(!scan("{\"event\": \"MIGRATION_PASS\", \"data\": {\"pass\": 2}, "
+                 "\"timestamp\": {\"seconds\": 1, \"microseconds\": 2}}\n",
+                 &fields));
+    assert(fields.valid);
+    assert(fields.has_event && !strcmp(fields.event, "MIGRATION_PASS"));
+    assert(!fields.has_return && !fields.has_error && !fields.has_status);
+
+    assert(!scan("{\"event\": \"JOB_STATUS_CHANGE\", "
+                 "\"data\": {\"status\": \"running\", \"id\": \"resync\"}}\n",
+                 &fields));
+    assert(fields.valid && fields.has_status);
+    assert(!strcmp(fields.status, "running"));
+    assert(!fields.has_id);
+
+    assert(!scan("{\"return\": {\"status\": \"running\", \"running\": true, "
+                 "\"list\": [1, -2.5e3, null, {\"a\": [\"}\"]}]}, "
+                 "\"id\": \"colod3\"}\n", &fields));
+    assert(fields.valid && fields.has_return && !fields.has_status);
+    assert(fields.has_id && !strcmp(fields.id, "colod3"));
+
+    assert(!scan("{\"error\": {\"class\": \"GenericError\", "
+                 "\"desc\": \"a \\\"quoted\\\" text\"}}", &fields));
+    assert(fields.valid && fields.has_error && !fields.has_return);
+
+    assert(!scan("{\"event\": \"ESCAPED\\u0041\"}", &fields));
+    assert(!fields.valid);
+
+    assert(!scan("{\"id\": 5, \"return\": {}}", &fields));
+    assert(!fields.valid);
+
+    assert(!scan("{'exec-colod': 'query-status'}\n", &fields));
+    assert(fields.valid && fields.has_exec_colod);
+    assert(!strcmp(fields.exec_colod, "query-status"));
+
+    assert(!scan("{'execute': 'qom-get', 'arguments': {'path': '/a\\'b'}}\n",
+                 &fields));
+    assert(fields.valid && !fields.has_exec_colod);
+    assert(fields.has_execute && !strcmp(fields.execute, "qom-get"));
+    assert(!fields.has_oob);
+
+    assert(!scan("{'exec-oob': 'migrate-pause', 'id': 'a'}\n", &fields));
+    assert(fields.valid && fields.has_execute && fields.has_oob);
+    assert(!strcmp(fields.execute, "migrate-pause"));
+
+    assert(!scan("{\"exec\\u002dcolod\": \"quit\"}", &fields));
+    assert(!fields.valid);
+
+    assert(scan("[1, 2]", &fields) < 0);
+    assert(scan("{\"return\": {}", &fields) < 0);
+    assert(scan("{\"return\": {}} garbage", &fields) < 0);
+    assert(scan("{\"return\" {}}", &fields) < 0);
+}
+
+static void test_reader() {
+    QmpReader *reader;
+    gchar *line;
+    gsize len;
+    GError *local_errp = NULL;
+    int fds[2];
+    int ret;
+
+    ret = pipe(fds);
+    assert(!ret);
+    ret = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    assert(!ret);
+
+    reader = qmp_reader_new(fds[0]);
+    assert(!qmp_reader_pending(reader));
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 0);
+
+    const gchar *data = "{\"return\": {}}\n\n{\"event\": \"A\"}\n{\"par";
+    ret = write(fds[1], data, strlen(data));
+    assert(ret == (int) strlen(data));
+
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 1);
+    assert(!strcmp(line, "{\"return\": {}}\n"));
+    assert(len == strlen(line));
+    assert(qmp_reader_pending(reader));
+
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 1);
+    assert(!strcmp(line, "\n"));
+
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 1);
+    assert(!strcmp(line, "{\"event\": \"A\"}\n"));
+    assert(!qmp_reader_pending(reader));
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 0);
+
+    GString *big = g_string_new("tial\": \"");
+    for (int i = 0; i < 3000; i++) {
+        g_string_append(big, "xyz");
+    }
+    g_string_append(big, "\"}\n");
+    ret = write(fds[1], big->str, big->len);
+    assert(ret == (int) big->len);
+
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) == 1);
+    assert(len == big->len + strlen("{\"par"));
+    assert(!strncmp(line, "{\"partial\": \"xyz", 16));
+    assert(!strcmp(line + len - 3, "\"}\n"));
+    g_string_free(big, TRUE);
+
+    close(fds[1]);
+    assert(qmp_reader_next(reader, &line, &len, &local_errp) < 0);
+    assert(g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_EOF));
+    g_error_free(local_errp);
+
+    qmp_reader_free(reader);
+    close(fds[0]);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_scan();
+    test_reader();
+
+    return 0;
+}
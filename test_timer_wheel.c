@@ -0,0 +1,140 @@
+/*
+ * Timer wheel tests
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <glib-2.0/glib.h>
+
+#include "timer_wheel.h"
+
+#define TEST_TIMERS 2000
+
+typedef struct TestTimer {
+    TimerWheel *wheel;
+    guint id;
+    gint64 expires;
+    gboolean fired, removed;
+} TestTimer;
+
+static gint64 test_now;
+
+static gboolean test_timer_cb(gpointer data) {
+    TestTimer *timer = data;
+
+    assert(!timer->fired && !timer->removed);
+    assert(timer->expires <= test_now);
+    assert(timer_wheel_current(timer->wheel) == timer->id);
+    timer->fired = TRUE;
+
+    return G_SOURCE_REMOVE;
+}
+
+static void test_check(TestTimer *timers, guint count) {
+    for (guint i = 0; i < count; i++) {
+        if (timers[i].removed) {
+            continue;
+        }
+        assert(timers[i].fired == (timers[i].expires <= test_now));
+    }
+}
+
+static void test_random() {
+    static TestTimer timers[TEST_TIMERS];
+    TimerWheel *wheel;
+    guint count = 0;
+
+    srand(1);
+    test_now = 1000;
+    wheel = timer_wheel_new(test_now);
+
+    while (count < TEST_TIMERS) {
+        guint timeout;
+
+        switch (rand() % 4) {
+            case 0: timeout = rand() % 64; break;
+            case 1: timeout = rand() % 5000; break;
+            case 2: timeout = rand() % 1000000; break;
+            default: timeout = rand() % 40000000; break;
+        }
+
+        TestTimer *timer = &timers[count++];
+        timer->wheel = wheel;
+        timer->expires = test_now + timeout;
+        timer->id = timer_wheel_add(wheel, test_now, timeout, test_timer_cb,
+                                    timer);
+        assert(timer->id);
+
+        if (rand() % 8 == 0) {
+            TestTimer *other = &timers[rand() % count];
+            gboolean ret = timer_wheel_remove(wheel, other->id);
+            assert(ret == (!other->fired && !other->removed));
+            other->removed = TRUE;
+        }
+
+        if (rand() % 4 == 0) {
+            test_now += rand() % 3000;
+            timer_wheel_run(wheel, test_now);
+            test_check(timers, count);
+        }
+    }
+
+    while (timer_wheel_next(wheel) >= 0) {
+        gint64 next = timer_wheel_next(wheel);
+
+        assert(next >= test_now);
+        // Step to the next tick or a bit beyond
+        test_now = next + rand() % 2;
+        timer_wheel_run(wheel, test_now);
+        test_check(timers, count);
+    }
+
+    for (guint i = 0; i < count; i++) {
+        assert(timers[i].fired || timers[i].removed);
+        assert(!timer_wheel_remove(wheel, timers[i].id));
+    }
+
+    timer_wheel_free(wheel);
+}
+
+static void test_idle() {
+    TestTimer timer = {0};
+    TimerWheel *wheel;
+
+    test_now = 0;
+    wheel = timer_wheel_new(test_now);
+    assert(timer_wheel_next(wheel) < 0);
+
+    // A long idle period is skipped, not walked tick by tick
+    test_now = G_GINT64_CONSTANT(1) << 40;
+    timer_wheel_run(wheel, test_now);
+
+    timer.wheel = wheel;
+    timer.expires = test_now + 100;
+    timer.id = timer_wheel_add(wheel, test_now, 100, test_timer_cb, &timer);
+    assert(timer_wheel_next(wheel) <= timer.expires);
+
+    test_now += 99;
+    timer_wheel_run(wheel, test_now);
+    assert(!timer.fired);
+    test_now += 1;
+    timer_wheel_run(wheel, test_now);
+    assert(timer.fired);
+    assert(timer_wheel_next(wheel) < 0);
+    assert(!timer_wheel_current(wheel));
+
+    timer_wheel_free(wheel);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_random();
+    test_idle();
+
+    return 0;
+}
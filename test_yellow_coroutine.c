@@ -45,6 +45,8 @@ struct TestCoroutine {
     GMainLoop *mainloop;
 };
 
+static CoroutineType test_coroutine_type = COROUTINE_TYPE("test", 1);
+
 int _test_co(Coroutine *coroutine, TestCoroutine *this, YellowStatus event) {
     struct {
         guint source_id;
@@ -141,12 +143,15 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     TestCoroutine _this = {0};
     TestCoroutine *this = &_this;
     Coroutine *coroutine = &this->coroutine;
+    coroutine_init(coroutine, &test_coroutine_type);
     coroutine->cb = test_co;
 
     this->mainloop = g_main_loop_new(g_main_context_default(), FALSE);
 
     this->cpg = colod_open_cpg(NULL, NULL);
     this->ctx.monitor_interface = "eth0";
+    this->ctx.netlink = netlink_new(&local_errp);
+    assert(this->ctx.netlink);
     this->yellow_co = yellow_coroutine_new(this->cpg, &this->ctx,
                                            50, 100, &local_errp);
     if (!this->yellow_co) {
@@ -163,7 +168,9 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     g_main_loop_unref(this->mainloop);
 
     yellow_coroutine_free(this->yellow_co);
+    netlink_free(this->ctx.netlink);
     cpg_unref(this->cpg);
+    coroutine_destroy(coroutine);
 
     return 0;
 }
@@ -0,0 +1,381 @@
+/*
+ * COLO background daemon timer wheel
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "timer_wheel.h"
+
+// 4 levels of 64 slots cover 2^24 ms (about 4.6 hours). Timers further out
+// are parked on the last level and re-added when they get there.
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX ((G_GINT64_CONSTANT(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+// Level of timers taken off level 0 that are about to fire
+#define WHEEL_PENDING WHEEL_LEVELS
+
+// Timer ids are the index + 1 in the low bits and a generation counter in
+// the high bits, so ids of fired timers don't match a reused entry
+#define TIMER_INDEX_BITS 20
+#define TIMER_INDEX_MASK ((1u << TIMER_INDEX_BITS) - 1)
+#define TIMER_GENERATION_MASK ((1u << (32 - TIMER_INDEX_BITS)) - 1)
+
+typedef struct Timer {
+    gint64 expires;
+    GSourceFunc func;
+    gpointer data;
+    // 0 while the entry is free
+    guint id;
+    guint generation;
+    // Slot list links, next doubles as free list link
+    int prev, next;
+    guint8 level, slot;
+} Timer;
+
+struct TimerWheel {
+    // Entries are addressed by index, the array may be reallocated
+    Timer *timers;
+    guint size;
+    int free;
+    int slots[WHEEL_LEVELS][WHEEL_SIZE];
+    guint64 occupied[WHEEL_LEVELS];
+    int pending;
+    // Next tick to process
+    gint64 next;
+    guint armed;
+    guint current;
+};
+
+TimerWheel *timer_wheel_new(gint64 now) {
+    TimerWheel *this = g_new0(TimerWheel, 1);
+
+    this->free = -1;
+    this->pending = -1;
+    for (guint level = 0; level < WHEEL_LEVELS; level++) {
+        for (guint slot = 0; slot < WHEEL_SIZE; slot++) {
+            this->slots[level][slot] = -1;
+        }
+    }
+    this->next = now;
+
+    return this;
+}
+
+void timer_wheel_free(TimerWheel *this) {
+    g_free(this->timers);
+    g_free(this);
+}
+
+static void timer_wheel_grow(TimerWheel *this) {
+    guint size = this->size ? this->size * 2 : 16;
+
+    assert(size <= TIMER_INDEX_MASK);
+    this->timers = g_renew(Timer, this->timers, size);
+    for (guint i = size; i > this->size; i--) {
+        Timer *timer = &this->timers[i - 1];
+
+        memset(timer, 0, sizeof(*timer));
+        timer->next = this->free;
+        this->free = i - 1;
+    }
+    this->size = size;
+}
+
+static int *timer_wheel_head(TimerWheel *this, Timer *timer) {
+    if (timer->level == WHEEL_PENDING) {
+        return &this->pending;
+    }
+
+    return &this->slots[timer->level][timer->slot];
+}
+
+static void timer_wheel_link(TimerWheel *this, int index) {
+    Timer *timer = &this->timers[index];
+    gint64 expires = MIN(timer->expires, this->next + WHEEL_MAX);
+    guint level = 0;
+    int *head;
+
+    // Already expired ones fire on the next tick
+    expires = MAX(expires, this->next);
+    while ((expires - this->next) >> (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    timer->level = level;
+    timer->slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    head = timer_wheel_head(this, timer);
+    timer->prev = -1;
+    timer->next = *head;
+    if (*head >= 0) {
+        this->timers[*head].prev = index;
+    }
+    *head = index;
+    this->occupied[level] |= G_GUINT64_CONSTANT(1) << timer->slot;
+}
+
+static void timer_wheel_unlink(TimerWheel *this, int index) {
+    Timer *timer = &this->timers[index];
+    int *head = timer_wheel_head(this, timer);
+
+    if (timer->prev >= 0) {
+        this->timers[timer->prev].next = timer->next;
+    } else {
+        *head = timer->next;
+    }
+    if (timer->next >= 0) {
+        this->timers[timer->next].prev = timer->prev;
+    }
+
+    if (*head < 0 && timer->level != WHEEL_PENDING) {
+        this->occupied[timer->level] &= ~(G_GUINT64_CONSTANT(1) << timer->slot);
+    }
+}
+
+static void timer_wheel_release(TimerWheel *this, int index) {
+    Timer *timer = &this->timers[index];
+
+    timer->id = 0;
+    timer->func = NULL;
+    timer->data = NULL;
+    timer->next = this->free;
+    this->free = index;
+    this->armed--;
+}
+
+guint timer_wheel_add(TimerWheel *this, gint64 now, guint timeout,
+                      GSourceFunc func, gpointer data) {
+    Timer *timer;
+    int index;
+
+    if (this->free < 0) {
+        timer_wheel_grow(this);
+    }
+    index = this->free;
+    timer = &this->timers[index];
+    this->free = timer->next;
+
+    // Nothing to catch up on, don't place timers relative to a stale tick
+    if (!this->armed && now > this->next) {
+        this->next = now;
+    }
+
+    timer->generation = (timer->generation + 1) & TIMER_GENERATION_MASK;
+    timer->id = (timer->generation << TIMER_INDEX_BITS) | (index + 1);
+    timer->expires = now + timeout;
+    timer->func = func;
+    timer->data = data;
+    timer_wheel_link(this, index);
+    this->armed++;
+
+    return timer->id;
+}
+
+static int timer_wheel_lookup(TimerWheel *this, guint id) {
+    guint index = (id & TIMER_INDEX_MASK) - 1;
+
+    if (!id || index >= this->size || this->timers[index].id != id) {
+        return -1;
+    }
+
+    return index;
+}
+
+gboolean timer_wheel_remove(TimerWheel *this, guint id) {
+    int index = timer_wheel_lookup(this, id);
+
+    if (index < 0) {
+        return FALSE;
+    }
+
+    timer_wheel_unlink(this, index);
+    timer_wheel_release(this, index);
+    return TRUE;
+}
+
+static guint64 rotate_right(guint64 value, guint n) {
+    if (!n) {
+        return value;
+    }
+
+    return (value >> n) | (value << (64 - n));
+}
+
+gint64 timer_wheel_next(TimerWheel *this) {
+    gint64 best = -1;
+
+    if (this->occupied[0]) {
+        guint64 rotated = rotate_right(this->occupied[0],
+                                       this->next & WHEEL_MASK);
+        best = this->next + __builtin_ctzll(rotated);
+    }
+
+    // Higher levels need to be cascaded when the lower levels wrap around
+    // to the index of a occupied slot
+    for (guint level = 1; level < WHEEL_LEVELS; level++) {
+        guint shift = WHEEL_BITS * level;
+        gint64 base = this->next >> shift;
+        guint current = base & WHEEL_MASK;
+        gint64 tick;
+
+        if (!this->occupied[level]) {
+            continue;
+        }
+
+        if (!(this->next & ((G_GINT64_CONSTANT(1) << shift) - 1))
+                && this->occupied[level] & (G_GUINT64_CONSTANT(1) << current)) {
+            tick = this->next;
+        } else {
+            guint64 rotated = rotate_right(this->occupied[level],
+                                           (current + 1) & WHEEL_MASK);
+            tick = (base + __builtin_ctzll(rotated) + 1) << shift;
+        }
+
+        if (best < 0 || tick < best) {
+            best = tick;
+        }
+    }
+
+    return best;
+}
+
+static void timer_wheel_cascade(TimerWheel *this, guint level) {
+    guint slot = (this->next >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    int index = this->slots[level][slot];
+
+    this->slots[level][slot] = -1;
+    this->occupied[level] &= ~(G_GUINT64_CONSTANT(1) << slot);
+    while (index >= 0) {
+        int next = this->timers[index].next;
+        timer_wheel_link(this, index);
+        index = next;
+    }
+}
+
+static void timer_wheel_fire(TimerWheel *this, gint64 tick) {
+    guint slot = tick & WHEEL_MASK;
+
+    // Callbacks may add and remove timers, including the pending ones
+    this->pending = this->slots[0][slot];
+    this->slots[0][slot] = -1;
+    this->occupied[0] &= ~(G_GUINT64_CONSTANT(1) << slot);
+    for (int index = this->pending; index >= 0;
+         index = this->timers[index].next) {
+        this->timers[index].level = WHEEL_PENDING;
+    }
+
+    while (this->pending >= 0) {
+        int index = this->pending;
+        Timer *timer = &this->timers[index];
+        GSourceFunc func = timer->func;
+        gpointer data = timer->data;
+
+        timer_wheel_unlink(this, index);
+        if (timer->expires > tick) {
+            timer_wheel_link(this, index);
+            continue;
+        }
+
+        this->current = timer->id;
+        timer_wheel_release(this, index);
+        func(data);
+        this->current = 0;
+    }
+}
+
+void timer_wheel_run(TimerWheel *this, gint64 now) {
+    while (this->next <= now) {
+        gint64 tick = timer_wheel_next(this);
+
+        // Nothing happens on the ticks in between, skip them
+        if (tick < 0 || tick > now) {
+            this->next = now + 1;
+            break;
+        }
+        assert(tick >= this->next);
+        this->next = tick;
+
+        for (guint level = 1; level < WHEEL_LEVELS; level++) {
+            if (tick & ((G_GINT64_CONSTANT(1) << (WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            timer_wheel_cascade(this, level);
+        }
+
+        this->next = tick + 1;
+        timer_wheel_fire(this, tick);
+    }
+}
+
+guint timer_wheel_current(TimerWheel *this) {
+    return this->current;
+}
+
+static TimerWheel *wheel = NULL;
+static GSource *wheel_source = NULL;
+static gint64 wheel_ready = -1;
+
+static void colod_timer_update(void) {
+    gint64 tick = timer_wheel_next(wheel);
+
+    if (tick != wheel_ready) {
+        wheel_ready = tick;
+        g_source_set_ready_time(wheel_source, tick < 0 ? -1 : tick * 1000);
+    }
+}
+
+static gboolean colod_timer_dispatch(G_GNUC_UNUSED GSource *source,
+                                     G_GNUC_UNUSED GSourceFunc callback,
+                                     G_GNUC_UNUSED gpointer data) {
+    timer_wheel_run(wheel, g_get_monotonic_time() / 1000);
+    colod_timer_update();
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs colod_timer_source_funcs = {
+    NULL, NULL, colod_timer_dispatch, NULL, NULL, NULL
+};
+
+guint colod_timer_add(guint timeout, GSourceFunc func, gpointer data) {
+    // Round up so timers never fire early
+    gint64 now = (g_get_monotonic_time() + 999) / 1000;
+    guint id;
+
+    if (!wheel) {
+        wheel = timer_wheel_new(now);
+        wheel_source = g_source_new(&colod_timer_source_funcs,
+                                    sizeof(GSource));
+        g_source_set_name(wheel_source, "timer wheel");
+        g_source_attach(wheel_source, NULL);
+    }
+
+    id = timer_wheel_add(wheel, now, timeout, func, data);
+    colod_timer_update();
+    return id;
+}
+
+// Doesn't move the ready time, if it was the first timer the source just
+// dispatches once without firing anything
+void colod_timer_remove(guint id) {
+    if (wheel) {
+        timer_wheel_remove(wheel, id);
+    }
+}
+
+guint colod_timer_current(void) {
+    if (!wheel) {
+        return 0;
+    }
+
+    return timer_wheel_current(wheel);
+}
@@ -0,0 +1,44 @@
+/*
+ * COLO background daemon timer wheel
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <glib-2.0/glib.h>
+
+// Hierarchical timer wheel with millisecond ticks. Arming and disarming a
+// timer is O(1) and doesn't allocate, so it is cheap enough for timeouts
+// that almost never fire.
+typedef struct TimerWheel TimerWheel;
+
+TimerWheel *timer_wheel_new(gint64 now);
+void timer_wheel_free(TimerWheel *this);
+
+// Timers are one-shot, the return value of func is ignored. Returns an id
+// that is never 0.
+guint timer_wheel_add(TimerWheel *this, gint64 now, guint timeout,
+                      GSourceFunc func, gpointer data);
+// Ids of timers that already fired or got removed are ignored
+gboolean timer_wheel_remove(TimerWheel *this, guint id);
+// Fires all timers that expired at now
+void timer_wheel_run(TimerWheel *this, gint64 now);
+// Tick at which timer_wheel_run() needs to be called next, -1 if none
+gint64 timer_wheel_next(TimerWheel *this);
+// Id of the timer whose callback is running, 0 if none
+guint timer_wheel_current(TimerWheel *this);
+
+// Same as above, driven by a single GSource on the default main context.
+// Use these instead of g_timeout_add() for coroutine timeouts: Check
+// colod_timer_current() instead of g_main_current_source() to see if the
+// timeout woke the coroutine.
+guint colod_timer_add(guint timeout, GSourceFunc func, gpointer data);
+void colod_timer_remove(guint id);
+guint colod_timer_current(void);
+
+#endif // TIMER_WHEEL_H
@@ -261,6 +261,48 @@ void _colod_assert_remove_one_source(gpointer data, const gchar *func,
     abort();
 }
 
+struct MyTimeout {
+    gint64 deadline;
+};
+
+guint my_timeout_remaining_ms(MyTimeout *this) {
+    gint64 now = g_get_monotonic_time();
+
+    if (now >= this->deadline) {
+        return 0;
+    }
+
+    return (this->deadline - now + 999) / 1000;
+}
+
+guint my_timeout_remaining_minus_ms(MyTimeout *this, guint minus) {
+    guint remaining = my_timeout_remaining_ms(this);
+
+    if (minus >= remaining) {
+        return 0;
+    }
+
+    return remaining - minus;
+}
+
+gint64 my_timeout_deadline(MyTimeout *this) {
+    return this->deadline;
+}
+
+MyTimeout *my_timeout_new(guint timeout_ms) {
+    MyTimeout *this = g_rc_box_new0(MyTimeout);
+    this->deadline = g_get_monotonic_time() + ((gint64) timeout_ms) * 1000;
+    return this;
+}
+
+MyTimeout *my_timeout_ref(MyTimeout *this) {
+    return g_rc_box_acquire(this);
+}
+
+void my_timeout_unref(MyTimeout *this) {
+    g_rc_box_release(this);
+}
+
 MyArray *my_array_new(GDestroyNotify destroy_func) {
     const unsigned alloc = 128;
     MyArray *ret = g_rc_box_new0(MyArray);
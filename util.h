@@ -20,7 +20,9 @@ typedef enum ColodError {
     COLOD_ERROR_TIMEOUT,
     COLOD_ERROR_QMP,
     COLOD_ERROR_EOF,
-    COLOD_ERROR_INTERRUPT
+    COLOD_ERROR_INTERRUPT,
+    COLOD_ERROR_CANCELLED,
+    COLOD_ERROR_QUIT
 } ColodError;
 
 #define COLOD_ERROR (colod_error_quark())
@@ -66,6 +68,18 @@ const char *colod_source_name_or_null(GSource *source);
 void _colod_assert_remove_one_source(gpointer data, const gchar *func,
                                      int line);
 
+// Absolute deadline, shared by all steps of an operation so they don't
+// each get the whole budget
+typedef struct MyTimeout MyTimeout;
+
+guint my_timeout_remaining_ms(MyTimeout *this);
+guint my_timeout_remaining_minus_ms(MyTimeout *this, guint minus);
+// In g_get_monotonic_time() microseconds
+gint64 my_timeout_deadline(MyTimeout *this);
+MyTimeout *my_timeout_new(guint timeout_ms);
+MyTimeout *my_timeout_ref(MyTimeout *this);
+void my_timeout_unref(MyTimeout *this);
+
 typedef struct MyArray {
     void **array;
     GDestroyNotify destroy_func;
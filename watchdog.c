@@ -10,33 +10,34 @@
 #include <glib-2.0/glib.h>
 
 #include "watchdog.h"
+#include "metrics.h"
 
 typedef struct ColodWatchdog {
     Coroutine coroutine;
     ColodQmpState *qmp;
+    const gchar *instance;
     guint interval;
     guint timer_id;
+    gboolean refreshed;
+    guint64 events;
+    gint64 check_start;
     gboolean quit;
     WatchdogCheckHealth cb;
     gpointer cb_data;
 } ColodWatchdog;
 
+// The health check callback queries the qemu status, a query that drains a
+// stale reply, times out and yanks nests 15 frames deep
+static CoroutineType watchdog_coroutine_type =
+    COROUTINE_POOL("watchdog", ColodWatchdog, 18);
+
+// Only note the activity and let the timer skip the next health check
 void colod_watchdog_refresh(ColodWatchdog *state) {
     if (state->timer_id) {
-        g_source_remove(state->timer_id);
-        state->timer_id = g_timeout_add_full(G_PRIORITY_LOW,
-                                             state->interval,
-                                             state->coroutine.cb,
-                                             &state->coroutine, NULL);
+        state->refreshed = TRUE;
     }
 }
 
-static void colod_watchdog_event_cb(gpointer data,
-                                    G_GNUC_UNUSED ColodQmpResult *result) {
-    ColodWatchdog *state = data;
-    colod_watchdog_refresh(state);
-}
-
 static gboolean _colod_watchdog_co(Coroutine *coroutine);
 static gboolean colod_watchdog_co(gpointer data) {
     ColodWatchdog *state = data;
@@ -60,6 +61,7 @@ static int _check_health_co(Coroutine *coroutine, ColodWatchdog *this, GError **
 
 static gboolean _colod_watchdog_co(Coroutine *coroutine) {
     ColodWatchdog *state = (ColodWatchdog *) coroutine;
+    guint64 events;
     int ret;
     GError *local_errp = NULL;
 
@@ -76,7 +78,30 @@ static gboolean _colod_watchdog_co(Coroutine *coroutine) {
         }
         state->timer_id = 0;
 
+        // An event since the last check proves qemu alive. Replies don't
+        // count, the health check also looks for a status mismatch that
+        // steady command traffic would hide.
+        events = qmp_get_events(state->qmp);
+        if (state->refreshed || events != state->events) {
+            state->refreshed = FALSE;
+            state->events = events;
+            continue;
+        }
+
+        state->check_start = g_get_monotonic_time();
         co_recurse(ret = check_health_co(coroutine, state, &local_errp));
+        metrics_observe_since(metrics_instance_histogram(state->instance,
+                                                         "watchdog_check",
+                                                         NULL, NULL),
+                              state->check_start);
+        state->events = qmp_get_events(state->qmp);
+        if (ret < 0 && g_error_matches(local_errp, COLOD_ERROR,
+                                       COLOD_ERROR_CANCELLED)) {
+            // Gave way to a failover, check again next time
+            g_error_free(local_errp);
+            local_errp = NULL;
+            continue;
+        }
         if (ret < 0) {
             log_error_fmt("colod check health: %s", local_errp->message);
             g_error_free(local_errp);
@@ -93,14 +118,12 @@ static gboolean _colod_watchdog_co(Coroutine *coroutine) {
 void colod_watchdog_free(ColodWatchdog *state) {
 
     if (!state->interval) {
-        g_free(state);
+        coroutine_free(state);
         return;
     }
 
     state->quit = TRUE;
 
-    qmp_del_notify_event(state->qmp, colod_watchdog_event_cb, state);
-
     if (state->timer_id) {
         g_source_remove(state->timer_id);
         state->timer_id = 0;
@@ -111,7 +134,7 @@ void colod_watchdog_free(ColodWatchdog *state) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
-    g_free(state);
+    coroutine_free(state);
 }
 
 ColodWatchdog *colod_watchdog_new(const ColodContext *ctx, ColodQmpState *qmp,
@@ -119,17 +142,17 @@ ColodWatchdog *colod_watchdog_new(const ColodContext *ctx, ColodQmpState *qmp,
     ColodWatchdog *state;
     Coroutine *coroutine;
 
-    state = g_new0(ColodWatchdog, 1);
+    state = coroutine_new(&watchdog_coroutine_type);
     coroutine = &state->coroutine;
     coroutine->cb = colod_watchdog_co;
     state->qmp = qmp;
+    state->instance = ctx->instance_name;
     state->interval = ctx->watchdog_interval;
     state->cb = cb;
     state->cb_data = data;
 
     if (state->interval) {
         g_idle_add(colod_watchdog_co, coroutine);
-        qmp_add_notify_event(state->qmp, colod_watchdog_event_cb, state);
     }
     return state;
 }
@@ -22,6 +22,9 @@ struct YellowCoroutine {
     guint timeout1, timeout2;
 };
 
+static CoroutineType yellow_coroutine_type =
+    COROUTINE_POOL("yellow", YellowCoroutine, 4);
+
 void yellow_add_notify(YellowCoroutine *this, YellowCallback _func,
                        gpointer user_data) {
     ColodCallbackFunc func = (ColodCallbackFunc) _func;
@@ -181,7 +184,7 @@ YellowCoroutine *yellow_coroutine_new(Cpg *cpg, const ColodContext *ctx,
     YellowCoroutine *this;
     Coroutine *coroutine;
 
-    this = g_new0(YellowCoroutine, 1);
+    this = coroutine_new(&yellow_coroutine_type);
     coroutine = &this->coroutine;
     coroutine->cb = yellow_co;
     this->cpg = cpg;
@@ -189,12 +192,8 @@ YellowCoroutine *yellow_coroutine_new(Cpg *cpg, const ColodContext *ctx,
     this->timeout1 = timeout1;
     this->timeout2 = timeout2;
 
-    this->netlink = netlink_new(errp);
-    if (!this->netlink) {
-        g_free(this);
-        return NULL;
-    }
-
+    // The netlink socket is shared with the whole daemon and outlives us
+    this->netlink = ctx->netlink;
     netlink_add_notify(this->netlink, yellow_netlink_event_cb, this);
     ret = netlink_request_status(this->netlink, errp);
     if (ret < 0) {
@@ -220,6 +219,5 @@ void yellow_coroutine_free(YellowCoroutine *this) {
 
     colod_callback_clear(&this->callbacks);
 
-    netlink_free(this->netlink);
-    g_free(this);
+    coroutine_free(this);
 }